@@ -2,7 +2,10 @@
 #include <algorithm>
 #include "Utils.h"
 #include <cstring>  // For memcpy
+#include <bit>
 #include <chrono>
+#include <cmath>
+#include <limits>
 #include <span>
 
 namespace {
@@ -38,22 +41,84 @@ SampleCounter calcPlaybackAlignmentOffsetFromZero(PlayheadTime playheadTime,
 namespace audio_plugin {
 
 AnalysisRegions::AnalysisRegions(std::shared_ptr<MonoCircularBuffer> readBuff,
-                                 std::shared_ptr<ServiceCommunicator> comms) {
+                                 std::shared_ptr<ServiceCommunicator> comms,
+                                 std::shared_ptr<AudioThreadStats> stats)
+    : stats_{stats ? stats : std::make_shared<AudioThreadStats>()} {
   assert(readBuff && comms);
   readBuff_ = readBuff;
   comms_ = comms;
   refSampleRate_ = readBuff->getSampleRate();
   analysisBlock_.resize(regionSize_, 0.f);
-  maxRegionAge_ = readBuff->getNumStoredSamples();
+  streams_.push_back(Stream{readBuff, "", std::make_unique<PlaybackResults>(),
+                            std::make_unique<Levels>()});
+
+  auto labels = "client=\"" + comms->getIdentity() + "\"";
+  static const char* stateNames[] = {"pending", "in_progress", "complete",
+                                     "timeout", "failure"};
+  for (size_t state = 0; state < stateGauges_.size(); state++) {
+    stateGauges_[state] = metrics_->gauge(
+        "whisper_plugin_regions", "Regions currently held, by state",
+        labels + ",state=\"" + stateNames[state] + "\"");
+  }
+  inFlightGauge_ = metrics_->gauge("whisper_plugin_regions_in_flight",
+                                   "Regions with the service", labels);
+  queueDepthGauge_ = metrics_->gauge("whisper_plugin_regions_queue_depth",
+                                     "Regions waiting to be sent", labels);
+  timedOut_ = metrics_->counter(
+      "whisper_plugin_regions_timed_out_total",
+      "Regions dropped or aborted before a result came back", labels);
+  failed_ = metrics_->counter("whisper_plugin_regions_failed_total",
+                              "Regions the service couldn't analyse", labels);
+  retried_ = metrics_->counter("whisper_plugin_regions_retried_total",
+                               "Offline regions sent again after a failure",
+                               labels);
+  infilled_ = metrics_->counter(
+      "whisper_plugin_regions_infilled_total",
+      "Regions added between neighbours by adaptive density", labels);
+  roundTripMs_ = metrics_->histogram(
+      "whisper_plugin_region_round_trip_ms",
+      "Time from sending a region to its reply",
+      {10, 25, 50, 100, 250, 500, 1000, 2500, 5000, 10000}, labels);
+
   startTimerHz(10);
 }
 
 AnalysisRegions::~AnalysisRegions() {}
 
+void AnalysisRegions::addStream(std::shared_ptr<MonoCircularBuffer> history,
+                                const std::string& name) {
+  assert(history && history->getSampleRate() == refSampleRate_);
+  // Stream indices travel in request IDs
+  assert(streams_.size() < ServiceCommunicator::maxStreams);
+  streams_.push_back(Stream{history, name,
+                            std::make_unique<PlaybackResults>(),
+                            std::make_unique<Levels>()});
+}
+
+void AnalysisRegions::setStreamName(size_t stream, const std::string& name) {
+  streams_.at(stream).name = name;
+}
+
+size_t AnalysisRegions::getNumStreams() {
+  return streams_.size();
+}
+
+std::string AnalysisRegions::getStreamName(size_t stream) {
+  return stream < streams_.size() ? streams_[stream].name : std::string();
+}
+
 void AnalysisRegions::updateFrom(const TimePoint& blockStartTime,
                                  const TimePoint& curTime,
-                                 const PlaybackRegion& currentPlaybackRegion) {
+                                 const PlaybackRegion& currentPlaybackRegion,
+                                 std::span<const std::vector<float>> blocks) {
   curTime_ = curTime.asSampleRate(refSampleRate_);
+  if (adaptiveDensity_) {
+    for (size_t stream = 0; stream < std::min(blocks.size(), streams_.size());
+         stream++) {
+      measureLevel(*streams_[stream].levels, blockStartTime.sampleCounter,
+                   blocks[stream]);
+    }
+  }
   lastKnownPlaybackRegion_ = currentPlaybackRegion.asSampleRate(refSampleRate_);
   // Add regions if we can
   if (generateRegions_) {
@@ -115,27 +180,37 @@ bool AnalysisRegions::addNewRegion(SampleCounter startTime) {
     }
   }
 
-  // Add region
+  // Add region, one for each stream
   bool successReturn{false};
   {
-    std::lock_guard mtx(regionsLock_);
+    auto mtx = stats_->lock(regionsLock_, AudioThreadStats::REGIONS);
     uint16_t nextCount = 0;
     if (regions_.size() > 0) {
       nextCount = regions_.rbegin()->count + 1;
     }
-    auto empRes = regions_.emplace(nextRegionStartTime, nextRegionEndTime,
-                                   nextCount, wasDuringPlayback);
-    if (empRes.second) {
-      successReturn = true;
+    const auto createdMs = juce::Time::getMillisecondCounterHiRes();
+    for (size_t stream = 0; stream < streams_.size(); stream++) {
+      auto empRes = regions_.emplace(nextRegionStartTime, nextRegionEndTime,
+                                     nextCount, wasDuringPlayback, offline_,
+                                     static_cast<uint8_t>(stream));
+      if (empRes.second) {
+        successReturn = true;
+        empRes.first->createdMs = createdMs;
+        if (empRes.first->duringOfflineRender) {
+          offlineProgress_.regionsTotal++;
+        }
+      }
     }
   }
 
   // If the new regions don't align with regions in playbackResults_, we need to clear that down
   if (nextRegionStartTime.playheadTime.has_value() &&
       nextRegionEndTime.playheadTime.has_value()) {
-    playbackResults_.setConfigFromRegion(
-        nextRegionStartTime.playheadTime.value(),
-        nextRegionEndTime.playheadTime.value(), regionFrequency_);
+    for (auto& stream : streams_) {
+      stream.results->setConfigFromRegion(
+          nextRegionStartTime.playheadTime.value(),
+          nextRegionEndTime.playheadTime.value(), getResultsGrid());
+    }
   }
 
   return successReturn;
@@ -159,7 +234,7 @@ bool AnalysisRegions::addNewRegionIfRequired() {
         return addNewRegion(playbackSyncStart.sampleCounter);
       } else if (alignment == TIME_ZERO) {
         auto nextTimePoint =
-            roundUpToAlignmentBoundary(playbackSyncStart, regionFrequency_);
+            roundUpToAlignmentBoundary(playbackSyncStart, getResultsGrid());
         return addNewRegion(nextTimePoint.sampleCounter);
       }
       return false;
@@ -193,7 +268,8 @@ void AnalysisRegions::generateRegions(bool enable) {
 
 std::optional<std::pair<SampleCounter, SampleCounter>>
 AnalysisRegions::getLastAddedRegionSampleCounters() {
-  std::lock_guard mtx(regionsLock_);
+  // Only called from the audio thread (via updateFrom)
+  auto mtx = stats_->lock(regionsLock_, AudioThreadStats::REGIONS);
   if (regions_.empty()) {
     return std::nullopt;
   }
@@ -204,11 +280,12 @@ AnalysisRegions::getLastAddedRegionSampleCounters() {
 
 size_t AnalysisRegions::getNumRegionsInState(Region::State state) {
   std::lock_guard mtx(regionsLock_);
-  return std::count_if(
-      PREFERRED_EXEC(std::execution::par, regions_.begin(), regions_.end(),
-                     [state](const Region& region) {
-                       return region.analysisState == state;
-                     }));
+  // A set can't be split up without walking it anyway, and there are only a
+  // few hundred regions, so this is quicker on the one thread
+  return std::count_if(regions_.begin(), regions_.end(),
+                       [state](const Region& region) {
+                         return region.analysisState == state;
+                       });
 }
 
 SampleRate AnalysisRegions::getReferenceSampleRate() {
@@ -240,18 +317,260 @@ void AnalysisRegions::setRegionFreqMs(uint32_t ms) {
   regionFrequency_ = msToSamples(ms, refSampleRate_);
 }
 
+void AnalysisRegions::setAutoFrequency(bool enable,
+                                       uint32_t minMs,
+                                       uint32_t maxMs) {
+  std::lock_guard mtx(regionsLock_);
+  auto minFrequency = std::max<SampleCounter>(msToSamples(minMs, refSampleRate_), 1);
+  auto maxFrequency =
+      std::max(msToSamples(maxMs, refSampleRate_), minFrequency);
+  // Whole steps of the minimum
+  maxFrequency -= maxFrequency % minFrequency;
+  minFrequency_ = minFrequency;
+  maxFrequency_ = maxFrequency;
+  if (enable) {
+    auto frequency = regionFrequency_.load();
+    frequency = ((frequency + minFrequency - 1) / minFrequency) * minFrequency;
+    regionFrequency_ = std::clamp(frequency, minFrequency, maxFrequency);
+    if (!autoFrequency_) {
+      lastFrequencyAdjustMs_ = juce::Time::getMillisecondCounterHiRes();
+      frequencyHoldUntilMs_ = 0.0;
+      completionsSinceAdjust_ = 0;
+      expiredAtAdjust_ = scheduler_.getSnapshot().expired;
+    }
+  }
+  autoFrequency_ = enable;
+}
+
+bool AnalysisRegions::isAutoFrequency() {
+  return autoFrequency_;
+}
+
+AnalysisRegions::FrequencyStatus AnalysisRegions::getFrequencyStatus() {
+  std::lock_guard mtx(regionsLock_);
+  FrequencyStatus status;
+  status.automatic = autoFrequency_;
+  status.frequencyMs = samplesToMs(regionFrequency_, refSampleRate_);
+  status.minMs = samplesToMs(minFrequency_, refSampleRate_);
+  status.maxMs = samplesToMs(maxFrequency_, refSampleRate_);
+  status.completionsPerSecond = completionsPerSecond_;
+  status.latencyMs = latencyMs_;
+  return status;
+}
+
+SampleCounter AnalysisRegions::getResultsGrid() {
+  // Automatic frequencies are all multiples of the minimum, so results line
+  // up on it whatever the frequency was when they were made. Likewise
+  // regions added in between for adaptive density.
+  auto grid = autoFrequency_ ? minFrequency_.load() : regionFrequency_.load();
+  return std::max<SampleCounter>(grid >> densitySubdivisions_, 1);
+}
+
+void AnalysisRegions::measureLevel(Levels& levels,
+                                   SampleCounter blockStart,
+                                   std::span<const float> block) {
+  // Audio thread only. Sums squares into the current bin, publishing each
+  // bin as the audio moves past it.
+  const SampleCounter binSize = std::max<SampleCounter>(refSampleRate_ / 4, 1);
+  size_t offset{0};
+  while (offset < block.size()) {
+    auto sampleCounter = blockStart + static_cast<SampleCounter>(offset);
+    auto bin = static_cast<int64_t>(sampleCounter / binSize);
+    if (bin != levels.bin) {
+      if (levels.bin >= 0 && levels.samples > 0) {
+        auto meanSquare = levels.sum / static_cast<double>(levels.samples);
+        levels.bins[static_cast<size_t>(levels.bin) % levelBins].store(
+            static_cast<float>(meanSquare), std::memory_order_relaxed);
+      }
+      // Nothing for any bins jumped over (e.g. when the host looped)
+      for (auto skipped = std::max(levels.bin + 1, bin - int64_t{levelBins});
+           skipped < bin; skipped++) {
+        levels.bins[static_cast<size_t>(skipped) % levelBins].store(
+            std::numeric_limits<float>::quiet_NaN(),
+            std::memory_order_relaxed);
+      }
+      if (bin > levels.bin) {
+        levels.end.store(bin, std::memory_order_release);
+      }
+      levels.bin = bin;
+      levels.sum = 0.0;
+      levels.samples = 0;
+    }
+    auto count = std::min<size_t>(
+        block.size() - offset,
+        static_cast<size_t>((bin + 1) * binSize - sampleCounter));
+    for (auto sample : block.subspan(offset, count)) {
+      levels.sum += static_cast<double>(sample) * sample;
+    }
+    levels.samples += static_cast<SampleCounter>(count);
+    offset += count;
+  }
+}
+
+std::optional<float> AnalysisRegions::getLevel(const Levels& levels,
+                                               SampleCounter start,
+                                               SampleCounter end) {
+  // Mean square level over the bins wholly from start to end, if known
+  const SampleCounter binSize = std::max<SampleCounter>(refSampleRate_ / 4, 1);
+  auto firstBin = static_cast<int64_t>((start + binSize - 1) / binSize);
+  auto lastBin = static_cast<int64_t>(end / binSize);  // Exclusive
+  auto levelsEnd = levels.end.load(std::memory_order_acquire);
+  if (firstBin >= lastBin || lastBin > levelsEnd ||
+      firstBin < levelsEnd - static_cast<int64_t>(levelBins)) {
+    return std::nullopt;
+  }
+  double sum{0.0};
+  size_t count{0};
+  for (auto bin = firstBin; bin < lastBin; bin++) {
+    auto level = levels.bins[static_cast<size_t>(bin) % levelBins].load(
+        std::memory_order_relaxed);
+    if (!std::isnan(level)) {
+      sum += level;
+      count++;
+    }
+  }
+  // Overwritten while being read
+  if (count == 0 || firstBin < levels.end.load(std::memory_order_acquire) -
+                                   static_cast<int64_t>(levelBins)) {
+    return std::nullopt;
+  }
+  return static_cast<float>(sum / static_cast<double>(count));
+}
+
+void AnalysisRegions::addInfill(const Region& region, double nowMs) {
+  // regionsLock_ must be held. Looks either side of a newly completed region
+  // for neighbours that differ enough to be worth a region in between.
+  if (!adaptiveDensity_ || region.duringOfflineRender ||
+      region.analysisState != Region::State::COMPLETE) {
+    return;
+  }
+  auto it = regions_.find(region);
+  if (it == regions_.end()) {
+    return;
+  }
+  // Neighbours in the same stream
+  for (auto prev = it; prev != regions_.begin();) {
+    if ((--prev)->stream == region.stream) {
+      addInfillBetween(*prev, *it, nowMs);
+      break;
+    }
+  }
+  for (auto next = std::next(it); next != regions_.end(); ++next) {
+    if (next->stream == region.stream) {
+      addInfillBetween(*it, *next, nowMs);
+      break;
+    }
+  }
+}
+
+void AnalysisRegions::addInfillBetween(const Region& before,
+                                       const Region& after,
+                                       double nowMs) {
+  // regionsLock_ must be held
+  if (before.analysisState != Region::State::COMPLETE ||
+      after.analysisState != Region::State::COMPLETE ||
+      before.duringOfflineRender || after.duringOfflineRender) {
+    return;
+  }
+  const auto grid = getResultsGrid();
+  const auto gap = after.start.sampleCounter - before.start.sampleCounter;
+  // Only between regions that were next to each other to begin with (not,
+  // say, either side of a break in playback), down to the finest allowed
+  const auto widest =
+      autoFrequency_ ? maxFrequency_.load() : regionFrequency_.load();
+  if (gap < 2 * grid || gap > widest) {
+    return;
+  }
+  bool differ = std::abs(before.analysisResult - after.analysisResult) >
+                densityConfig_.resultThreshold;
+  if (!differ) {
+    // Compare what the later region hears that the earlier doesn't with what
+    // it no longer hears
+    const auto& levels = *streams_[before.stream].levels;
+    auto dropped = getLevel(levels, before.start.sampleCounter,
+                            std::min(after.start.sampleCounter,
+                                     before.end.sampleCounter));
+    auto added = getLevel(levels, std::max(before.end.sampleCounter,
+                                   after.start.sampleCounter),
+                          after.end.sampleCounter);
+    if (dropped && added) {
+      constexpr float floor{1e-10f};
+      auto changeDb = 10.f * std::log10((std::max(*added, floor)) /
+                                        (std::max(*dropped, floor)));
+      differ = std::abs(changeDb) > densityConfig_.levelThresholdDb;
+    }
+  }
+  if (!differ) {
+    return;
+  }
+
+  TimePoint start{refSampleRate_,
+                  before.start.sampleCounter + (gap / grid / 2) * grid,
+                  std::nullopt};
+  TimePoint end = start + regionSize_;
+  // Playhead times carry over if playback ran straight through both
+  if (before.start.playheadTime && after.end.playheadTime &&
+      *after.end.playheadTime - *before.start.playheadTime ==
+          after.end.sampleCounter - before.start.sampleCounter) {
+    start.playheadTime = *before.start.playheadTime +
+                         (start.sampleCounter - before.start.sampleCounter);
+    end.playheadTime = *start.playheadTime + regionSize_;
+  }
+  Region infill(start, end, before.count,
+                before.wasDuringPlayback && after.wasDuringPlayback, false,
+                before.stream);
+  infill.infill = true;
+  auto [inserted, added] = regions_.insert(infill);
+  if (!added) {
+    return;
+  }
+  inserted->createdMs = nowMs;
+  inserted->sendAttemptedMs = nowMs;
+  scheduler_.push(*inserted, nowMs);
+  infillRegions_++;
+  infilled_->inc();
+}
+
+void AnalysisRegions::setDensityConfig(const DensityConfig& config) {
+  std::lock_guard mtx(regionsLock_);
+  densityConfig_ = config;
+  densityConfig_.maxSubdivisions =
+      std::min<uint8_t>(config.maxSubdivisions, 4);
+  densitySubdivisions_ =
+      config.adaptive ? densityConfig_.maxSubdivisions : uint8_t{0};
+  adaptiveDensity_ = config.adaptive;
+}
+
+AnalysisRegions::DensityConfig AnalysisRegions::getDensityConfig() {
+  std::lock_guard mtx(regionsLock_);
+  return densityConfig_;
+}
+
+uint64_t AnalysisRegions::getNumInfillRegions() {
+  return infillRegions_;
+}
+
 void AnalysisRegions::restartRegions() {
   std::lock_guard mtx(regionsLock_);
+  scheduler_.clear();
   regions_.clear();
 }
 
 void AnalysisRegions::updateAsStale() {
   std::lock_guard mtx(regionsLock_);
-  std::erase_if(regions_, [](const Region& region) {
+  std::erase_if(regions_, [this](const Region& region) {
     // A stale timedout/failed/pending region might as well not exist
-    return region.analysisState == Region::State::PENDING ||
-           region.analysisState == Region::State::TIMEOUT ||
-           region.analysisState == Region::State::FAILURE;
+    if (region.duringOfflineRender &&
+        region.analysisState == Region::State::PENDING) {
+      offlineProgress_.regionsTotal--;
+    }
+    if (region.analysisState == Region::State::PENDING ||
+        region.analysisState == Region::State::TIMEOUT ||
+        region.analysisState == Region::State::FAILURE) {
+      scheduler_.remove(region);
+      return true;
+    }
+    return false;
   });
   for(auto& region : regions_) {
     region.stale = true;
@@ -271,6 +590,9 @@ void AnalysisRegions::abortInProgress() {
   for (auto& region : regions_) {
     if (region.analysisState == Region::State::IN_PROGRESS) {
       region.analysisState = Region::State::TIMEOUT;
+      timedOut_->inc();
+      scheduler_.setCovered(region, false);
+      regionFinished(region);
     }
   }
 }
@@ -287,87 +609,477 @@ void AnalysisRegions::updateRegions() {
   {
     std::lock_guard mtx(regionsLock_);
 
-    // Erase old regions
-    auto regionStartCutoff = curTime_.sampleCounter - maxRegionAge_;
+    // Erase old regions - retention can change at runtime, so ask each time
+    auto maxRegionAge =
+        static_cast<SampleCounter>(readBuff->getNumStoredSamples());
+    auto regionStartCutoff = curTime_.sampleCounter - maxRegionAge;
     if (regionStartCutoff >= 0) {
-      std::erase_if(regions_, [regionStartCutoff](const Region& region) {
+      std::erase_if(regions_, [this, regionStartCutoff](const Region& region) {
+        // Offline render regions wait (with their history pinned) however
+        // long it takes
+        if (region.duringOfflineRender &&
+            (region.analysisState == Region::State::PENDING ||
+             region.analysisState == Region::State::IN_PROGRESS)) {
+          return false;
+        }
         // If region too old, return true
-        return region.start.sampleCounter < regionStartCutoff;
+        if (region.start.sampleCounter >= regionStartCutoff) {
+          return false;
+        }
+        if (region.analysisState == Region::State::PENDING) {
+          // Deferred until its audio was gone
+          scheduler_.expire(region);
+          timedOut_->inc();
+        } else {
+          scheduler_.remove(region);
+        }
+        return true;
       });
     }
 
-    // Send off pending jobs - latest takes priority
-    for (auto rit = regions_.rbegin(); rit != regions_.rend(); ++rit) {
-      auto const& region = *rit;
-      if (region.analysisState == Region::State::PENDING) {
-        if (!comms->readyToSend()) {
-          break;
+    // Nothing more is coming for what was with a service that's gone. Offline
+    // render regions go again once it's back, live ones are given up on.
+    auto nowMs = juce::Time::getMillisecondCounterHiRes();
+    auto connection = comms->getConnectionState();
+    if (connection == ServiceCommunicator::DOWN &&
+        lastConnectionState_ != ServiceCommunicator::DOWN) {
+      for (auto& region : regions_) {
+        if (region.analysisState != Region::State::IN_PROGRESS) {
+          continue;
         }
-        auto res = comms->sendRequest(region.start, regionSize_, readBuff);
-        if (res) {
-          region.analysisState = Region::State::IN_PROGRESS;
+        scheduler_.setCovered(region, false);
+        if (region.duringOfflineRender) {
+          region.analysisState = Region::State::PENDING;
+          scheduler_.push(region, nowMs);
+          retried_->inc();
+        } else {
+          region.analysisState = Region::State::TIMEOUT;
+          timedOut_->inc();
+          regionFinished(region);
         }
       }
     }
+    lastConnectionState_ = connection;
 
-    // Abort pending regions beyond limit
-    size_t pendingCount{0};
-    for (auto rit = regions_.rbegin(); rit != regions_.rend(); ++rit) {
-      auto const& region = *rit;
-      if (region.analysisState == Region::State::PENDING) {
-        pendingCount++;
-        if (pendingCount > maxPendingRegions_) {
-          region.analysisState = Region::State::TIMEOUT;
-        }
+    // Queue new regions with the scheduler
+    scheduler_.beginTick();
+    size_t inFlight{0};
+    for (auto const& region : regions_) {
+      if (region.analysisState == Region::State::IN_PROGRESS) {
+        inFlight++;
+      } else if (region.analysisState == Region::State::PENDING &&
+                 region.sendAttemptedMs == 0.0) {
+        region.sendAttemptedMs = nowMs;
+        scheduler_.push(region, nowMs);
       }
     }
+    // Send off pending regions in the order it picks for as long as the
+    // service will take them. The rest wait for next time. Offline, work
+    // through the programme in order so history can be released behind us.
+    while (!scheduler_.empty() && canSend(*comms, inFlight)) {
+      auto region = scheduler_.pop(nowMs);
+      // Each batch is read from one stream's history
+      if (!batch_.empty() && batch_.front()->stream != region->stream &&
+          !sendBatch(*comms, inFlight)) {
+        scheduler_.push(*region, nowMs);
+        break;
+      }
+      scheduler_.setCovered(*region, true);
+      batch_.push_back(region);
+      if (batch_.size() >= comms->getMaxBatchSize() &&
+          !sendBatch(*comms, inFlight)) {
+        break;
+      }
+    }
+    // Don't hold a part batch back for regions that aren't ready yet
+    sendBatch(*comms, inFlight);
+    adjustFrequency(nowMs);
+    updateStateGauges();
   }
 
-  // Check for new responses
-  auto resp = comms->getResponse();
-  if (resp.has_value()) {
+  // Check for new responses - offline there can be many per tick
+  while (auto resp = comms->getResponse()) {
+    auto receivedMs = juce::Time::getMillisecondCounterHiRes();
     std::lock_guard mtx(regionsLock_);
-    SampleCounter reqId = resp.value().reqId;
+    SampleCounter reqId =
+        resp.value().reqId & ~ServiceCommunicator::streamIdMask;
+    auto stream = ServiceCommunicator::getStream(resp.value().reqId);
+    const Region* completed{nullptr};
     // Lookup region and update
     for (auto& region : regions_) {
-      if (region.start.sampleCounter == reqId) {
+      if (region.start.sampleCounter == reqId && region.stream == stream) {
+        region.receivedMs = receivedMs;
+        region.serviceQueueMs = resp.value().serviceQueueMs;
+        region.serviceInferenceMs = resp.value().serviceInferenceMs;
         // Update struct
         if (resp.value().success) {
           region.analysisResult = resp.value().result;
+          region.frames = resultArena_.add(resp.value().frames,
+                                           resp.value().confidence);
           region.analysisState = Region::State::COMPLETE;
+        } else if (region.duringOfflineRender &&
+                   region.attempts < maxOfflineAttempts_) {
+          // Most likely rejected by a busy service - try again
+          region.analysisState = Region::State::PENDING;
+          scheduler_.setCovered(region, false);
+          scheduler_.push(region, receivedMs);
+          retried_->inc();
+          continue;
         } else {
           region.analysisState = Region::State::FAILURE;
+          scheduler_.setCovered(region, false);
+          failed_->inc();
         }
-        // If during playback, add to playbackResults_
+        // If during playback, add to its stream's results (below)
         if (region.start.playheadTime.has_value() &&
             region.end.playheadTime.has_value()) {
-          playbackResults_.addResult(region);
+          playbackCompleted_.push_back(region);
         }
+        region.appliedMs = juce::Time::getMillisecondCounterHiRes();
+        regionFinished(region);
+        completed = &region;
+      }
+    }
+    if (completed) {
+      addInfill(*completed, receivedMs);
+    }
+  }
+  // Fingerprinted so results can be kept for as long as the audio at their
+  // span stays the same. Reading history can mean decoding it, so this is
+  // done without holding up the audio thread.
+  for (auto& region : playbackCompleted_) {
+    auto history = streams_[region.stream].history.lock();
+    if (history && region.analysisState == Region::State::COMPLETE) {
+      fingerprintBlock_.resize(static_cast<size_t>(
+          region.end.sampleCounter - region.start.sampleCounter));
+      if (history->getSamples(region.start, fingerprintBlock_)) {
+        region.fingerprint = AudioFingerprint::of(fingerprintBlock_);
       }
     }
+    streams_[region.stream].results->addResult(region);
+  }
+  playbackCompleted_.clear();
+
+  // Hold on to history for anything from an offline render still to do
+  std::optional<SampleCounter> oldestOutstanding;
+  {
+    std::lock_guard mtx(regionsLock_);
+    for (auto const& region : regions_) {
+      if (region.duringOfflineRender &&
+          (region.analysisState == Region::State::PENDING ||
+           region.analysisState == Region::State::IN_PROGRESS)) {
+        oldestOutstanding = region.start.sampleCounter;
+        break;
+      }
+    }
+  }
+  for (auto& stream : streams_) {
+    if (auto history = stream.history.lock()) {
+      history->setRetentionPin(oldestOutstanding);
+    }
+  }
+}
+
+bool AnalysisRegions::canSend(ServiceCommunicator& comms, size_t inFlight) {
+  // regionsLock_ must be held. Whether the service can take another region,
+  // counting those gathered into the batch so far.
+  auto maxInFlight = maxInFlight_.load();
+  if (maxInFlight != 0 && inFlight + batch_.size() >= maxInFlight) {
+    return false;
+  }
+  return comms.readyToSend();
+}
+
+bool AnalysisRegions::sendBatch(ServiceCommunicator& comms,
+                                size_t& inFlight) {
+  // regionsLock_ must be held. Regions are gathered into batches of up to the
+  // comms' max batch size, sent once full (or once there are no more). Those
+  // the socket won't take go back to the scheduler.
+  if (batch_.empty()) {
+    return true;
+  }
+  batchStarts_.clear();
+  for (auto region : batch_) {
+    batchStarts_.push_back(region->start);
+  }
+  const auto stream = batch_.front()->stream;
+  auto history = streams_[stream].history.lock();
+  if (history &&
+      comms.sendRequests(batchStarts_, regionSize_, history, stream)) {
+    auto sentMs = juce::Time::getMillisecondCounterHiRes();
+    for (auto region : batch_) {
+      region->analysisState = Region::State::IN_PROGRESS;
+      region->attempts++;
+      region->sentMs = sentMs;
+    }
+    inFlight += batch_.size();
+    batch_.clear();
+    return true;
+  }
+  auto nowMs = juce::Time::getMillisecondCounterHiRes();
+  for (auto region : batch_) {
+    scheduler_.setCovered(*region, false);
+    scheduler_.push(*region, nowMs);
+  }
+  batch_.clear();
+  return false;
+}
+
+void AnalysisRegions::regionFinished(const Region& region) {
+  // regionsLock_ must be held
+  tracer_.record(region);
+  if (region.analysisState != Region::State::TIMEOUT) {
+    auto roundTripMs = region.receivedMs - region.sentMs;
+    roundTripMs_->observe(roundTripMs);
+    if (!region.duringOfflineRender) {
+      completionsSinceAdjust_++;
+      latencyMs_ = latencyMs_ == 0.0 ? roundTripMs
+                                     : 0.8 * latencyMs_ + 0.2 * roundTripMs;
+    }
+  }
+  if (region.duringOfflineRender) {
+    if (region.analysisState == Region::State::COMPLETE) {
+      offlineProgress_.regionsComplete++;
+    } else {
+      offlineProgress_.regionsFailed++;
+    }
+    offlineLastCompletionMs_ = region.receivedMs;
+  }
+  if (journal_) {
+    journal_->push(region);
+  }
+  if (regionFinishedCallback_) {
+    regionFinishedCallback_(region);
+  }
+}
+
+void AnalysisRegions::adjustFrequency(double nowMs) {
+  // regionsLock_ must be held. Steps the frequency finer while the service
+  // is keeping up, and when it stops keeping up backs off to what it was
+  // managing (less a margin), holding there a while before trying finer
+  // again.
+  auto elapsedMs = nowMs - lastFrequencyAdjustMs_;
+  if (elapsedMs < autoFrequencyIntervalMs) {
+    return;
+  }
+  auto rate = static_cast<double>(completionsSinceAdjust_) * 1000.0 / elapsedMs;
+  completionsPerSecond_ = completionsPerSecond_ == 0.0
+                              ? rate
+                              : 0.7 * completionsPerSecond_ + 0.3 * rate;
+  const auto expired = scheduler_.getSnapshot().expired;
+  const bool expiredSince = expired > expiredAtAdjust_;
+  lastFrequencyAdjustMs_ = nowMs;
+  completionsSinceAdjust_ = 0;
+  expiredAtAdjust_ = expired;
+  // Offline renders send everything regardless, as fast as they can
+  if (!autoFrequency_ || offline_) {
+    return;
+  }
+
+  const auto step = minFrequency_.load();
+  const auto frequency = regionFrequency_.load();
+  auto target = frequency;
+  // One waiting is just the newest, not yet sent
+  if (scheduler_.size() > 1 || expiredSince) {
+    // Falling behind, so completions are what the service sustains
+    auto sustained = completionsPerSecond_ > 0.0
+                         ? static_cast<SampleCounter>(
+                               static_cast<double>(refSampleRate_) /
+                               (completionsPerSecond_ *
+                                autoFrequencyUtilisation))
+                         : maxFrequency_.load();
+    target = std::max(sustained, frequency + step);
+    frequencyHoldUntilMs_ = nowMs + autoFrequencyHoldMs;
+  } else if (scheduler_.empty() && nowMs >= frequencyHoldUntilMs_ &&
+             latencyMs_ < static_cast<double>(
+                              samplesToMs(frequency - step, refSampleRate_))) {
+    // Keeping up, with results back before the next region is due - try
+    // finer
+    target = frequency - step;
+  }
+  target = ((target + step - 1) / step) * step;
+  regionFrequency_ = std::clamp(target, step, maxFrequency_.load());
+}
+
+void AnalysisRegions::updateStateGauges() {
+  // regionsLock_ must be held
+  std::array<size_t, Region::State::FAILURE + 1> counts{};
+  for (auto const& region : regions_) {
+    counts[region.analysisState]++;
+  }
+  for (size_t state = 0; state < counts.size(); state++) {
+    stateGauges_[state]->set(static_cast<double>(counts[state]));
+  }
+  inFlightGauge_->set(static_cast<double>(counts[Region::State::IN_PROGRESS]));
+  queueDepthGauge_->set(static_cast<double>(counts[Region::State::PENDING]));
+}
+
+void AnalysisRegions::setOfflineMode(bool offline) {
+  if (offline_.exchange(offline) == offline) {
+    return;
+  }
+  {
+    std::lock_guard mtx(regionsLock_);
+    scheduler_.setPolicy(offline ? RegionScheduler::PROGRAMME_ORDER
+                                 : schedulingPolicy_.load());
+    if (offline) {
+      offlineProgress_ = OfflineProgress{};
+      offlineStartMs_ = juce::Time::getMillisecondCounterHiRes();
+      offlineLastCompletionMs_ = offlineStartMs_;
+    }
   }
+  for (auto& stream : streams_) {
+    if (auto history = stream.history.lock()) {
+      history->setBlockWhenFull(offline);
+    }
+  }
+  // Service replies come back much faster than the live rate
+  startTimerHz(offline ? 100 : 10);
+}
 
+void AnalysisRegions::setMaxInFlight(size_t maxInFlight) {
+  maxInFlight_ = maxInFlight;
 }
 
-PlaybackResults::Results AnalysisRegions::getResults() {
-  return playbackResults_.getResults();
+void AnalysisRegions::setSchedulingPolicy(RegionScheduler::Policy policy) {
+  std::lock_guard mtx(regionsLock_);
+  schedulingPolicy_ = policy;
+  if (!offline_) {
+    scheduler_.setPolicy(policy);
+  }
+}
+
+RegionScheduler::Policy AnalysisRegions::getSchedulingPolicy() {
+  return schedulingPolicy_;
+}
+
+RegionScheduler::Snapshot AnalysisRegions::getSchedulerSnapshot() {
+  std::lock_guard mtx(regionsLock_);
+  return scheduler_.getSnapshot();
+}
+
+void AnalysisRegions::resetSchedulerStats() {
+  std::lock_guard mtx(regionsLock_);
+  scheduler_.resetStats();
+}
+
+void AnalysisRegions::setRegionFinishedCallback(
+    std::function<void(const Region&)> callback) {
+  std::lock_guard mtx(regionsLock_);
+  regionFinishedCallback_ = std::move(callback);
+}
+
+void AnalysisRegions::setJournal(std::shared_ptr<ResultJournal> journal) {
+  std::lock_guard mtx(regionsLock_);
+  journal_ = std::move(journal);
+}
+
+RegionTracer& AnalysisRegions::getTracer() {
+  return tracer_;
+}
+
+ResultArena& AnalysisRegions::getResultArena() {
+  return resultArena_;
+}
+
+bool AnalysisRegions::isOfflineMode() {
+  return offline_;
+}
+
+AnalysisRegions::OfflineProgress AnalysisRegions::getOfflineProgress() {
+  std::lock_guard mtx(regionsLock_);
+  auto progress = offlineProgress_;
+  auto outstanding = progress.regionsTotal - progress.regionsComplete -
+                     progress.regionsFailed;
+  progress.active = offline_ || outstanding > 0;
+  auto elapsedSecs = (offlineLastCompletionMs_ - offlineStartMs_) / 1000.0;
+  if (elapsedSecs > 0.0) {
+    progress.regionsPerSecond =
+        static_cast<double>(progress.regionsComplete) / elapsedSecs;
+  }
+  return progress;
+}
+
+PlaybackResults::Results AnalysisRegions::getResults(size_t stream) {
+  if (stream >= streams_.size()) {
+    return {};
+  }
+  return streams_[stream].results->getResults();
 }
 
-uint64_t AnalysisRegions::getResultsUpdateCount() {
-  return playbackResults_.getUpdateCounter();
+uint64_t AnalysisRegions::getResultsUpdateCount(size_t stream) {
+  if (stream >= streams_.size()) {
+    return 0;
+  }
+  return streams_[stream].results->getUpdateCounter();
 }
 
 void AnalysisRegions::resetResults() {
-  playbackResults_.clear();
+  for (auto& stream : streams_) {
+    stream.results->clear();
+  }
+}
+
+void AnalysisRegions::writeResults(juce::MemoryOutputStream& out) {
+  out.writeInt(static_cast<int>(streams_.size()));
+  for (auto& stream : streams_) {
+    out.writeInt(static_cast<int>(stream.name.size()));
+    out.write(stream.name.data(), stream.name.size());
+    stream.results->writeTo(out);
+  }
+}
+
+bool AnalysisRegions::readResults(const void* data, size_t size) {
+  // Checked in full before any stream's results are replaced
+  auto bytes = static_cast<const uint8_t*>(data);
+  auto readUint32 = [&bytes, &size](uint32_t& value) {
+    if (size < sizeof(value)) {
+      return false;
+    }
+    value = juce::ByteOrder::littleEndianInt(bytes);
+    bytes += sizeof(value);
+    size -= sizeof(value);
+    return true;
+  };
+  uint32_t numStreams{0};
+  if (!readUint32(numStreams) || numStreams > ServiceCommunicator::maxStreams) {
+    return false;
+  }
+  std::vector<std::pair<std::string, PlaybackResults>> saved(numStreams);
+  for (auto& [name, results] : saved) {
+    uint32_t nameLength{0};
+    if (!readUint32(nameLength) || nameLength > size) {
+      return false;
+    }
+    name.assign(reinterpret_cast<const char*>(bytes), nameLength);
+    bytes += nameLength;
+    size -= nameLength;
+    auto used = results.readFrom(bytes, size);
+    if (used == 0) {
+      return false;
+    }
+    bytes += used;
+    size -= used;
+  }
+  for (auto& stream : streams_) {
+    for (auto& [name, results] : saved) {
+      if (name == stream.name) {
+        stream.results->swap(results);
+        break;
+      }
+    }
+  }
+  return true;
 }
 
 std::set<Region> AnalysisRegions::getRegions(
     SampleCounter rangeStart,
-    SampleCounter rangeEnd) {
+    SampleCounter rangeEnd,
+    size_t stream) {
   std::set<Region> ret;
   std::lock_guard mtx(regionsLock_);
   for (auto const& region : regions_) {
-    if (region.end.sampleCounter >= rangeStart &&
+    if (region.stream == stream && region.end.sampleCounter >= rangeStart &&
         region.start.sampleCounter <= rangeEnd) {
       ret.insert(region);
     }
@@ -387,6 +1099,10 @@ void PlaybackResults::addResult(const Region& resultantRegion) {
           resultantRegion.start.sampleCounter -
           resultantRegionStartPlayheadTime;
       std::lock_guard mtx(resultsLock_);
+      if (resultantRegion.fingerprint) {
+        invalidate(resultantRegionStartPlayheadTime,
+                   *resultantRegion.fingerprint);
+      }
       results_.playheadStartTimes.insert(resultantRegionStartPlayheadTime);
       results_.playthroughOffsets.insert(resultantRegionPlaythroughOffset);
       results_.regions[resultantRegionPlaythroughOffset]
@@ -396,6 +1112,27 @@ void PlaybackResults::addResult(const Region& resultantRegion) {
   }
 }
 
+void PlaybackResults::invalidate(PlayheadTime playheadStart,
+                                 const AudioFingerprint& fingerprint) {
+  // resultsLock_ must be held. Drops earlier results for this span that were
+  // of different audio, along with any playthroughs left empty.
+  for (auto it = results_.regions.begin(); it != results_.regions.end();) {
+    auto& playthrough = it->second;
+    auto found = playthrough.find(playheadStart);
+    if (found != playthrough.end() && found->second.fingerprint &&
+        !found->second.fingerprint->matches(fingerprint)) {
+      playthrough.erase(found);
+      invalidated_++;
+    }
+    if (playthrough.empty()) {
+      results_.playthroughOffsets.erase(it->first);
+      it = results_.regions.erase(it);
+    } else {
+      ++it;
+    }
+  }
+}
+
 PlaybackResults::Results PlaybackResults::getResults() {
   std::lock_guard mtx(resultsLock_);
   return results_;
@@ -434,4 +1171,159 @@ void PlaybackResults::clear() {
   ++updateCounter_;
 }
 
+void PlaybackResults::writeTo(juce::MemoryOutputStream& out) {
+  std::lock_guard mtx(resultsLock_);
+  size_t count{0};
+  SampleRate sampleRate{0};
+  for (auto const& [offset, playthrough] : results_.regions) {
+    count += playthrough.size();
+    if (!playthrough.empty()) {
+      sampleRate = playthrough.begin()->second.start.sampleRate;
+    }
+  }
+  out.write(stateMagic, sizeof(stateMagic));
+  out.writeInt64(alignmentOffset_);
+  out.writeInt64(regionSize_);
+  out.writeInt64(regionFrequency_);
+  out.writeInt(static_cast<int>(sampleRate));
+  out.writeInt(static_cast<int>(count));
+  for (auto const& [offset, playthrough] : results_.regions) {
+    for (auto const& [playheadStart, region] : playthrough) {
+      out.writeInt64(offset);
+      out.writeInt64(playheadStart);
+      out.writeByte(static_cast<char>(region.analysisState));
+      out.writeFloat(region.analysisResult);
+      out.writeBool(region.fingerprint.has_value());
+      if (region.fingerprint) {
+        out.write(region.fingerprint->levels.data(),
+                  sizeof(region.fingerprint->levels));
+        out.write(region.fingerprint->crossings.data(),
+                  sizeof(region.fingerprint->crossings));
+      }
+    }
+  }
+}
+
+size_t PlaybackResults::readFrom(const void* data, size_t size) {
+  // Read straight out of the buffer, in the order written, so the maps can
+  // be built with hints rather than searched
+  auto bytes = static_cast<const uint8_t*>(data);
+  if (size < stateHeaderSize ||
+      std::memcmp(bytes, stateMagic, sizeof(stateMagic)) != 0) {
+    return 0;
+  }
+  // Written little-endian by MemoryOutputStream, whatever the platform
+  auto pos = bytes + sizeof(stateMagic);
+  auto alignmentOffset =
+      static_cast<SampleCounter>(juce::ByteOrder::littleEndianInt64(pos));
+  auto regionSize =
+      static_cast<SampleCounter>(juce::ByteOrder::littleEndianInt64(pos + 8));
+  auto regionFrequency =
+      static_cast<SampleCounter>(juce::ByteOrder::littleEndianInt64(pos + 16));
+  uint32_t sampleRate = juce::ByteOrder::littleEndianInt(pos + 24);
+  uint32_t count = juce::ByteOrder::littleEndianInt(pos + 28);
+  pos += 32;
+  const auto end = bytes + size;
+  if (static_cast<size_t>(end - pos) / stateRegionSize < count) {
+    return 0;
+  }
+
+  Results restored;
+  std::optional<SampleCounter> lastOffset;
+  std::map<PlayheadTime, Region>* playthrough{nullptr};
+  for (uint32_t i = 0; i < count; i++) {
+    if (static_cast<size_t>(end - pos) < stateRegionSize) {
+      return 0;
+    }
+    auto offset =
+        static_cast<SampleCounter>(juce::ByteOrder::littleEndianInt64(pos));
+    auto playheadStart =
+        static_cast<PlayheadTime>(juce::ByteOrder::littleEndianInt64(pos + 8));
+    auto state = pos[16];
+    auto result =
+        std::bit_cast<float>(juce::ByteOrder::littleEndianInt(pos + 17));
+    bool hasFingerprint = pos[21] != 0;
+    pos += stateRegionSize;
+    if (state > Region::State::FAILURE ||
+        (lastOffset && offset < *lastOffset)) {
+      return 0;
+    }
+
+    Region region(TimePoint{sampleRate, offset + playheadStart, playheadStart},
+                  TimePoint{sampleRate, offset + playheadStart + regionSize,
+                            playheadStart + regionSize},
+                  0, true);
+    region.analysisState = static_cast<Region::State>(state);
+    region.analysisResult = result;
+    if (hasFingerprint) {
+      AudioFingerprint fingerprint;
+      if (static_cast<size_t>(end - pos) <
+          sizeof(fingerprint.levels) + sizeof(fingerprint.crossings)) {
+        return 0;
+      }
+      std::memcpy(fingerprint.levels.data(), pos, sizeof(fingerprint.levels));
+      pos += sizeof(fingerprint.levels);
+      std::memcpy(fingerprint.crossings.data(), pos,
+                  sizeof(fingerprint.crossings));
+      pos += sizeof(fingerprint.crossings);
+      region.fingerprint = fingerprint;
+    }
+
+    if (offset != lastOffset) {
+      playthrough = &restored.regions
+                         .emplace_hint(restored.regions.end(), offset,
+                                       std::map<PlayheadTime, Region>{})
+                         ->second;
+      restored.playthroughOffsets.emplace_hint(
+          restored.playthroughOffsets.end(), offset);
+      lastOffset = offset;
+    }
+    playthrough->emplace_hint(playthrough->end(), playheadStart, region);
+    restored.playheadStartTimes.insert(playheadStart);
+  }
+
+  // Earlier than anything from this session, in the same order
+  if (lastOffset) {
+    auto shift = restoredOffsetsEnd - *lastOffset;
+    Results rebased;
+    rebased.playheadStartTimes = std::move(restored.playheadStartTimes);
+    for (auto& [offset, regions] : restored.regions) {
+      // Sample counters move with their playthrough, playhead times don't
+      for (auto& [playheadStart, region] : regions) {
+        region.start.sampleCounter += shift;
+        region.end.sampleCounter += shift;
+      }
+      rebased.playthroughOffsets.emplace_hint(
+          rebased.playthroughOffsets.end(), offset + shift);
+      rebased.regions.emplace_hint(rebased.regions.end(), offset + shift,
+                                   std::move(regions));
+    }
+    restored = std::move(rebased);
+  }
+
+  {
+    std::lock_guard mtx(resultsLock_);
+    alignmentOffset_ = alignmentOffset;
+    regionSize_ = regionSize;
+    regionFrequency_ = regionFrequency;
+    results_ = std::move(restored);
+    ++updateCounter_;
+  }
+  return static_cast<size_t>(pos - bytes);
+}
+
+uint64_t PlaybackResults::getNumInvalidated() {
+  return invalidated_;
+}
+
+void PlaybackResults::swap(PlaybackResults& other) {
+  std::scoped_lock mtx(resultsLock_, other.resultsLock_);
+  std::swap(results_, other.results_);
+  alignmentOffset_ = other.alignmentOffset_.exchange(alignmentOffset_);
+  regionSize_ = other.regionSize_.exchange(regionSize_);
+  regionFrequency_ = other.regionFrequency_.exchange(regionFrequency_);
+  ++updateCounter_;
+  ++other.updateCounter_;
+}
+
 }  // namespace audio_plugin
\ No newline at end of file
@@ -7,9 +7,19 @@
 #include <vector>
 #include <map>
 #include <memory>
+#include <array>
 #include <atomic>
+#include <functional>
+#include <span>
+#include "AudioFingerprint.h"
+#include "AudioThreadStats.h"
 #include "CircularBuffer.h"
 #include "Comms.h"
+#include "Metrics.h"
+#include "RegionScheduler.h"
+#include "RegionTracer.h"
+#include "ResultArena.h"
+#include "ResultJournal.h"
 #include "Types.h"
 
 namespace audio_plugin {
@@ -23,11 +33,15 @@ struct Region {
   Region(TimePoint startTime,
          TimePoint endTime,
          uint16_t counter,
-         bool duringPlayback)
+         bool duringPlayback,
+         bool offlineRender = false,
+         uint8_t streamIndex = 0)
       : start(startTime),
         end(endTime),
         count(counter),
-        wasDuringPlayback(duringPlayback) {}
+        wasDuringPlayback(duringPlayback),
+        duringOfflineRender(offlineRender),
+        stream(streamIndex) {}
   enum State { 
     PENDING,        // Region added - no other action taken
     IN_PROGRESS,    // Region has been sent for analysis
@@ -39,14 +53,35 @@ struct Region {
   TimePoint end;
   uint16_t count{0};
   bool wasDuringPlayback{false};
+  bool duringOfflineRender{false};  // Never timed out or aged out
+  bool infill{false};  // Added between neighbours by adaptive density
+  uint8_t stream{0};   // Which of the input's streams it's from
   // This struct is stored in a set which is iterated by const
   // so need to mark non-order-changing members as mutable
   mutable State analysisState{PENDING};
+  mutable uint8_t attempts{0};
+  // Stage timestamps, all from juce::Time::getMillisecondCounterHiRes()
+  mutable double createdMs{0.0};
+  mutable double sendAttemptedMs{0.0};  // First seen by the timer
+  mutable double sentMs{0.0};           // Latest attempt
+  mutable double receivedMs{0.0};       // Reply received
+  mutable double appliedMs{0.0};        // Result stored
+  // As reported by the service, if it does
+  mutable std::optional<double> serviceQueueMs;
+  mutable std::optional<double> serviceInferenceMs;
   mutable bool stale{false};
-  mutable float analysisResult{0.f};
+  mutable float analysisResult{0.f};  // Over the whole region
+  // Per-frame scores across the region, if the service sent them. Read
+  // through AnalysisRegions::getResultArena().
+  mutable ResultArena::Handle frames;
+  // Of the audio analysed, for results from playback
+  mutable std::optional<AudioFingerprint> fingerprint;
   bool operator<(const Region& other) const {
-    return start.sampleCounter <
-            other.start.sampleCounter;  // Sorting for quick search
+    // Sorting for quick search
+    if (start.sampleCounter != other.start.sampleCounter) {
+      return start.sampleCounter < other.start.sampleCounter;
+    }
+    return stream < other.stream;
   }
 };
 
@@ -69,8 +104,32 @@ public:
                  SampleCounter regionFrequency);
   void clear();
 
+  // Compact binary form, for saving with the plugin state: the config, then
+  // each result with its fingerprint (little-endian). Per-frame scores
+  // aren't kept.
+  static constexpr uint8_t stateMagic[4]{'W', 'P', 'R', 1};
+  void writeTo(juce::MemoryOutputStream& out);
+  // Replaces the results and config with those written by writeTo().
+  // Restored playthroughs go before any from this session. Returns how many
+  // bytes were read, or 0 (changing nothing) if they aren't readable.
+  size_t readFrom(const void* data, size_t size);
+  // Results for earlier playthroughs are dropped when a new result for the
+  // same span has a fingerprint that doesn't match theirs
+  uint64_t getNumInvalidated();
+  // Exchanges results and config (e.g. with those just read)
+  void swap(PlaybackResults& other);
+
 private:
+  void invalidate(PlayheadTime playheadStart,
+                  const AudioFingerprint& fingerprint);
+
+  static constexpr size_t stateHeaderSize{sizeof(stateMagic) + 3 * 8 + 4 + 4};
+  static constexpr size_t stateRegionSize{8 + 8 + 1 + 4 + 1};
+  // Playthroughs restored from a saved state are moved to end here
+  static constexpr SampleCounter restoredOffsetsEnd{-(int64_t{1} << 48)};
+
   std::atomic<uint64_t> updateCounter_{0};
+  std::atomic<uint64_t> invalidated_{0};
   std::atomic<SampleCounter> alignmentOffset_{0};
   std::atomic<SampleCounter> regionSize_{0};
   std::atomic<SampleCounter> regionFrequency_{0};
@@ -80,8 +139,17 @@ private:
 
 class AnalysisRegions : private juce::Timer {
 public:
+  struct OfflineProgress {
+    bool active{false};  // Rendering, or still working through the backlog
+    size_t regionsTotal{0};
+    size_t regionsComplete{0};
+    size_t regionsFailed{0};
+    double regionsPerSecond{0.0};
+  };
+
   AnalysisRegions(std::shared_ptr<MonoCircularBuffer> readBuff,
-                  std::shared_ptr<ServiceCommunicator> comms);
+                  std::shared_ptr<ServiceCommunicator> comms,
+                  std::shared_ptr<AudioThreadStats> stats = {});
   ~AnalysisRegions();
 
   enum Alignment {
@@ -90,10 +158,24 @@ public:
     PLAYBACK_BEGIN
   };
 
+  // Further streams of the same input (e.g. per stem), each with its own
+  // history. Regions are made for every stream at once and share the
+  // scheduler and service. Only before any audio arrives.
+  void addStream(std::shared_ptr<MonoCircularBuffer> history,
+                 const std::string& name);
+  void setStreamName(size_t stream, const std::string& name);
+  size_t getNumStreams();
+  std::string getStreamName(size_t stream);
+
+  // blocks are the audio from blockStartTime to curTime, one per stream, for
+  // adaptive density
   void updateFrom(const TimePoint& blockStartTime,
                   const TimePoint& curTime,
-                  const PlaybackRegion& currentPlaybackRegion);
-  std::set<Region> getRegions(SampleCounter rangeStart, SampleCounter rangeEnd);
+                  const PlaybackRegion& currentPlaybackRegion,
+                  std::span<const std::vector<float>> blocks = {});
+  std::set<Region> getRegions(SampleCounter rangeStart,
+                              SampleCounter rangeEnd,
+                              size_t stream = 0);
   size_t getNumRegionsInState(Region::State state);
   SampleRate getReferenceSampleRate();
   uint32_t getRegionSizeMs();
@@ -102,15 +184,77 @@ public:
   uint32_t getRegionFreqMs();
   uint32_t getRegionFreqSamples();
   void setRegionFreqMs(uint32_t ms);
+  // Rather than a fixed frequency, keep adjusting it to just inside what the
+  // service keeps up with, between minMs and maxMs. It moves in steps of
+  // minMs so results stay on one grid. Off, the frequency stays where it
+  // got to.
+  void setAutoFrequency(bool enable, uint32_t minMs, uint32_t maxMs);
+  bool isAutoFrequency();
+  struct FrequencyStatus {
+    bool automatic{false};
+    uint32_t frequencyMs{0};
+    uint32_t minMs{0};
+    uint32_t maxMs{0};
+    double completionsPerSecond{0.0};  // Measured, live regions only
+    double latencyMs{0.0};             // Likewise, round trip
+  };
+  FrequencyStatus getFrequencyStatus();
+  // Rather than spending the service on regions that will all say the same,
+  // regions go at the region frequency and more are added between
+  // neighbours whose results differ by more than resultThreshold, or across
+  // which the level of the audio moves by more than levelThresholdDb.
+  // Gaps are halved until they are the frequency over 2^maxSubdivisions,
+  // which the results table is then aligned to. Live regions only.
+  struct DensityConfig {
+    bool adaptive{false};
+    float resultThreshold{0.1f};
+    float levelThresholdDb{6.f};
+    uint8_t maxSubdivisions{2};
+  };
+  void setDensityConfig(const DensityConfig& config);
+  DensityConfig getDensityConfig();
+  // Regions added by adaptive density
+  uint64_t getNumInfillRegions();
   Alignment getAlignment();
   void setAlignment(Alignment alignment);
   void restartRegions();
   void updateAsStale();
   void abortInProgress();
   void generateRegions(bool enable);
-  PlaybackResults::Results getResults();
-  uint64_t getResultsUpdateCount();
-  void resetResults();
+  // Offline renders run faster than real time. Rather than dropping regions
+  // to keep up, every region is kept (along with its history) and sent as
+  // fast as the service will take them.
+  void setOfflineMode(bool offline);
+  bool isOfflineMode();
+  OfflineProgress getOfflineProgress();
+  // Limits how many regions are with the service at once (0 for no limit)
+  void setMaxInFlight(size_t maxInFlight);
+  // Which pending region is sent next, live. Offline renders are always sent
+  // in programme order.
+  void setSchedulingPolicy(RegionScheduler::Policy policy);
+  RegionScheduler::Policy getSchedulingPolicy();
+  RegionScheduler::Snapshot getSchedulerSnapshot();
+  void resetSchedulerStats();
+  // Per stage latencies of regions that have had a reply
+  RegionTracer& getTracer();
+  // Per-frame scores of completed regions
+  ResultArena& getResultArena();
+  // Called from the timer whenever a region completes or fails, with the
+  // regions locked - so keep it quick
+  void setRegionFinishedCallback(std::function<void(const Region&)> callback);
+  // Records every region that completes or fails. None by default.
+  void setJournal(std::shared_ptr<ResultJournal> journal);
+  PlaybackResults::Results getResults(size_t stream = 0);
+  uint64_t getResultsUpdateCount(size_t stream = 0);
+  void resetResults();  // Every stream's
+  // Every stream's results, for saving with the plugin state. Read back by
+  // stream name, so streams can be added or removed in between. False if
+  // the data isn't readable (nothing is changed).
+  void writeResults(juce::MemoryOutputStream& out);
+  bool readResults(const void* data, size_t size);
+  // Sends pending regions and collects responses. Normally run by the timer,
+  // public so it can be driven directly (e.g. benchmarks)
+  void updateRegions();
 
 private:
   void timerCallback() override;
@@ -119,25 +263,109 @@ private:
   getLastAddedRegionSampleCounters();
   bool addNewRegion(SampleCounter startTime);
   bool addNewRegionIfRequired();
-  void updateRegions();
+  bool canSend(ServiceCommunicator& comms, size_t inFlight);
+  bool sendBatch(ServiceCommunicator& comms, size_t& inFlight);
+  void regionFinished(const Region& region);
+  void adjustFrequency(double nowMs);
+  SampleCounter getResultsGrid();
+  struct Levels;
+  void measureLevel(Levels& levels,
+                    SampleCounter blockStart,
+                    std::span<const float> block);
+  std::optional<float> getLevel(const Levels& levels,
+                                SampleCounter start,
+                                SampleCounter end);
+  void addInfill(const Region& region, double nowMs);
+  void addInfillBetween(const Region& before, const Region& after,
+                        double nowMs);
+  void updateStateGauges();
 
   // using weak_ptrs so we don't end up with cyclic shared_ptrs
   std::weak_ptr<ServiceCommunicator> comms_;
-  std::weak_ptr<MonoCircularBuffer> readBuff_;
+  std::weak_ptr<MonoCircularBuffer> readBuff_;  // The first stream's history
 
+  std::shared_ptr<AudioThreadStats> stats_;
   std::mutex regionsLock_;
   std::set<Region> regions_;
 
-  PlaybackResults playbackResults_;
+  // Mean square level of the audio in bins of a quarter of a second, most
+  // recent levelBins of them, written by the audio thread. Bins it skipped
+  // over are NaN.
+  static constexpr size_t levelBins{1024};
+  struct Levels {
+    std::array<std::atomic<float>, levelBins> bins{};
+    std::atomic<int64_t> end{0};  // Index after the last complete bin
+    int64_t bin{-1};              // Audio thread only, like these
+    double sum{0.0};
+    SampleCounter samples{0};
+  };
+  struct Stream {
+    std::weak_ptr<MonoCircularBuffer> history;
+    std::string name;
+    std::unique_ptr<PlaybackResults> results;
+    std::unique_ptr<Levels> levels;
+  };
+  // Fixed once audio arrives, so read without locking
+  std::vector<Stream> streams_;
+  RegionTracer tracer_;
+  RegionScheduler scheduler_;  // Guarded by regionsLock_
+  ResultArena resultArena_;
+
+  SharedMetricsRegistry metrics_;
+  std::array<std::shared_ptr<Gauge>, Region::State::FAILURE + 1> stateGauges_;
+  std::shared_ptr<Gauge> inFlightGauge_;
+  std::shared_ptr<Gauge> queueDepthGauge_;  // Waiting to be sent
+  std::shared_ptr<Counter> timedOut_;
+  std::shared_ptr<Counter> failed_;
+  std::shared_ptr<Counter> retried_;
+  std::shared_ptr<Counter> infilled_;
+  std::shared_ptr<Histogram> roundTripMs_;
 
   SampleRate refSampleRate_{16000};
   SampleCounter regionSize_{16000 * 5};           // 5 sec
-  SampleCounter regionFrequency_{(16000 * 5) / 2};  // 2.5 sec
+  std::atomic<SampleCounter> regionFrequency_{(16000 * 5) / 2};  // 2.5 sec
+  // Auto frequency
+  static constexpr double autoFrequencyIntervalMs{2000.0};
+  static constexpr double autoFrequencyHoldMs{10000.0};  // After backing off
+  static constexpr double autoFrequencyUtilisation{0.9};
+  std::atomic<bool> autoFrequency_{false};
+  std::atomic<SampleCounter> minFrequency_{16000};
+  std::atomic<SampleCounter> maxFrequency_{16000 * 5};
+  // Guarded by regionsLock_
+  double lastFrequencyAdjustMs_{0.0};
+  double frequencyHoldUntilMs_{0.0};
+  uint64_t completionsSinceAdjust_{0};
+  uint64_t expiredAtAdjust_{0};
+  double completionsPerSecond_{0.0};
+  double latencyMs_{0.0};
+  // Adaptive density
+  std::atomic<bool> adaptiveDensity_{false};
+  DensityConfig densityConfig_;  // Guarded by regionsLock_
+  std::atomic<uint8_t> densitySubdivisions_{0};  // 0 unless adaptive
+  std::atomic<uint64_t> infillRegions_{0};
   std::vector<float> analysisBlock_; // Avoid repeated alloc
+  // Completed during playback, fingerprinted without regionsLock_ held.
+  // Timer thread only.
+  std::vector<Region> playbackCompleted_;
+  std::vector<float> fingerprintBlock_;
+  // Regions gathered to send together, guarded by regionsLock_
+  std::vector<const Region*> batch_;
+  std::vector<TimePoint> batchStarts_;  // Avoid repeated alloc
   TimePoint curTime_;
   PlaybackRegion lastKnownPlaybackRegion_;
-  SampleCounter maxRegionAge_;
-  const size_t maxPendingRegions_{3}; // Prevent overwhelming service when connected
+  // Guarded by regionsLock_
+  ServiceCommunicator::ConnectionState lastConnectionState_{
+      ServiceCommunicator::DOWN};
+  const uint8_t maxOfflineAttempts_{5};
+  std::atomic<bool> offline_{false};
+  OfflineProgress offlineProgress_;      // Guarded by regionsLock_
+  double offlineStartMs_{0.0};           // Guarded by regionsLock_
+  double offlineLastCompletionMs_{0.0};  // Guarded by regionsLock_
+  std::atomic<size_t> maxInFlight_{0};
+  std::atomic<RegionScheduler::Policy> schedulingPolicy_{
+      RegionScheduler::LATEST_FIRST};
+  std::function<void(const Region&)> regionFinishedCallback_;  // Likewise
+  std::shared_ptr<ResultJournal> journal_;                     // Likewise
   std::atomic<Alignment> alignment_{TIME_ZERO};
   std::atomic<bool> generateRegions_{true};
 };
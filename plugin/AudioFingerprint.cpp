@@ -0,0 +1,49 @@
+#include "AudioFingerprint.h"
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+
+namespace audio_plugin {
+
+AudioFingerprint AudioFingerprint::of(std::span<const float> samples) {
+  AudioFingerprint fingerprint;
+  fingerprint.levels.fill(-127);
+  const auto bandLength = samples.size() / numBands;
+  if (bandLength < 2) {
+    return fingerprint;
+  }
+  for (size_t band = 0; band < numBands; band++) {
+    auto slice = samples.subspan(band * bandLength, bandLength);
+    double sum{0.0};
+    size_t crossings{0};
+    bool wasPositive = slice[0] >= 0.f;
+    for (auto sample : slice) {
+      sum += static_cast<double>(sample) * sample;
+      bool isPositive = sample >= 0.f;
+      crossings += isPositive != wasPositive;
+      wasPositive = isPositive;
+    }
+    auto meanSquare = sum / static_cast<double>(bandLength);
+    auto db = meanSquare > 0.0 ? 10.0 * std::log10(meanSquare) : -127.0;
+    fingerprint.levels[band] =
+        static_cast<int8_t>(std::lround(std::clamp(db, -127.0, 0.0)));
+    fingerprint.crossings[band] = static_cast<uint8_t>(
+        std::min<size_t>(crossings * 255 / (bandLength - 1), 255));
+  }
+  return fingerprint;
+}
+
+bool AudioFingerprint::matches(const AudioFingerprint& other) const {
+  for (size_t band = 0; band < numBands; band++) {
+    if (std::abs(levels[band] - other.levels[band]) > levelToleranceDb) {
+      return false;
+    }
+    if (levels[band] > quietDb && other.levels[band] > quietDb &&
+        std::abs(crossings[band] - other.crossings[band]) > crossingTolerance) {
+      return false;
+    }
+  }
+  return true;
+}
+
+}  // namespace audio_plugin
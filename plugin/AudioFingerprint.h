@@ -0,0 +1,30 @@
+#pragma once
+
+#include <array>
+#include <cstdint>
+#include <span>
+
+namespace audio_plugin {
+
+// A coarse summary of a region's audio, to tell whether what's at a playhead
+// span has changed since it was analysed.
+//
+// Level and zero crossing rate for each of a number of equal slices. The
+// same audio heard again matches even if it lands a fraction of a sample
+// differently, while edits and mix moves of more than about a decibel don't.
+// Small (64 bytes) so it can be kept with every saved result.
+struct AudioFingerprint {
+  static constexpr size_t numBands{32};
+  static constexpr int levelToleranceDb{1};
+  static constexpr int crossingTolerance{4};  // Out of 255
+  // Zero crossings in quieter slices are mostly noise, so aren't compared
+  static constexpr int quietDb{-60};
+
+  std::array<int8_t, numBands> levels{};  // Mean square, dBFS (-127 to 0)
+  std::array<uint8_t, numBands> crossings{};  // Per sample, scaled to 255
+
+  static AudioFingerprint of(std::span<const float> samples);
+  bool matches(const AudioFingerprint& other) const;
+};
+
+}  // namespace audio_plugin
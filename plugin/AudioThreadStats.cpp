@@ -0,0 +1,198 @@
+#include "AudioThreadStats.h"
+#include <algorithm>
+#include <bit>
+
+namespace {
+
+template <typename T>
+void updateMax(std::atomic<T>& max, T value) {
+  auto current = max.load(std::memory_order_relaxed);
+  while (value > current &&
+         !max.compare_exchange_weak(current, value, std::memory_order_relaxed)) {
+  }
+}
+
+juce::String formatUs(uint64_t ns) {
+  return juce::String(static_cast<double>(ns) / 1000.0, 1) + " us";
+}
+
+}  // namespace
+
+namespace audio_plugin {
+
+AudioThreadStats::ScopedCallbackTimer::ScopedCallbackTimer(
+    AudioThreadStats& stats,
+    int numSamples,
+    double sampleRate)
+    : stats_(stats),
+      start_(std::chrono::steady_clock::now()),
+      deadlineNs_(sampleRate > 0.0
+                      ? static_cast<uint64_t>(numSamples * 1e9 / sampleRate)
+                      : 0) {}
+
+AudioThreadStats::ScopedCallbackTimer::~ScopedCallbackTimer() {
+  stats_.recordCallback(elapsedNs(start_), deadlineNs_);
+}
+
+AudioThreadStats::AudioThreadStats() {
+  reset();
+}
+
+uint64_t AudioThreadStats::elapsedNs(
+    std::chrono::steady_clock::time_point since) {
+  return static_cast<uint64_t>(
+      std::chrono::duration_cast<std::chrono::nanoseconds>(
+          std::chrono::steady_clock::now() - since)
+          .count());
+}
+
+void AudioThreadStats::recordCallback(uint64_t ns, uint64_t deadlineNs) {
+  callbacks_.fetch_add(1, std::memory_order_relaxed);
+  totalCallbackNs_.fetch_add(ns, std::memory_order_relaxed);
+  updateMax(maxCallbackNs_, ns);
+  if (deadlineNs == 0) {
+    return;  // Not prepared yet, so no deadline to measure against
+  }
+  auto loadPercent = static_cast<uint32_t>(
+      std::min<uint64_t>(ns * 100 / deadlineNs, UINT32_MAX));
+  updateMax(maxLoadPercent_, loadPercent);
+  auto bucket =
+      std::min<size_t>(loadPercent / loadBucketPercent, numLoadBuckets - 1);
+  loadHistogram_[bucket].fetch_add(1, std::memory_order_relaxed);
+  if (ns > deadlineNs) {
+    overruns_.fetch_add(1, std::memory_order_relaxed);
+  }
+}
+
+void AudioThreadStats::recordLockWait(Lock which, uint64_t ns, bool contended) {
+  auto& waits = locks_[which];
+  waits.count.fetch_add(1, std::memory_order_relaxed);
+  if (contended) {
+    waits.contended.fetch_add(1, std::memory_order_relaxed);
+  }
+  waits.totalNs.fetch_add(ns, std::memory_order_relaxed);
+  updateMax(waits.maxNs, ns);
+  auto bucket = std::min<size_t>(std::bit_width(ns / 1000), numWaitBuckets - 1);
+  waits.histogram[bucket].fetch_add(1, std::memory_order_relaxed);
+}
+
+AudioThreadStats::Snapshot AudioThreadStats::getSnapshot() const {
+  // Each value is read atomically, but not all together. Good enough for
+  // stats that are only ever added to.
+  Snapshot snapshot;
+  snapshot.callbacks = callbacks_.load(std::memory_order_relaxed);
+  snapshot.overruns = overruns_.load(std::memory_order_relaxed);
+  snapshot.historyDrops = historyDrops_.load(std::memory_order_relaxed);
+  snapshot.totalCallbackNs = totalCallbackNs_.load(std::memory_order_relaxed);
+  snapshot.maxCallbackNs = maxCallbackNs_.load(std::memory_order_relaxed);
+  snapshot.maxLoadPercent = maxLoadPercent_.load(std::memory_order_relaxed);
+  for (size_t i = 0; i < numLoadBuckets; i++) {
+    snapshot.loadHistogram[i] =
+        loadHistogram_[i].load(std::memory_order_relaxed);
+  }
+  for (size_t l = 0; l < NUM_LOCKS; l++) {
+    auto& src = locks_[l];
+    auto& dst = snapshot.locks[l];
+    dst.count = src.count.load(std::memory_order_relaxed);
+    dst.contended = src.contended.load(std::memory_order_relaxed);
+    dst.totalNs = src.totalNs.load(std::memory_order_relaxed);
+    dst.maxNs = src.maxNs.load(std::memory_order_relaxed);
+    for (size_t i = 0; i < numWaitBuckets; i++) {
+      dst.histogram[i] = src.histogram[i].load(std::memory_order_relaxed);
+    }
+  }
+  return snapshot;
+}
+
+void AudioThreadStats::reset() {
+  callbacks_ = 0;
+  overruns_ = 0;
+  historyDrops_ = 0;
+  totalCallbackNs_ = 0;
+  maxCallbackNs_ = 0;
+  maxLoadPercent_ = 0;
+  for (auto& bucket : loadHistogram_) {
+    bucket = 0;
+  }
+  for (auto& waits : locks_) {
+    waits.count = 0;
+    waits.contended = 0;
+    waits.totalNs = 0;
+    waits.maxNs = 0;
+    for (auto& bucket : waits.histogram) {
+      bucket = 0;
+    }
+  }
+}
+
+const char* AudioThreadStats::getLockName(Lock which) {
+  switch (which) {
+    case PLAY_STATE:
+      return "Play state";
+    case PLAYBACK_REGION:
+      return "Playback region";
+    case BUFFER:
+      return "History buffer";
+    case REGIONS:
+      return "Regions";
+    case NUM_LOCKS:
+      break;
+  }
+  return "";
+}
+
+juce::String AudioThreadStats::toString(const Snapshot& snapshot) {
+  juce::String text;
+  text << "Callbacks: " << juce::String(snapshot.callbacks)
+       << ", overruns: " << juce::String(snapshot.overruns)
+       << ", history drops: " << juce::String(snapshot.historyDrops) << "\n";
+  if (snapshot.callbacks > 0) {
+    text << "Callback time: mean "
+         << formatUs(snapshot.totalCallbackNs / snapshot.callbacks)
+         << ", max " << formatUs(snapshot.maxCallbackNs) << " ("
+         << juce::String(snapshot.maxLoadPercent) << "% of block)\n";
+  }
+
+  text << "\nCallback time as % of block:\n";
+  for (size_t i = 0; i < numLoadBuckets; i++) {
+    auto from = static_cast<uint32_t>(i) * loadBucketPercent;
+    text << "  " << juce::String(from).paddedLeft(' ', 3) << "%"
+         << (i + 1 < numLoadBuckets
+                 ? "-" + juce::String(from + loadBucketPercent).paddedLeft(' ', 3) + "%"
+                 : juce::String("+    "))
+         << ": " << juce::String(snapshot.loadHistogram[i]) << "\n";
+  }
+
+  text << "\nLock waits on the audio thread:\n";
+  for (size_t l = 0; l < NUM_LOCKS; l++) {
+    const auto& waits = snapshot.locks[l];
+    text << "  " << getLockName(static_cast<Lock>(l)) << ": "
+         << juce::String(waits.count) << " taken, "
+         << juce::String(waits.contended) << " contended, total "
+         << formatUs(waits.totalNs) << ", max " << formatUs(waits.maxNs)
+         << "\n";
+    if (waits.contended == 0) {
+      continue;
+    }
+    for (size_t i = 0; i < numWaitBuckets; i++) {
+      if (waits.histogram[i] == 0) {
+        continue;
+      }
+      text << "    "
+           << (i + 1 < numWaitBuckets ? "<" + juce::String(1 << i)
+                                      : ">=" + juce::String(1 << (i - 1)))
+           << " us: " << juce::String(waits.histogram[i]) << "\n";
+    }
+  }
+  return text;
+}
+
+bool AudioThreadStats::dumpToFile(const juce::File& file,
+                                  const juce::String& appendix) const {
+  auto text = "Audio thread stats at " +
+              juce::Time::getCurrentTime().toISO8601(true) + "\n\n" +
+              toString(getSnapshot()) + appendix;
+  return file.replaceWithText(text);
+}
+
+}  // namespace audio_plugin
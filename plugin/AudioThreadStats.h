@@ -0,0 +1,128 @@
+#pragma once
+
+#include <juce_core/juce_core.h>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <mutex>
+
+namespace audio_plugin {
+
+// Health of the audio thread, so dropouts in big sessions can be attributed
+// to this plugin (or ruled out).
+//
+// Records how long each callback took against its deadline (the duration of
+// the block) and how long the audio thread waited on each lock it takes.
+// Recording is lock-free and allocation-free - just relaxed atomics - so it
+// is safe to leave on. Read it from anywhere with getSnapshot().
+class AudioThreadStats {
+public:
+  enum Lock {
+    PLAY_STATE,       // AudioPluginAudioProcessor::playStateMtx_
+    PLAYBACK_REGION,  // Buff::playbackRegionMtx_
+    BUFFER,           // MonoCircularBuffer::bufferMutex_
+    REGIONS,          // AnalysisRegions::regionsLock_
+    NUM_LOCKS
+  };
+
+  // Callback duration as a percentage of the deadline, in 10% steps. The last
+  // bucket holds everything from 150%.
+  static constexpr size_t numLoadBuckets{16};
+  static constexpr uint32_t loadBucketPercent{10};
+  // Lock waits in power-of-two microsecond steps: <1us, <2us, <4us... with
+  // the last bucket holding everything from 16ms
+  static constexpr size_t numWaitBuckets{16};
+
+  struct LockWaits {
+    uint64_t count{0};      // Times the lock was taken
+    uint64_t contended{0};  // ...of which it wasn't immediately available
+    uint64_t totalNs{0};
+    uint64_t maxNs{0};
+    std::array<uint64_t, numWaitBuckets> histogram{};
+  };
+
+  struct Snapshot {
+    uint64_t callbacks{0};
+    uint64_t overruns{0};  // Callbacks that took longer than their block
+    // Blocks partly or wholly left out of the history because no memory
+    // was ready for them (the history encoder had fallen far behind)
+    uint64_t historyDrops{0};
+    uint64_t totalCallbackNs{0};
+    uint64_t maxCallbackNs{0};
+    uint32_t maxLoadPercent{0};
+    std::array<uint64_t, numLoadBuckets> loadHistogram{};
+    std::array<LockWaits, NUM_LOCKS> locks{};
+  };
+
+  // Times a callback from construction to destruction
+  class ScopedCallbackTimer {
+  public:
+    ScopedCallbackTimer(AudioThreadStats& stats,
+                        int numSamples,
+                        double sampleRate);
+    ~ScopedCallbackTimer();
+
+  private:
+    AudioThreadStats& stats_;
+    std::chrono::steady_clock::time_point start_;
+    uint64_t deadlineNs_;
+  };
+
+  AudioThreadStats();
+
+  ScopedCallbackTimer timeCallback(int numSamples, double sampleRate) {
+    return ScopedCallbackTimer(*this, numSamples, sampleRate);
+  }
+
+  // Takes the lock, recording how long we had to wait for it
+  template <typename Mutex>
+  std::unique_lock<Mutex> lock(Mutex& mutex, Lock which) {
+    std::unique_lock<Mutex> lock{mutex, std::try_to_lock};
+    if (lock.owns_lock()) {
+      recordLockWait(which, 0, false);
+      return lock;
+    }
+    auto start = std::chrono::steady_clock::now();
+    lock.lock();
+    recordLockWait(which, elapsedNs(start), true);
+    return lock;
+  }
+
+  void recordHistoryDrop() {
+    historyDrops_.fetch_add(1, std::memory_order_relaxed);
+  }
+
+  Snapshot getSnapshot() const;
+  void reset();
+
+  static const char* getLockName(Lock which);
+  static juce::String toString(const Snapshot& snapshot);
+  // Anything in appendix (e.g. other stats) is written after ours
+  bool dumpToFile(const juce::File& file,
+                  const juce::String& appendix = {}) const;
+
+private:
+  struct AtomicLockWaits {
+    std::atomic<uint64_t> count{0};
+    std::atomic<uint64_t> contended{0};
+    std::atomic<uint64_t> totalNs{0};
+    std::atomic<uint64_t> maxNs{0};
+    std::array<std::atomic<uint64_t>, numWaitBuckets> histogram{};
+  };
+
+  static uint64_t elapsedNs(std::chrono::steady_clock::time_point since);
+  void recordCallback(uint64_t ns, uint64_t deadlineNs);
+  void recordLockWait(Lock which, uint64_t ns, bool contended);
+
+  std::atomic<uint64_t> callbacks_{0};
+  std::atomic<uint64_t> overruns_{0};
+  std::atomic<uint64_t> historyDrops_{0};
+  std::atomic<uint64_t> totalCallbackNs_{0};
+  std::atomic<uint64_t> maxCallbackNs_{0};
+  std::atomic<uint32_t> maxLoadPercent_{0};
+  std::array<std::atomic<uint64_t>, numLoadBuckets> loadHistogram_{};
+  std::array<AtomicLockWaits, NUM_LOCKS> locks_{};
+};
+
+}  // namespace audio_plugin
@@ -1,6 +1,31 @@
 #include "CircularBuffer.h"
+#include "Utils.h"
 #include <cassert>
 #include <algorithm>
+#include <bit>
+#include <cstdlib>
+#include <chrono>
+
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#elif defined(__linux__)
+#include <sys/mman.h>
+#endif
+
+namespace {
+
+constexpr size_t hugePageBytes{2 * 1024 * 1024};
+// Longest the audio thread is held up per block in an offline render before
+// we give up and let the oldest history go: this many times the block's own
+// length, so a render is never slowed to less than 1/20th real time, and no
+// more than maxBackpressureWait
+constexpr double maxBackpressureBlocks{20.0};
+constexpr auto maxBackpressureWait = std::chrono::seconds(10);
+
+}  // namespace
 
 namespace audio_plugin {
 
@@ -24,6 +49,22 @@ void WriteTracker::recordWrite(const TimePoint& latestDataStart,
   haveWritten_ = true;
 }
 
+void WriteTracker::recordWrites(const TimePoint& dataStart, size_t count) {
+  // Equivalent to recordWrite for each sample, but in one go
+  if (count == 0) {
+    return;
+  }
+  if (haveWritten_) {
+    assert(dataStart.sampleCounter == latestDataEnd_.sampleCounter + 1);
+  }
+  latestDataEnd_ = dataStart + static_cast<int64_t>(count - 1);
+  latestPosition_ = haveWritten_ ? latestPosition_ + count : count - 1;
+  if (positionLimit_ != 0) {
+    latestPosition_ %= positionLimit_;
+  }
+  haveWritten_ = true;
+}
+
 bool WriteTracker::haveWritten() {
   return haveWritten_;
 }
@@ -48,50 +89,164 @@ TimePoint WriteTracker::getLatestDataTimePoint() {
   return latestDataEnd_;
 }
 
-MonoCircularBuffer::MonoCircularBuffer(uint32_t bufferLengthMs,
-                                       SampleRate sampleRate)
-    : sampleRate_{sampleRate} {
-  size_t bufferLength = (bufferLengthMs * sampleRate) / 1000;
-  std::lock_guard<std::mutex> bufferLock{bufferMutex_};
-  buffer_ = std::vector<float>(bufferLength, 0.f);
-  writeTracker_ = WriteTracker(bufferLength);
+HistoryEncoderThread::HistoryEncoderThread()
+    : juce::TimeSliceThread("History Encoder") {
+  startThread(juce::Thread::Priority::low);
+}
+
+HistoryEncoderThread::~HistoryEncoderThread() {
+  stopThread(2000);
+}
+
+MonoCircularBuffer::MonoCircularBuffer(const HistoryConfig& config,
+                                       SampleRate sampleRate,
+                                       std::shared_ptr<AudioThreadStats> stats)
+    : stats_{stats ? stats : std::make_shared<AudioThreadStats>()},
+      sampleRate_{sampleRate} {
+  const size_t chunkSamples = sampleRate;  // 1 sec chunks
+  if (config.storage == HistoryConfig::DISK) {
+    auto mappedStore = std::make_unique<MappedHistoryStore>(
+        chunkSamples, msToSamples(config.diskCapacityMs, sampleRate),
+        config.diskDirectory);
+    if (mappedStore->isValid()) {
+      coldStore_ = std::move(mappedStore);
+      storage_ = HistoryConfig::DISK;
+    } else {
+      std::cerr << "Unable to map history file - using memory" << std::endl;
+    }
+  }
+  if (!coldStore_) {
+    coldStore_ = std::make_unique<CompressedHistoryStore>(chunkSamples);
+  }
+
+  // Hot tier needs to hold at least a couple of chunks so the encoder always
+  // has a chance to move a chunk before it is overwritten
+  size_t bufferLength = std::max<size_t>(
+      msToSamples(config.hotLengthMs, sampleRate), chunkSamples * 2);
+  encodeScratch_.resize(chunkSamples);
+  // Only the first couple of hot chunks (and the reserve) are committed here
+  // - the rest are committed as audio arrives
+  useHugePages_ = config.useHugePages;
+  hotChunkSamples_ =
+      useHugePages_ ? hugePageBytes / sizeof(float) : chunkSamples;
+  {
+    std::lock_guard<std::mutex> bufferLock{bufferMutex_};
+    hotLength_ = bufferLength;
+    hotChunks_.resize((bufferLength + hotChunkSamples_ - 1) / hotChunkSamples_);
+    writeTracker_ = WriteTracker(bufferLength);
+  }
+  setRetentionMs(config.retentionMs);
+  commitAhead();
+  encoderThread_->addTimeSliceClient(this);
+}
+
+MonoCircularBuffer::~MonoCircularBuffer() {
+  // Blocks until any in-progress slice has finished
+  encoderThread_->removeTimeSliceClient(this);
 }
 
 void MonoCircularBuffer::updateFrom(const std::vector<float>& srcBuffer,
                                     const TimePoint& startTime) {
 
-  std::lock_guard<std::mutex> lock{bufferMutex_};
-  for (int s = 0; s < srcBuffer.size(); ++s) {
-    size_t bufferNextWritePos = writeTracker_.getNextWritePosition();
-    buffer_[bufferNextWritePos] = srcBuffer[s];
-    writeTracker_.recordWrite(startTime, s);
+  auto lock = stats_->lock(bufferMutex_, AudioThreadStats::BUFFER);
+  // Never on a real-time audio thread, which drops (and counts) instead
+  const bool mayBlock = blockWhenFull_ && !realtime_;
+  std::chrono::steady_clock::time_point waitUntil;
+  if (mayBlock) {
+    waitUntil = std::chrono::steady_clock::now() + std::min(
+        std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+            std::chrono::duration<double>(
+                maxBackpressureBlocks * static_cast<double>(srcBuffer.size()) /
+                static_cast<double>(sampleRate_))),
+        std::chrono::steady_clock::duration(maxBackpressureWait));
+  }
+  if (mayBlock && !srcBuffer.empty()) {
+    auto newLatest =
+        startTime.sampleCounter + static_cast<SampleCounter>(srcBuffer.size()) -
+        1;
+    while (!hasSpaceFor(newLatest)) {
+      encoderThread_->notify();
+      if (spaceAvailable_.wait_until(lock, waitUntil) ==
+          std::cv_status::timeout) {
+        break;
+      }
+    }
+  }
+  if (!firstWrittenSampleCounter_.has_value() && !srcBuffer.empty()) {
+    firstWrittenSampleCounter_ = startTime.sampleCounter;
+  }
+  size_t written{0};
+  size_t writePos = writeTracker_.getNextWritePosition();
+  std::optional<SampleCounter> droppedUntil;
+  while (written < srcBuffer.size()) {
+    auto& chunk = hotChunks_[writePos / hotChunkSamples_];
+    if (!chunk) {
+      // The encoder thread commits ahead of us, so we should only get here
+      // if it is badly behind (or we're faster than real time). Never
+      // allocate here - take the reserve and have it commit another.
+      encoderThread_->moveToFrontOfQueue(this);
+      if (!reserveChunk_ && mayBlock) {
+        while (!chunk && !reserveChunk_ &&
+               spaceAvailable_.wait_until(lock, waitUntil) !=
+                   std::cv_status::timeout) {
+        }
+      }
+      if (!chunk) {
+        chunk = std::move(reserveChunk_);
+      }
+    }
+    auto chunkOffset = writePos % hotChunkSamples_;
+    auto run = std::min({srcBuffer.size() - written,
+                         hotChunkSamples_ - chunkOffset,
+                         hotLength_ - writePos});
+    if (chunk) {
+      std::copy_n(srcBuffer.begin() + written, run, chunk.get() + chunkOffset);
+    } else {
+      droppedUntil = startTime.sampleCounter +
+                     static_cast<SampleCounter>(written + run);
+    }
+    written += run;
+    writePos = (writePos + run) % hotLength_;
+  }
+  writeTracker_.recordWrites(startTime, srcBuffer.size());
+  if (droppedUntil.has_value()) {
+    // Nothing up to the end of what was dropped can be read from the hot
+    // tier. It leaves a gap in the history, like any other overrun.
+    hotValidFrom_ = std::max(hotValidFrom_.value_or(*droppedUntil),
+                             *droppedUntil);
+    stats_->recordHistoryDrop();
   }
 }
 
 TimePoint MonoCircularBuffer::getLatestSamples(
     std::vector<float>& dstBuffer) {
-  std::lock_guard<std::mutex> lock{bufferMutex_};
-
   if (dstBuffer.size() == 0) {
     return {sampleRate_, 0, std::nullopt};
   }
 
-  if (buffer_.size() == 0 || !writeTracker_.haveWritten()) {
-    // Zero-fill
-    std::fill(dstBuffer.begin(), dstBuffer.end(), 0.f);
-    return {sampleRate_, 0, std::nullopt};
-  }
-
-  size_t readPos = writeTracker_.getLatestWritePosition();
-  for (int i = dstBuffer.size() - 1; i >= 0; --i) {
-    dstBuffer[i] = buffer_[readPos];
-    if (readPos == 0) {
-      readPos = buffer_.size() - 1;
-    } else {
-      --readPos;
+  std::span<float> dst(dstBuffer);
+  TimePoint latest;
+  SampleCounter start;
+  size_t coldCount{0};
+  {
+    std::lock_guard<std::mutex> lock{bufferMutex_};
+    if (hotLength_ == 0 || !writeTracker_.haveWritten()) {
+      // Zero-fill
+      std::fill(dstBuffer.begin(), dstBuffer.end(), 0.f);
+      return {sampleRate_, 0, std::nullopt};
     }
+    latest = writeTracker_.getLatestDataTimePoint();
+    start = latest.sampleCounter - static_cast<SampleCounter>(dst.size()) + 1;
+    auto hotStart = std::max(start, getOldestHotSampleCounter());
+    coldCount = static_cast<size_t>(
+        std::min<SampleCounter>(hotStart - start, dst.size()));
+    copyFromHot(hotStart, dst.subspan(coldCount));
   }
-  return writeTracker_.getLatestDataTimePoint();
+  if (coldCount > 0) {
+    // Anything beyond what we've retained will just be zero-filled
+    coldStore_->read(start, dst.first(coldCount));
+  }
+  return latest;
 }
 
 bool MonoCircularBuffer::getSamples(const TimePoint& startTime,
@@ -105,65 +260,436 @@ bool MonoCircularBuffer::getSamples(const TimePoint& startTime,
   if (startTime.sampleRate != sampleRate_) {
     return false;
   }
-  std::lock_guard<std::mutex> lock{bufferMutex_};
-  if (buffer_.size() == 0 || !writeTracker_.haveWritten()) {
-    return false;
-  }
-  auto buffEnd = writeTracker_.getLatestDataTimePoint();
-  if (startTime.sampleCounter + dstBuffer.size() > buffEnd.sampleCounter) {
-    return false;
-  }
-  SampleCounter startPosDelta = buffEnd.sampleCounter - startTime.sampleCounter;
-  if (startPosDelta > buffer_.size()) {
-    return false;
-  }
-  int64_t buffEndPos = writeTracker_.getLatestWritePosition();
-  for (int s = 0; s < dstBuffer.size(); s++) {
-    auto buffReadPos = buffEndPos - startPosDelta + s;
-    if (buffReadPos < 0) {
-      buffReadPos += buffer_.size();
+  size_t coldCount{0};
+  {
+    std::lock_guard<std::mutex> lock{bufferMutex_};
+    if (hotLength_ == 0 || !writeTracker_.haveWritten()) {
+      return false;
+    }
+    auto buffEnd = writeTracker_.getLatestDataTimePoint();
+    if (startTime.sampleCounter + dstBuffer.size() > buffEnd.sampleCounter) {
+      return false;
+    }
+    if (startTime.sampleCounter < getOldestToKeep(buffEnd.sampleCounter)) {
+      return false;
     }
-    dstBuffer[s] = buffer_[buffReadPos];
+    auto hotStart =
+        std::max(startTime.sampleCounter, getOldestHotSampleCounter());
+    coldCount = static_cast<size_t>(std::min<SampleCounter>(
+        hotStart - startTime.sampleCounter, dstBuffer.size()));
+    copyFromHot(hotStart, dstBuffer.subspan(coldCount));
+  }
+  if (coldCount > 0) {
+    // Older than the hot tier - decode from the cold tier
+    return coldStore_->read(startTime.sampleCounter,
+                            dstBuffer.first(coldCount));
   }
   return true;
 }
 
 uint32_t MonoCircularBuffer::getDurationMs() {
-  return (buffer_.size() * 1000) / sampleRate_;
+  return samplesToMs(retentionSamples_, sampleRate_);
 }
 
 size_t MonoCircularBuffer::getNumStoredSamples() {
-  return buffer_.size();
+  return static_cast<size_t>(retentionSamples_.load());
 }
 
 const SampleRate MonoCircularBuffer::getSampleRate() {
   return sampleRate_;
 }
 
+void MonoCircularBuffer::setRetentionMs(uint32_t ms) {
+  // Never less than the hot tier - that's allocated up front anyway
+  auto retention =
+      std::max<SampleCounter>(msToSamples(ms, sampleRate_), hotLength_);
+  // ...and never more than the cold tier can hold
+  if (auto capacity = coldStore_->getCapacitySamples()) {
+    retention = std::min<SampleCounter>(
+        retention, static_cast<SampleCounter>(*capacity + hotLength_));
+  }
+  retentionSamples_ = retention;
+}
+
+size_t MonoCircularBuffer::getMemoryUsageBytes() {
+  size_t hotChunkBytes = useHugePages_ ? hugePageBytes
+                                       : hotChunkSamples_ * sizeof(float);
+  return committedHotChunks_ * hotChunkBytes +
+         encodeScratch_.capacity() * sizeof(float) +
+         coldStore_->getMemoryUsageBytes();
+}
+
+HistoryConfig::Storage MonoCircularBuffer::getStorage() {
+  return storage_;
+}
+
+void MonoCircularBuffer::releaseUnusedMemory() {
+  // Only call when no audio is being written (e.g, from releaseResources)
+  // Make sure everything that can be is in the cold tier first
+  while (encodeNextChunk()) {
+  }
+  std::vector<HotChunk> released;
+  {
+    std::lock_guard<std::mutex> lock{bufferMutex_};
+    if (!writeTracker_.haveWritten() || !nextToEncode_.has_value()) {
+      return;
+    }
+    // Keep the chunks holding anything not yet encoded (at most the latest
+    // chunk's worth), and the one the next write goes to. Everything else can
+    // be served from the cold tier.
+    auto latest = writeTracker_.getLatestDataTimePoint().sampleCounter;
+    auto keepFrom = std::max(*nextToEncode_, getOldestHotSampleCounter());
+    if (keepFrom > latest) {
+      keepFrom = latest;
+    }
+    auto keepFromPos =
+        static_cast<int64_t>(writeTracker_.getLatestWritePosition()) -
+        (latest - keepFrom);
+    if (keepFromPos < 0) {
+      keepFromPos += static_cast<int64_t>(hotLength_);
+    }
+    auto firstKept = static_cast<size_t>(keepFromPos) / hotChunkSamples_;
+    auto lastKept = writeTracker_.getLatestWritePosition() / hotChunkSamples_;
+    auto nextWrite = writeTracker_.getNextWritePosition() / hotChunkSamples_;
+    for (size_t c = 0; c < hotChunks_.size(); ++c) {
+      bool kept = firstKept <= lastKept ? (c >= firstKept && c <= lastKept)
+                                        : (c >= firstKept || c <= lastKept);
+      if (!kept && c != nextWrite && hotChunks_[c]) {
+        released.push_back(std::move(hotChunks_[c]));
+      }
+    }
+    committedHotChunks_ -= released.size();
+    // Never earlier than anything dropped in updateFrom()
+    hotValidFrom_ = std::max(
+        getOldestHotSampleCounter(),
+        keepFrom - (keepFromPos % static_cast<int64_t>(hotChunkSamples_)));
+  }
+  // Freed outside of the lock
+}
+
+void MonoCircularBuffer::setRetentionPin(
+    std::optional<SampleCounter> oldestToKeep) {
+  {
+    std::lock_guard<std::mutex> lock{bufferMutex_};
+    retentionPin_ = oldestToKeep;
+  }
+  spaceAvailable_.notify_all();
+}
+
+void MonoCircularBuffer::setBlockWhenFull(bool block) {
+  blockWhenFull_ = block;
+  spaceAvailable_.notify_all();
+}
+
+void MonoCircularBuffer::setRealtime(bool realtime) {
+  realtime_ = realtime;
+  spaceAvailable_.notify_all();
+}
+
+int MonoCircularBuffer::useTimeSlice() {
+  commitAhead();
+  while (encodeNextChunk()) {
+  }
+  SampleCounter oldestToKeep;
+  {
+    std::lock_guard<std::mutex> lock{bufferMutex_};
+    if (!writeTracker_.haveWritten()) {
+      return 100;
+    }
+    oldestToKeep =
+        getOldestToKeep(writeTracker_.getLatestDataTimePoint().sampleCounter);
+  }
+  coldStore_->trimBefore(oldestToKeep);
+  coldStore_->writeBack();
+  return 100;  // ms until next slice
+}
+
+bool MonoCircularBuffer::encodeNextChunk() {
+  const auto chunkSamples =
+      static_cast<SampleCounter>(coldStore_->getChunkSamples());
+  SampleCounter chunkStart;
+  {
+    std::lock_guard<std::mutex> lock{bufferMutex_};
+    if (!writeTracker_.haveWritten()) {
+      return false;
+    }
+    auto oldestHot = getOldestHotSampleCounter();
+    if (!nextToEncode_.has_value()) {
+      nextToEncode_ = firstWrittenSampleCounter_;
+    }
+    if (*nextToEncode_ < oldestHot) {
+      // Fell behind and the hot tier has moved on. Leave a gap.
+      nextToEncode_ = oldestHot;
+    }
+    auto latest = writeTracker_.getLatestDataTimePoint().sampleCounter;
+    if (*nextToEncode_ + chunkSamples - 1 > latest) {
+      return false;  // No full chunk yet
+    }
+    chunkStart = *nextToEncode_;
+    copyFromHot(chunkStart, encodeScratch_);
+    *nextToEncode_ += chunkSamples;
+  }
+  // Encode outside of the lock so the audio thread isn't held up
+  coldStore_->append(chunkStart, encodeScratch_);
+  spaceAvailable_.notify_all();
+  return true;
+}
+
+bool MonoCircularBuffer::hasSpaceFor(SampleCounter newLatest) {
+  // bufferMutex_ must be held
+  if (!writeTracker_.haveWritten()) {
+    return true;
+  }
+  const auto hotLength = static_cast<SampleCounter>(hotLength_);
+  // Nothing not yet in the cold tier can be overwritten...
+  auto unencodedFrom = nextToEncode_.value_or(*firstWrittenSampleCounter_);
+  if (newLatest - unencodedFrom >= hotLength) {
+    return false;
+  }
+  // ...and nothing pinned can be pushed out of a fixed size cold tier
+  if (retentionPin_.has_value()) {
+    if (auto capacity = coldStore_->getCapacitySamples()) {
+      if (newLatest - *retentionPin_ >=
+          static_cast<SampleCounter>(*capacity) + hotLength) {
+        return false;
+      }
+    }
+  }
+  return true;
+}
+
+SampleCounter MonoCircularBuffer::getOldestToKeep(SampleCounter latest) {
+  // bufferMutex_ must be held
+  auto oldest = latest - retentionSamples_ + 1;
+  if (retentionPin_.has_value()) {
+    oldest = std::min(oldest, *retentionPin_);
+  }
+  return oldest;
+}
+
+SampleCounter MonoCircularBuffer::getOldestHotSampleCounter() {
+  // bufferMutex_ must be held
+  assert(writeTracker_.haveWritten() && firstWrittenSampleCounter_);
+  auto latest = writeTracker_.getLatestDataTimePoint().sampleCounter;
+  auto oldest =
+      std::max(*firstWrittenSampleCounter_,
+               latest - static_cast<SampleCounter>(hotLength_) + 1);
+  if (hotValidFrom_.has_value()) {
+    oldest = std::max(oldest, *hotValidFrom_);
+  }
+  return oldest;
+}
+
+void MonoCircularBuffer::copyFromHot(SampleCounter from, std::span<float> dst) {
+  // bufferMutex_ must be held, and [from, from + dst.size()) must be in the
+  // hot tier
+  if (dst.empty()) {
+    return;
+  }
+  auto latest = writeTracker_.getLatestDataTimePoint().sampleCounter;
+  auto buffSize = static_cast<int64_t>(hotLength_);
+  int64_t readPos = static_cast<int64_t>(writeTracker_.getLatestWritePosition()) -
+                    (latest - from);
+  if (readPos < 0) {
+    readPos += buffSize;
+  }
+  // Contiguous runs up to the end of each chunk (or the ring)
+  size_t copied{0};
+  auto pos = static_cast<size_t>(readPos);
+  while (copied < dst.size()) {
+    auto chunkOffset = pos % hotChunkSamples_;
+    auto run = std::min({dst.size() - copied, hotChunkSamples_ - chunkOffset,
+                         hotLength_ - pos});
+    auto const& chunk = hotChunks_[pos / hotChunkSamples_];
+    assert(chunk);
+    std::copy_n(chunk.get() + chunkOffset, run, dst.begin() + copied);
+    copied += run;
+    pos = (pos + run) % hotLength_;
+  }
+}
+
+HotChunk MonoCircularBuffer::allocateHotChunk() {
+  ++committedHotChunks_;
+  if (useHugePages_) {
+#if defined(_WIN32)
+    // Needs SeLockMemoryPrivilege, so quite likely to fail
+    if (GetLargePageMinimum() > 0 &&
+        hugePageBytes % GetLargePageMinimum() == 0) {
+      if (void* mem = VirtualAlloc(nullptr, hugePageBytes,
+                                   MEM_RESERVE | MEM_COMMIT | MEM_LARGE_PAGES,
+                                   PAGE_READWRITE)) {
+        return HotChunk(static_cast<float*>(mem),
+                        HotChunkDeleter(HotChunkDeleter::LARGE_PAGES));
+      }
+    }
+#elif defined(__linux__)
+    if (void* mem = std::aligned_alloc(hugePageBytes, hugePageBytes)) {
+      // Transparent huge pages - just a hint
+      madvise(mem, hugePageBytes, MADV_HUGEPAGE);
+      return HotChunk(static_cast<float*>(mem),
+                      HotChunkDeleter(HotChunkDeleter::ALIGNED));
+    }
+#endif
+  }
+  // Deliberately left uninitialised - only ever read once written
+  return HotChunk(new float[hotChunkSamples_],
+                  HotChunkDeleter(HotChunkDeleter::HEAP));
+}
+
+void MonoCircularBuffer::commitAhead() {
+  // Make sure the chunk being written to and the next one are committed,
+  // and that there's a reserve, so the audio thread doesn't need to allocate
+  std::vector<size_t> needed;
+  bool needReserve{false};
+  {
+    std::lock_guard<std::mutex> lock{bufferMutex_};
+    auto chunk = writeTracker_.getNextWritePosition() / hotChunkSamples_;
+    for (auto c : {chunk, (chunk + 1) % hotChunks_.size()}) {
+      if (!hotChunks_[c]) {
+        needed.push_back(c);
+      }
+    }
+    needReserve = !reserveChunk_;
+  }
+  for (auto c : needed) {
+    auto newChunk = allocateHotChunk();
+    std::lock_guard<std::mutex> lock{bufferMutex_};
+    if (!hotChunks_[c]) {
+      hotChunks_[c] = std::move(newChunk);
+    } else if (!reserveChunk_) {
+      reserveChunk_ = std::move(newChunk);  // Audio thread beat us to it
+    } else {
+      --committedHotChunks_;
+    }
+  }
+  if (needReserve) {
+    auto newChunk = allocateHotChunk();
+    std::lock_guard<std::mutex> lock{bufferMutex_};
+    if (!reserveChunk_) {
+      reserveChunk_ = std::move(newChunk);
+    } else {
+      --committedHotChunks_;
+    }
+  }
+  if (!needed.empty() || needReserve) {
+    spaceAvailable_.notify_all();  // For updateFrom() waiting on a chunk
+  }
+}
+
+void HotChunkDeleter::operator()(float* chunk) const {
+  switch (kind_) {
+    case HEAP:
+      delete[] chunk;
+      break;
+    case ALIGNED:
+      std::free(chunk);
+      break;
+    case LARGE_PAGES:
+#if defined(_WIN32)
+      VirtualFree(chunk, 0, MEM_RELEASE);
+#endif
+      break;
+  }
+}
+
+Buff::FrontEnd::FrontEnd(SampleRate srcSampleRate,
+                         uint16_t srcBlockSize,
+                         SampleRate targetSampleRate,
+                         size_t numStreams)
+    : srcSampleRate(srcSampleRate),
+      toTarget(srcSampleRate, targetSampleRate),
+      latestBlockForResampling(numStreams),
+      latestResampledBlock(numStreams),
+      unconsumedSamples(numStreams),
+      interp(numStreams) {
+  downsampleRatio = static_cast<double>(srcSampleRate) /
+                    static_cast<double>(targetSampleRate);
+  for (size_t stream = 0; stream < numStreams; stream++) {
+    // Unconsumed samples are samples unused by the resampler from the last
+    // block. Can't possibly be more than a full block
+    // (usually only up to 3 samples - 48Khz to 16Khz)
+    unconsumedSamples[stream].reserve(srcBlockSize);
+    // latestBlockForResampling must accomodate a block plus any
+    // unconsumedSamples
+    latestBlockForResampling[stream].reserve(
+        srcBlockSize + unconsumedSamples[stream].capacity());
+    // latestResampledBlock must accomodate
+    // latestBlockForResampling/downsampleRatio, ceiled for safety
+    size_t maxResampledBlockSize =
+        static_cast<size_t>(latestBlockForResampling[stream].capacity() /
+                            downsampleRatio) + 1;
+    latestResampledBlock[stream].reserve(maxResampledBlockSize);
+  }
+}
+
 Buff::Buff(SampleRate srcSampleRate,
            uint16_t srcBlockSize,
            SampleRate targetSampleRate,
-           std::shared_ptr<ServiceCommunicator> comms) {
-  srcSampleRate_ = srcSampleRate;
+           std::shared_ptr<ServiceCommunicator> comms,
+           const HistoryConfig& historyConfig,
+           std::shared_ptr<AudioThreadStats> stats,
+           const std::vector<StreamConfig>& streams)
+    : stats_{stats ? stats : std::make_shared<AudioThreadStats>()},
+      streams_{streams} {
+  if (streams_.empty()) {
+    streams_.push_back(StreamConfig{});  // All channels, as one
+  }
+  streams_.resize(std::min(streams_.size(), ServiceCommunicator::maxStreams));
+  blockChannels_.resize(streams_.size(), 0);
+  blockGains_.resize(streams_.size(), 1.f);
   buffSampleRate_ = targetSampleRate;
-  downsampleRatio_ = static_cast<double>(srcSampleRate) /
-                     static_cast<double>(targetSampleRate);
-  // Unconsumed samples are samples unused by the resampler from the last block.
-  // Can't possibly be more than a full block 
-  // (usually only up to 3 samples - 48Khz to 16Khz)
-  unconsumedSamples_.reserve(srcBlockSize);
-  // latestBlockForResampling_ must accomodate a block plus any unconsumedSamples_ 
-  latestBlockForResampling_.reserve(srcBlockSize + unconsumedSamples_.capacity());
-  // latestResampledBlock_ must accomodate latestBlockForResampling_/downsampleRatio_,
-  // ceiled for safety
-  size_t maxResampledBlockSize =
-      static_cast<size_t>(latestBlockForResampling_.capacity() /
-                          downsampleRatio_) + 1;
-  latestResampledBlock_.reserve(maxResampledBlockSize);
+  frontEnd_ = new FrontEnd(srcSampleRate, srcBlockSize, targetSampleRate,
+                           streams_.size());
   // Set up circBuff_ for the monoised 16Khz samples
-  circBuff_ = std::make_shared<MonoCircularBuffer>(1200000, targetSampleRate);
+  circBuff_ = std::make_shared<MonoCircularBuffer>(historyConfig,
+                                                   targetSampleRate, stats_);
+  streamBuffs_.push_back(circBuff_);
   // Set up analysis region handler
-  analysisRegions_ = std::make_shared<AnalysisRegions>(circBuff_, comms);
+  analysisRegions_ =
+      std::make_shared<AnalysisRegions>(circBuff_, comms, stats_);
+  analysisRegions_->setStreamName(0, streams_[0].name);
+  auto compactConfig = historyConfig;
+  compactConfig.hotLengthMs =
+      std::min(historyConfig.hotLengthMs, compactHotLengthMs);
+  for (size_t stream = 1; stream < streams_.size(); stream++) {
+    streamBuffs_.push_back(std::make_shared<MonoCircularBuffer>(
+        compactConfig, targetSampleRate, stats_));
+    analysisRegions_->addStream(streamBuffs_.back(), streams_[stream].name);
+  }
+}
+
+Buff::~Buff() {
+  delete frontEnd_.load();
+}
+
+void Buff::reconfigure(SampleRate srcSampleRate, uint16_t srcBlockSize) {
+  auto* previous = frontEnd_.exchange(new FrontEnd(
+      srcSampleRate, srcBlockSize, buffSampleRate_, streams_.size()));
+
+  // Any block that starts from here on picks up the new front end, so the old
+  // one is only in use if a block was already running
+  RetiredFrontEnd retired{std::unique_ptr<FrontEnd>(previous), std::nullopt};
+  if (inBlock_.load()) {
+    retired.inUseUntilBlock = blocksCompleted_.load();
+  }
+  {
+    std::lock_guard<std::mutex> lock{retiredMtx_};
+    retired_.push_back(std::move(retired));
+  }
+  reclaimRetiredFrontEnds();
+
+  // Playback positions were in the old rate, start afresh on the next block
+  std::lock_guard<std::mutex> mtx{playbackRegionMtx_};
+  playbackRegion_ = PlaybackRegion{};
+}
+
+void Buff::reclaimRetiredFrontEnds() {
+  std::lock_guard<std::mutex> lock{retiredMtx_};
+  auto completed = blocksCompleted_.load();
+  std::erase_if(retired_, [completed](const RetiredFrontEnd& retired) {
+    return !retired.inUseUntilBlock.has_value() ||
+           completed > retired.inUseUntilBlock.value();
+  });
 }
 
 void Buff::justStarted() {
@@ -176,9 +702,18 @@ void Buff::justStopped() {
 
 void Buff::updateFrom(const juce::AudioBuffer<float>& srcBuffer,
                       const TimePoint& startTime) {
+  // Flag the block before picking up the front end, so reconfigure() can
+  // tell whether the one it replaces might still be in use
+  inBlock_.store(true);
+  auto& frontEnd = *frontEnd_.load();
+  auto& latestBlockForResampling = frontEnd.latestBlockForResampling;
+  auto& latestResampledBlock = frontEnd.latestResampledBlock;
+  auto& unconsumedSamples = frontEnd.unconsumedSamples;
+
   // See if we need to update playhead start/stop points
   {
-    std::lock_guard<std::mutex> mtx{playbackRegionMtx_};
+    auto mtx = stats_->lock(playbackRegionMtx_,
+                            AudioThreadStats::PLAYBACK_REGION);
     switch (playbackState_) {
       case JUST_STARTED:
         assert(startTime.playheadTime.has_value());
@@ -223,56 +758,96 @@ void Buff::updateFrom(const juce::AudioBuffer<float>& srcBuffer,
     }
   }
 
-  // Put the last unconsumed samples in the vector to pass to the resampler
-  latestBlockForResampling_.clear();
-  latestBlockForResampling_.insert(latestBlockForResampling_.end(),
-                                   unconsumedSamples_.begin(),
-                                   unconsumedSamples_.end());
+  // Which of this block's channels go to each stream. Anything other than a
+  // single channel is summed at -3dB for now.
+  const auto numStreams = streams_.size();
+  const auto numChannels = std::min(srcBuffer.getNumChannels(), 64);
+  const uint64_t allChannels =
+      numChannels >= 64 ? ~uint64_t{0} : (uint64_t{1} << numChannels) - 1;
+  for (size_t stream = 0; stream < numStreams; stream++) {
+    auto channels = streams_[stream].channels;
+    blockChannels_[stream] =
+        channels == 0 ? allChannels : channels & allChannels;
+    blockGains_[stream] =
+        std::popcount(blockChannels_[stream]) == 1 ? 1.f : 0.7079f;
+    // Put the last unconsumed samples in the vector to pass to the resampler
+    latestBlockForResampling[stream].clear();
+    latestBlockForResampling[stream].insert(
+        latestBlockForResampling[stream].end(),
+        unconsumedSamples[stream].begin(), unconsumedSamples[stream].end());
+  }
 
-  // Add new mono-ised samples to blockForResampling
+  // Add new mono-ised samples to blockForResampling, for every stream in the
+  // one pass over the block
   for (int sampleNum = 0; sampleNum < srcBuffer.getNumSamples(); ++sampleNum) {
-    float sample = getMonoSample(srcBuffer, sampleNum);
-    latestBlockForResampling_.push_back(sample);
-  }
-
-  // Pass to resampler
-  auto requiredSamples =
-      static_cast<int>(latestBlockForResampling_.size() / downsampleRatio_);
-  latestResampledBlock_.resize(requiredSamples, 0.f);
-  auto samplesConsumed =
-      interp_.process(downsampleRatio_, latestBlockForResampling_.data(),
-                      latestResampledBlock_.data(), requiredSamples);
-  if (!interpPrimingSamples_.has_value()) {
+    for (size_t stream = 0; stream < numStreams; stream++) {
+      latestBlockForResampling[stream].push_back(
+          getMonoSample(srcBuffer, blockChannels_[stream],
+                        blockGains_[stream], sampleNum));
+    }
+  }
+
+  // Pass to resampler. Every stream consumes the same number of samples.
+  auto requiredSamples = static_cast<int>(latestBlockForResampling[0].size() /
+                                          frontEnd.downsampleRatio);
+  int samplesConsumed{0};
+  for (size_t stream = 0; stream < numStreams; stream++) {
+    latestResampledBlock[stream].resize(requiredSamples, 0.f);
+    samplesConsumed = frontEnd.interp[stream].process(
+        frontEnd.downsampleRatio, latestBlockForResampling[stream].data(),
+        latestResampledBlock[stream].data(), requiredSamples);
+  }
+  if (!frontEnd.interpPrimingSamples.has_value()) {
     auto expectedSamplesConsumed =
-        static_cast<int>(requiredSamples * downsampleRatio_);
-    interpPrimingSamples_ = expectedSamplesConsumed - samplesConsumed;
+        static_cast<int>(requiredSamples * frontEnd.downsampleRatio);
+    frontEnd.interpPrimingSamples = expectedSamplesConsumed - samplesConsumed;
   }
 
   // Work out time points
   TimePoint latestBlockForResamplingStartTime =
-      startTime - static_cast<SampleCounter>(unconsumedSamples_.size() -
-                                             interpPrimingSamples_.value_or(0));
+      startTime -
+      static_cast<SampleCounter>(unconsumedSamples[0].size() -
+                                 frontEnd.interpPrimingSamples.value_or(0));
   TimePoint latestResampledBlockStartTime =
-      latestBlockForResamplingStartTime / downsampleRatio_;
+      latestBlockForResamplingStartTime.converted(frontEnd.toTarget);
+
+  // After a reconfigure the new rate's counters won't line up exactly with
+  // the previous ones, so keep the 16Khz counter contiguous
+  if (!frontEnd.counterOffset.has_value()) {
+    frontEnd.counterOffset = 0;
+    if (nextOutputSampleCounter_.has_value()) {
+      frontEnd.counterOffset = nextOutputSampleCounter_.value() -
+                               latestResampledBlockStartTime.sampleCounter;
+    }
+  }
+  latestResampledBlockStartTime.sampleCounter += frontEnd.counterOffset.value();
+  nextOutputSampleCounter_ = latestResampledBlockStartTime.sampleCounter +
+                             static_cast<SampleCounter>(requiredSamples);
 
   // Store unconsumed samples for next iter
   auto unconsumedSampleCount =
-      latestBlockForResampling_.size() - samplesConsumed;
-  unconsumedSamples_.clear();
-  unconsumedSamples_.insert(
-      unconsumedSamples_.begin(),
-      latestBlockForResampling_.end() - unconsumedSampleCount,
-      latestBlockForResampling_.end());
-
-  // At this stage, we have mono 16Khz downsampled data in latestResampledBlock_
+      latestBlockForResampling[0].size() - samplesConsumed;
+  for (size_t stream = 0; stream < numStreams; stream++) {
+    unconsumedSamples[stream].clear();
+    unconsumedSamples[stream].insert(
+        unconsumedSamples[stream].begin(),
+        latestBlockForResampling[stream].end() - unconsumedSampleCount,
+        latestBlockForResampling[stream].end());
+  }
+
+  // At this stage, we have mono 16Khz downsampled data in latestResampledBlock
   // Put in circular buffer - update latest start timestamp
-  circBuff_->updateFrom(latestResampledBlock_, latestResampledBlockStartTime);
+  for (size_t stream = 0; stream < numStreams; stream++) {
+    streamBuffs_[stream]->updateFrom(latestResampledBlock[stream],
+                                     latestResampledBlockStartTime);
+  }
 
   // See if we need to create new analysis regions
   analysisRegions_->updateFrom(
       latestResampledBlockStartTime,
-      latestResampledBlockStartTime + latestResampledBlock_.size() - 1,
-      getPlaybackRegion()
+      latestResampledBlockStartTime + latestResampledBlock[0].size() - 1,
+      getPlaybackRegion(),
+      latestResampledBlock
     );
 
   // Update state
@@ -285,12 +860,22 @@ void Buff::updateFrom(const juce::AudioBuffer<float>& srcBuffer,
       break;
   }
 
+  blocksCompleted_.fetch_add(1);
+  inBlock_.store(false);
 }
 
 std::shared_ptr<MonoCircularBuffer> Buff::getCircularBuffer() {
   return circBuff_;
 }
 
+std::shared_ptr<MonoCircularBuffer> Buff::getCircularBuffer(size_t stream) {
+  return stream < streamBuffs_.size() ? streamBuffs_[stream] : nullptr;
+}
+
+size_t Buff::getNumStreams() {
+  return streamBuffs_.size();
+}
+
 std::shared_ptr<AnalysisRegions> Buff::getAnalysisRegions() {
   return analysisRegions_;
 }
@@ -305,19 +890,54 @@ PlaybackRegion Buff::getPlaybackRegion() {
 }
 
 float Buff::getMonoSample(const juce::AudioBuffer<float>& srcBuffer,
+                          uint64_t channels,
+                          float gain,
                           int sampleNumber) {
   float outSample{0.f};
-  for (int c = 0; c < srcBuffer.getNumChannels(); ++c) {
+  for (int c = 0; channels != 0; ++c, channels >>= 1) {
     // TODO: Proper downmix per channel count.
-    auto sample = srcBuffer.getSample(c, sampleNumber);
-    if (srcBuffer.getNumChannels() == 1) {
-      outSample += sample;
-    } else {
-      // Probably stereo. For any multi-channel, sum with -3db for now.
-      outSample += sample * 0.7079f;
+    if (channels & 1) {
+      outSample += srcBuffer.getSample(c, sampleNumber) * gain;
     }
   }
   return outSample;
 }
 
+std::vector<StreamConfig> parseStreamConfigs(const std::string& text) {
+  std::vector<StreamConfig> streams;
+  auto groups = juce::StringArray::fromTokens(juce::String(text), ";", "");
+  for (auto const& group : groups) {
+    auto colon = group.lastIndexOfChar(':');
+    StreamConfig stream;
+    stream.name = group.substring(0, std::max(colon, 0)).trim().toStdString();
+    auto channels = juce::StringArray::fromTokens(
+        group.substring(colon + 1), ", ", "");
+    for (auto const& channel : channels) {
+      auto number = channel.getIntValue();
+      if (number >= 1 && number <= 64) {
+        stream.channels |= uint64_t{1} << (number - 1);
+      }
+    }
+    if (stream.channels != 0) {
+      streams.push_back(std::move(stream));
+    }
+  }
+  return streams;
+}
+
+std::string formatStreamConfigs(const std::vector<StreamConfig>& streams) {
+  juce::StringArray groups;
+  for (auto const& stream : streams) {
+    juce::StringArray channels;
+    for (int c = 0; c < 64; c++) {
+      if ((stream.channels >> c) & 1) {
+        channels.add(juce::String(c + 1));
+      }
+    }
+    groups.add(juce::String(stream.name) + ": " +
+               channels.joinIntoString(", "));
+  }
+  return groups.joinIntoString("; ").toStdString();
+}
+
 }  // namespace audio_plugin
@@ -6,7 +6,12 @@
 #include <optional>
 #include <memory>
 #include <span>
+#include <string>
+#include <atomic>
+#include <condition_variable>
 #include "AnalysisRegions.h"
+#include "AudioThreadStats.h"
+#include "HistoryStore.h"
 #include "Comms.h"
 #include "Types.h"
 
@@ -18,6 +23,7 @@ class WriteTracker {
 public:
   WriteTracker(size_t positionLimit = 0);
   void recordWrite(const TimePoint& latestDataStart, int64_t latestDataOffset);
+  void recordWrites(const TimePoint& dataStart, size_t count);
   bool haveWritten();
   size_t getNextWritePosition();
   size_t getLatestWritePosition();
@@ -30,9 +36,62 @@ private:
   TimePoint latestDataEnd_;
 };
 
-class MonoCircularBuffer {
+// How much audio history to keep, how much of it to keep as float32, and
+// where to keep the rest.
+//
+// The hot tier is a float32 ring sized for the GUI and any regions still in
+// flight. Anything older is moved off the audio thread in to a cold tier
+// until it falls outside of the retention period. By default the cold tier is
+// float16 in memory, but for long-form monitoring it can be a memory mapped
+// file instead (in which case retention is limited by diskCapacityMs).
+struct HistoryConfig {
+  enum Storage { MEMORY, DISK };
+  uint32_t hotLengthMs{60000};     // 1 min
+  uint32_t retentionMs{1200000};   // 20 mins (hot + cold)
+  Storage storage{MEMORY};
+  uint32_t diskCapacityMs{8 * 60 * 60 * 1000};  // 8 hours
+  std::filesystem::path diskDirectory;  // Empty for the temp directory
+  bool useHugePages{false};  // Hot tier in 2MB chunks backed by huge pages
+};
+
+// A group of input channels downmixed and analysed as a stream of its own,
+// e.g. the dialogue stem of a 5.1 mix. One bit per input channel, or 0 for
+// all of them.
+struct StreamConfig {
+  std::string name;
+  uint64_t channels{0};
+};
+// As edited and saved, e.g. "Dialogue: 3; Music: 1, 2" (channels from 1)
+std::vector<StreamConfig> parseStreamConfigs(const std::string& text);
+std::string formatStreamConfigs(const std::vector<StreamConfig>& streams);
+
+// A chunk of the hot tier. Memory is only committed for these as audio is
+// written, so an instance that never sees audio costs next to nothing.
+class HotChunkDeleter {
+public:
+  enum Kind { HEAP, ALIGNED, LARGE_PAGES };
+  HotChunkDeleter(Kind kind = HEAP) : kind_(kind) {}
+  void operator()(float* chunk) const;
+
+private:
+  Kind kind_;
+};
+using HotChunk = std::unique_ptr<float[], HotChunkDeleter>;
+
+// Shared by all buffers in the process so we don't spin up a thread per
+// plugin instance just to move samples between tiers
+class HistoryEncoderThread : public juce::TimeSliceThread {
 public:
-  MonoCircularBuffer(uint32_t bufferLengthMs, SampleRate sampleRate);
+  HistoryEncoderThread();
+  ~HistoryEncoderThread() override;
+};
+
+class MonoCircularBuffer : protected juce::TimeSliceClient {
+public:
+  MonoCircularBuffer(const HistoryConfig& config,
+                     SampleRate sampleRate,
+                     std::shared_ptr<AudioThreadStats> stats = {});
+  ~MonoCircularBuffer() override;
   void updateFrom(const std::vector<float>& srcBuffer,
                   const TimePoint& startTime);
   TimePoint getLatestSamples(std::vector<float>& dstBuffer);
@@ -41,20 +100,86 @@ public:
   uint32_t getDurationMs();
   size_t getNumStoredSamples();
   const SampleRate getSampleRate();
+  void setRetentionMs(uint32_t ms);
+  size_t getMemoryUsageBytes();
+  HistoryConfig::Storage getStorage();
+  // Frees hot chunks that only hold audio already in the cold tier. Keeps
+  // the reserve and the chunk the next write goes to.
+  void releaseUnusedMemory();
+  // Commits the chunks the next writes need, and the reserve. The encoder
+  // thread keeps doing this as audio arrives - call it before audio resumes
+  // (e.g. from prepareToPlay) so the first blocks don't find none.
+  void commitAhead();
+  // Keeps everything from this sample counter on, regardless of retention
+  void setRetentionPin(std::optional<SampleCounter> oldestToKeep);
+  // For offline renders. Rather than let unencoded or pinned history be
+  // overwritten, updateFrom() waits (for a bounded time) for space.
+  void setBlockWhenFull(bool block);
+  // Written to by a real-time audio thread, which must never wait, so
+  // setBlockWhenFull() is ignored and full history is dropped instead
+  void setRealtime(bool realtime);
 
 protected:
+  int useTimeSlice() override;
+  bool encodeNextChunk();
+  SampleCounter getOldestHotSampleCounter();
+  void copyFromHot(SampleCounter from, std::span<float> dst);
+  HotChunk allocateHotChunk();
+  bool hasSpaceFor(SampleCounter newLatest);
+  SampleCounter getOldestToKeep(SampleCounter latest);
+
+  std::shared_ptr<AudioThreadStats> stats_;
   std::mutex bufferMutex_;
-  std::vector<float> buffer_;
+  std::condition_variable spaceAvailable_;
+  std::vector<HotChunk> hotChunks_;  // Unallocated until written to
+  // Committed by the encoder thread for the audio thread to take if it ever
+  // gets to a chunk that isn't, so it never has to allocate
+  HotChunk reserveChunk_;
+  size_t hotChunkSamples_;
+  size_t hotLength_;
+  bool useHugePages_;
+  std::atomic<size_t> committedHotChunks_{0};
   WriteTracker writeTracker_;
   SampleRate sampleRate_;
+  std::optional<SampleCounter> firstWrittenSampleCounter_;
+  // Anything before this has had its hot chunk released (it's in the cold
+  // tier though)
+  std::optional<SampleCounter> hotValidFrom_;
+
+  // Cold tier - only touched by the encoder thread and readers
+  std::unique_ptr<HistoryStore> coldStore_;
+  HistoryConfig::Storage storage_{HistoryConfig::MEMORY};
+  std::atomic<SampleCounter> retentionSamples_;
+  std::optional<SampleCounter> retentionPin_;  // Guarded by bufferMutex_
+  std::atomic<bool> blockWhenFull_{false};
+  std::atomic<bool> realtime_{false};
+  std::optional<SampleCounter> nextToEncode_;  // Guarded by bufferMutex_
+  std::vector<float> encodeScratch_;
+  juce::SharedResourcePointer<HistoryEncoderThread> encoderThread_;
 };
 
 class Buff {
 public:
+  // With more than one stream, each gets its own history and regions, sharing
+  // this downmix/resample pass and the regions' scheduler and connection.
+  // Histories after the first keep a shorter hot tier, as they're not shown.
+  static constexpr uint32_t compactHotLengthMs{15000};
   Buff(SampleRate srcSampleRate,
        uint16_t srcBlockSize,
        SampleRate targetSampleRate,
-       std::shared_ptr<ServiceCommunicator> comms);
+       std::shared_ptr<ServiceCommunicator> comms,
+       const HistoryConfig& historyConfig = {},
+       std::shared_ptr<AudioThreadStats> stats = {},
+       const std::vector<StreamConfig>& streams = {});
+  ~Buff();
+
+  // Rebuilds only the downmix/resampler for a new source sample rate, keeping
+  // the history, regions and results. Safe to call while the audio thread is
+  // running, but never from it.
+  void reconfigure(SampleRate srcSampleRate, uint16_t srcBlockSize);
+  // Frees front ends replaced by reconfigure() once the audio thread is done
+  // with them. Never from the audio thread.
+  void reclaimRetiredFrontEnds();
 
   void justStarted();
   void justStopped();
@@ -62,19 +187,54 @@ public:
   void updateFrom(const juce::AudioBuffer<float>& srcBuffer,
                   const TimePoint& startTime);
 
-  std::shared_ptr<MonoCircularBuffer> getCircularBuffer();
+  std::shared_ptr<MonoCircularBuffer> getCircularBuffer();  // First stream's
+  std::shared_ptr<MonoCircularBuffer> getCircularBuffer(size_t stream);
+  size_t getNumStreams();
   std::shared_ptr<AnalysisRegions> getAnalysisRegions();
   SampleRate getBufferSampleRate();
   PlaybackRegion getPlaybackRegion();
 
 private:
+  // Everything that depends on the source sample rate
+  struct FrontEnd {
+    FrontEnd(SampleRate srcSampleRate,
+             uint16_t srcBlockSize,
+             SampleRate targetSampleRate,
+             size_t numStreams);
+
+    SampleRate srcSampleRate;
+    double downsampleRatio;   // For the resampler
+    RateConversion toTarget;  // For times, exactly
+    // One of each per stream. Every stream goes through the same number of
+    // samples, so the first stands for them all when working out times.
+    std::vector<std::vector<float>> latestBlockForResampling;
+    std::vector<std::vector<float>> latestResampledBlock;
+    std::vector<std::vector<float>> unconsumedSamples;
+    std::vector<juce::LagrangeInterpolator> interp;
+    std::optional<uint8_t> interpPrimingSamples;
+    // Shifts output so it carries on from where the previous front end ended
+    std::optional<SampleCounter> counterOffset;
+  };
+
+  struct RetiredFrontEnd {
+    std::unique_ptr<FrontEnd> frontEnd;
+    // Block count at retirement if the audio thread might still be using it
+    std::optional<uint64_t> inUseUntilBlock;
+  };
+
   float getMonoSample(const juce::AudioBuffer<float>& srcBuffer,
+                      uint64_t channels,
+                      float gain,
                       int sampleNumber);
 
+  std::shared_ptr<AudioThreadStats> stats_;
   std::shared_ptr<AnalysisRegions> analysisRegions_;
   std::shared_ptr<MonoCircularBuffer> circBuff_;
-  SampleRate srcSampleRate_;
-  double downsampleRatio_;
+  std::vector<std::shared_ptr<MonoCircularBuffer>> streamBuffs_;  // Incl. first
+  std::vector<StreamConfig> streams_;
+  // Per stream, for the current block's channels. Audio thread only.
+  std::vector<uint64_t> blockChannels_;
+  std::vector<float> blockGains_;
   SampleRate buffSampleRate_;
 
   enum PlaybackState {
@@ -89,11 +249,14 @@ private:
   std::mutex playbackRegionMtx_;
   PlaybackRegion playbackRegion_;
 
-  std::vector<float> latestBlockForResampling_;
-  std::vector<float> latestResampledBlock_;
-  std::vector<float> unconsumedSamples_;
-  juce::LagrangeInterpolator interp_;
-  std::optional<uint8_t> interpPrimingSamples_;
+  // Swapped by reconfigure(). Old front ends are only deleted once the audio
+  // thread can no longer be using them, so it never blocks or frees memory.
+  std::atomic<FrontEnd*> frontEnd_;
+  std::atomic<bool> inBlock_{false};
+  std::atomic<uint64_t> blocksCompleted_{0};
+  std::mutex retiredMtx_;
+  std::vector<RetiredFrontEnd> retired_;
+  std::optional<SampleCounter> nextOutputSampleCounter_;  // Audio thread only
 
 };
 
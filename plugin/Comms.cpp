@@ -1,6 +1,9 @@
 #include "Comms.h"
+#include "CircularBuffer.h"
 #include "Utils.h"
+#include <cstdint>
 #include <cstring>  // For memcpy
+#include <algorithm>
 #include <chrono>
 #include <vector>
 #include <span>
@@ -9,7 +12,9 @@
 namespace audio_plugin {
 
 ServiceCommunicator::ServiceCommunicator()
-    : context_{1}, requester_{context_, ZMQ_DEALER} {
+    : context_{1},
+      requester_{context_, ZMQ_DEALER},
+      monitor_{context_, ZMQ_PAIR} {
   identity_ = generateUniqueID();
   requester_.setsockopt(ZMQ_IDENTITY, identity_.c_str(), identity_.length());
   // Allow only 1 message to be queued
@@ -17,12 +22,85 @@ ServiceCommunicator::ServiceCommunicator()
   // and to prevent spamming the server on reconnect
   int snd_hwm = 1;
   requester_.setsockopt(ZMQ_SNDHWM, &snd_hwm, sizeof(snd_hwm));
+  // Only queue for a connection that's up, so nothing is sent in to a dead
+  // pipe while the service is away
+  int immediate = 1;
+  requester_.setsockopt(ZMQ_IMMEDIATE, &immediate, sizeof(immediate));
+  // ZMTP heartbeats notice a service that has gone (crashed, or its machine
+  // has) without closing the connection
+  int heartbeatIvl = 1000;
+  int heartbeatTimeout = heartbeatTimeoutMs;
+  int heartbeatTtl = 2 * heartbeatTimeoutMs;  // For the service's side
+  requester_.setsockopt(ZMQ_HEARTBEAT_IVL, &heartbeatIvl,
+                        sizeof(heartbeatIvl));
+  requester_.setsockopt(ZMQ_HEARTBEAT_TIMEOUT, &heartbeatTimeout,
+                        sizeof(heartbeatTimeout));
+  requester_.setsockopt(ZMQ_HEARTBEAT_TTL, &heartbeatTtl,
+                        sizeof(heartbeatTtl));
+  // Retry quickly at first so a restarted service is picked straight back
+  // up, backing off to every couple of seconds while it stays away
+  int reconnectIvl = 250;
+  int reconnectIvlMax = 2000;
+  int connectTimeout = 2000;  // Rather than the OS's, for unreachable hosts
+  requester_.setsockopt(ZMQ_RECONNECT_IVL, &reconnectIvl,
+                        sizeof(reconnectIvl));
+  requester_.setsockopt(ZMQ_RECONNECT_IVL_MAX, &reconnectIvlMax,
+                        sizeof(reconnectIvlMax));
+  requester_.setsockopt(ZMQ_CONNECT_TIMEOUT, &connectTimeout,
+                        sizeof(connectTimeout));
+
+  // Connection events come in on an inproc pair, read whenever the state is
+  // asked for
+  const auto monitorEndpoint = "inproc://monitor-" + identity_;
+  const int monitorEvents =
+      ZMQ_EVENT_HANDSHAKE_SUCCEEDED | ZMQ_EVENT_DISCONNECTED |
+      ZMQ_EVENT_HANDSHAKE_FAILED_NO_DETAIL |
+      ZMQ_EVENT_HANDSHAKE_FAILED_PROTOCOL | ZMQ_EVENT_HANDSHAKE_FAILED_AUTH;
+  int linger = 0;
+  monitor_.setsockopt(ZMQ_LINGER, &linger, sizeof(linger));
+  if (zmq_socket_monitor(requester_.handle(), monitorEndpoint.c_str(),
+                         monitorEvents) == 0) {
+    monitor_.connect(monitorEndpoint);
+  }
+
+  auto labels = "client=\"" + identity_ + "\"";
+  requestsSent_ = metrics_->counter("whisper_plugin_requests_sent_total",
+                                    "Requests sent to the service", labels);
+  batchesSent_ = metrics_->counter(
+      "whisper_plugin_batches_sent_total",
+      "Messages sent to the service, each of one or more requests", labels);
+  requestsRejected_ = metrics_->counter(
+      "whisper_plugin_requests_rejected_total",
+      "Requests the socket wouldn't take (not connected or queue full)",
+      labels);
+  bytesSent_ = metrics_->counter("whisper_plugin_bytes_sent_total",
+                                 "Bytes sent to the service", labels);
+  sharedAudioSent_ = metrics_->counter(
+      "whisper_plugin_shared_audio_requests_total",
+      "Requests whose audio was passed in shared memory", labels);
+  repliesReceived_ = metrics_->counter("whisper_plugin_replies_total",
+                                       "Replies received from the service",
+                                       labels);
+  replyErrors_ = metrics_->counter(
+      "whisper_plugin_reply_errors_total",
+      "Replies reporting an error, or that couldn't be read", labels);
+  disconnects_ = metrics_->counter(
+      "whisper_plugin_disconnects_total",
+      "Connections to the service lost (closed or heartbeats unanswered)",
+      labels);
+  connectionStateGauge_ = metrics_->gauge(
+      "whisper_plugin_connection_state",
+      "0 connecting, 1 live, 2 degraded, 3 down", labels);
+  connectionStateGauge_->set(static_cast<double>(connectionState_));
 }
 
 ServiceCommunicator::~ServiceCommunicator() {
   std::lock_guard mtx(mtx_);
   // ZMQ Cleanup steps
   try {
+    // Stop monitoring before closing either end
+    zmq_socket_monitor(requester_.handle(), nullptr, 0);
+    monitor_.close();
     // Close the socket
     requester_.close();
     // Terminate the context
@@ -33,12 +111,27 @@ ServiceCommunicator::~ServiceCommunicator() {
   }
 }
 
+namespace {
+
+std::string toEndpoint(const std::string& address) {
+  return address.find("://") == std::string::npos ? "tcp://" + address
+                                                  : address;
+}
+
+}  // namespace
+
 bool ServiceCommunicator::setServiceAddress(const std::string& address) {
   std::lock_guard mtx(mtx_);
   reconnectionErrors_.clear();
+  // Start over - anything still to come from the old address is left behind
+  pollMonitor();
+  liveEndpoints_.clear();
+  lost_ = false;
+  writeOffOutstandingReplies();
+  consecutiveErrors_ = 0;
   if (!address_.empty()) {
     try {
-      requester_.disconnect(address_);
+      requester_.disconnect(toEndpoint(address_));
     } catch (const zmq::error_t& e) {
       std::cerr << "Error during disconnect: " << e.what() << std::endl;
       reconnectionErrors_.add(juce::String("Disconnect: ") + e.what());
@@ -48,17 +141,23 @@ bool ServiceCommunicator::setServiceAddress(const std::string& address) {
     }
   }
   if (address.empty()) {
+    address_.clear();
+    updateConnectionState();
     return false;
   }
   try {
-    requester_.connect(std::string("tcp://") + address);
+    const auto endpoint = toEndpoint(address);
+    requester_.connect(endpoint);
     address_ = address;
+    localService_ = endpoint.starts_with("ipc://");
   } catch (const zmq::error_t& e) {
     std::cerr << "Error during connect: " << e.what() << std::endl;
     address_.clear();
     reconnectionErrors_.add(juce::String("Connect: ") + e.what());
+    updateConnectionState();
     return false;
   }
+  updateConnectionState();
   return true;
 }
 
@@ -71,9 +170,138 @@ juce::StringArray ServiceCommunicator::getConnectionErrors() {
   return reconnectionErrors_;
 }
 
-bool ServiceCommunicator::readyToSend() {
+const std::string& ServiceCommunicator::getIdentity() const {
+  return identity_;
+}
+
+void ServiceCommunicator::setBinaryReplies(bool enable) {
+  binaryReplies_ = enable;
+}
+
+void ServiceCommunicator::setFrameResults(bool enable) {
+  frameResults_ = enable;
+}
+
+void ServiceCommunicator::setSharedAudio(bool enable) {
   std::lock_guard mtx(mtx_);
+  sharedAudio_ = enable;
+}
+
+void ServiceCommunicator::setMaxBatchSize(size_t maxBatchSize) {
+  maxBatchSize_ = std::max<size_t>(maxBatchSize, 1);
+}
+
+size_t ServiceCommunicator::getMaxBatchSize() {
+  return maxBatchSize_;
+}
+
+ServiceCommunicator::ConnectionState
+ServiceCommunicator::getConnectionState() {
+  std::lock_guard mtx(mtx_);
+  pollMonitor();
+  return updateConnectionState();
+}
+
+juce::String ServiceCommunicator::toString(ConnectionState state) {
+  switch (state) {
+    case CONNECTING:
+      return "Connecting";
+    case LIVE:
+      return "Live";
+    case DEGRADED:
+      return "Degraded";
+    case DOWN:
+      return "Down";
+  }
+  return {};
+}
+
+void ServiceCommunicator::pollMonitor() {
+  // Each event is two frames: uint16 event and uint32 value, then the
+  // endpoint it concerns
+  try {
+    zmq::message_t event;
+    while (monitor_.recv(event, zmq::recv_flags::dontwait)) {
+      zmq::message_t endpoint;
+      if (!event.more() ||
+          !monitor_.recv(endpoint, zmq::recv_flags::dontwait) ||
+          event.size() < sizeof(uint16_t)) {
+        continue;
+      }
+      uint16_t id;
+      std::memcpy(&id, event.data(), sizeof(id));
+      switch (id) {
+        case ZMQ_EVENT_HANDSHAKE_SUCCEEDED:
+          liveEndpoints_.insert(endpoint.to_string());
+          break;
+        case ZMQ_EVENT_DISCONNECTED:
+          if (liveEndpoints_.erase(endpoint.to_string()) > 0) {
+            lost_ = true;
+            disconnects_->inc();
+          }
+          break;
+        case ZMQ_EVENT_HANDSHAKE_FAILED_NO_DETAIL:
+        case ZMQ_EVENT_HANDSHAKE_FAILED_PROTOCOL:
+        case ZMQ_EVENT_HANDSHAKE_FAILED_AUTH:
+          // Something's listening, but it isn't the service
+          lost_ = true;
+          break;
+        default:
+          break;
+      }
+    }
+  } catch (const zmq::error_t& e) {
+    std::cerr << "Error reading connection events: " << e.what() << std::endl;
+  }
+}
+
+ServiceCommunicator::ConnectionState
+ServiceCommunicator::updateConnectionState() {
+  auto nowMs = juce::Time::getMillisecondCounterHiRes();
+  if (outstandingReplies_ > 0 && nowMs - lastProgressMs_ > replyLostMs) {
+    // They're not coming - don't wait on them forever
+    writeOffOutstandingReplies();
+  }
+
+  ConnectionState state;
   if (address_.empty()) {
+    state = DOWN;
+  } else if (liveEndpoints_.empty()) {
+    state = lost_ ? DOWN : CONNECTING;
+  } else if ((outstandingReplies_ > 0 &&
+              nowMs - lastProgressMs_ > replyOverdueMs) ||
+             consecutiveErrors_ >= maxConsecutiveErrors) {
+    state = DEGRADED;
+  } else {
+    state = LIVE;
+  }
+
+  if (state != connectionState_) {
+    if (state == DOWN) {
+      // Whatever was with the service went with it
+      writeOffOutstandingReplies();
+      consecutiveErrors_ = 0;
+    }
+    connectionState_ = state;
+    connectionStateGauge_->set(static_cast<double>(state));
+  }
+  return state;
+}
+
+void ServiceCommunicator::writeOffOutstandingReplies() {
+  outstandingReplies_ = 0;
+  // Otherwise their slots only come back by being taken as the oldest, which
+  // could be while the service still has the request queued
+  if (sharedAudioRing_) {
+    sharedAudioRing_->releaseAll();
+  }
+}
+
+bool ServiceCommunicator::readyToSend() {
+  std::lock_guard mtx(mtx_);
+  pollMonitor();
+  auto state = updateConnectionState();
+  if (state != LIVE && !(state == DEGRADED && outstandingReplies_ == 0)) {
     return false;
   }
 
@@ -93,77 +321,308 @@ bool ServiceCommunicator::sendRequest(
     const TimePoint& start,
     const SampleCounter length,
     std::shared_ptr<MonoCircularBuffer> readBuff) {
+  return sendRequests(std::span(&start, 1), length, std::move(readBuff));
+}
+
+bool ServiceCommunicator::sendRequests(
+    std::span<const TimePoint> starts,
+    const SampleCounter length,
+    std::shared_ptr<MonoCircularBuffer> readBuff,
+    uint8_t stream) {
   std::lock_guard mtx(mtx_);
+  if (starts.empty()) {
+    return true;
+  }
 
-  const int64_t reqId{start.sampleCounter};
-  const size_t reqIdElmCount = sizeof(int64_t) / sizeof(float);
-  const size_t floatBufferSize = reqIdElmCount + length;
-  std::vector<float> buff(floatBufferSize);
-  // Copy the 64 bits of id directly into the first two float elements
-  std::memcpy(buff.data(), &reqId, sizeof(reqId));
-  // Fill the remaining elements with buffer samples
-  std::span<float> samplesArea(buff.data() + reqIdElmCount,
-                               buff.size() - reqIdElmCount);
-  readBuff->getSamples(start, samplesArea);
-  zmq::const_buffer zmqBuff(buff.data(), floatBufferSize * sizeof(float));
+  parts_.clear();
+  sharedParts_.clear();
+  size_t bytes{0};
+  for (auto const& start : starts) {
+    parts_.push_back(buildRequest(start, length, *readBuff, stream));
+    bytes += parts_.back().size();
+  }
+  // Multipart messages are queued whole or not at all, so only the first
+  // part can be refused
   zmq::send_result_t res;
   try {
-    res = requester_.send(zmqBuff, zmq::send_flags::dontwait);
+    for (size_t i = 0; i < parts_.size(); i++) {
+      auto flags = zmq::send_flags::dontwait;
+      if (i + 1 < parts_.size()) {
+        flags = flags | zmq::send_flags::sndmore;
+      }
+      res = requester_.send(parts_[i], flags);
+      if (!res.has_value()) {
+        break;
+      }
+    }
   } catch (const zmq::error_t& e) {
     std::cout << zmq_errno() << std::endl;
-    return false;
+    res = zmq::send_result_t();
   }
   if (!res.has_value()) {
-      return false;
+    requestsRejected_->inc(starts.size());
+    // No reply is coming to release their audio
+    for (auto id : sharedParts_) {
+      sharedAudioRing_->release(id);
+    }
+    return false;
+  }
+  requestsSent_->inc(starts.size());
+  batchesSent_->inc();
+  bytesSent_->inc(bytes);
+  if (outstandingReplies_ == 0) {
+    lastProgressMs_ = juce::Time::getMillisecondCounterHiRes();
   }
-  outstandingReplies_++;
+  outstandingReplies_ += static_cast<uint32_t>(starts.size());
   return true;
 }
 
+zmq::message_t ServiceCommunicator::buildRequest(const TimePoint& start,
+                                                 const SampleCounter length,
+                                                 MonoCircularBuffer& readBuff,
+                                                 uint8_t stream) {
+  // mtx_ must be held
+  const int64_t id{start.sampleCounter |
+                   (static_cast<int64_t>(stream) << streamIdShift)};
+  int64_t reqId{id | (binaryReplies_ ? binaryReplyFlag : 0) |
+                (frameResults_ ? framesRequestFlag : 0)};
+
+  if (sharedAudio_ && localService_) {
+    if (!sharedAudioRing_ ||
+        (sharedAudioRing_->getSlotSamples() < static_cast<size_t>(length) &&
+         sharedAudioRing_->slotsInUse() == 0)) {
+      // Slots just big enough for a region, remade if regions grow (once
+      // nothing is still being read from the old ones)
+      sharedAudioRing_ = std::make_unique<SharedAudioRing>(
+          SharedAudioRing::defaultSlots, static_cast<size_t>(length));
+    }
+    // Write the samples straight in to shared memory and send just where
+    // they are
+    auto descriptor = sharedAudioRing_->write(
+        id, static_cast<size_t>(length),
+        [&](std::span<float> samples) {
+          readBuff.getSamples(start, samples);
+        });
+    if (descriptor) {
+      reqId |= sharedAudioFlag;
+      zmq::message_t msg(sizeof(reqId) + descriptor->size());
+      auto msgData = static_cast<uint8_t*>(msg.data());
+      std::memcpy(msgData, &reqId, sizeof(reqId));
+      descriptor->writeTo(msgData + sizeof(reqId));
+      sharedParts_.push_back(id);
+      sharedAudioSent_->inc();
+      return msg;
+    }
+  }
+
+  // Build the message in place rather than staging it in another buffer
+  zmq::message_t msg(sizeof(reqId) + length * sizeof(float));
+  auto msgData = static_cast<uint8_t*>(msg.data());
+  // Copy the 64 bits of id directly into the start of the message
+  std::memcpy(msgData, &reqId, sizeof(reqId));
+  // Fill the remainder with buffer samples
+  std::span<float> samplesArea(reinterpret_cast<float*>(msgData + sizeof(reqId)),
+                               static_cast<size_t>(length));
+  readBuff.getSamples(start, samplesArea);
+  return msg;
+}
+
 std::optional<ServiceCommunicator::Response>
 ServiceCommunicator::getResponse() {
   std::lock_guard mtx(mtx_);
-  if (outstandingReplies_ > 0) {
+  pollMonitor();
+  updateConnectionState();
+  if (!address_.empty()) {
     // Polling for replies with a 0 ms timeout (non-blocking, immediate check)
     zmq::pollitem_t items[] = {{requester_, 0, ZMQ_POLLIN, 0}};
     zmq::poll(items, 1, std::chrono::milliseconds(0));
 
-    if (items[0].revents & ZMQ_POLLIN) {
-      zmq::message_t msg;
+    // Replies that can't be read are counted and skipped, so only an empty
+    // socket ends a caller's drain
+    while (items[0].revents & ZMQ_POLLIN) {
+      auto& msg = reply_;
 
       // Receive the reply
       auto res = requester_.recv(msg, zmq::recv_flags::none);
-      if (res.has_value()) {
-        std::string jsonString(static_cast<const char*>(msg.data()),
-                               msg.size());
-        juce::var json = juce::JSON::parse(jsonString);
-        if (json.isObject()) {
-          Response response;
-          if (json.hasProperty("request_id") && json["request_id"].isInt()) {
-            response.reqId = static_cast<juce::int64>(json["request_id"]);
-            response.success = false; // Default - we'll correct this unless "error" in response or result field is missing/invalid
-            if (json.hasProperty("result") &&
-                json["result"].isArray()) {
-              auto resultsArray = json["result"].getArray();
-              if (resultsArray->size() > 0) {
-                auto resultElement = resultsArray->begin();
-                if (resultElement->isDouble()) {
-                  response.success = true;
-                  response.result = *resultElement;
-                }
-              }
-            }
-            if (json.hasProperty("error")) {
-              // We don't need to read this. The very presence of the field means something went wrong
-              response.success = false;
-            }
-            return response;
+      if (!res.has_value()) {
+        break;
+      }
+      repliesReceived_->inc();
+      // Replies can still turn up after being written off
+      if (outstandingReplies_ > 0) {
+        outstandingReplies_--;
+      }
+      lastProgressMs_ = juce::Time::getMillisecondCounterHiRes();
+      auto response = parseResponse(msg.data(), msg.size());
+      if (!response || !response->success) {
+        replyErrors_->inc();
+        consecutiveErrors_++;
+      } else {
+        consecutiveErrors_ = 0;
+      }
+      if (!response) {
+        zmq::poll(items, 1, std::chrono::milliseconds(0));
+        continue;
+      }
+      if (sharedAudioRing_) {
+        // Done with its audio, whatever the outcome
+        sharedAudioRing_->release(response->reqId);
+      }
+      return response;
+    }
+  }
+
+  return std::optional<Response>();
+}
+
+size_t ServiceCommunicator::getSharedSlotsInUse() {
+  std::lock_guard mtx(mtx_);
+  return sharedAudioRing_ ? sharedAudioRing_->slotsInUse() : 0;
+}
+
+std::optional<ServiceCommunicator::Response>
+ServiceCommunicator::parseResponse(const void* data, size_t size) {
+  if (size >= sizeof(binaryReplyMagic) &&
+      std::memcmp(data, binaryReplyMagic, sizeof(binaryReplyMagic)) == 0) {
+    return parseBinaryResponse(data, size);
+  }
+  return parseJsonResponse(data, size);
+}
+
+std::optional<ServiceCommunicator::Response>
+ServiceCommunicator::parseBinaryResponse(const void* data, size_t size) {
+  // All little-endian:
+  //   0  "WSR" + version 1
+  //   4  uint8 status (BinaryReplyStatus)
+  //   5  uint8 flags (binaryReplyHas...)
+  //   6  uint16 result count
+  //   8  uint64 request ID
+  //  16  float32 results[count]
+  //      float32 queue_ms, float32 inference_ms (if binaryReplyHasTiming)
+  //      uint32 frame count, float32 frames[frame count] (if
+  //      binaryReplyHasFrames), then float32 confidence[frame count] (if
+  //      binaryReplyHasConfidence)
+  auto bytes = static_cast<const uint8_t*>(data);
+  if (size < binaryReplyHeaderSize ||
+      std::memcmp(bytes, binaryReplyMagic, sizeof(binaryReplyMagic)) != 0) {
+    return std::nullopt;
+  }
+  const uint8_t status = bytes[4];
+  const uint8_t flags = bytes[5];
+  uint16_t count;
+  std::memcpy(&count, bytes + 6, sizeof(count));
+  const bool hasTiming = flags & binaryReplyHasTiming;
+  const bool hasFrames = flags & binaryReplyHasFrames;
+  const bool hasConfidence = hasFrames && (flags & binaryReplyHasConfidence);
+  const size_t timingOffset = binaryReplyHeaderSize + count * sizeof(float);
+  const size_t framesOffset =
+      timingOffset + (hasTiming ? 2 * sizeof(float) : 0);
+  uint32_t frameCount{0};
+  if (hasFrames) {
+    if (size < framesOffset + sizeof(frameCount)) {
+      return std::nullopt;
+    }
+    std::memcpy(&frameCount, bytes + framesOffset, sizeof(frameCount));
+  }
+  const size_t frameBytes = size_t{frameCount} * sizeof(float);
+  const size_t expectedSize =
+      framesOffset +
+      (hasFrames ? sizeof(frameCount) + frameBytes * (hasConfidence ? 2 : 1)
+                 : 0);
+  if (size != expectedSize) {
+    return std::nullopt;
+  }
+
+  Response response;
+  std::memcpy(&response.reqId, bytes + 8, sizeof(response.reqId));
+  response.reqId &= ~requestFlags;
+  response.success = status == REPLY_OK && count > 0;
+  if (count > 0) {
+    std::memcpy(&response.result, bytes + binaryReplyHeaderSize, sizeof(float));
+  }
+  if (hasTiming) {
+    float timing[2];
+    std::memcpy(timing, bytes + timingOffset, sizeof(timing));
+    response.serviceQueueMs = timing[0];
+    response.serviceInferenceMs = timing[1];
+  }
+  auto framesData = bytes + framesOffset + sizeof(frameCount);
+  // Read in place rather than copied. Every field is 4 byte aligned within
+  // the reply, so this only fails if the reply itself isn't, when the
+  // frames are left out rather than copied.
+  if (frameCount > 0 &&
+      reinterpret_cast<uintptr_t>(framesData) % alignof(float) == 0) {
+    auto floats = reinterpret_cast<const float*>(framesData);
+    response.frames = std::span(floats, frameCount);
+    if (hasConfidence) {
+      response.confidence = std::span(floats + frameCount, frameCount);
+    }
+  }
+  return response;
+}
+
+std::optional<ServiceCommunicator::Response>
+ServiceCommunicator::parseJsonResponse(const void* data, size_t size) {
+  std::string jsonString(static_cast<const char*>(data), size);
+  juce::var json = juce::JSON::parse(jsonString);
+  if (json.isObject()) {
+    Response response;
+    if (json.hasProperty("request_id") &&
+        (json["request_id"].isInt() || json["request_id"].isInt64())) {
+      response.reqId =
+          static_cast<juce::int64>(json["request_id"]) & ~requestFlags;
+      response.success = false; // Default - we'll correct this unless "error" in response or result field is missing/invalid
+      if (json.hasProperty("result") &&
+          json["result"].isArray()) {
+        auto resultsArray = json["result"].getArray();
+        if (resultsArray->size() > 0) {
+          auto resultElement = resultsArray->begin();
+          if (resultElement->isDouble()) {
+            response.success = true;
+            response.result = *resultElement;
           }
         }
       }
+      if (json.hasProperty("error")) {
+        // We don't need to read this. The very presence of the field means something went wrong
+        response.success = false;
+      }
+      if (json.hasProperty("timing") && json["timing"].isObject()) {
+        auto timing = json["timing"];
+        auto readMs = [&timing](const char* name) -> std::optional<double> {
+          auto value = timing[name];
+          if (value.isDouble() || value.isInt() || value.isInt64()) {
+            return static_cast<double>(value);
+          }
+          return std::nullopt;
+        };
+        response.serviceQueueMs = readMs("queue_ms");
+        response.serviceInferenceMs = readMs("inference_ms");
+      }
+      // Frames then confidence, one after the other
+      auto parsed = std::make_shared<std::vector<float>>();
+      auto readFloats = [&json, &parsed](const char* name) {
+        const auto from = parsed->size();
+        if (auto array = json[name].getArray()) {
+          for (const auto& value : *array) {
+            parsed->push_back(static_cast<float>(static_cast<double>(value)));
+          }
+        }
+        return parsed->size() - from;
+      };
+      const auto frameCount = readFloats("frames");
+      const auto confidenceCount = readFloats("confidence");
+      if (frameCount > 0) {
+        response.frames = std::span(parsed->data(), frameCount);
+        if (confidenceCount == frameCount) {
+          response.confidence =
+              std::span(parsed->data() + frameCount, frameCount);
+        }
+        response.parsedFrames = std::move(parsed);
+      }
+      return response;
     }
   }
-
   return std::optional<Response>();
 }
 
@@ -1,10 +1,15 @@
 #pragma once
 
 #include <juce_gui_basics/juce_gui_basics.h>
+#include <atomic>
 #include <mutex>
 #include <optional>
+#include <set>
+#include <span>
+#include <vector>
 #include <memory>
-#include "CircularBuffer.h"
+#include "Metrics.h"
+#include "SharedAudioRing.h"
 #include "Types.h"
 #include <zmq.hpp>
 
@@ -17,30 +22,163 @@ public:
   ServiceCommunicator();
   ~ServiceCommunicator();
 
+  // host:port for TCP, or a full ZMQ endpoint (e.g. ipc:///tmp/whisper).
+  // Audio for ipc:// endpoints goes through shared memory.
   bool setServiceAddress(const std::string& address);
   std::string getServiceAddress();
   juce::StringArray getConnectionErrors();
+  // Unique to this instance - also labels its metrics
+  const std::string& getIdentity() const;
 
   struct Response {
     int64_t reqId;
     float result{0.f};
     bool success{true};
+    // Time spent queued and analysing, if the service reports it
+    std::optional<double> serviceQueueMs;
+    std::optional<double> serviceInferenceMs;
+    // Scores for evenly spaced frames across the region, if asked for and
+    // the service provides them. Confidence is per frame, or empty.
+    // From a binary reply these point into it, so are only valid until the
+    // next getResponse() (or for as long as parseResponse()'s data is).
+    std::span<const float> frames;
+    std::span<const float> confidence;
+    // Holds frames and confidence for JSON replies, which have to be parsed
+    std::shared_ptr<const std::vector<float>> parsedFrames;
   };
 
+  // Set in a request's ID to ask for a binary reply. Services that don't
+  // understand it reply in JSON with it still set, so it is masked off
+  // replies either way.
+  static constexpr int64_t binaryReplyFlag{int64_t{1} << 62};
+  // Likewise, to ask for per-frame scores as well
+  static constexpr int64_t framesRequestFlag{int64_t{1} << 61};
+  // Set by the plugin when the request carries a SharedAudioRing descriptor
+  // rather than audio
+  static constexpr int64_t sharedAudioFlag{int64_t{1} << 60};
+  static constexpr int64_t requestFlags{binaryReplyFlag | framesRequestFlag |
+                                        sharedAudioFlag};
+  // Requests for streams after the first (see AnalysisRegions::addStream)
+  // carry the stream here, below the flags. Services just echo it back.
+  static constexpr int streamIdShift{52};
+  static constexpr size_t maxStreams{256};
+  static constexpr int64_t streamIdMask{int64_t{0xff} << streamIdShift};
+  static uint8_t getStream(int64_t reqId) {
+    return static_cast<uint8_t>((reqId & streamIdMask) >> streamIdShift);
+  }
+  // Binary reply header: "WSR" + version, status, flags, result count, ID
+  static constexpr uint8_t binaryReplyMagic[4]{'W', 'S', 'R', 1};
+  static constexpr size_t binaryReplyHeaderSize{16};
+  enum BinaryReplyStatus : uint8_t {
+    REPLY_OK,
+    REPLY_OVERLOADED,   // Queue full
+    REPLY_BAD_REQUEST,  // Couldn't be read
+    REPLY_FAILED        // Analysis failed
+  };
+  static constexpr uint8_t binaryReplyHasTiming{1};
+  static constexpr uint8_t binaryReplyHasFrames{2};
+  static constexpr uint8_t binaryReplyHasConfidence{4};
+
+  // On by default - old services just carry on replying in JSON
+  void setBinaryReplies(bool enable);
+  // Likewise, old services just don't send them
+  void setFrameResults(bool enable);
+  // On by default, for ipc:// services only (which must be on this machine)
+  void setSharedAudio(bool enable);
+
+  // Where the connection to the service is, from the socket's monitor events
+  // and ZMTP heartbeats. Nothing is sent unless LIVE or DEGRADED.
+  enum ConnectionState {
+    CONNECTING,  // Not reached the service yet since the address was set
+    LIVE,
+    DEGRADED,  // Connected, but replies are overdue or failing - one request
+               // at a time until it recovers
+    DOWN       // No address, lost the service, or whatever's there isn't one
+  };
+  ConnectionState getConnectionState();
+  static juce::String toString(ConnectionState state);
+  // Heartbeats every second, and the connection is dropped (and retried)
+  // if the service doesn't answer within this long
+  static constexpr int heartbeatTimeoutMs{3000};
+  // DEGRADED once replies are this overdue, or after this many failures in
+  // a row
+  static constexpr double replyOverdueMs{15000.0};
+  static constexpr uint32_t maxConsecutiveErrors{3};
+  // Outstanding replies still missing after this long are written off
+  static constexpr double replyLostMs{60000.0};
+
+  // Most regions to send in one request. Off (1) by default - services that
+  // predate batching only read a request's first part.
+  void setMaxBatchSize(size_t maxBatchSize);
+  size_t getMaxBatchSize();
+
   bool readyToSend();
   bool sendRequest(const TimePoint& start,
                    const SampleCounter length,
                    std::shared_ptr<MonoCircularBuffer> readBuff);
+  // Sends several regions as one multipart request, one region per part,
+  // for the service to analyse together. Each still gets its own reply.
+  // All or nothing.
+  bool sendRequests(std::span<const TimePoint> starts,
+                    const SampleCounter length,
+                    std::shared_ptr<MonoCircularBuffer> readBuff,
+                    uint8_t stream = 0);
   std::optional<Response> getResponse();
+  // Shared memory slots holding audio for requests still awaiting replies
+  size_t getSharedSlotsInUse();
+  // Decodes a single reply from the service, binary or JSON
+  static std::optional<Response> parseResponse(const void* data, size_t size);
+  // Without allocating, unless there are frames. Empty if not a well formed
+  // binary reply.
+  static std::optional<Response> parseBinaryResponse(const void* data,
+                                                     size_t size);
+  static std::optional<Response> parseJsonResponse(const void* data,
+                                                   size_t size);
 
 private:
+  zmq::message_t buildRequest(const TimePoint& start,
+                              const SampleCounter length,
+                              MonoCircularBuffer& readBuff,
+                              uint8_t stream);
+  // mtx_ must be held for these
+  void pollMonitor();
+  ConnectionState updateConnectionState();
+  // Stops waiting on any outstanding replies, and frees their shared audio
+  void writeOffOutstandingReplies();
+
   std::mutex mtx_;
   std::string identity_;
   zmq::context_t context_;
   zmq::socket_t requester_;
+  zmq::socket_t monitor_;  // Receives requester_'s connection events
   std::string address_;
   uint32_t outstandingReplies_{0};
+  double lastProgressMs_{0.0};  // Last reply, or first send with none due
+  uint32_t consecutiveErrors_{0};
+  ConnectionState connectionState_{DOWN};
+  std::set<std::string> liveEndpoints_;  // Handshaken with, by event address
+  bool lost_{false};  // Been disconnected since the address was set
+  std::atomic<bool> binaryReplies_{true};
+  std::atomic<bool> frameResults_{true};
+  std::atomic<size_t> maxBatchSize_{1};
+  bool sharedAudio_{true};
+  bool localService_{false};  // Reached over ipc://
+  std::unique_ptr<SharedAudioRing> sharedAudioRing_;  // Made when first used
+  std::vector<zmq::message_t> parts_;  // Avoid repeated alloc
+  zmq::message_t reply_;  // The last reply, which its Response may point into
+  std::vector<int64_t> sharedParts_;   // IDs of parts_ sent via the ring
   juce::StringArray reconnectionErrors_;
+
+  SharedMetricsRegistry metrics_;
+  std::shared_ptr<Counter> requestsSent_;
+  std::shared_ptr<Counter> batchesSent_;  // Messages, of one or more requests
+  std::shared_ptr<Counter> requestsRejected_;  // Not taken by the socket
+  std::shared_ptr<Counter> bytesSent_;
+  std::shared_ptr<Counter> sharedAudioSent_;  // Audio sent in shared memory
+  std::shared_ptr<Counter> repliesReceived_;
+  std::shared_ptr<Counter> replyErrors_;
+  std::shared_ptr<Counter> disconnects_;
+  std::shared_ptr<Gauge> connectionStateGauge_;
 };
 
 }  // namespace audio_plugin
\ No newline at end of file
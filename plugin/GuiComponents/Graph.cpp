@@ -1,19 +1,38 @@
 #include "Graph.h"
 #include <algorithm>
 #include <cassert>
+#include <cmath>
 #include "Utils.h"
 
 using namespace audio_plugin::ui;
 
+void audio_plugin::ui::calcColumnPeaks(std::span<const float> samples,
+                                       size_t samplesPerColumn,
+                                       std::span<float> columns,
+                                       TaskPool& pool) {
+  assert(samples.size() >= columns.size() * samplesPerColumn);
+  // Split by columns, and only once there are enough samples to be worth
+  // waking other threads for
+  auto minColumns = std::max<size_t>(
+      1, columnPeaksMinChunkSamples / std::max<size_t>(samplesPerColumn, 1));
+  pool.parallelFor(
+      TaskPool::GUI, columns.size(), minColumns, [&](size_t begin, size_t end) {
+        for (size_t column = begin; column < end; column++) {
+          auto start = samples.begin() + column * samplesPerColumn;
+          float peak{0.f};
+          for (auto sample = start; sample != start + samplesPerColumn;
+               ++sample) {
+            peak = std::max(peak, std::abs(*sample));
+          }
+          columns[column] = peak;
+        }
+      });
+}
 
 Graph::Graph(AudioPluginAudioProcessor& processorRef)
     : processorRef_(processorRef) {
   startTimerHz(30);
-  auto circBuff = processorRef_.getCircularBuffer();
-  assert(circBuff);
-  if (circBuff) {
-    samples_ = std::vector<float>(circBuff->getNumStoredSamples(), 0.f);
-  }
+  // samples_ is sized in resized() - don't allocate the whole history here
   setOpaque(true);
 }
 
@@ -71,21 +90,8 @@ void Graph::paint(juce::Graphics& g) {
   auto dataTime = circBuff->getLatestSamples(
       samples_);  // Use dataTime to align whisper results with waveform
 
-  // Precompute the absolute values of samples
-  std::for_each(
-      PREFERRED_EXEC(std::execution::par, samples_.begin(), samples_.end(),
-                     [](float& sample) { sample = std::abs(sample); }));
-
-  // Parallel loop to find the max sample for each line
-  std::for_each(PREFERRED_EXEC(
-      std::execution::par, waveformColumns_.begin(), waveformColumns_.end(), [&](float& line) {
-        size_t i = &line - &waveformColumns_[0];  // Calculate the index based on the
-                                       // pointer difference
-        size_t start = i * samplesPerLine_;
-        size_t end = start + samplesPerLine_;
-        line =
-            *std::max_element(samples_.begin() + start, samples_.begin() + end);
-      }));
+  calcColumnPeaks(samples_, samplesPerLine_, waveformColumns_,
+                  processorRef_.getTaskPool());
 
   g.setColour(colWaveform_);
   for (int x = 0; x < waveformColumns_.size(); ++x) {
@@ -131,6 +137,13 @@ void Graph::paint(juce::Graphics& g) {
       g.fillRect(area);
       g.setColour(regionOutline);
       g.drawRect(area);
+      // Finer grained scores within the region, if the service sent them
+      if (regionAnalyser->getResultArena().read(region.frames, frameScores_,
+                                                &frameConfidence_)) {
+        drawFrameCurve(g, left, right, mainAreaHeight,
+                       region.stale ? colAnalysisCurveStale_
+                                    : colAnalysisCurve_);
+      }
       auto [resultArea, timeRangeArea] = calcCompletedRegionTextArea(area);
       if (region.wasDuringPlayback) {
         g.setFont(normalFont);
@@ -202,6 +215,31 @@ void Graph::paint(juce::Graphics& g) {
 
 }
 
+void Graph::drawFrameCurve(juce::Graphics& g,
+                           int left,
+                           int right,
+                           int mainAreaHeight,
+                           juce::Colour colour) {
+  // frameScores_ spread evenly across the region, each frame at its centre.
+  // Segments fade with the confidence of their frames, where there is one.
+  const auto numFrames = frameScores_.size();
+  const float frameWidth = static_cast<float>(right - left) / numFrames;
+  auto pointAt = [&](size_t frame) {
+    return juce::Point<float>(
+        left + (frame + 0.5f) * frameWidth,
+        (1.f - std::clamp(frameScores_[frame], 0.f, 1.f)) * mainAreaHeight);
+  };
+  for (size_t frame = 1; frame < numFrames; ++frame) {
+    auto alpha = frameConfidence_.empty()
+                     ? 1.f
+                     : std::clamp(std::min(frameConfidence_[frame - 1],
+                                           frameConfidence_[frame]),
+                                  0.2f, 1.f);
+    g.setColour(colour.withMultipliedAlpha(alpha));
+    g.drawLine(juce::Line<float>(pointAt(frame - 1), pointAt(frame)), 1.5f);
+  }
+}
+
 int Graph::getGraphDurationMs() {
   return calcGraphDurationMs(samplesPerLine_);
 }
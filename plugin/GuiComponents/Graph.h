@@ -2,11 +2,21 @@
 
 #include<juce_gui_basics/juce_gui_basics.h>
 #include "../PluginProcessor.h"
+#include "../TaskPool.h"
 #include <optional>
+#include <span>
 
 namespace audio_plugin {
 namespace ui {
 
+// Reduces samples to the peak absolute value of each column of
+// samplesPerColumn, splitting big reductions across the pool
+constexpr size_t columnPeaksMinChunkSamples{32768};
+void calcColumnPeaks(std::span<const float> samples,
+                     size_t samplesPerColumn,
+                     std::span<float> columns,
+                     TaskPool& pool);
+
 class Graph : public juce::Component, private juce::Timer {
 public:
   Graph(AudioPluginAudioProcessor& processorRef);
@@ -22,6 +32,8 @@ private:
   AudioPluginAudioProcessor& processorRef_;
   std::vector<float> samples_;
   std::vector<float> waveformColumns_;
+  std::vector<float> frameScores_;      // Avoid repeated alloc
+  std::vector<float> frameConfidence_;  // Likewise
 
   void drawTimeRangeText(juce::Graphics& g,
                          const juce::Rectangle<int>& area,
@@ -31,6 +43,11 @@ private:
   std::pair<juce::Rectangle<int>, juce::Rectangle<int>>
   calcCompletedRegionTextArea(const juce::Rectangle<int>& inputArea);
   int getGraphX(SampleCounter forSc, SampleCounter knownScAtGraphRightEdge);
+  void drawFrameCurve(juce::Graphics& g,
+                      int left,
+                      int right,
+                      int mainAreaHeight,
+                      juce::Colour colour);
   size_t samplesPerLine_{256};
 
   void timerCallback() override;
@@ -61,6 +78,8 @@ private:
   const juce::Colour colAnalysisResultStaleOutline_{juce::Colours::grey};
   const juce::Colour colAnalysisResultStaleFill_{
       juce::Colours::grey.withAlpha(0.5f)};
+  const juce::Colour colAnalysisCurve_{juce::Colours::yellow};
+  const juce::Colour colAnalysisCurveStale_{juce::Colours::lightgrey};
 
   JUCE_DECLARE_NON_COPYABLE_WITH_LEAK_DETECTOR(Graph)
 };
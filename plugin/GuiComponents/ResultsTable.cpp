@@ -64,6 +64,9 @@ ResultsTable::ResultsTable(AudioPluginAudioProcessor& processorRef)
   clearButton_.addListener(this);
   addAndMakeVisible(clearButton_);
 
+  stream_.addListener(this);
+  addChildComponent(stream_);
+
   startTimer(100);
 }
 
@@ -171,6 +174,8 @@ void ResultsTable::resized() {
   heading_.setBounds(header.removeFromLeft(200));
   clearButton_.setBounds(
       header.removeFromRight(75).withSizeKeepingCentre(75, 20));
+  header.removeFromRight(10);
+  stream_.setBounds(header.removeFromRight(150).withSizeKeepingCentre(150, 20));
   text_.setBounds(header);
   area.removeFromTop(5);
   table_.setBounds(area);
@@ -184,15 +189,20 @@ void ResultsTable::timerCallback() {
   std::set<PlayheadTime> columns;
   auto regionAnalyser = processorRef_.getAnalysisRegions();
   assert(regionAnalyser);
+  updateStreamItems(*regionAnalyser);
+  auto stream =
+      static_cast<size_t>(std::max(stream_.getSelectedItemIndex(), 0));
 
   {
     std::lock_guard mtx(latestResultsMtx_);
-    auto currentUpdateCounter = regionAnalyser->getResultsUpdateCount();
-    if (currentUpdateCounter != latestResultsUpdateCount_) {
+    auto currentUpdateCounter = regionAnalyser->getResultsUpdateCount(stream);
+    if (currentUpdateCounter != latestResultsUpdateCount_ ||
+        stream != latestResultsStream_) {
       auto oldCols = latestResults_.playheadStartTimes;
-      latestResults_ = regionAnalyser->getResults();
+      latestResults_ = regionAnalyser->getResults(stream);
       latestResultsMaxRows_ = latestResults_.playthroughOffsets.size();
       latestResultsUpdateCount_ = currentUpdateCounter;
+      latestResultsStream_ = stream;
       if (latestResults_.playheadStartTimes != oldCols) {
         doColumnReset = true;
         columns = latestResults_.playheadStartTimes;
@@ -232,3 +242,29 @@ void ResultsTable::buttonClicked(juce::Button* button) {
     }
   }
 }
+
+void ResultsTable::comboBoxChanged(juce::ComboBox* comboBoxThatHasChanged) {
+  if (comboBoxThatHasChanged == &stream_) {
+    // Picked up straight away rather than on the next tick
+    stopTimer();
+    timerCallback();
+  }
+}
+
+void ResultsTable::updateStreamItems(AnalysisRegions& regionAnalyser) {
+  // Streams only change when the buffer is rebuilt, so this is usually a no-op
+  auto numStreams = regionAnalyser.getNumStreams();
+  if (static_cast<size_t>(stream_.getNumItems()) == numStreams) {
+    return;
+  }
+  stream_.clear(juce::NotificationType::dontSendNotification);
+  for (size_t stream = 0; stream < numStreams; stream++) {
+    auto name = juce::String(regionAnalyser.getStreamName(stream));
+    if (name.isEmpty()) {
+      name = "Stream " + juce::String(static_cast<int>(stream) + 1);
+    }
+    stream_.addItem(name, static_cast<int>(stream) + 1);
+  }
+  stream_.setSelectedItemIndex(0, juce::NotificationType::dontSendNotification);
+  stream_.setVisible(numStreams > 1);
+}
@@ -12,7 +12,8 @@ namespace ui {
 class ResultsTable : public juce::Component,
                      juce::TableListBoxModel,
                      private juce::Timer,
-                     juce::Button::Listener {
+                     juce::Button::Listener,
+                     juce::ComboBox::Listener {
 public:
   ResultsTable(AudioPluginAudioProcessor& processorRef);
   int getNumRows() override;
@@ -35,12 +36,16 @@ private:
   juce::Label heading_;
   juce::Label text_;
   juce::TextButton clearButton_;
+  juce::ComboBox stream_;  // Only shown with more than one
 
   void timerCallback() override;
   void buttonClicked(juce::Button* button) override;
+  void comboBoxChanged(juce::ComboBox* comboBoxThatHasChanged) override;
+  void updateStreamItems(AnalysisRegions& regionAnalyser);
 
   std::mutex latestResultsMtx_;
   uint64_t latestResultsUpdateCount_{0};
+  size_t latestResultsStream_{0};
   PlaybackResults::Results latestResults_;
   std::atomic<int> latestResultsMaxRows_{0};
 
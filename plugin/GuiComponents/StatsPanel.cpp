@@ -0,0 +1,130 @@
+#include "StatsPanel.h"
+
+using namespace audio_plugin::ui;
+
+StatsPanel::StatsPanel(AudioPluginAudioProcessor& processorRef)
+    : processorRef_(processorRef) {
+  heading_.setEditable(false);
+  heading_.setText("Stats",
+                   juce::NotificationType::dontSendNotification);
+  heading_.setFont(heading_.getFont().boldened().withHeight(20));
+  heading_.setJustificationType(juce::Justification::bottomLeft);
+  addAndMakeVisible(heading_);
+
+  text_.setMultiLine(true);
+  text_.setReadOnly(true);
+  text_.setScrollbarsShown(true);
+  text_.setCaretVisible(false);
+  text_.setFont(juce::Font(juce::FontOptions(
+      juce::Font::getDefaultMonospacedFontName(), 14.f, juce::Font::plain)));
+  addAndMakeVisible(text_);
+
+  resetButton_.setButtonText("Reset");
+  resetButton_.setToggleable(false);
+  resetButton_.addListener(this);
+  addAndMakeVisible(resetButton_);
+
+  saveButton_.setButtonText("Save...");
+  saveButton_.setToggleable(false);
+  saveButton_.addListener(this);
+  addAndMakeVisible(saveButton_);
+
+  exportTraceButton_.setButtonText("Export Trace...");
+  exportTraceButton_.setToggleable(false);
+  exportTraceButton_.setTooltip(
+      "Chrome/Perfetto trace of the most recent regions");
+  exportTraceButton_.addListener(this);
+  addAndMakeVisible(exportTraceButton_);
+}
+
+void StatsPanel::resized() {
+  auto area = getLocalBounds();
+  auto header = area.removeFromTop(40);
+  exportTraceButton_.setBounds(header.removeFromRight(120).reduced(0, 5));
+  header.removeFromRight(10);
+  saveButton_.setBounds(header.removeFromRight(100).reduced(0, 5));
+  header.removeFromRight(10);
+  resetButton_.setBounds(header.removeFromRight(100).reduced(0, 5));
+  heading_.setBounds(header);
+  text_.setBounds(area);
+}
+
+void StatsPanel::visibilityChanged() {
+  // Only poll while we're showing
+  if (isVisible()) {
+    updateText();
+    startTimer(500);
+  } else {
+    stopTimer();
+  }
+}
+
+void StatsPanel::timerCallback() {
+  updateText();
+}
+
+void StatsPanel::buttonClicked(juce::Button* button) {
+  auto stats = processorRef_.getAudioThreadStats();
+  auto regions = processorRef_.getAnalysisRegions();
+  if (button == &resetButton_) {
+    stats->reset();
+    if (regions) {
+      regions->getTracer().reset();
+      regions->resetSchedulerStats();
+    }
+    updateText();
+  } else if (button == &saveButton_) {
+    launchSaveDialog("Save stats", "whisper-stats.txt",
+                     [stats, regions](const juce::File& file) {
+                       juce::String regionStats;
+                       if (regions) {
+                         regionStats =
+                             "\n" +
+                             RegionTracer::toString(
+                                 regions->getTracer().getSnapshot()) +
+                             "\n" +
+                             RegionScheduler::toString(
+                                 regions->getSchedulerSnapshot());
+                       }
+                       stats->dumpToFile(file, regionStats);
+                     });
+  } else if (button == &exportTraceButton_) {
+    if (!regions) {
+      return;
+    }
+    launchSaveDialog("Export trace", "whisper-trace.json",
+                     [regions](const juce::File& file) {
+                       regions->getTracer().exportChromeTrace(file);
+                     });
+  }
+}
+
+void StatsPanel::launchSaveDialog(
+    const juce::String& title,
+    const juce::String& defaultName,
+    std::function<void(const juce::File&)> save) {
+  fileChooser_ = std::make_unique<juce::FileChooser>(
+      title,
+      juce::File::getSpecialLocation(juce::File::userDocumentsDirectory)
+          .getChildFile(defaultName),
+      "*" + juce::File(defaultName).getFileExtension());
+  fileChooser_->launchAsync(juce::FileBrowserComponent::saveMode |
+                                juce::FileBrowserComponent::canSelectFiles |
+                                juce::FileBrowserComponent::warnAboutOverwriting,
+                            [save](const juce::FileChooser& chooser) {
+                              auto file = chooser.getResult();
+                              if (file != juce::File()) {
+                                save(file);
+                              }
+                            });
+}
+
+void StatsPanel::updateText() {
+  auto stats = processorRef_.getAudioThreadStats();
+  auto text = AudioThreadStats::toString(stats->getSnapshot());
+  if (auto regions = processorRef_.getAnalysisRegions()) {
+    text += "\n" + RegionTracer::toString(regions->getTracer().getSnapshot());
+    text += "\n" + RegionScheduler::toString(regions->getSchedulerSnapshot());
+  }
+  text_.setText(text, false);
+}
@@ -0,0 +1,42 @@
+#pragma once
+
+#include<juce_gui_basics/juce_gui_basics.h>
+#include "../PluginProcessor.h"
+#include <functional>
+#include <memory>
+
+namespace audio_plugin {
+namespace ui {
+
+// Shows the audio thread stats (callback load, overruns and lock waits) and
+// region latencies, with options to reset them or save them to a file to
+// attach to a bug report
+class StatsPanel : public juce::Component,
+                   private juce::Timer,
+                   juce::Button::Listener {
+public:
+  StatsPanel(AudioPluginAudioProcessor& processorRef);
+  void resized() override;
+  void visibilityChanged() override;
+
+private:
+  AudioPluginAudioProcessor& processorRef_;
+  juce::Label heading_;
+  juce::TextEditor text_;
+  juce::TextButton resetButton_;
+  juce::TextButton saveButton_;
+  juce::TextButton exportTraceButton_;
+  std::unique_ptr<juce::FileChooser> fileChooser_;
+
+  void timerCallback() override;
+  void buttonClicked(juce::Button* button) override;
+  void updateText();
+  void launchSaveDialog(const juce::String& title,
+                        const juce::String& defaultName,
+                        std::function<void(const juce::File&)> save);
+
+  JUCE_DECLARE_NON_COPYABLE_WITH_LEAK_DETECTOR(StatsPanel)
+};
+
+}  // namespace ui
+}  // namespace audio_plugin
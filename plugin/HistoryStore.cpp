@@ -0,0 +1,486 @@
+#include "HistoryStore.h"
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <bit>
+#include <cstddef>
+#include <cstring>
+#include <string>
+#include <chrono>
+
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#include <winioctl.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+namespace {
+
+float decodeHalf(uint16_t value) {
+  uint32_t sign = static_cast<uint32_t>(value & 0x8000) << 16;
+  uint32_t exponent = (value >> 10) & 0x1f;
+  uint32_t mantissa = value & 0x3ff;
+  if (exponent == 0) {
+    // Zero or subnormal
+    float magnitude = static_cast<float>(mantissa) / 16777216.f;  // 2^-24
+    return sign ? -magnitude : magnitude;
+  }
+  if (exponent == 0x1f) {
+    // Inf or NaN
+    return std::bit_cast<float>(sign | 0x7f800000 | (mantissa << 13));
+  }
+  return std::bit_cast<float>(sign | ((exponent + 112) << 23) |
+                              (mantissa << 13));
+}
+
+const std::array<float, 65536>& getHalfDecodeTable() {
+  // 256KB, but turns every decode in to a single lookup
+  static const auto table = [] {
+    std::array<float, 65536> t{};
+    for (uint32_t h = 0; h < t.size(); ++h) {
+      t[h] = decodeHalf(static_cast<uint16_t>(h));
+    }
+    return t;
+  }();
+  return table;
+}
+
+size_t getPageSize() {
+#ifdef _WIN32
+  SYSTEM_INFO info;
+  GetSystemInfo(&info);
+  return info.dwPageSize;
+#else
+  return static_cast<size_t>(sysconf(_SC_PAGESIZE));
+#endif
+}
+
+std::filesystem::path makeUniqueHistoryPath(
+    const std::filesystem::path& directory) {
+  static std::atomic<uint32_t> instanceCounter{0};
+  auto now = std::chrono::system_clock::now().time_since_epoch().count();
+#ifdef _WIN32
+  auto pid = GetCurrentProcessId();
+#else
+  auto pid = getpid();
+#endif
+  return directory / ("wim-history-" + std::to_string(pid) + "-" +
+                      std::to_string(now) + "-" +
+                      std::to_string(instanceCounter++) + ".f32");
+}
+
+}  // namespace
+
+namespace audio_plugin {
+
+uint16_t floatToHalf(float value) {
+  uint32_t bits = std::bit_cast<uint32_t>(value);
+  uint16_t sign = static_cast<uint16_t>((bits >> 16) & 0x8000);
+  int32_t exponent = static_cast<int32_t>((bits >> 23) & 0xff);
+  uint32_t mantissa = bits & 0x7fffff;
+
+  if (exponent == 0xff) {
+    // Inf or NaN (keep NaN a NaN)
+    return sign | 0x7c00 | (mantissa ? 0x200 : 0);
+  }
+  int32_t halfExponent = exponent - 127 + 15;
+  if (halfExponent >= 0x1f) {
+    return sign | 0x7c00;  // Overflow to inf
+  }
+  if (halfExponent <= 0) {
+    // Subnormal half (or too small - flush to zero)
+    if (halfExponent < -10) {
+      return sign;
+    }
+    mantissa |= 0x800000;
+    uint32_t shift = static_cast<uint32_t>(14 - halfExponent);
+    uint32_t halfMantissa = mantissa >> shift;
+    uint32_t remainder = mantissa & ((1u << shift) - 1);
+    uint32_t halfway = 1u << (shift - 1);
+    if (remainder > halfway || (remainder == halfway && (halfMantissa & 1))) {
+      ++halfMantissa;
+    }
+    return sign | static_cast<uint16_t>(halfMantissa);
+  }
+  uint16_t half = sign | static_cast<uint16_t>(halfExponent << 10) |
+                  static_cast<uint16_t>(mantissa >> 13);
+  uint32_t remainder = mantissa & 0x1fff;
+  if (remainder > 0x1000 || (remainder == 0x1000 && (half & 1))) {
+    ++half;  // Carry in to the exponent is correct behaviour here
+  }
+  return half;
+}
+
+float halfToFloat(uint16_t value) {
+  return getHalfDecodeTable()[value];
+}
+
+CompressedHistoryStore::CompressedHistoryStore(size_t chunkSamples)
+    : chunkSamples_(chunkSamples) {
+  // Make sure the decode table isn't built on first read
+  getHalfDecodeTable();
+}
+
+void CompressedHistoryStore::append(SampleCounter start,
+                                    std::span<const float> samples) {
+  std::vector<uint16_t> encoded;
+  {
+    std::lock_guard mtx(mtx_);
+    if (!spare_.empty()) {
+      encoded = std::move(spare_.back());
+      spare_.pop_back();
+    }
+  }
+  encoded.resize(samples.size());
+  std::transform(samples.begin(), samples.end(), encoded.begin(),
+                 floatToHalf);
+
+  std::lock_guard mtx(mtx_);
+  // Chunks must stay ordered for lookup. Anything that would break that
+  // (e.g, an overlapping write) means the old data is no longer valid.
+  while (!chunks_.empty() &&
+         chunks_.back().start + static_cast<SampleCounter>(
+                                    chunks_.back().samples.size()) > start) {
+    spare_.push_back(std::move(chunks_.back().samples));
+    chunks_.pop_back();
+  }
+  chunks_.push_back(Chunk{start, std::move(encoded)});
+}
+
+bool CompressedHistoryStore::read(SampleCounter start, std::span<float> dst) {
+  const auto& table = getHalfDecodeTable();
+  bool complete{true};
+  std::lock_guard mtx(mtx_);
+
+  // Find the chunk containing start (or the first one after it)
+  auto it = std::upper_bound(
+      chunks_.begin(), chunks_.end(), start,
+      [](SampleCounter sc, const Chunk& chunk) { return sc < chunk.start; });
+  if (it != chunks_.begin()) {
+    auto prev = std::prev(it);
+    if (start <
+        prev->start + static_cast<SampleCounter>(prev->samples.size())) {
+      it = prev;
+    }
+  }
+
+  size_t written{0};
+  while (written < dst.size()) {
+    SampleCounter sc = start + static_cast<SampleCounter>(written);
+    if (it == chunks_.end() || sc < it->start) {
+      // Gap - zero-fill up to the next chunk
+      size_t gap = dst.size() - written;
+      if (it != chunks_.end()) {
+        gap = std::min(gap, static_cast<size_t>(it->start - sc));
+      }
+      std::fill_n(dst.begin() + static_cast<std::ptrdiff_t>(written), gap,
+                  0.f);
+      written += gap;
+      complete = false;
+      continue;
+    }
+    size_t offset = static_cast<size_t>(sc - it->start);
+    size_t count = std::min(dst.size() - written, it->samples.size() - offset);
+    for (size_t s = 0; s < count; ++s) {
+      dst[written + s] = table[it->samples[offset + s]];
+    }
+    written += count;
+    ++it;
+  }
+  return complete;
+}
+
+void CompressedHistoryStore::trimBefore(SampleCounter oldestToKeep) {
+  std::lock_guard mtx(mtx_);
+  while (!chunks_.empty() &&
+         chunks_.front().start + static_cast<SampleCounter>(
+                                     chunks_.front().samples.size()) <=
+             oldestToKeep) {
+    // Only keep a couple spare - retention may have just been reduced
+    if (spare_.size() < 2) {
+      spare_.push_back(std::move(chunks_.front().samples));
+    }
+    chunks_.pop_front();
+  }
+}
+
+std::optional<SampleCounter> CompressedHistoryStore::getOldestSampleCounter() {
+  std::lock_guard mtx(mtx_);
+  if (chunks_.empty()) {
+    return std::nullopt;
+  }
+  return chunks_.front().start;
+}
+
+size_t CompressedHistoryStore::getChunkSamples() const {
+  return chunkSamples_;
+}
+
+size_t CompressedHistoryStore::getMemoryUsageBytes() {
+  std::lock_guard mtx(mtx_);
+  size_t bytes{0};
+  for (auto const& chunk : chunks_) {
+    bytes += chunk.samples.capacity() * sizeof(uint16_t);
+  }
+  for (auto const& spare : spare_) {
+    bytes += spare.capacity() * sizeof(uint16_t);
+  }
+  return bytes;
+}
+
+MappedHistoryStore::MappedHistoryStore(size_t chunkSamples,
+                                       size_t capacitySamples,
+                                       const std::filesystem::path& directory)
+    : chunkSamples_(chunkSamples) {
+  // Whole chunks only, so a chunk is never split over the file end
+  capacitySamples_ =
+      ((std::max(capacitySamples, chunkSamples) + chunkSamples - 1) /
+       chunkSamples) *
+      chunkSamples;
+  std::error_code ec;
+  auto dir = directory.empty() ? std::filesystem::temp_directory_path(ec)
+                               : directory;
+  path_ = makeUniqueHistoryPath(dir);
+  const uint64_t bytes = static_cast<uint64_t>(capacitySamples_) * sizeof(float);
+
+#ifdef _WIN32
+  // Deleted by the OS once we close it, even if we crash
+  HANDLE file = CreateFileW(path_.c_str(), GENERIC_READ | GENERIC_WRITE, 0,
+                            nullptr, CREATE_NEW,
+                            FILE_ATTRIBUTE_TEMPORARY | FILE_FLAG_DELETE_ON_CLOSE,
+                            nullptr);
+  if (file == INVALID_HANDLE_VALUE) {
+    return;
+  }
+  fileHandle_ = file;
+  // Sparse, so only the history actually written takes up disk space
+  DWORD returned{0};
+  DeviceIoControl(file, FSCTL_SET_SPARSE, nullptr, 0, nullptr, 0, &returned,
+                  nullptr);
+  HANDLE mapping = CreateFileMappingW(file, nullptr, PAGE_READWRITE,
+                                      static_cast<DWORD>(bytes >> 32),
+                                      static_cast<DWORD>(bytes), nullptr);
+  if (mapping == nullptr) {
+    return;
+  }
+  mappingHandle_ = mapping;
+  mapping_ = static_cast<float*>(
+      MapViewOfFile(mapping, FILE_MAP_ALL_ACCESS, 0, 0, bytes));
+#else
+  fd_ = open(path_.c_str(), O_RDWR | O_CREAT | O_EXCL, 0600);
+  if (fd_ < 0) {
+    return;
+  }
+  // Unlink straight away - the mapping keeps it alive, and nothing is left
+  // behind if we crash
+  unlink(path_.c_str());
+  // Sparse, so only the history actually written takes up disk space
+  if (ftruncate(fd_, static_cast<off_t>(bytes)) != 0) {
+    return;
+  }
+  void* mapping =
+      mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd_, 0);
+  if (mapping == MAP_FAILED) {
+    return;
+  }
+  mapping_ = static_cast<float*>(mapping);
+  // Region reads are a few seconds at a time, so don't read ahead much more
+  // than asked for
+  madvise(mapping_, bytes, MADV_RANDOM);
+#endif
+}
+
+MappedHistoryStore::~MappedHistoryStore() {
+  const size_t bytes = capacitySamples_ * sizeof(float);
+#ifdef _WIN32
+  if (mapping_) {
+    UnmapViewOfFile(mapping_);
+  }
+  if (mappingHandle_) {
+    CloseHandle(static_cast<HANDLE>(mappingHandle_));
+  }
+  if (fileHandle_) {
+    CloseHandle(static_cast<HANDLE>(fileHandle_));
+  }
+#else
+  if (mapping_) {
+    munmap(mapping_, bytes);
+  }
+  if (fd_ >= 0) {
+    close(fd_);
+  }
+#endif
+}
+
+bool MappedHistoryStore::isValid() const {
+  return mapping_ != nullptr;
+}
+
+void MappedHistoryStore::append(SampleCounter start,
+                                std::span<const float> samples) {
+  if (!mapping_ || samples.empty()) {
+    return;
+  }
+  std::lock_guard mtx(mtx_);
+  if (!validFrom_.has_value() || start != validTo_) {
+    // First write, or a gap. Only contiguous history is held, so start over.
+    validFrom_ = start;
+    writtenBackTo_ = start;
+  }
+  auto pos = ringPosition(start);
+  auto firstRun = std::min(samples.size(), capacitySamples_ - pos);
+  std::memcpy(mapping_ + pos, samples.data(), firstRun * sizeof(float));
+  std::memcpy(mapping_, samples.data() + firstRun,
+              (samples.size() - firstRun) * sizeof(float));
+  validTo_ = start + static_cast<SampleCounter>(samples.size());
+  auto capacity = static_cast<SampleCounter>(capacitySamples_);
+  if (validTo_ - *validFrom_ > capacity) {
+    validFrom_ = validTo_ - capacity;  // Ring has wrapped
+  }
+}
+
+bool MappedHistoryStore::read(SampleCounter start, std::span<float> dst) {
+  std::lock_guard mtx(mtx_);
+  if (!mapping_ || !validFrom_.has_value()) {
+    std::fill(dst.begin(), dst.end(), 0.f);
+    return false;
+  }
+  auto end = start + static_cast<SampleCounter>(dst.size());
+  auto heldFrom = std::clamp(start, *validFrom_, end);
+  auto heldTo = std::clamp(validTo_, heldFrom, end);
+  auto before = static_cast<size_t>(heldFrom - start);
+  auto held = static_cast<size_t>(heldTo - heldFrom);
+  std::fill_n(dst.begin(), before, 0.f);
+  std::fill(dst.begin() + static_cast<std::ptrdiff_t>(before + held),
+            dst.end(), 0.f);
+  if (held > 0) {
+    adviseRange(heldFrom, held, WILL_NEED);
+    auto pos = ringPosition(heldFrom);
+    auto firstRun = std::min(held, capacitySamples_ - pos);
+    std::memcpy(dst.data() + before, mapping_ + pos, firstRun * sizeof(float));
+    std::memcpy(dst.data() + before + firstRun, mapping_,
+                (held - firstRun) * sizeof(float));
+  }
+  return held == dst.size();
+}
+
+void MappedHistoryStore::trimBefore(SampleCounter oldestToKeep) {
+  std::lock_guard mtx(mtx_);
+  if (validFrom_.has_value() && oldestToKeep > *validFrom_) {
+    validFrom_ = std::min(oldestToKeep, validTo_);
+    writtenBackTo_ = std::max(writtenBackTo_, *validFrom_);
+  }
+}
+
+std::optional<SampleCounter> MappedHistoryStore::getOldestSampleCounter() {
+  std::lock_guard mtx(mtx_);
+  return validFrom_;
+}
+
+std::optional<size_t> MappedHistoryStore::getCapacitySamples() {
+  return capacitySamples_;
+}
+
+size_t MappedHistoryStore::getChunkSamples() const {
+  return chunkSamples_;
+}
+
+size_t MappedHistoryStore::getMemoryUsageBytes() {
+  if (!mapping_) {
+    return 0;
+  }
+#ifdef _WIN32
+  // What hasn't been written back yet, which can't be dropped until it is
+  std::lock_guard mtx(mtx_);
+  return static_cast<size_t>(validTo_ - writtenBackTo_) * sizeof(float);
+#else
+  // The mapping's pages that are resident now
+  static const size_t pageSize = getPageSize();
+  const size_t pages =
+      (capacitySamples_ * sizeof(float) + pageSize - 1) / pageSize;
+#ifdef __APPLE__
+  std::vector<char> resident(pages);
+#else
+  std::vector<unsigned char> resident(pages);
+#endif
+  if (mincore(mapping_, pages * pageSize, resident.data()) != 0) {
+    return 0;
+  }
+  return static_cast<size_t>(std::count_if(
+             resident.begin(), resident.end(),
+             [](auto page) { return (page & 1) != 0; })) *
+         pageSize;
+#endif
+}
+
+void MappedHistoryStore::writeBack() {
+  SampleCounter from;
+  SampleCounter to;
+  {
+    std::lock_guard mtx(mtx_);
+    if (!mapping_ || !validFrom_.has_value() || writtenBackTo_ >= validTo_) {
+      return;
+    }
+    from = writtenBackTo_;
+    to = validTo_;
+    writtenBackTo_ = validTo_;
+  }
+  // Start writing it out, then let the OS know we're unlikely to touch it
+  // again soon (newer audio is still in the hot tier)
+  adviseRange(from, static_cast<size_t>(to - from), WRITE_BACK);
+  adviseRange(from, static_cast<size_t>(to - from), COLD);
+}
+
+size_t MappedHistoryStore::ringPosition(SampleCounter sc) const {
+  auto capacity = static_cast<SampleCounter>(capacitySamples_);
+  return static_cast<size_t>(((sc % capacity) + capacity) % capacity);
+}
+
+void MappedHistoryStore::adviseRange(SampleCounter start,
+                                     size_t count,
+                                     Advice advice) {
+  static const size_t pageSize = getPageSize();
+  count = std::min(count, capacitySamples_);
+  auto pos = ringPosition(start);
+  auto firstRun = std::min(count, capacitySamples_ - pos);
+  std::pair<size_t, size_t> runs[] = {{pos, firstRun}, {0, count - firstRun}};
+  for (auto [runPos, runCount] : runs) {
+    if (runCount == 0) {
+      continue;
+    }
+    // Page align (down) the start of the range
+    auto begin = reinterpret_cast<uintptr_t>(mapping_ + runPos);
+    auto alignedBegin = begin - (begin % pageSize);
+    auto length = (begin - alignedBegin) + runCount * sizeof(float);
+    void* addr = reinterpret_cast<void*>(alignedBegin);
+#ifdef _WIN32
+    if (advice == WRITE_BACK) {
+      FlushViewOfFile(addr, length);
+    } else if (advice == WILL_NEED) {
+      WIN32_MEMORY_RANGE_ENTRY entry{addr, length};
+      PrefetchVirtualMemory(GetCurrentProcess(), 1, &entry, 0);
+    }
+#else
+    if (advice == WRITE_BACK) {
+      msync(addr, length, MS_ASYNC);
+    } else if (advice == WILL_NEED) {
+      madvise(addr, length, MADV_WILLNEED);
+    } else if (advice == COLD) {
+#ifdef MADV_COLD
+      madvise(addr, length, MADV_COLD);
+#else
+      // Shared file mapping, so dirty pages are still written back
+      madvise(addr, length, MADV_DONTNEED);
+#endif
+    }
+#endif
+  }
+}
+
+}  // namespace audio_plugin
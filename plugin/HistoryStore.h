@@ -0,0 +1,114 @@
+#pragma once
+
+#include <cstdint>
+#include <deque>
+#include <filesystem>
+#include <mutex>
+#include <optional>
+#include <span>
+#include <vector>
+#include "Types.h"
+
+namespace audio_plugin {
+
+// Converts between float32 and IEEE 754 half precision (round to nearest even)
+uint16_t floatToHalf(float value);
+float halfToFloat(uint16_t value);
+
+// Cold tier for the audio history.
+//
+// Audio is appended in fixed size chunks by the encoder thread (never the
+// audio thread) and looked up by the sample counter of the first sample
+// wanted, so it can be read by TimePoint.
+class HistoryStore {
+public:
+  virtual ~HistoryStore() = default;
+
+  virtual void append(SampleCounter start, std::span<const float> samples) = 0;
+  // Any samples not held are zero-filled, in which case false is returned
+  virtual bool read(SampleCounter start, std::span<float> dst) = 0;
+  virtual void trimBefore(SampleCounter oldestToKeep) = 0;
+  virtual std::optional<SampleCounter> getOldestSampleCounter() = 0;
+  // Most samples that can ever be held, or nullopt if only limited by memory
+  virtual std::optional<size_t> getCapacitySamples() { return std::nullopt; }
+  virtual size_t getChunkSamples() const = 0;
+  virtual size_t getMemoryUsageBytes() = 0;
+  // Called periodically from the encoder thread for any background upkeep
+  virtual void writeBack() {}
+};
+
+// Default in-memory cold tier. Stored as float16, halving the memory needed
+// compared to the float32 ring.
+class CompressedHistoryStore : public HistoryStore {
+public:
+  explicit CompressedHistoryStore(size_t chunkSamples);
+
+  void append(SampleCounter start, std::span<const float> samples) override;
+  bool read(SampleCounter start, std::span<float> dst) override;
+  void trimBefore(SampleCounter oldestToKeep) override;
+  std::optional<SampleCounter> getOldestSampleCounter() override;
+  size_t getChunkSamples() const override;
+  size_t getMemoryUsageBytes() override;
+
+private:
+  struct Chunk {
+    SampleCounter start;
+    std::vector<uint16_t> samples;
+  };
+
+  const size_t chunkSamples_;
+  std::mutex mtx_;
+  std::deque<Chunk> chunks_;
+  std::vector<std::vector<uint16_t>> spare_;  // Recycled to avoid alloc churn
+};
+
+// Disk-backed cold tier for long-form monitoring.
+//
+// Samples are kept as float32 in a per-instance file which is memory mapped
+// as a ring, so reads can be served as views straight in to the mapping.
+// The file is sparse, removed when the store is destroyed, and written back
+// from the encoder thread with page hints so history that is unlikely to be
+// read again doesn't hang around in our resident set.
+class MappedHistoryStore : public HistoryStore {
+public:
+  MappedHistoryStore(size_t chunkSamples,
+                     size_t capacitySamples,
+                     const std::filesystem::path& directory);
+  ~MappedHistoryStore() override;
+
+  bool isValid() const;
+
+  void append(SampleCounter start, std::span<const float> samples) override;
+  bool read(SampleCounter start, std::span<float> dst) override;
+  void trimBefore(SampleCounter oldestToKeep) override;
+  std::optional<SampleCounter> getOldestSampleCounter() override;
+  std::optional<size_t> getCapacitySamples() override;
+  size_t getChunkSamples() const override;
+  size_t getMemoryUsageBytes() override;
+  void writeBack() override;
+
+private:
+  enum Advice { WILL_NEED, WRITE_BACK, COLD };
+
+  size_t ringPosition(SampleCounter sc) const;
+  void adviseRange(SampleCounter start, size_t count, Advice advice);
+
+  const size_t chunkSamples_;
+  size_t capacitySamples_;
+  std::filesystem::path path_;
+  float* mapping_{nullptr};
+#ifdef _WIN32
+  void* fileHandle_{nullptr};
+  void* mappingHandle_{nullptr};
+#else
+  int fd_{-1};
+#endif
+
+  std::mutex mtx_;
+  // Held samples are always contiguous: [validFrom_, validTo_)
+  std::optional<SampleCounter> validFrom_;
+  SampleCounter validTo_{0};
+  SampleCounter writtenBackTo_{0};
+};
+
+}  // namespace audio_plugin
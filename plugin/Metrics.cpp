@@ -0,0 +1,232 @@
+#include "Metrics.h"
+#include <algorithm>
+#include <cassert>
+#include <iostream>
+#include <sstream>
+
+namespace {
+
+// "name{labels}" or "name{labels,extra}"
+std::string series(const std::string& name,
+                   const std::string& labels,
+                   const std::string& extra = {}) {
+  if (labels.empty() && extra.empty()) {
+    return name;
+  }
+  std::string joined = labels;
+  if (!labels.empty() && !extra.empty()) {
+    joined += ",";
+  }
+  return name + "{" + joined + extra + "}";
+}
+
+}  // namespace
+
+namespace audio_plugin {
+
+Histogram::Histogram(std::vector<double> bounds)
+    : bounds_(std::move(bounds)),
+      counts_(std::make_unique<std::atomic<uint64_t>[]>(bounds_.size() + 1)) {
+  assert(std::is_sorted(bounds_.begin(), bounds_.end()));
+}
+
+void Histogram::observe(double value) {
+  auto bucket = static_cast<size_t>(
+      std::lower_bound(bounds_.begin(), bounds_.end(), value) -
+      bounds_.begin());
+  counts_[bucket].fetch_add(1, std::memory_order_relaxed);
+  auto sum = sum_.load(std::memory_order_relaxed);
+  while (!sum_.compare_exchange_weak(sum, sum + value,
+                                     std::memory_order_relaxed)) {
+  }
+}
+
+Histogram::Snapshot Histogram::getSnapshot() const {
+  Snapshot snapshot;
+  uint64_t cumulative{0};
+  for (size_t i = 0; i <= bounds_.size(); i++) {
+    cumulative += counts_[i].load(std::memory_order_relaxed);
+    snapshot.cumulativeCounts.push_back(cumulative);
+  }
+  snapshot.sum = sum_.load(std::memory_order_relaxed);
+  return snapshot;
+}
+
+// Renders the registry every interval, off any thread that matters
+class MetricsRegistry::Exporter : public juce::Thread {
+public:
+  Exporter(MetricsRegistry& registry,
+           const juce::File& file,
+           const juce::String& pubEndpoint,
+           int intervalMs)
+      : juce::Thread("Metrics Exporter"),
+        registry_(registry),
+        file_(file),
+        pubEndpoint_(pubEndpoint.toStdString()),
+        intervalMs_(std::max(100, intervalMs)) {
+    startThread(juce::Thread::Priority::background);
+  }
+
+  ~Exporter() override {
+    signalThreadShouldExit();
+    notify();
+    stopThread(2000);
+  }
+
+  void run() override {
+    zmq::context_t context{1};
+    zmq::socket_t publisher{context, ZMQ_PUB};
+    publisher.set(zmq::sockopt::linger, 0);
+    bool publishing{false};
+    if (!pubEndpoint_.empty()) {
+      try {
+        publisher.bind(pubEndpoint_);
+        publishing = true;
+      } catch (const zmq::error_t& e) {
+        std::cerr << "Unable to publish metrics on " << pubEndpoint_ << ": "
+                  << e.what() << std::endl;
+      }
+    }
+
+    while (!threadShouldExit()) {
+      auto text = registry_.toPrometheusText();
+      if (file_ != juce::File()) {
+        // Written to a temporary file and moved in to place, so scrapers
+        // never see half a file
+        file_.replaceWithText(text);
+      }
+      if (publishing) {
+        publisher.send(zmq::buffer(std::string("metrics")),
+                       zmq::send_flags::sndmore | zmq::send_flags::dontwait);
+        publisher.send(zmq::buffer(text), zmq::send_flags::dontwait);
+      }
+      wait(intervalMs_);
+    }
+  }
+
+private:
+  MetricsRegistry& registry_;
+  const juce::File file_;
+  const std::string pubEndpoint_;
+  const int intervalMs_;
+};
+
+MetricsRegistry::MetricsRegistry() {
+  auto file = juce::SystemStats::getEnvironmentVariable("WHISPER_METRICS_FILE",
+                                                        {});
+  auto pubEndpoint =
+      juce::SystemStats::getEnvironmentVariable("WHISPER_METRICS_PUB", {});
+  auto intervalMs = juce::SystemStats::getEnvironmentVariable(
+                        "WHISPER_METRICS_INTERVAL_MS", "5000")
+                        .getIntValue();
+  if (file.isNotEmpty() || pubEndpoint.isNotEmpty()) {
+    exporter_ = std::make_unique<Exporter>(
+        *this, file.isNotEmpty() ? juce::File(file) : juce::File(),
+        pubEndpoint, intervalMs);
+  }
+}
+
+MetricsRegistry::~MetricsRegistry() {
+  exporter_.reset();
+}
+
+std::shared_ptr<Counter> MetricsRegistry::counter(const std::string& name,
+                                                  const std::string& help,
+                                                  const std::string& labels) {
+  auto metric = std::make_shared<Counter>();
+  add(name, help, labels, COUNTER, metric);
+  return metric;
+}
+
+std::shared_ptr<Gauge> MetricsRegistry::gauge(const std::string& name,
+                                              const std::string& help,
+                                              const std::string& labels) {
+  auto metric = std::make_shared<Gauge>();
+  add(name, help, labels, GAUGE, metric);
+  return metric;
+}
+
+std::shared_ptr<Histogram> MetricsRegistry::histogram(
+    const std::string& name,
+    const std::string& help,
+    std::vector<double> bounds,
+    const std::string& labels) {
+  auto metric = std::make_shared<Histogram>(std::move(bounds));
+  add(name, help, labels, HISTOGRAM, metric);
+  return metric;
+}
+
+void MetricsRegistry::add(const std::string& name,
+                          const std::string& help,
+                          const std::string& labels,
+                          Type type,
+                          std::shared_ptr<void> metric) {
+  std::lock_guard lock(mtx_);
+  std::erase_if(entries_, [](const Entry& entry) {
+    return entry.metric.expired();
+  });
+  entries_.push_back(Entry{name, help, labels, type, metric});
+}
+
+std::string MetricsRegistry::toPrometheusText() {
+  // Hold on to everything for the duration, so nothing disappears mid-render
+  std::vector<std::pair<Entry, std::shared_ptr<void>>> live;
+  {
+    std::lock_guard lock(mtx_);
+    for (const auto& entry : entries_) {
+      if (auto metric = entry.metric.lock()) {
+        live.emplace_back(entry, std::move(metric));
+      }
+    }
+  }
+  // Series of the same metric have to be together
+  std::stable_sort(live.begin(), live.end(), [](const auto& a, const auto& b) {
+    return a.first.name < b.first.name;
+  });
+
+  std::ostringstream out;
+  const std::string* previousName{nullptr};
+  for (const auto& [entry, metric] : live) {
+    if (!previousName || *previousName != entry.name) {
+      static const char* typeNames[] = {"counter", "gauge", "histogram"};
+      out << "# HELP " << entry.name << " " << entry.help << "\n"
+          << "# TYPE " << entry.name << " " << typeNames[entry.type] << "\n";
+      previousName = &entry.name;
+    }
+    switch (entry.type) {
+      case COUNTER:
+        out << series(entry.name, entry.labels) << " "
+            << static_cast<Counter*>(metric.get())->get() << "\n";
+        break;
+      case GAUGE:
+        out << series(entry.name, entry.labels) << " "
+            << static_cast<Gauge*>(metric.get())->get() << "\n";
+        break;
+      case HISTOGRAM: {
+        auto histogram = static_cast<Histogram*>(metric.get());
+        auto snapshot = histogram->getSnapshot();
+        const auto& bounds = histogram->getBounds();
+        for (size_t i = 0; i < snapshot.cumulativeCounts.size(); i++) {
+          std::ostringstream le;
+          le << "le=\"";
+          if (i < bounds.size()) {
+            le << bounds[i];
+          } else {
+            le << "+Inf";
+          }
+          le << "\"";
+          out << series(entry.name + "_bucket", entry.labels, le.str()) << " "
+              << snapshot.cumulativeCounts[i] << "\n";
+        }
+        out << series(entry.name + "_sum", entry.labels) << " " << snapshot.sum
+            << "\n"
+            << series(entry.name + "_count", entry.labels) << " "
+            << snapshot.cumulativeCounts.back() << "\n";
+        break;
+      }
+    }
+  }
+  return out.str();
+}
+
+}  // namespace audio_plugin
@@ -0,0 +1,111 @@
+#pragma once
+
+#include <juce_core/juce_core.h>
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+#include <zmq.hpp>
+
+namespace audio_plugin {
+
+// Fleet-level visibility of what the plugin is doing with the service.
+//
+// Metrics are plain atomics, so they can be updated from anywhere without
+// blocking. Each process has one registry (shared by all plugin instances),
+// which is rendered in the Prometheus text format by a background exporter
+// configured through environment variables:
+//
+//   WHISPER_METRICS_FILE         Rewrite this file (e.g. for node_exporter's
+//                                textfile collector)
+//   WHISPER_METRICS_PUB          Publish on this ZMQ PUB endpoint instead
+//                                (e.g. tcp://127.0.0.1:9101)
+//   WHISPER_METRICS_INTERVAL_MS  How often, defaulting to 5000
+//
+// Nothing is exported unless one of the first two is set.
+
+class Counter {
+public:
+  void inc(uint64_t n = 1) { value_.fetch_add(n, std::memory_order_relaxed); }
+  uint64_t get() const { return value_.load(std::memory_order_relaxed); }
+
+private:
+  std::atomic<uint64_t> value_{0};
+};
+
+class Gauge {
+public:
+  void set(double value) { value_.store(value, std::memory_order_relaxed); }
+  double get() const { return value_.load(std::memory_order_relaxed); }
+
+private:
+  std::atomic<double> value_{0.0};
+};
+
+class Histogram {
+public:
+  // Upper bounds of each bucket, ascending. +Inf is implied.
+  explicit Histogram(std::vector<double> bounds);
+  void observe(double value);
+
+  struct Snapshot {
+    std::vector<uint64_t> cumulativeCounts;  // Per bound, then +Inf
+    double sum{0.0};
+  };
+  const std::vector<double>& getBounds() const { return bounds_; }
+  Snapshot getSnapshot() const;
+
+private:
+  const std::vector<double> bounds_;
+  std::unique_ptr<std::atomic<uint64_t>[]> counts_;  // Per bound, then +Inf
+  std::atomic<double> sum_{0.0};
+};
+
+class MetricsRegistry {
+public:
+  MetricsRegistry();
+  ~MetricsRegistry();
+
+  // Metrics are only exported while something holds on to them, so drop
+  // them to remove an instance's series. labels is rendered as is, e.g.
+  // client="abc",state="pending"
+  std::shared_ptr<Counter> counter(const std::string& name,
+                                   const std::string& help,
+                                   const std::string& labels = {});
+  std::shared_ptr<Gauge> gauge(const std::string& name,
+                               const std::string& help,
+                               const std::string& labels = {});
+  std::shared_ptr<Histogram> histogram(const std::string& name,
+                                       const std::string& help,
+                                       std::vector<double> bounds,
+                                       const std::string& labels = {});
+
+  std::string toPrometheusText();
+
+private:
+  class Exporter;
+
+  enum Type { COUNTER, GAUGE, HISTOGRAM };
+  struct Entry {
+    std::string name;
+    std::string help;
+    std::string labels;
+    Type type;
+    std::weak_ptr<void> metric;
+  };
+  void add(const std::string& name,
+           const std::string& help,
+           const std::string& labels,
+           Type type,
+           std::shared_ptr<void> metric);
+
+  std::mutex mtx_;
+  std::vector<Entry> entries_;
+  std::unique_ptr<Exporter> exporter_;
+};
+
+// Shared by everything in the process
+using SharedMetricsRegistry = juce::SharedResourcePointer<MetricsRegistry>;
+
+}  // namespace audio_plugin
@@ -2,11 +2,12 @@
 #include "PluginProcessor.h"
 
 const int comboIdOffset = 1; // Used to ensure no entry has ID 0
+const int retentionOptionsMins[] = {5, 10, 20, 60, 120, 240, 480};
 
 namespace audio_plugin {
 AudioPluginAudioProcessorEditor::AudioPluginAudioProcessorEditor(
     AudioPluginAudioProcessor &p)
-    : AudioProcessorEditor(&p), processorRef_(p), graph_(p), table_(p) {
+    : AudioProcessorEditor(&p), processorRef_(p), graph_(p), table_(p), stats_(p) {
   // Make sure that before the constructor has finished, you've set the
   // editor's size to whatever you need it to be.
   setResizable(true, true); 
@@ -16,12 +17,21 @@ AudioPluginAudioProcessorEditor::AudioPluginAudioProcessorEditor(
 
   addChildComponent(graph_);
   addChildComponent(table_);
+  addChildComponent(stats_);
 
   uiToggle_.setToggleable(true);
   uiToggle_.setClickingTogglesState(true);
   uiToggle_.setToggleState(false, juce::NotificationType::dontSendNotification);
   uiToggle_.addListener(this);
   addAndMakeVisible(uiToggle_);
+
+  statsToggle_.setButtonText("Stats");
+  statsToggle_.setToggleable(true);
+  statsToggle_.setClickingTogglesState(true);
+  statsToggle_.setToggleState(false,
+                              juce::NotificationType::dontSendNotification);
+  statsToggle_.addListener(this);
+  addAndMakeVisible(statsToggle_);
   updateAccordingToUiToggle();
 
   sampleRateHeading_.setEditable(false);
@@ -103,11 +113,57 @@ AudioPluginAudioProcessorEditor::AudioPluginAudioProcessorEditor(
   regionFreq_.addListener(this);
   addChildComponent(regionFreq_);
   if (regions) {
-    regionFreq_.setValue(regions->getRegionFreqMs(),
-                         juce::NotificationType::dontSendNotification);
     regionFreq_.setVisible(true);
   }
 
+  regionFreqAuto_.setButtonText("Auto");
+  regionFreqAuto_.setTooltip(
+      "Keep the frequency as fine as the service keeps up with, between the "
+      "two values");
+  regionFreqAuto_.addListener(this);
+  addChildComponent(regionFreqAuto_);
+  if (regions) {
+    regionFreqAuto_.setToggleState(regions->isAutoFrequency(),
+                                   juce::NotificationType::dontSendNotification);
+    regionFreqAuto_.setVisible(true);
+    updateRegionFreqSlider();
+  }
+
+  regionHopHeading_.setEditable(false);
+  regionHopHeading_.setText("Region Hop:",
+                            juce::NotificationType::dontSendNotification);
+  addChildComponent(regionHopHeading_);
+
+  regionHop_.setEditable(false);
+  addChildComponent(regionHop_);
+  if (regions) {
+    regionHopHeading_.setVisible(true);
+    regionHop_.setVisible(true);
+    updateRegionHopText();
+  }
+
+  regionDensityHeading_.setEditable(false);
+  regionDensityHeading_.setText("Region Density:",
+                                juce::NotificationType::dontSendNotification);
+  addChildComponent(regionDensityHeading_);
+
+  regionDensity_.setButtonText("Adaptive");
+  regionDensity_.setTooltip(
+      "Add regions between neighbours whose results or level differ");
+  regionDensity_.addListener(this);
+  addChildComponent(regionDensity_);
+
+  regionDensityInfill_.setEditable(false);
+  addChildComponent(regionDensityInfill_);
+  if (regions) {
+    regionDensityHeading_.setVisible(true);
+    regionDensity_.setToggleState(regions->getDensityConfig().adaptive,
+                                  juce::NotificationType::dontSendNotification);
+    regionDensity_.setVisible(true);
+    regionDensityInfill_.setVisible(true);
+    updateRegionDensityText();
+  }
+
   alignmentHeading_.setEditable(false);
   alignmentHeading_.setText("Region Alignment:",
                              juce::NotificationType::dontSendNotification);
@@ -126,6 +182,89 @@ AudioPluginAudioProcessorEditor::AudioPluginAudioProcessorEditor(
     alignment_.setVisible(true);
   }
 
+  schedulingHeading_.setEditable(false);
+  schedulingHeading_.setText("Scheduling:",
+                             juce::NotificationType::dontSendNotification);
+  addChildComponent(schedulingHeading_);
+
+  // Programme order is only for offline renders, which choose it themselves
+  for (auto policy :
+       {RegionScheduler::LATEST_FIRST, RegionScheduler::PLAYHEAD_ALIGNED_FIRST,
+        RegionScheduler::GAP_FILLING, RegionScheduler::WEIGHTED_AGING}) {
+    auto name = juce::String(RegionScheduler::getPolicyName(policy));
+    scheduling_.addItem(name.substring(0, 1).toUpperCase() + name.substring(1),
+                        policy + comboIdOffset);
+  }
+  scheduling_.addListener(this);
+  addChildComponent(scheduling_);
+  if (regions) {
+    schedulingHeading_.setVisible(true);
+    scheduling_.setSelectedId(regions->getSchedulingPolicy() + comboIdOffset,
+                              juce::NotificationType::dontSendNotification);
+    scheduling_.setVisible(true);
+  }
+
+  historyRetentionHeading_.setEditable(false);
+  historyRetentionHeading_.setText("History Retention:",
+                                   juce::NotificationType::dontSendNotification);
+  addAndMakeVisible(historyRetentionHeading_);
+
+  for (auto mins : retentionOptionsMins) {
+    historyRetention_.addItem(juce::String(mins) + " mins", mins);
+  }
+  historyRetention_.setSelectedId(
+      static_cast<int>(p.getHistoryRetentionMs() / 60000),
+      juce::NotificationType::dontSendNotification);
+  historyRetention_.addListener(this);
+  addAndMakeVisible(historyRetention_);
+
+  historyStorageHeading_.setEditable(false);
+  historyStorageHeading_.setText("History Storage:",
+                                 juce::NotificationType::dontSendNotification);
+  addAndMakeVisible(historyStorageHeading_);
+
+  historyStorage_.addItem("Memory", HistoryConfig::MEMORY + comboIdOffset);
+  historyStorage_.addItem("Disk (memory mapped)",
+                          HistoryConfig::DISK + comboIdOffset);
+  historyStorage_.setSelectedId(p.getHistoryStorage() + comboIdOffset,
+                                juce::NotificationType::dontSendNotification);
+  historyStorage_.setTooltip(
+      "Applies (clearing history) when audio processing is next restarted");
+  historyStorage_.addListener(this);
+  addAndMakeVisible(historyStorage_);
+
+  streamsHeading_.setEditable(false);
+  streamsHeading_.setText("Streams:",
+                          juce::NotificationType::dontSendNotification);
+  addAndMakeVisible(streamsHeading_);
+
+  streams_.setTextToShowWhenEmpty("All channels, e.g. Dialogue: 3; Music: 1, 2",
+                                  juce::Colours::grey);
+  streams_.setText(formatStreamConfigs(p.getStreams()), false);
+  streams_.setTooltip(
+      "Channel groups analysed separately. Applies (clearing history) when "
+      "audio processing is next restarted");
+  streams_.addListener(this);
+  addAndMakeVisible(streams_);
+
+  historyMemoryHeading_.setEditable(false);
+  historyMemoryHeading_.setText("History Memory:",
+                                juce::NotificationType::dontSendNotification);
+  addAndMakeVisible(historyMemoryHeading_);
+
+  historyMemory_.setEditable(false);
+  updateHistoryMemoryText();
+  addAndMakeVisible(historyMemory_);
+
+  offlineProgressHeading_.setEditable(false);
+  offlineProgressHeading_.setText("Offline Render:",
+                                  juce::NotificationType::dontSendNotification);
+  addAndMakeVisible(offlineProgressHeading_);
+
+  offlineProgress_.setEditable(false);
+  updateOfflineProgressText();
+  addAndMakeVisible(offlineProgress_);
+
   serviceAddressHeading_.setEditable(false);
   serviceAddressHeading_.setText("Service Address/Port:",
                              juce::NotificationType::dontSendNotification);
@@ -147,6 +286,10 @@ AudioPluginAudioProcessorEditor::AudioPluginAudioProcessorEditor(
   serviceAddressCancel_.addListener(this);
   addChildComponent(serviceAddressCancel_);
 
+  connectionState_.setEditable(false);
+  updateConnectionStateText();
+  addAndMakeVisible(connectionState_);
+
   auto errorStrings = processorRef_.getCommunicator()->getConnectionErrors();
   if (!errorStrings.isEmpty()) {
     showConnectionErrors(errorStrings);
@@ -169,6 +312,8 @@ void AudioPluginAudioProcessorEditor::resized() {
 
   auto header = area.removeFromTop(45).reduced(50, 10);
   uiToggle_.setBounds(header.removeFromRight(100));
+  header.removeFromRight(10);
+  statsToggle_.setBounds(header.removeFromRight(75));
 
   serviceAddressHeading_.setBounds(header.removeFromLeft(150));
   header.removeFromLeft(10);
@@ -177,8 +322,10 @@ void AudioPluginAudioProcessorEditor::resized() {
   serviceAddressSet_.setBounds(header.removeFromLeft(75));
   header.removeFromLeft(10);
   serviceAddressCancel_.setBounds(header.removeFromLeft(75));
+  header.removeFromLeft(10);
+  connectionState_.setBounds(header.removeFromLeft(100));
 
-  auto btmArea = area.removeFromBottom(100).reduced(50, 10);
+  auto btmArea = area.removeFromBottom(220).reduced(50, 10);
   auto btmLeft = btmArea.removeFromLeft(400);
   auto btmRight = btmArea;
 
@@ -205,6 +352,26 @@ void AudioPluginAudioProcessorEditor::resized() {
       playheadPositionArea.removeFromLeft(headingWidth));
   playheadPosition_.setBounds(playheadPositionArea);
 
+  auto historyMemoryArea = btmLeft.removeFromTop(rowHeight);
+  historyMemoryHeading_.setBounds(
+      historyMemoryArea.removeFromLeft(headingWidth));
+  historyMemory_.setBounds(historyMemoryArea);
+
+  auto offlineProgressArea = btmLeft.removeFromTop(rowHeight);
+  offlineProgressHeading_.setBounds(
+      offlineProgressArea.removeFromLeft(headingWidth));
+  offlineProgress_.setBounds(offlineProgressArea);
+
+  auto regionHopArea = btmLeft.removeFromTop(rowHeight);
+  regionHopHeading_.setBounds(regionHopArea.removeFromLeft(headingWidth));
+  regionHop_.setBounds(regionHopArea);
+
+  auto regionDensityArea = btmLeft.removeFromTop(rowHeight);
+  regionDensityHeading_.setBounds(
+      regionDensityArea.removeFromLeft(headingWidth));
+  regionDensity_.setBounds(regionDensityArea.removeFromLeft(90));
+  regionDensityInfill_.setBounds(regionDensityArea);
+
   auto pendingRegionsArea = btmRight.removeFromTop(rowHeight);
   regionsQueuedHeading_.setBounds(
       pendingRegionsArea.removeFromLeft(headingWidth));
@@ -218,15 +385,35 @@ void AudioPluginAudioProcessorEditor::resized() {
 
   auto regionFreqArea = btmRight.removeFromTop(sliderRowHeight);
   regionFreqHeading_.setBounds(regionFreqArea.removeFromLeft(headingWidth));
+  regionFreqAuto_.setBounds(regionFreqArea.removeFromRight(60));
   regionFreq_.setBounds(regionFreqArea);
 
   auto alignmentArea = btmRight.removeFromTop(sliderRowHeight);
   alignmentHeading_.setBounds(alignmentArea.removeFromLeft(headingWidth));
   alignment_.setBounds(alignmentArea);
 
+  auto schedulingArea = btmRight.removeFromTop(sliderRowHeight);
+  schedulingHeading_.setBounds(schedulingArea.removeFromLeft(headingWidth));
+  scheduling_.setBounds(schedulingArea);
+
+  auto historyRetentionArea = btmRight.removeFromTop(sliderRowHeight);
+  historyRetentionHeading_.setBounds(
+      historyRetentionArea.removeFromLeft(headingWidth));
+  historyRetention_.setBounds(historyRetentionArea);
+
+  auto historyStorageArea = btmRight.removeFromTop(sliderRowHeight);
+  historyStorageHeading_.setBounds(
+      historyStorageArea.removeFromLeft(headingWidth));
+  historyStorage_.setBounds(historyStorageArea);
+
+  auto streamsArea = btmRight.removeFromTop(sliderRowHeight).reduced(0, 3);
+  streamsHeading_.setBounds(streamsArea.removeFromLeft(headingWidth));
+  streams_.setBounds(streamsArea);
+
   auto mainArea = area.reduced(20, 5);
   table_.setBounds(mainArea);
   graph_.setBounds(mainArea);
+  stats_.setBounds(mainArea);
 }
 
 void AudioPluginAudioProcessorEditor::updateSampleRate(SampleRate sampleRate) {
@@ -247,15 +434,35 @@ void AudioPluginAudioProcessorEditor::timerCallback() {
                          juce::NotificationType::dontSendNotification);
   auto regions = processorRef_.getAnalysisRegions();
   updatePendingRegionsText();
+  updateConnectionStateText();
+  updateRegionHopText();
+  updateRegionDensityText();
+  updateHistoryMemoryText();
+  updateOfflineProgressText();
 }
 
 void AudioPluginAudioProcessorEditor::buttonClicked(juce::Button* button) {
-  if (button == &uiToggle_) {
+  if (button == &uiToggle_ || button == &statsToggle_) {
     updateAccordingToUiToggle();
   } else if (button == &serviceAddressSet_) {
     serviceAddressSetAction();
   } else if (button == &serviceAddressCancel_) {
     serviceAddressCancelAction();
+  } else if (button == &regionFreqAuto_) {
+    if (auto regions = processorRef_.getAnalysisRegions()) {
+      auto status = regions->getFrequencyStatus();
+      regions->setAutoFrequency(regionFreqAuto_.getToggleState(),
+                                status.minMs, status.maxMs);
+      updateRegionFreqSlider();
+      updateRegionHopText();
+    }
+  } else if (button == &regionDensity_) {
+    if (auto regions = processorRef_.getAnalysisRegions()) {
+      auto density = regions->getDensityConfig();
+      density.adaptive = regionDensity_.getToggleState();
+      regions->setDensityConfig(density);
+      updateRegionDensityText();
+    }
   }
 }
 
@@ -263,6 +470,15 @@ void AudioPluginAudioProcessorEditor::sliderValueChanged(juce::Slider* slider) {
   auto regions = processorRef_.getAnalysisRegions();
   assert(regions);
   if (regions) {
+    if (slider == &regionFreq_ && regionFreqAuto_.getToggleState()) {
+      // Just the bounds - the frequency moves within them as it goes, without
+      // disturbing regions in progress
+      regions->setAutoFrequency(
+          true, static_cast<uint32_t>(regionFreq_.getMinValue()),
+          static_cast<uint32_t>(regionFreq_.getMaxValue()));
+      updateRegionHopText();
+      return;
+    }
     regions->generateRegions(false);
     if (slider == &regionFreq_) {
       regions->setRegionFreqMs(static_cast<uint32_t>(regionFreq_.getValue()));
@@ -276,17 +492,33 @@ void AudioPluginAudioProcessorEditor::sliderValueChanged(juce::Slider* slider) {
 
 void AudioPluginAudioProcessorEditor::textEditorTextChanged(
     juce::TextEditor& textEditor) {
+  if (&textEditor == &streams_) {
+    return;
+  }
   serviceAddressSet_.setVisible(true);
   serviceAddressCancel_.setVisible(true);
 }
 
 void AudioPluginAudioProcessorEditor::textEditorReturnKeyPressed(
     juce::TextEditor& textEditor) {
+  if (&textEditor == &streams_) {
+    // Shown as understood, so anything ignored disappears
+    auto streams = parseStreamConfigs(streams_.getText().toStdString());
+    processorRef_.setStreams(streams);
+    streams_.setText(formatStreamConfigs(streams), false);
+    streams_.unfocusAllComponents();
+    return;
+  }
   serviceAddressSetAction();
 }
 
 void AudioPluginAudioProcessorEditor::textEditorEscapeKeyPressed(
     juce::TextEditor& textEditor) {
+  if (&textEditor == &streams_) {
+    streams_.setText(formatStreamConfigs(processorRef_.getStreams()), false);
+    streams_.unfocusAllComponents();
+    return;
+  }
   serviceAddressCancelAction();
 }
 
@@ -302,6 +534,17 @@ void AudioPluginAudioProcessorEditor::comboBoxChanged(
       regions->abortInProgress();
       regions->generateRegions(true);
     }
+  } else if (comboBoxThatHasChanged == &scheduling_) {
+    if (auto regions = processorRef_.getAnalysisRegions()) {
+      regions->setSchedulingPolicy(static_cast<RegionScheduler::Policy>(
+          scheduling_.getSelectedId() - comboIdOffset));
+    }
+  } else if (comboBoxThatHasChanged == &historyRetention_) {
+    auto mins = static_cast<uint32_t>(historyRetention_.getSelectedId());
+    processorRef_.setHistoryRetentionMs(mins * 60000);
+  } else if (comboBoxThatHasChanged == &historyStorage_) {
+    processorRef_.setHistoryStorage(static_cast<HistoryConfig::Storage>(
+        historyStorage_.getSelectedId() - comboIdOffset));
   }
 }
 
@@ -339,11 +582,62 @@ void AudioPluginAudioProcessorEditor::showConnectionErrors(
   messageBox_ = juce::AlertWindow::showScopedAsync(options, nullptr);
 }
 
+void AudioPluginAudioProcessorEditor::updateRegionFreqSlider() {
+  auto regions = processorRef_.getAnalysisRegions();
+  if (!regions) {
+    return;
+  }
+  auto status = regions->getFrequencyStatus();
+  if (status.automatic) {
+    regionFreq_.setSliderStyle(juce::Slider::TwoValueHorizontal);
+    regionFreq_.setMinAndMaxValues(
+        status.minMs, status.maxMs,
+        juce::NotificationType::dontSendNotification);
+    regionFreq_.setTextBoxStyle(juce::Slider::NoTextBox, true, 0, 0);
+  } else {
+    regionFreq_.setSliderStyle(juce::Slider::LinearHorizontal);
+    regionFreq_.setTextBoxStyle(juce::Slider::TextBoxLeft, false, 80, 20);
+    regionFreq_.setValue(status.frequencyMs,
+                         juce::NotificationType::dontSendNotification);
+  }
+}
+
+void AudioPluginAudioProcessorEditor::updateRegionHopText() {
+  auto regions = processorRef_.getAnalysisRegions();
+  if (!regions) {
+    return;
+  }
+  auto status = regions->getFrequencyStatus();
+  juce::String text;
+  text << juce::String(status.frequencyMs / 1000.0, 2) << " s";
+  if (status.automatic) {
+    text << " (auto " << juce::String(status.minMs / 1000.0, 1) << "-"
+         << juce::String(status.maxMs / 1000.0, 1) << " s: "
+         << juce::String(status.completionsPerSecond, 1) << " regions/s, "
+         << juce::String(status.latencyMs, 0) << " ms)";
+  }
+  regionHop_.setText(text, juce::NotificationType::dontSendNotification);
+}
+
+void AudioPluginAudioProcessorEditor::updateRegionDensityText() {
+  auto regions = processorRef_.getAnalysisRegions();
+  if (!regions) {
+    return;
+  }
+  regionDensityInfill_.setText(
+      regionDensity_.getToggleState()
+          ? juce::String(regions->getNumInfillRegions()) + " added"
+          : juce::String(),
+      juce::NotificationType::dontSendNotification);
+}
+
 void AudioPluginAudioProcessorEditor::updateAccordingToUiToggle() {
   auto state = uiToggle_.getToggleState();
+  auto showStats = statsToggle_.getToggleState();
   uiToggle_.setButtonText(state ? "<< Graph View" : "Table View >>");
-  graph_.setVisible(!state);
-  table_.setVisible(state);
+  graph_.setVisible(!state && !showStats);
+  table_.setVisible(state && !showStats);
+  stats_.setVisible(showStats);
 }
 
 void AudioPluginAudioProcessorEditor::updatePendingRegionsText() {
@@ -361,4 +655,41 @@ void AudioPluginAudioProcessorEditor::updatePendingRegionsText() {
   }
 }
 
+void AudioPluginAudioProcessorEditor::updateConnectionStateText() {
+  auto state = processorRef_.getCommunicator()->getConnectionState();
+  connectionState_.setText(ServiceCommunicator::toString(state),
+                           juce::NotificationType::dontSendNotification);
+  connectionState_.setColour(
+      juce::Label::textColourId,
+      state == ServiceCommunicator::LIVE       ? juce::Colours::lightgreen
+      : state == ServiceCommunicator::DEGRADED ? juce::Colours::orange
+      : state == ServiceCommunicator::DOWN     ? juce::Colours::red
+                                               : juce::Colours::grey);
+}
+
+void AudioPluginAudioProcessorEditor::updateHistoryMemoryText() {
+  auto bytes = processorRef_.getHistoryMemoryUsageBytes();
+  historyMemory_.setText(
+      juce::String(static_cast<double>(bytes) / (1024.0 * 1024.0), 1) + " MB",
+      juce::NotificationType::dontSendNotification);
+}
+
+void AudioPluginAudioProcessorEditor::updateOfflineProgressText() {
+  auto regions = processorRef_.getAnalysisRegions();
+  auto progress =
+      regions ? regions->getOfflineProgress() : AnalysisRegions::OfflineProgress{};
+  if (!progress.active) {
+    offlineProgress_.setText("---",
+                             juce::NotificationType::dontSendNotification);
+    return;
+  }
+  auto text = juce::String(progress.regionsComplete) + " / " +
+              juce::String(progress.regionsTotal) + " regions (" +
+              juce::String(progress.regionsPerSecond, 1) + "/s)";
+  if (progress.regionsFailed > 0) {
+    text += ", " + juce::String(progress.regionsFailed) + " failed";
+  }
+  offlineProgress_.setText(text, juce::NotificationType::dontSendNotification);
+}
+
 } // namespace audio_plugin
@@ -3,6 +3,7 @@
 #include "PluginProcessor.h"
 #include "GuiComponents/Graph.h"
 #include "GuiComponents/ResultsTable.h"
+#include "GuiComponents/StatsPanel.h"
 #include "Types.h"
 #include <juce_gui_basics/juce_gui_basics.h>
 
@@ -47,7 +48,9 @@ private:
 
   ui::GraphPane graph_;
   ui::ResultsTable table_;
+  ui::StatsPanel stats_;
   juce::TextButton uiToggle_;
+  juce::TextButton statsToggle_;
   juce::Label sampleRateHeading_;
   juce::Label sampleRate_;
   juce::Label downsampleRateHeading_;
@@ -62,16 +65,41 @@ private:
   juce::Slider regionSize_;
   juce::Label regionFreqHeading_;
   juce::Slider regionFreq_;
+  juce::ToggleButton regionFreqAuto_;
+  juce::Label regionHopHeading_;
+  juce::Label regionHop_;
+  juce::Label regionDensityHeading_;
+  juce::ToggleButton regionDensity_;
+  juce::Label regionDensityInfill_;
   juce::Label serviceAddressHeading_;
   juce::TextEditor serviceAddress_;
   juce::TextButton serviceAddressSet_;
   juce::TextButton serviceAddressCancel_;
+  juce::Label connectionState_;
   juce::Label alignmentHeading_;
   juce::ComboBox alignment_;
+  juce::Label schedulingHeading_;
+  juce::ComboBox scheduling_;
+  juce::Label historyRetentionHeading_;
+  juce::ComboBox historyRetention_;
+  juce::Label historyStorageHeading_;
+  juce::ComboBox historyStorage_;
+  juce::Label streamsHeading_;
+  juce::TextEditor streams_;
+  juce::Label historyMemoryHeading_;
+  juce::Label historyMemory_;
+  juce::Label offlineProgressHeading_;
+  juce::Label offlineProgress_;
 
   juce::ScopedMessageBox messageBox_;
 
   void updatePendingRegionsText();
+  void updateConnectionStateText();
+  void updateRegionFreqSlider();
+  void updateRegionHopText();
+  void updateRegionDensityText();
+  void updateHistoryMemoryText();
+  void updateOfflineProgressText();
 
   JUCE_DECLARE_NON_COPYABLE_WITH_LEAK_DETECTOR(AudioPluginAudioProcessorEditor)
 };
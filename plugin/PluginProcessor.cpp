@@ -17,12 +17,18 @@ AudioPluginAudioProcessor::AudioPluginAudioProcessor()
               )
 {
   comms_ = std::make_shared<ServiceCommunicator>();
+  audioThreadStats_ = std::make_shared<AudioThreadStats>();
+  journal_ = ResultJournal::fromEnvironment(comms_->getIdentity());
   buffMan_ = std::make_shared<Buff>(static_cast<SampleRate>(48000),
                                     static_cast<uint16_t>(1024),
-                                    processingSampleRate, comms_);
+                                    processingSampleRate, comms_,
+                                    historyConfig_, audioThreadStats_);
+  buffMan_->getAnalysisRegions()->setJournal(journal_);
+  audioBuffMan_ = buffMan_.get();
 }
 
 AudioPluginAudioProcessor::~AudioPluginAudioProcessor() {
+  audioBuffMan_ = nullptr;
   buffMan_.reset();
 }
 
@@ -86,17 +92,54 @@ void AudioPluginAudioProcessor::prepareToPlay(double sampleRate,
                                               int samplesPerBlock) {
   // Use this method as the place to do any pre-playback
   // initialisation that you need..
+  SampleRate castSampleRate = static_cast<SampleRate>(sampleRate);
+  // Not short-circuited, so both flags are cleared
+  if (historyStorageChanged_.exchange(false) |
+      streamsChanged_.exchange(false)) {
+    // Storage and streams can only be changed by rebuilding the whole buffer,
+    // which loses the history
+    auto rebuilt = std::make_shared<Buff>(
+        castSampleRate, static_cast<uint16_t>(samplesPerBlock),
+        processingSampleRate, comms_, historyConfig_, audioThreadStats_,
+        getStreams());
+    rebuilt->getAnalysisRegions()->setOfflineMode(isNonRealtime());
+    rebuilt->getAnalysisRegions()->setJournal(journal_);
+    std::unique_ptr<juce::XmlElement> analysisState;
+    {
+      std::lock_guard<std::mutex> lock(streamsMtx_);
+      analysisState = std::move(restoredAnalysisState_);
+    }
+    if (!analysisState) {
+      analysisState = std::make_unique<juce::XmlElement>("Analysis");
+      writeAnalysisState(*getAnalysisRegions(), *analysisState);
+    }
+    readAnalysisState(*rebuilt->getAnalysisRegions(), *analysisState);
+    // The audio thread isn't running, so it can't still be using the old
+    // one. The editor may hold it for a little longer.
+    audioBuffMan_.store(rebuilt.get(), std::memory_order_release);
+    std::shared_ptr<Buff> replaced;
+    {
+      std::lock_guard<std::mutex> lock(buffManMtx_);
+      replaced = std::exchange(buffMan_, std::move(rebuilt));
+    }
+  } else if (sampleRate != lastKnownSampleRate_) {
+    // Only the downmix/resampler depends on the host rate, so the history,
+    // regions and results all carry on
+    getBufferManager()->reconfigure(castSampleRate,
+                                    static_cast<uint16_t>(samplesPerBlock));
+  }
   if (sampleRate != lastKnownSampleRate_) {
-    lastKnownSampleRate_ = sampleRate;
-    SampleRate castSampleRate = static_cast<SampleRate>(sampleRate);
-    buffMan_ = std::make_shared<Buff>(castSampleRate,
-                                      static_cast<uint16_t>(samplesPerBlock),
-                                      processingSampleRate, comms_);
-    auto regions = getAnalysisRegions();
-    assert(regions);
-    if (regions) {
-      regions->restartRegions();
+    {
+      // Keep the sample counter pointing at the same moment in the new rate
+      std::lock_guard<std::mutex> lock(playStateMtx_);
+      if (lastKnownSampleRate_ > 0.0) {
+        playState_.sampleCounter =
+            RateConversion(static_cast<SampleRate>(lastKnownSampleRate_),
+                           castSampleRate)
+                .convert(playState_.sampleCounter);
+      }
     }
+    lastKnownSampleRate_ = sampleRate;
     if (auto e = getCastEditor()) {
       e->updateSampleRate(castSampleRate);
     }
@@ -106,14 +149,45 @@ void AudioPluginAudioProcessor::prepareToPlay(double sampleRate,
     playState_.isPlaying = false;
     playState_.lastRecordedPlayheadTime.reset();
   }
+  auto buffMan = getBufferManager();
+  // The audio thread is stopped, so any block that was running when a front
+  // end was replaced has finished with it
+  buffMan->reclaimRetiredFrontEnds();
+  // In case releaseResources() freed them, so the first blocks have chunks
+  // to write to
+  for (size_t stream = 0; stream < buffMan->getNumStreams(); stream++) {
+    buffMan->getCircularBuffer(stream)->setRealtime(!isNonRealtime());
+    buffMan->getCircularBuffer(stream)->commitAhead();
+  }
 }
 
 void AudioPluginAudioProcessor::releaseResources() {
   // When playback stops, you can use this as an opportunity to free up any
   // spare memory, etc.
-  std::lock_guard<std::mutex> lock(playStateMtx_);
-  playState_.isPlaying = false;
-  playState_.lastRecordedPlayheadTime.reset();
+  {
+    std::lock_guard<std::mutex> lock(playStateMtx_);
+    playState_.isPlaying = false;
+    playState_.lastRecordedPlayheadTime.reset();
+  }
+
+  // History chunks are committed again by the next prepareToPlay
+  if (auto buffMan = getBufferManager()) {
+    for (size_t stream = 0; stream < buffMan->getNumStreams(); stream++) {
+      buffMan->getCircularBuffer(stream)->releaseUnusedMemory();
+    }
+  }
+}
+
+void AudioPluginAudioProcessor::setNonRealtime(bool isNonRealtime) noexcept {
+  AudioProcessor::setNonRealtime(isNonRealtime);
+  // Bounces keep every region rather than dropping them to keep up. Only
+  // then may the audio thread wait for history to make room.
+  if (auto buffMan = getBufferManager()) {
+    for (size_t stream = 0; stream < buffMan->getNumStreams(); stream++) {
+      buffMan->getCircularBuffer(stream)->setRealtime(!isNonRealtime);
+    }
+    buffMan->getAnalysisRegions()->setOfflineMode(isNonRealtime);
+  }
 }
 
 bool AudioPluginAudioProcessor::isBusesLayoutSupported(
@@ -122,12 +196,11 @@ bool AudioPluginAudioProcessor::isBusesLayoutSupported(
   juce::ignoreUnused(layouts);
   return true;
 #else
-  // This is the place where you check if the layout is supported.
-  // In this template code we only support mono or stereo.
-  // Some plugin hosts, such as certain GarageBand versions, will only
+  // Mono, stereo, or up to 7.1 so stems can be analysed as streams of their
+  // own. Some plugin hosts, such as certain GarageBand versions, will only
   // load plugins that support stereo bus layouts.
-  if (layouts.getMainOutputChannelSet() != juce::AudioChannelSet::mono() &&
-      layouts.getMainOutputChannelSet() != juce::AudioChannelSet::stereo())
+  auto numChannels = layouts.getMainOutputChannelSet().size();
+  if (numChannels < 1 || numChannels > 8)
     return false;
 
     // This checks if the input layout matches the output layout
@@ -143,7 +216,10 @@ bool AudioPluginAudioProcessor::isBusesLayoutSupported(
 void AudioPluginAudioProcessor::processBlock(juce::AudioBuffer<float>& buffer,
                                              juce::MidiBuffer& midiMessages) {
   juce::ignoreUnused(midiMessages);
-  assert(buffMan_);
+  auto callbackTimer =
+      audioThreadStats_->timeCallback(buffer.getNumSamples(), getSampleRate());
+  auto buffMan = audioBuffMan_.load(std::memory_order_acquire);
+  assert(buffMan);
 
   juce::ScopedNoDenormals noDenormals;
   auto totalNumInputChannels = getTotalNumInputChannels();
@@ -166,19 +242,20 @@ void AudioPluginAudioProcessor::processBlock(juce::AudioBuffer<float>& buffer,
 
   TimePoint blockStartTime;
   {
-    std::lock_guard<std::mutex> lock(playStateMtx_);
+    auto lock =
+        audioThreadStats_->lock(playStateMtx_, AudioThreadStats::PLAY_STATE);
     if (isNowPlaying != playState_.isPlaying) {
       playState_.isPlaying = isNowPlaying;
       if (isNowPlaying) {
         // Just started playing. Mark old completed regions stale.
-        auto regions = getAnalysisRegions();
+        auto regions = buffMan->getAnalysisRegions();
         assert(regions);
         if (regions) {
           regions->updateAsStale();
         }
-        buffMan_->justStarted();
+        buffMan->justStarted();
       } else {
-        buffMan_->justStopped();
+        buffMan->justStopped();
       }
     }
     playState_.lastRecordedPlayheadTime = phTime;
@@ -192,7 +269,7 @@ void AudioPluginAudioProcessor::processBlock(juce::AudioBuffer<float>& buffer,
       blockStartTime.playheadTime = *phTime;
     }
   }
-  buffMan_->updateFrom(buffer, blockStartTime);
+  buffMan->updateFrom(buffer, blockStartTime);
 }
 
 bool AudioPluginAudioProcessor::hasEditor() const {
@@ -210,6 +287,13 @@ void AudioPluginAudioProcessor::getStateInformation(
   // as intermediaries to make it easy to save and load complex data.
   std::unique_ptr<juce::XmlElement> xml(new juce::XmlElement("PluginSettings"));
   xml->setAttribute("serviceAddress", comms_->getServiceAddress());
+  xml->setAttribute("historyRetentionMs",
+                    static_cast<int>(getHistoryRetentionMs()));
+  xml->setAttribute("historyStorage", static_cast<int>(getHistoryStorage()));
+  xml->setAttribute("streams", formatStreamConfigs(getStreams()));
+  if (auto regions = getAnalysisRegions()) {
+    writeAnalysisState(*regions, *xml);
+  }
   copyXmlToBinary(*xml, destData);
 }
 
@@ -226,6 +310,25 @@ void AudioPluginAudioProcessor::setStateInformation(const void* data,
           xmlState->getStringAttribute("serviceAddress", "").toStdString();
       comms_->setServiceAddress(serviceAddress);
     }
+    if (xmlState->hasAttribute("historyRetentionMs")) {
+      setHistoryRetentionMs(static_cast<uint32_t>(
+          xmlState->getIntAttribute("historyRetentionMs")));
+    }
+    if (xmlState->hasAttribute("historyStorage")) {
+      setHistoryStorage(static_cast<HistoryConfig::Storage>(
+          xmlState->getIntAttribute("historyStorage")));
+    }
+    if (xmlState->hasAttribute("streams")) {
+      setStreams(parseStreamConfigs(
+          xmlState->getStringAttribute("streams", "").toStdString()));
+    }
+    if (auto regions = getAnalysisRegions()) {
+      readAnalysisState(*regions, *xmlState);
+    }
+    if (streamsChanged_) {
+      std::lock_guard<std::mutex> lock(streamsMtx_);
+      restoredAnalysisState_ = std::make_unique<juce::XmlElement>(*xmlState);
+    }
   }
 }
 
@@ -247,12 +350,13 @@ std::optional<SampleCounter> AudioPluginAudioProcessor::getPlayheadPosition() {
 }
 
 std::shared_ptr<Buff> AudioPluginAudioProcessor::getBufferManager() {
+  std::lock_guard<std::mutex> lock(buffManMtx_);
   return buffMan_;
 }
 
 std::shared_ptr<MonoCircularBuffer>
 AudioPluginAudioProcessor::getCircularBuffer() {
-  auto buffMan = buffMan_;
+  auto buffMan = getBufferManager();
   if (!buffMan)
     return nullptr;
   return buffMan->getCircularBuffer();
@@ -260,7 +364,7 @@ AudioPluginAudioProcessor::getCircularBuffer() {
 
 std::shared_ptr<AnalysisRegions>
 AudioPluginAudioProcessor::getAnalysisRegions() {
-  auto buffMan = buffMan_;
+  auto buffMan = getBufferManager();
   if (!buffMan)
     return nullptr;
   return buffMan->getAnalysisRegions();
@@ -271,6 +375,118 @@ AudioPluginAudioProcessor::getCommunicator() {
   return comms_;
 }
 
+std::shared_ptr<AudioThreadStats>
+AudioPluginAudioProcessor::getAudioThreadStats() {
+  return audioThreadStats_;
+}
+
+TaskPool& AudioPluginAudioProcessor::getTaskPool() {
+  return *taskPool_;
+}
+
+uint32_t AudioPluginAudioProcessor::getHistoryRetentionMs() {
+  return historyConfig_.retentionMs;
+}
+
+void AudioPluginAudioProcessor::setHistoryRetentionMs(uint32_t ms) {
+  // Keep the config up to date so any rebuilt buffer gets the same retention
+  historyConfig_.retentionMs = ms;
+  if (auto buffMan = getBufferManager()) {
+    for (size_t stream = 0; stream < buffMan->getNumStreams(); stream++) {
+      buffMan->getCircularBuffer(stream)->setRetentionMs(ms);
+    }
+  }
+}
+
+size_t AudioPluginAudioProcessor::getHistoryMemoryUsageBytes() {
+  auto buffMan = getBufferManager();
+  if (!buffMan)
+    return 0;
+  size_t bytes{0};
+  for (size_t stream = 0; stream < buffMan->getNumStreams(); stream++) {
+    bytes += buffMan->getCircularBuffer(stream)->getMemoryUsageBytes();
+  }
+  return bytes;
+}
+
+HistoryConfig::Storage AudioPluginAudioProcessor::getHistoryStorage() {
+  return historyConfig_.storage;
+}
+
+void AudioPluginAudioProcessor::setHistoryStorage(
+    HistoryConfig::Storage storage) {
+  if (storage == historyConfig_.storage)
+    return;
+  // Takes effect (discarding current history) next time we're prepared
+  historyConfig_.storage = storage;
+  historyStorageChanged_ = true;
+}
+
+std::vector<StreamConfig> AudioPluginAudioProcessor::getStreams() {
+  std::lock_guard<std::mutex> lock(streamsMtx_);
+  return streams_;
+}
+
+void AudioPluginAudioProcessor::setStreams(
+    const std::vector<StreamConfig>& streams) {
+  std::lock_guard<std::mutex> lock(streamsMtx_);
+  auto same = [](const StreamConfig& a, const StreamConfig& b) {
+    return a.name == b.name && a.channels == b.channels;
+  };
+  if (std::equal(streams.begin(), streams.end(), streams_.begin(),
+                 streams_.end(), same))
+    return;
+  // Likewise, takes effect (discarding current history) next time we're
+  // prepared
+  streams_ = streams;
+  streamsChanged_ = true;
+}
+
+void AudioPluginAudioProcessor::writeAnalysisState(AnalysisRegions& regions,
+                                                   juce::XmlElement& xml) {
+  xml.setAttribute("regionFreqMs", static_cast<int>(regions.getRegionFreqMs()));
+  xml.setAttribute("alignment", static_cast<int>(regions.getAlignment()));
+  auto frequency = regions.getFrequencyStatus();
+  xml.setAttribute("autoFrequency", frequency.automatic);
+  xml.setAttribute("autoFrequencyMinMs", static_cast<int>(frequency.minMs));
+  xml.setAttribute("autoFrequencyMaxMs", static_cast<int>(frequency.maxMs));
+  xml.setAttribute("adaptiveDensity", regions.getDensityConfig().adaptive);
+  // Binary, so thousands of results load without holding up the session
+  juce::MemoryOutputStream results;
+  regions.writeResults(results);
+  xml.createNewChildElement("Results")
+      ->addTextElement(results.getMemoryBlock().toBase64Encoding());
+}
+
+void AudioPluginAudioProcessor::readAnalysisState(
+    AnalysisRegions& regions,
+    const juce::XmlElement& xml) {
+  if (xml.hasAttribute("alignment")) {
+    regions.setAlignment(static_cast<AnalysisRegions::Alignment>(
+        xml.getIntAttribute("alignment")));
+  }
+  if (xml.hasAttribute("regionFreqMs")) {
+    regions.setRegionFreqMs(
+        static_cast<uint32_t>(xml.getIntAttribute("regionFreqMs")));
+  }
+  if (xml.getBoolAttribute("autoFrequency")) {
+    regions.setAutoFrequency(
+        true, static_cast<uint32_t>(xml.getIntAttribute("autoFrequencyMinMs")),
+        static_cast<uint32_t>(xml.getIntAttribute("autoFrequencyMaxMs")));
+  }
+  if (xml.hasAttribute("adaptiveDensity")) {
+    auto density = regions.getDensityConfig();
+    density.adaptive = xml.getBoolAttribute("adaptiveDensity");
+    regions.setDensityConfig(density);
+  }
+  if (auto resultsXml = xml.getChildByName("Results")) {
+    juce::MemoryBlock results;
+    if (results.fromBase64Encoding(resultsXml->getAllSubText())) {
+      regions.readResults(results.getData(), results.getSize());
+    }
+  }
+}
+
 AudioPluginAudioProcessorEditor* AudioPluginAudioProcessor::getCastEditor() {
   if (auto e = getActiveEditor()) {
     return dynamic_cast<AudioPluginAudioProcessorEditor*>(e);
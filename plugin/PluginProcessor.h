@@ -1,11 +1,16 @@
 #pragma once
 
+#include "AudioThreadStats.h"
 #include "CircularBuffer.h"
 #include "Comms.h"
+#include "ResultJournal.h"
+#include "TaskPool.h"
 #include <juce_audio_processors/juce_audio_processors.h>
 #include <optional>
 #include <mutex>
 #include <memory>
+#include <atomic>
+#include <vector>
 
 namespace audio_plugin {
 
@@ -18,6 +23,7 @@ public:
 
   void prepareToPlay(double sampleRate, int samplesPerBlock) override;
   void releaseResources() override;
+  void setNonRealtime(bool isNonRealtime) noexcept override;
 
   bool isBusesLayoutSupported(const BusesLayout &layouts) const override;
 
@@ -54,12 +60,40 @@ public:
   std::shared_ptr<MonoCircularBuffer> getCircularBuffer();
   std::shared_ptr<AnalysisRegions> getAnalysisRegions();
   std::shared_ptr<ServiceCommunicator> getCommunicator();
+  std::shared_ptr<AudioThreadStats> getAudioThreadStats();
+  // For splitting up GUI and background work. Shared with other instances.
+  TaskPool& getTaskPool();
+
+  uint32_t getHistoryRetentionMs();
+  void setHistoryRetentionMs(uint32_t ms);
+  size_t getHistoryMemoryUsageBytes();
+  HistoryConfig::Storage getHistoryStorage();
+  void setHistoryStorage(HistoryConfig::Storage storage);
+  // Channel groups analysed separately. Empty for all channels as one.
+  std::vector<StreamConfig> getStreams();
+  void setStreams(const std::vector<StreamConfig>& streams);
 
 private:
   juce::PluginHostType pluginHostType_;
 
-  std::shared_ptr<Buff> buffMan_;
+  std::shared_ptr<Buff> buffMan_;  // Guarded by buffManMtx_
+  std::mutex buffManMtx_;
+  // The audio thread's copy of buffMan_, so it never waits on a lock for it.
+  // Only replaced in prepareToPlay, while the audio thread isn't running, and
+  // buffMan_ keeps it alive until then.
+  std::atomic<Buff*> audioBuffMan_{nullptr};
   std::shared_ptr<ServiceCommunicator> comms_;
+  // Outlives any Buff, so stats carry on across rebuilds
+  std::shared_ptr<AudioThreadStats> audioThreadStats_;
+  std::shared_ptr<ResultJournal> journal_;  // Likewise. Null if not enabled.
+  SharedTaskPool taskPool_;
+  HistoryConfig historyConfig_;
+  std::atomic<bool> historyStorageChanged_{false};
+  std::vector<StreamConfig> streams_;  // Guarded by streamsMtx_
+  std::mutex streamsMtx_;
+  std::atomic<bool> streamsChanged_{false};
+  // Restored along with different streams, so only read once they're built
+  std::unique_ptr<juce::XmlElement> restoredAnalysisState_;  // streamsMtx_
 
   double lastKnownSampleRate_{0.0};
 
@@ -71,6 +105,10 @@ private:
   std::mutex playStateMtx_;
 
   AudioPluginAudioProcessorEditor* getCastEditor();
+  // Region settings and playback results, saved with the state and carried
+  // across rebuilds of the buffer
+  void writeAnalysisState(AnalysisRegions& regions, juce::XmlElement& xml);
+  void readAnalysisState(AnalysisRegions& regions, const juce::XmlElement& xml);
 
   JUCE_DECLARE_NON_COPYABLE_WITH_LEAK_DETECTOR(AudioPluginAudioProcessor)
 };
@@ -0,0 +1,228 @@
+#include "RegionScheduler.h"
+#include "AnalysisRegions.h"
+#include <algorithm>
+#include <vector>
+
+namespace audio_plugin {
+
+void RegionScheduler::setPolicy(Policy policy) {
+  if (policy == policy_) {
+    return;
+  }
+  policy_ = policy;
+  stats_.policy = policy;
+  // Everything waiting is put back in the new order
+  std::vector<Entry> entries(queue_.begin(), queue_.end());
+  queue_.clear();
+  byStart_.clear();
+  for (auto& entry : entries) {
+    entry.priority = priorityOf(*entry.region);
+    insert(entry);
+  }
+}
+
+RegionScheduler::Policy RegionScheduler::getPolicy() const {
+  return policy_;
+}
+
+void RegionScheduler::beginTick() {
+  tick_++;
+}
+
+void RegionScheduler::push(const Region& region, double nowMs) {
+  if (auto it = byStart_.find(keyOf(region)); it != byStart_.end()) {
+    queue_.erase(it->second);
+    byStart_.erase(it);
+  }
+  longestRegion_ = std::max(
+      longestRegion_, region.end.sampleCounter - region.start.sampleCounter);
+  insert(Entry{priorityOf(region), keyOf(region), &region, nowMs, tick_});
+}
+
+bool RegionScheduler::remove(const Region& region) {
+  if (covered_.erase(keyOf(region)) > 0 && policy_ == GAP_FILLING) {
+    rekeyOverlapping(region);
+  }
+  auto it = byStart_.find(keyOf(region));
+  if (it == byStart_.end()) {
+    return false;
+  }
+  queue_.erase(it->second);
+  byStart_.erase(it);
+  return true;
+}
+
+bool RegionScheduler::expire(const Region& region) {
+  if (!remove(region)) {
+    return false;
+  }
+  stats_.expired++;
+  return true;
+}
+
+const Region* RegionScheduler::pop(double nowMs) {
+  if (queue_.empty()) {
+    return nullptr;
+  }
+  auto entry = *queue_.begin();
+  queue_.erase(queue_.begin());
+  byStart_.erase(entry.key);
+
+  stats_.scheduled++;
+  if (entry.queuedTick < tick_) {
+    stats_.deferred++;
+  }
+  const auto& region = *entry.region;
+  Decision decision;
+  decision.startSecs = static_cast<double>(region.start.sampleCounter) /
+                       static_cast<double>(region.start.sampleRate);
+  if (region.start.playheadTime) {
+    decision.playheadSecs = static_cast<double>(*region.start.playheadTime) /
+                            static_cast<double>(region.start.sampleRate);
+  }
+  decision.waitedMs = nowMs - entry.queuedMs;
+  decision.queued = queue_.size();
+  stats_.recent.push_front(decision);
+  if (stats_.recent.size() > maxRecentDecisions) {
+    stats_.recent.pop_back();
+  }
+  return entry.region;
+}
+
+bool RegionScheduler::empty() const {
+  return queue_.empty();
+}
+
+size_t RegionScheduler::size() const {
+  return queue_.size();
+}
+
+void RegionScheduler::clear() {
+  queue_.clear();
+  byStart_.clear();
+  covered_.clear();
+}
+
+void RegionScheduler::setCovered(const Region& region, bool covered) {
+  const auto start = region.start.sampleCounter;
+  const auto end = region.end.sampleCounter;
+  bool changed;
+  if (covered) {
+    longestRegion_ = std::max(longestRegion_, end - start);
+    changed = covered_.insert_or_assign(keyOf(region), end).second;
+  } else {
+    changed = covered_.erase(keyOf(region)) > 0;
+  }
+  if (changed && policy_ == GAP_FILLING) {
+    rekeyOverlapping(region);
+  }
+}
+
+RegionScheduler::Snapshot RegionScheduler::getSnapshot() const {
+  auto snapshot = stats_;
+  snapshot.policy = policy_;
+  snapshot.queued = queue_.size();
+  return snapshot;
+}
+
+void RegionScheduler::resetStats() {
+  stats_ = Snapshot{};
+}
+
+double RegionScheduler::priorityOf(const Region& region) const {
+  const bool fromPlayback = region.start.playheadTime.has_value() &&
+                            region.end.playheadTime.has_value();
+  switch (policy_) {
+    case LATEST_FIRST:
+      break;
+    case PLAYHEAD_ALIGNED_FIRST:
+      return fromPlayback ? 0.0 : 1.0;
+    case GAP_FILLING:
+      return static_cast<double>(coverageOf(region));
+    case WEIGHTED_AGING:
+      // Waiting time only grows, and at the same rate for everything, so
+      // ordering by when it was created is ordering by how long it's waited
+      return region.createdMs - (fromPlayback ? agingHeadStartMs : 0.0);
+    case PROGRAMME_ORDER:
+      return static_cast<double>(region.start.sampleCounter);
+  }
+  return 0.0;  // Ties broken latest first
+}
+
+RegionScheduler::Key RegionScheduler::keyOf(const Region& region) {
+  return {region.start.sampleCounter, region.stream};
+}
+
+size_t RegionScheduler::coverageOf(const Region& region) const {
+  const auto start = region.start.sampleCounter;
+  const auto end = region.end.sampleCounter;
+  size_t count{0};
+  for (auto it = covered_.upper_bound({start - longestRegion_, UINT8_MAX});
+       it != covered_.end() && it->first.first < end; ++it) {
+    if (it->first.second == region.stream && it->second > start) {
+      count++;
+    }
+  }
+  return count;
+}
+
+void RegionScheduler::rekeyOverlapping(const Region& region) {
+  const auto start = region.start.sampleCounter;
+  const auto end = region.end.sampleCounter;
+  for (auto it = byStart_.upper_bound({start - longestRegion_, UINT8_MAX});
+       it != byStart_.end() && it->first.first < end; ++it) {
+    auto entry = *it->second;
+    if (it->first.second != region.stream ||
+        entry.region->end.sampleCounter <= start) {
+      continue;
+    }
+    queue_.erase(it->second);
+    entry.priority = priorityOf(*entry.region);
+    it->second = queue_.insert(entry).first;
+  }
+}
+
+void RegionScheduler::insert(Entry entry) {
+  const auto key = entry.key;
+  byStart_[key] = queue_.insert(entry).first;
+}
+
+const char* RegionScheduler::getPolicyName(Policy policy) {
+  switch (policy) {
+    case LATEST_FIRST:
+      return "latest first";
+    case PLAYHEAD_ALIGNED_FIRST:
+      return "playhead aligned first";
+    case GAP_FILLING:
+      return "gap filling";
+    case WEIGHTED_AGING:
+      return "weighted aging";
+    case PROGRAMME_ORDER:
+      return "programme order";
+  }
+  return "";
+}
+
+juce::String RegionScheduler::toString(const Snapshot& snapshot) {
+  juce::String text;
+  text << "Scheduling (" << getPolicyName(snapshot.policy)
+       << "): " << juce::String(snapshot.queued) << " waiting\n";
+  text << "  " << juce::String(snapshot.scheduled) << " scheduled, "
+       << juce::String(snapshot.deferred) << " deferred, "
+       << juce::String(snapshot.expired) << " expired\n";
+  if (!snapshot.recent.empty()) {
+    text << "  Recent:\n";
+  }
+  for (const auto& decision : snapshot.recent) {
+    text << "    " << juce::String(decision.startSecs, 2) << " s";
+    if (decision.playheadSecs) {
+      text << " (playhead " << juce::String(*decision.playheadSecs, 2)
+           << " s)";
+    }
+    text << ": waited " << juce::String(decision.waitedMs, 1) << " ms, "
+         << juce::String(decision.queued) << " left waiting\n";
+  }
+  return text;
+}
+
+}  // namespace audio_plugin
@@ -0,0 +1,122 @@
+#pragma once
+
+#include <juce_core/juce_core.h>
+#include <cstdint>
+#include <deque>
+#include <map>
+#include <optional>
+#include <set>
+#include <utility>
+#include "Types.h"
+
+namespace audio_plugin {
+
+struct Region;
+
+// Decides which pending region goes to the service next.
+//
+// Regions waiting to be sent are held in an ordered set keyed by the policy,
+// so adding, removing and taking the next are all O(log n). Nothing is
+// dropped for being low priority - regions wait until they are sent, or
+// until their history ages out.
+//
+// Holds pointers to regions, which must stay put (as in a std::set) until
+// they are removed. Regions are told apart by start and stream, and only
+// regions of the same stream count as overlapping. Not thread safe - the
+// owner guards it.
+class RegionScheduler {
+public:
+  enum Policy {
+    LATEST_FIRST,            // The most recent audio first
+    PLAYHEAD_ALIGNED_FIRST,  // Regions from playback (which fill the results
+                             // table) first, then the rest, latest first
+    GAP_FILLING,             // Regions overlapping the fewest sent or
+                             // analysed ones first, spreading results across
+                             // the timeline before filling it in
+    WEIGHTED_AGING,          // Longest waiting first, with regions from
+                             // playback counted as having waited longer
+    PROGRAMME_ORDER          // Earliest first (offline renders)
+  };
+  // How much longer regions from playback count as having waited
+  static constexpr double agingHeadStartMs{10000.0};
+  static constexpr size_t maxRecentDecisions{8};
+
+  struct Decision {
+    double startSecs{0.0};
+    std::optional<double> playheadSecs;  // If from playback
+    double waitedMs{0.0};                // Since queued
+    size_t queued{0};                    // Left waiting after it was taken
+  };
+
+  struct Snapshot {
+    Policy policy{LATEST_FIRST};
+    size_t queued{0};
+    uint64_t scheduled{0};
+    uint64_t deferred{0};  // Of those scheduled, how many waited a tick or more
+    uint64_t expired{0};   // Aged out before they could be sent
+    std::deque<Decision> recent;  // Newest first
+  };
+
+  void setPolicy(Policy policy);
+  Policy getPolicy() const;
+
+  // Call at the start of each round of sending, to tell deferred regions
+  // from those taken straight away
+  void beginTick();
+  // The region is waiting to be sent (again)
+  void push(const Region& region, double nowMs);
+  // The region is gone. Returns whether it was waiting.
+  bool remove(const Region& region);
+  // Likewise, counting it as having waited too long if it was waiting
+  bool expire(const Region& region);
+  // Takes the highest priority region, or nullptr if none are waiting
+  const Region* pop(double nowMs);
+  bool empty() const;
+  size_t size() const;
+  void clear();
+
+  // For gap filling: the region is with the service or has a result (or,
+  // if not, has since failed)
+  void setCovered(const Region& region, bool covered);
+
+  Snapshot getSnapshot() const;
+  void resetStats();
+  static const char* getPolicyName(Policy policy);
+  static juce::String toString(const Snapshot& snapshot);
+
+private:
+  using Key = std::pair<SampleCounter, uint8_t>;  // Start, stream
+  static Key keyOf(const Region& region);
+
+  struct Entry {
+    double priority{0.0};  // Lowest first
+    Key key;               // Then latest first, then by stream
+    const Region* region{nullptr};
+    double queuedMs{0.0};
+    uint64_t queuedTick{0};
+    bool operator<(const Entry& other) const {
+      if (priority != other.priority) {
+        return priority < other.priority;
+      }
+      if (key.first != other.key.first) {
+        return key.first > other.key.first;
+      }
+      return key.second < other.key.second;
+    }
+  };
+
+  double priorityOf(const Region& region) const;
+  size_t coverageOf(const Region& region) const;
+  void rekeyOverlapping(const Region& region);
+  void insert(Entry entry);
+
+  Policy policy_{LATEST_FIRST};
+  std::set<Entry> queue_;
+  std::map<Key, std::set<Entry>::iterator> byStart_;
+  std::map<Key, SampleCounter> covered_;  // To end
+  SampleCounter longestRegion_{0};  // Bounds overlap searches
+  uint64_t tick_{0};
+  Snapshot stats_;
+};
+
+}  // namespace audio_plugin
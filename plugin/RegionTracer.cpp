@@ -0,0 +1,215 @@
+#include "RegionTracer.h"
+#include "AnalysisRegions.h"
+#include <algorithm>
+#include <cmath>
+#include <iomanip>
+#include <sstream>
+
+namespace {
+
+constexpr int pluginPid{1};
+constexpr int servicePid{2};
+
+// One begin/end pair of an async event, so overlapping regions each get
+// their own track
+void writeSpan(std::ostringstream& out,
+               const char* name,
+               int pid,
+               uint16_t id,
+               double beginUs,
+               double endUs,
+               const std::string& args = {}) {
+  auto writeEvent = [&](char phase, double ts) {
+    out << ",\n{\"name\":\"" << name << "\",\"cat\":\"region\",\"ph\":\""
+        << phase << "\",\"id\":" << id << ",\"pid\":" << pid
+        << ",\"tid\":1,\"ts\":" << ts;
+    if (phase == 'b' && !args.empty()) {
+      out << ",\"args\":{" << args << "}";
+    }
+    out << "}";
+  };
+  writeEvent('b', beginUs);
+  writeEvent('e', std::max(beginUs, endUs));
+}
+
+}  // namespace
+
+namespace audio_plugin {
+
+RegionTracer::RegionTracer(size_t maxTraces) : maxTraces_(maxTraces) {}
+
+void RegionTracer::record(const Region& region) {
+  Trace trace;
+  trace.count = region.count;
+  trace.startSampleCounter = region.start.sampleCounter;
+  trace.success = region.analysisState == Region::State::COMPLETE;
+  trace.attempts = region.attempts;
+  trace.createdMs = region.createdMs;
+  trace.sendAttemptedMs = region.sendAttemptedMs;
+  trace.sentMs = region.sentMs;
+  trace.receivedMs = region.receivedMs;
+  trace.appliedMs = region.appliedMs;
+  trace.serviceQueueMs = region.serviceQueueMs;
+  trace.serviceInferenceMs = region.serviceInferenceMs;
+
+  std::lock_guard lock(mtx_);
+  stats_.regions++;
+  addToStage(TIMER_WAIT, trace.sendAttemptedMs - trace.createdMs);
+  addToStage(SEND_WAIT, trace.sentMs - trace.sendAttemptedMs);
+  auto serviceMs = trace.serviceQueueMs.value_or(0.0) +
+                   trace.serviceInferenceMs.value_or(0.0);
+  addToStage(NETWORK, trace.receivedMs - trace.sentMs - serviceMs);
+  if (trace.serviceQueueMs.has_value()) {
+    addToStage(SERVICE_QUEUE, *trace.serviceQueueMs);
+  }
+  if (trace.serviceInferenceMs.has_value()) {
+    addToStage(SERVICE_INFERENCE, *trace.serviceInferenceMs);
+  }
+  addToStage(REPLY_TO_APPLIED, trace.appliedMs - trace.receivedMs);
+  addToStage(TOTAL, trace.appliedMs - trace.createdMs);
+
+  traces_.push_back(trace);
+  while (traces_.size() > maxTraces_) {
+    traces_.pop_front();
+  }
+}
+
+void RegionTracer::addToStage(Stage stage, double ms) {
+  // mtx_ must be held
+  ms = std::max(ms, 0.0);
+  auto& stats = stats_.stages[stage];
+  stats.count++;
+  stats.totalMs += ms;
+  stats.maxMs = std::max(stats.maxMs, ms);
+  size_t bucket{0};
+  if (ms >= 1.0) {
+    bucket = static_cast<size_t>(std::floor(std::log2(ms))) + 1;
+  }
+  stats.histogram[std::min(bucket, numBuckets - 1)]++;
+}
+
+RegionTracer::Snapshot RegionTracer::getSnapshot() {
+  std::lock_guard lock(mtx_);
+  return stats_;
+}
+
+void RegionTracer::reset() {
+  std::lock_guard lock(mtx_);
+  stats_ = Snapshot{};
+  traces_.clear();
+}
+
+const char* RegionTracer::getStageName(Stage stage) {
+  switch (stage) {
+    case TIMER_WAIT:
+      return "Waiting for timer";
+    case SEND_WAIT:
+      return "Waiting to send";
+    case NETWORK:
+      return "Network";
+    case SERVICE_QUEUE:
+      return "Service queue";
+    case SERVICE_INFERENCE:
+      return "Service inference";
+    case REPLY_TO_APPLIED:
+      return "Applying reply";
+    case TOTAL:
+      return "Total";
+    case NUM_STAGES:
+      break;
+  }
+  return "";
+}
+
+juce::String RegionTracer::toString(const Snapshot& snapshot) {
+  juce::String text;
+  text << "Region latency (" << juce::String(snapshot.regions)
+       << " regions):\n";
+  for (size_t s = 0; s < NUM_STAGES; s++) {
+    const auto& stats = snapshot.stages[s];
+    text << "  " << getStageName(static_cast<Stage>(s)) << ": ";
+    if (stats.count == 0) {
+      text << "---\n";
+      continue;
+    }
+    text << "mean "
+         << juce::String(stats.totalMs / static_cast<double>(stats.count), 1)
+         << " ms, max " << juce::String(stats.maxMs, 1) << " ms\n";
+    for (size_t i = 0; i < numBuckets; i++) {
+      if (stats.histogram[i] == 0) {
+        continue;
+      }
+      text << "    "
+           << (i + 1 < numBuckets ? "<" + juce::String(1 << i)
+                                  : ">=" + juce::String(1 << (i - 1)))
+           << " ms: " << juce::String(stats.histogram[i]) << "\n";
+    }
+  }
+  return text;
+}
+
+bool RegionTracer::exportChromeTrace(const juce::File& file) {
+  std::deque<Trace> traces;
+  {
+    std::lock_guard lock(mtx_);
+    traces = traces_;
+  }
+
+  double originMs{0.0};
+  if (!traces.empty()) {
+    originMs = std::min_element(traces.begin(), traces.end(),
+                                [](const Trace& a, const Trace& b) {
+                                  return a.createdMs < b.createdMs;
+                                })
+                   ->createdMs;
+  }
+  auto toUs = [originMs](double ms) { return (ms - originMs) * 1000.0; };
+
+  std::ostringstream out;
+  out << std::fixed << std::setprecision(3);
+  out << "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n"
+      << "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":" << pluginPid
+      << ",\"args\":{\"name\":\"Plugin\"}},\n"
+      << "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":" << servicePid
+      << ",\"args\":{\"name\":\"Service\"}}";
+  for (const auto& trace : traces) {
+    std::ostringstream args;
+    args << "\"sample_counter\":" << trace.startSampleCounter
+         << ",\"success\":" << (trace.success ? "true" : "false")
+         << ",\"attempts\":" << static_cast<int>(trace.attempts);
+    auto name = "Region " + std::to_string(trace.count);
+    writeSpan(out, name.c_str(), pluginPid, trace.count,
+              toUs(trace.createdMs), toUs(trace.appliedMs), args.str());
+    writeSpan(out, getStageName(TIMER_WAIT), pluginPid, trace.count,
+              toUs(trace.createdMs), toUs(trace.sendAttemptedMs));
+    writeSpan(out, getStageName(SEND_WAIT), pluginPid, trace.count,
+              toUs(trace.sendAttemptedMs), toUs(trace.sentMs));
+    writeSpan(out, "With service", pluginPid, trace.count, toUs(trace.sentMs),
+              toUs(trace.receivedMs));
+    writeSpan(out, getStageName(REPLY_TO_APPLIED), pluginPid, trace.count,
+              toUs(trace.receivedMs), toUs(trace.appliedMs));
+
+    if (!trace.serviceQueueMs.has_value() &&
+        !trace.serviceInferenceMs.has_value()) {
+      continue;
+    }
+    // The service's clock isn't ours, so centre its time within the round
+    // trip (i.e, assume the network is equally quick both ways)
+    auto queueMs = trace.serviceQueueMs.value_or(0.0);
+    auto inferenceMs = trace.serviceInferenceMs.value_or(0.0);
+    auto networkMs =
+        std::max(0.0, trace.receivedMs - trace.sentMs - queueMs - inferenceMs);
+    auto serviceStartMs = trace.sentMs + networkMs / 2.0;
+    writeSpan(out, name.c_str(), servicePid, trace.count, toUs(serviceStartMs),
+              toUs(serviceStartMs + queueMs + inferenceMs));
+    writeSpan(out, getStageName(SERVICE_QUEUE), servicePid, trace.count,
+              toUs(serviceStartMs), toUs(serviceStartMs + queueMs));
+    writeSpan(out, getStageName(SERVICE_INFERENCE), servicePid, trace.count,
+              toUs(serviceStartMs + queueMs),
+              toUs(serviceStartMs + queueMs + inferenceMs));
+  }
+  out << "\n]}\n";
+  return file.replaceWithText(juce::String(out.str()));
+}
+
+}  // namespace audio_plugin
@@ -0,0 +1,88 @@
+#pragma once
+
+#include <juce_core/juce_core.h>
+#include <array>
+#include <cstdint>
+#include <deque>
+#include <mutex>
+#include <optional>
+#include "Types.h"
+
+namespace audio_plugin {
+
+struct Region;
+
+// Where the time goes for each region, from being created on the audio
+// thread to its result being applied - so slow results can be put down to
+// the client, the network or the service.
+//
+// Keeps a latency histogram per stage, plus the most recent regions in full
+// so they can be exported as a Chrome/Perfetto trace (chrome://tracing or
+// ui.perfetto.dev). Service timings are only known if the service reports
+// them. Not for the audio thread.
+class RegionTracer {
+public:
+  enum Stage {
+    TIMER_WAIT,         // Created -> first looked at by the timer
+    SEND_WAIT,          // -> sent (waiting for a send slot)
+    NETWORK,            // Round trip less the service's own time
+    SERVICE_QUEUE,      // Reported by the service
+    SERVICE_INFERENCE,  // Reported by the service
+    REPLY_TO_APPLIED,   // Reply received -> result applied
+    TOTAL,              // Created -> result applied
+    NUM_STAGES
+  };
+
+  // Power-of-two ms steps: <1ms, <2ms, <4ms... the last holding everything
+  // from 2^(numBuckets - 2) ms
+  static constexpr size_t numBuckets{20};
+
+  struct StageStats {
+    uint64_t count{0};
+    double totalMs{0.0};
+    double maxMs{0.0};
+    std::array<uint64_t, numBuckets> histogram{};
+  };
+
+  struct Snapshot {
+    uint64_t regions{0};
+    std::array<StageStats, NUM_STAGES> stages{};
+  };
+
+  // All ms from juce::Time::getMillisecondCounterHiRes()
+  struct Trace {
+    uint16_t count{0};
+    SampleCounter startSampleCounter{0};
+    bool success{false};
+    uint8_t attempts{0};
+    double createdMs{0.0};
+    double sendAttemptedMs{0.0};
+    double sentMs{0.0};
+    double receivedMs{0.0};
+    double appliedMs{0.0};
+    std::optional<double> serviceQueueMs;
+    std::optional<double> serviceInferenceMs;
+  };
+
+  explicit RegionTracer(size_t maxTraces = 1000);
+
+  // For regions that got a reply (so not timeouts)
+  void record(const Region& region);
+  Snapshot getSnapshot();
+  void reset();
+
+  static const char* getStageName(Stage stage);
+  static juce::String toString(const Snapshot& snapshot);
+  // Everything in the last maxTraces regions, both sides of the round trip
+  bool exportChromeTrace(const juce::File& file);
+
+private:
+  void addToStage(Stage stage, double ms);
+
+  const size_t maxTraces_;
+  std::mutex mtx_;
+  std::deque<Trace> traces_;
+  Snapshot stats_;
+};
+
+}  // namespace audio_plugin
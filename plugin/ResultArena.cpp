@@ -0,0 +1,91 @@
+#include "ResultArena.h"
+#include <algorithm>
+#include <cassert>
+
+namespace audio_plugin {
+
+ResultArena::ResultArena(size_t capacity) : capacity_(capacity) {
+  assert(capacity > 0);
+}
+
+ResultArena::Handle ResultArena::add(std::span<const float> values,
+                                     std::span<const float> confidence) {
+  assert(confidence.empty() || confidence.size() == values.size());
+  std::lock_guard lock(mtx_);
+  if (values.empty() || values.size() > capacity_) {
+    return {};
+  }
+  Handle handle{written_, static_cast<uint32_t>(values.size()),
+                !confidence.empty()};
+  // Copy in up to two parts, either side of the wrap
+  const auto offset = static_cast<size_t>(written_ % capacity_);
+  const auto firstPart = std::min(values.size(), capacity_ - offset);
+  growTo(firstPart < values.size() ? capacity_ : offset + firstPart);
+  std::copy_n(values.begin(), firstPart, values_.begin() + offset);
+  std::copy(values.begin() + firstPart, values.end(), values_.begin());
+  if (!confidence.empty()) {
+    std::copy_n(confidence.begin(), firstPart, confidence_.begin() + offset);
+    std::copy(confidence.begin() + firstPart, confidence.end(),
+              confidence_.begin());
+  }
+  written_ += values.size();
+  return handle;
+}
+
+bool ResultArena::read(const Handle& handle,
+                       std::vector<float>& values,
+                       std::vector<float>* confidence) {
+  std::lock_guard lock(mtx_);
+  values.clear();
+  if (confidence) {
+    confidence->clear();
+  }
+  if (!isValid(handle)) {
+    return false;
+  }
+  values.resize(handle.count);
+  copyOut(values_, handle.start, values);
+  if (confidence && handle.hasConfidence) {
+    confidence->resize(handle.count);
+    copyOut(confidence_, handle.start, *confidence);
+  }
+  return true;
+}
+
+void ResultArena::clear() {
+  // Invalidates every handle without touching the storage
+  std::lock_guard lock(mtx_);
+  written_ += capacity_;
+}
+
+size_t ResultArena::getCapacity() const {
+  return capacity_;
+}
+
+bool ResultArena::isValid(const Handle& handle) const {
+  // mtx_ must be held
+  return handle.count > 0 && handle.start + handle.count <= written_ &&
+         handle.start + capacity_ >= written_;
+}
+
+void ResultArena::growTo(size_t size) {
+  // mtx_ must be held
+  if (size <= values_.size()) {
+    return;
+  }
+  // Doubling, so a full arena is only copied a handful of times getting there
+  size = std::min(capacity_, std::max({size, values_.size() * 2, growthChunk}));
+  values_.resize(size, 0.f);
+  confidence_.resize(size, 0.f);
+}
+
+void ResultArena::copyOut(const std::vector<float>& from,
+                          uint64_t start,
+                          std::span<float> to) const {
+  const auto offset = static_cast<size_t>(start % capacity_);
+  const auto firstPart = std::min(to.size(), capacity_ - offset);
+  std::copy_n(from.begin() + offset, firstPart, to.begin());
+  std::copy_n(from.begin(), to.size() - firstPart, to.begin() + firstPart);
+}
+
+}  // namespace audio_plugin
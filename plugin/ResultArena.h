@@ -0,0 +1,60 @@
+#pragma once
+
+#include <cstdint>
+#include <mutex>
+#include <span>
+#include <vector>
+
+namespace audio_plugin {
+
+// Per-frame results for every region, so regions only carry a handle rather
+// than vectors of their own.
+//
+// Stored structure-of-arrays (scores and confidence in separate arrays) in
+// one ring, so drawing a curve reads contiguous floats and nothing is
+// allocated per region. Once full the oldest frames are overwritten, after
+// which their handles read as empty - by then their regions have usually
+// aged out of the history anyway. Storage grows as frames arrive, so an
+// instance that never gets any doesn't pay for it.
+class ResultArena {
+public:
+  struct Handle {
+    uint64_t start{0};  // Position in everything ever written
+    uint32_t count{0};
+    bool hasConfidence{false};
+  };
+
+  // About 3.5 hours of 5s regions every 2.5s at 10 frames/s (2MB once full)
+  static constexpr size_t defaultCapacity{size_t{1} << 18};
+  // The least storage is grown by at a time
+  static constexpr size_t growthChunk{size_t{1} << 12};
+
+  explicit ResultArena(size_t capacity = defaultCapacity);
+
+  // confidence is either empty or one per value
+  Handle add(std::span<const float> values, std::span<const float> confidence);
+  // Copies out a region's frames. False if it has none or they have been
+  // overwritten. confidence is left empty if there isn't any.
+  bool read(const Handle& handle,
+            std::vector<float>& values,
+            std::vector<float>* confidence = nullptr);
+  void clear();
+  size_t getCapacity() const;
+
+private:
+  bool isValid(const Handle& handle) const;
+  // Grows the storage to hold at least the first size frames of the ring
+  void growTo(size_t size);
+  void copyOut(const std::vector<float>& from,
+               uint64_t start,
+               std::span<float> to) const;
+
+  const size_t capacity_;
+  std::mutex mtx_;
+  // Up to capacity_, grown as frames arrive
+  std::vector<float> values_;
+  std::vector<float> confidence_;
+  uint64_t written_{0};
+};
+
+}  // namespace audio_plugin
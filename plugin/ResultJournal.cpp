@@ -0,0 +1,400 @@
+#include "ResultJournal.h"
+#include "AnalysisRegions.h"
+#include <cmath>
+#include <cstring>
+#include <fstream>
+#include <iterator>
+#include <limits>
+#include <sstream>
+
+#ifdef _WIN32
+#include <io.h>
+#else
+#include <unistd.h>
+#endif
+
+namespace {
+
+constexpr uint8_t hasPlayhead{1};
+constexpr uint8_t duringPlayback{2};
+constexpr uint8_t offline{4};
+constexpr uint8_t infill{8};
+
+template <typename T>
+void put(uint8_t*& out, T value) {
+  std::memcpy(out, &value, sizeof(value));
+  out += sizeof(value);
+}
+
+template <typename T>
+T get(const uint8_t*& in) {
+  T value;
+  std::memcpy(&value, in, sizeof(value));
+  in += sizeof(value);
+  return value;
+}
+
+// NaN when not known
+float orNan(const std::optional<float>& value) {
+  return value.value_or(std::numeric_limits<float>::quiet_NaN());
+}
+
+std::optional<float> fromNan(float value) {
+  return std::isnan(value) ? std::nullopt : std::optional<float>(value);
+}
+
+std::optional<float> duration(double fromMs, double toMs) {
+  if (fromMs == 0.0 || toMs == 0.0) {
+    return std::nullopt;
+  }
+  return static_cast<float>(toMs - fromMs);
+}
+
+std::string format(const std::optional<float>& value) {
+  return value ? std::to_string(*value) : std::string();
+}
+
+std::string formatJson(const std::optional<float>& value) {
+  return value ? std::to_string(*value) : std::string("null");
+}
+
+const char* stateName(uint8_t state) {
+  static const char* names[] = {"pending", "in_progress", "complete",
+                                "timeout", "failure"};
+  return state < std::size(names) ? names[state] : "unknown";
+}
+
+}  // namespace
+
+namespace audio_plugin {
+
+ResultJournal::ResultJournal(const Config& config)
+    : juce::Thread("Result Journal"),
+      config_(config),
+      queue_(std::make_unique<std::array<uint8_t, recordSize>[]>(
+          queueCapacity)) {
+  static_assert((queueCapacity & (queueCapacity - 1)) == 0);
+  auto labels = "client=\"" + config.prefix + "\"";
+  recordsWritten_ = metrics_->counter("whisper_plugin_journal_records_total",
+                                      "Regions written to the journal", labels);
+  recordsDropped_ = metrics_->counter(
+      "whisper_plugin_journal_dropped_total",
+      "Regions not journaled because the writer had fallen behind", labels);
+  startThread(juce::Thread::Priority::background);
+}
+
+ResultJournal::~ResultJournal() {
+  // The writer drains the queue before it exits
+  signalThreadShouldExit();
+  notify();
+  stopThread(5000);
+}
+
+std::unique_ptr<ResultJournal> ResultJournal::fromEnvironment(
+    const std::string& prefix) {
+  auto directory =
+      juce::SystemStats::getEnvironmentVariable("WHISPER_JOURNAL_DIR", {});
+  if (directory.isEmpty()) {
+    return nullptr;
+  }
+  Config config;
+  config.directory = directory.toStdString();
+  config.prefix = prefix;
+  auto maxMb = juce::SystemStats::getEnvironmentVariable(
+                   "WHISPER_JOURNAL_MAX_MB", "64")
+                   .getIntValue();
+  config.maxFileBytes = static_cast<uint64_t>(std::max(1, maxMb)) << 20;
+  config.syncIntervalMs = std::max(
+      10, juce::SystemStats::getEnvironmentVariable("WHISPER_JOURNAL_SYNC_MS",
+                                                    "1000")
+              .getIntValue());
+  return std::make_unique<ResultJournal>(config);
+}
+
+bool ResultJournal::push(const Region& region) {
+  auto tail = tail_.load(std::memory_order_relaxed);
+  if (tail - head_.load(std::memory_order_acquire) >= queueCapacity) {
+    dropped_++;
+    recordsDropped_->inc();
+    return false;
+  }
+  auto record = toRecord(region, juce::Time::currentTimeMillis());
+  encode(record, queue_[tail & (queueCapacity - 1)].data());
+  tail_.store(tail + 1, std::memory_order_release);
+  return true;
+}
+
+uint64_t ResultJournal::getNumWritten() {
+  return written_;
+}
+
+uint64_t ResultJournal::getNumDropped() {
+  return dropped_;
+}
+
+std::vector<std::filesystem::path> ResultJournal::getFiles() {
+  std::lock_guard lock(filesMtx_);
+  return files_;
+}
+
+void ResultJournal::run() {
+  auto lastSyncMs = juce::Time::getMillisecondCounterHiRes();
+  while (!threadShouldExit()) {
+    // Polled, so pushing never has to wake us
+    wait(100);
+    writeQueued();
+    auto nowMs = juce::Time::getMillisecondCounterHiRes();
+    if (nowMs - lastSyncMs >= config_.syncIntervalMs) {
+      sync();
+      lastSyncMs = nowMs;
+    }
+  }
+  writeQueued();
+  closeFile();
+}
+
+void ResultJournal::writeQueued() {
+  auto head = head_.load(std::memory_order_relaxed);
+  auto tail = tail_.load(std::memory_order_acquire);
+  while (head != tail) {
+    if (!file_ && !openNextFile()) {
+      // Kept queued (and dropped once full) until the disk is back
+      return;
+    }
+    // Up to the end of this file, in one write
+    auto room = (config_.maxFileBytes - std::min(config_.maxFileBytes,
+                                                 fileBytes_)) / recordSize;
+    auto count = std::min<uint64_t>(tail - head, std::max<uint64_t>(room, 1));
+    writeBuffer_.resize(static_cast<size_t>(count) * recordSize);
+    for (uint64_t i = 0; i < count; i++) {
+      std::memcpy(writeBuffer_.data() + i * recordSize,
+                  queue_[(head + i) & (queueCapacity - 1)].data(), recordSize);
+    }
+    head += count;
+    head_.store(head, std::memory_order_release);
+    auto wrote = std::fwrite(writeBuffer_.data(), 1, writeBuffer_.size(), file_);
+    fileBytes_ += wrote;
+    written_ += wrote / recordSize;
+    recordsWritten_->inc(wrote / recordSize);
+    // Already off the queue, so a short write loses the rest
+    if (auto lost = count - wrote / recordSize; lost > 0) {
+      dropped_ += lost;
+      recordsDropped_->inc(lost);
+    }
+    if (wrote != writeBuffer_.size() || fileBytes_ >= config_.maxFileBytes) {
+      // Rotated, or the disk is full - either way, on to a new file
+      closeFile();
+    }
+  }
+}
+
+bool ResultJournal::openNextFile() {
+  std::error_code error;
+  std::filesystem::create_directories(config_.directory, error);
+  // Never appends to (or replaces) an existing file
+  std::filesystem::path path;
+  do {
+    auto number = std::to_string(++fileCount_);
+    number.insert(0, number.size() < 4 ? 4 - number.size() : 0, '0');
+    path = config_.directory /
+           (config_.prefix + "-" + number + fileExtension);
+  } while (std::filesystem::exists(path, error));
+#ifdef _WIN32
+  file_ = _wfopen(path.c_str(), L"wb");
+#else
+  file_ = std::fopen(path.c_str(), "wb");
+#endif
+  if (!file_) {
+    return false;
+  }
+  std::array<uint8_t, fileHeaderSize> header{};
+  auto out = header.data();
+  std::memcpy(out, fileMagic, sizeof(fileMagic));
+  out += sizeof(fileMagic);
+  put(out, static_cast<uint32_t>(recordSize));
+  put(out, static_cast<int64_t>(juce::Time::currentTimeMillis()));
+  fileBytes_ = std::fwrite(header.data(), 1, header.size(), file_);
+  {
+    std::lock_guard lock(filesMtx_);
+    files_.push_back(path);
+  }
+  return true;
+}
+
+void ResultJournal::sync() {
+  if (!file_) {
+    return;
+  }
+  std::fflush(file_);
+#ifdef _WIN32
+  _commit(_fileno(file_));
+#else
+  fsync(fileno(file_));
+#endif
+}
+
+void ResultJournal::closeFile() {
+  if (!file_) {
+    return;
+  }
+  sync();
+  std::fclose(file_);
+  file_ = nullptr;
+  fileBytes_ = 0;
+}
+
+ResultJournal::Record ResultJournal::toRecord(const Region& region,
+                                              int64_t finishedUnixMs) {
+  Record record;
+  record.finishedUnixMs = finishedUnixMs;
+  record.startSampleCounter = region.start.sampleCounter;
+  record.endSampleCounter = region.end.sampleCounter;
+  if (region.start.playheadTime && region.end.playheadTime) {
+    record.playheadStart = region.start.playheadTime;
+    record.playheadEnd = region.end.playheadTime;
+  }
+  record.sampleRate = region.start.sampleRate;
+  record.result = region.analysisResult;
+  record.state = static_cast<uint8_t>(region.analysisState);
+  record.stream = region.stream;
+  record.attempts = region.attempts;
+  record.duringPlayback = region.wasDuringPlayback;
+  record.offline = region.duringOfflineRender;
+  record.infill = region.infill;
+  record.sendWaitMs = duration(region.createdMs, region.sentMs);
+  record.roundTripMs = duration(region.sentMs, region.receivedMs);
+  record.applyMs = duration(region.receivedMs, region.appliedMs);
+  if (region.serviceQueueMs) {
+    record.serviceQueueMs = static_cast<float>(*region.serviceQueueMs);
+  }
+  if (region.serviceInferenceMs) {
+    record.serviceInferenceMs = static_cast<float>(*region.serviceInferenceMs);
+  }
+  return record;
+}
+
+void ResultJournal::encode(const Record& record, uint8_t* out) {
+  // Assumes a little-endian host, as everything else here does
+  put(out, static_cast<int64_t>(record.finishedUnixMs));
+  put(out, static_cast<int64_t>(record.startSampleCounter));
+  put(out, static_cast<int64_t>(record.endSampleCounter));
+  put(out, static_cast<int64_t>(record.playheadStart.value_or(0)));
+  put(out, static_cast<int64_t>(record.playheadEnd.value_or(0)));
+  put(out, static_cast<uint32_t>(record.sampleRate));
+  put(out, record.result);
+  put(out, record.state);
+  put(out, record.stream);
+  put(out, record.attempts);
+  put(out, static_cast<uint8_t>((record.playheadStart ? hasPlayhead : 0) |
+                                (record.duringPlayback ? duringPlayback : 0) |
+                                (record.offline ? offline : 0) |
+                                (record.infill ? infill : 0)));
+  put(out, orNan(record.sendWaitMs));
+  put(out, orNan(record.roundTripMs));
+  put(out, orNan(record.applyMs));
+  put(out, orNan(record.serviceQueueMs));
+  put(out, orNan(record.serviceInferenceMs));
+}
+
+ResultJournal::Record ResultJournal::decode(const uint8_t* in) {
+  Record record;
+  record.finishedUnixMs = get<int64_t>(in);
+  record.startSampleCounter = get<int64_t>(in);
+  record.endSampleCounter = get<int64_t>(in);
+  auto playheadStart = get<int64_t>(in);
+  auto playheadEnd = get<int64_t>(in);
+  record.sampleRate = get<uint32_t>(in);
+  record.result = get<float>(in);
+  record.state = get<uint8_t>(in);
+  record.stream = get<uint8_t>(in);
+  record.attempts = get<uint8_t>(in);
+  auto flags = get<uint8_t>(in);
+  if (flags & hasPlayhead) {
+    record.playheadStart = playheadStart;
+    record.playheadEnd = playheadEnd;
+  }
+  record.duringPlayback = flags & duringPlayback;
+  record.offline = flags & offline;
+  record.infill = flags & infill;
+  record.sendWaitMs = fromNan(get<float>(in));
+  record.roundTripMs = fromNan(get<float>(in));
+  record.applyMs = fromNan(get<float>(in));
+  record.serviceQueueMs = fromNan(get<float>(in));
+  record.serviceInferenceMs = fromNan(get<float>(in));
+  return record;
+}
+
+std::vector<ResultJournal::Record> ResultJournal::readFile(
+    const std::filesystem::path& file) {
+  std::ifstream in(file, std::ios::binary);
+  std::vector<uint8_t> bytes((std::istreambuf_iterator<char>(in)),
+                             std::istreambuf_iterator<char>());
+  std::vector<Record> records;
+  if (bytes.size() < fileHeaderSize ||
+      std::memcmp(bytes.data(), fileMagic, sizeof(fileMagic)) != 0) {
+    return records;
+  }
+  const uint8_t* header = bytes.data() + sizeof(fileMagic);
+  // Later versions may add to the end of each record
+  auto size = get<uint32_t>(header);
+  if (size < recordSize) {
+    return records;
+  }
+  for (size_t pos = fileHeaderSize; pos + size <= bytes.size(); pos += size) {
+    records.push_back(decode(bytes.data() + pos));
+  }
+  return records;
+}
+
+std::string ResultJournal::toCsvHeader() {
+  return "finished_unix_ms,stream,state,start_sample,end_sample,sample_rate,"
+         "playhead_start,playhead_end,result,attempts,during_playback,"
+         "offline,infill,send_wait_ms,round_trip_ms,apply_ms,"
+         "service_queue_ms,service_inference_ms";
+}
+
+std::string ResultJournal::toCsv(const Record& record) {
+  std::ostringstream out;
+  out << record.finishedUnixMs << "," << static_cast<int>(record.stream)
+      << "," << stateName(record.state) << "," << record.startSampleCounter
+      << "," << record.endSampleCounter << "," << record.sampleRate << ","
+      << (record.playheadStart ? std::to_string(*record.playheadStart) : "")
+      << ","
+      << (record.playheadEnd ? std::to_string(*record.playheadEnd) : "")
+      << "," << record.result << "," << static_cast<int>(record.attempts)
+      << "," << record.duringPlayback << "," << record.offline << ","
+      << record.infill << "," << format(record.sendWaitMs) << ","
+      << format(record.roundTripMs) << "," << format(record.applyMs) << ","
+      << format(record.serviceQueueMs) << ","
+      << format(record.serviceInferenceMs);
+  return out.str();
+}
+
+std::string ResultJournal::toJson(const Record& record) {
+  auto optional = [](const std::optional<PlayheadTime>& value) {
+    return value ? std::to_string(*value) : std::string("null");
+  };
+  std::ostringstream out;
+  out << "{\"finished_unix_ms\": " << record.finishedUnixMs
+      << ", \"stream\": " << static_cast<int>(record.stream)
+      << ", \"state\": \"" << stateName(record.state)
+      << "\", \"start_sample\": " << record.startSampleCounter
+      << ", \"end_sample\": " << record.endSampleCounter
+      << ", \"sample_rate\": " << record.sampleRate
+      << ", \"playhead_start\": " << optional(record.playheadStart)
+      << ", \"playhead_end\": " << optional(record.playheadEnd)
+      << ", \"result\": " << record.result
+      << ", \"attempts\": " << static_cast<int>(record.attempts)
+      << ", \"during_playback\": " << (record.duringPlayback ? "true" : "false")
+      << ", \"offline\": " << (record.offline ? "true" : "false")
+      << ", \"infill\": " << (record.infill ? "true" : "false")
+      << ", \"send_wait_ms\": " << formatJson(record.sendWaitMs)
+      << ", \"round_trip_ms\": " << formatJson(record.roundTripMs)
+      << ", \"apply_ms\": " << formatJson(record.applyMs)
+      << ", \"service_queue_ms\": " << formatJson(record.serviceQueueMs)
+      << ", \"service_inference_ms\": "
+      << formatJson(record.serviceInferenceMs) << "}";
+  return out.str();
+}
+
+}  // namespace audio_plugin
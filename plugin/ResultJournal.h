@@ -0,0 +1,131 @@
+#pragma once
+
+#include <juce_core/juce_core.h>
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <cstdio>
+#include <filesystem>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <vector>
+#include "Metrics.h"
+#include "Types.h"
+
+namespace audio_plugin {
+
+struct Region;
+
+// Every region that completes or fails, kept on disk for QC reports and so
+// results survive a crash.
+//
+// Regions are copied into a fixed size lock-free queue and written by a
+// background thread, so recording one never waits on the disk or a lock. If
+// the writer falls so far behind that the queue fills, regions are dropped
+// (and counted) rather than waited for. Files are append only: a fixed
+// header then fixed size records (all little-endian), synced to disk
+// periodically and rotated once they reach a size. A record torn by a crash
+// is ignored when read. Configured through environment variables:
+//
+//   WHISPER_JOURNAL_DIR      Write journals here (nothing is written unless
+//                            this is set)
+//   WHISPER_JOURNAL_MAX_MB   Start a new file after this many MB (default 64)
+//   WHISPER_JOURNAL_SYNC_MS  How often to sync to disk (default 1000)
+//
+// Read back with readFile(), or the whisper-journal tool.
+class ResultJournal : private juce::Thread {
+public:
+  // "WRJ" + version, then the record size, then when the file was started
+  static constexpr uint8_t fileMagic[4]{'W', 'R', 'J', 1};
+  static constexpr size_t fileHeaderSize{16};
+  static constexpr size_t recordSize{72};
+  static constexpr size_t queueCapacity{4096};  // Power of two
+  static constexpr const char* fileExtension{".wrj"};
+
+  struct Record {
+    int64_t finishedUnixMs{0};  // Wall clock
+    SampleCounter startSampleCounter{0};
+    SampleCounter endSampleCounter{0};
+    std::optional<PlayheadTime> playheadStart;  // If from playback
+    std::optional<PlayheadTime> playheadEnd;
+    SampleRate sampleRate{0};
+    float result{0.f};
+    uint8_t state{0};  // Region::State
+    uint8_t stream{0};
+    uint8_t attempts{0};
+    bool duringPlayback{false};
+    bool offline{false};
+    bool infill{false};
+    // Durations, if known: created -> sent, sent -> reply, reply -> applied
+    std::optional<float> sendWaitMs;
+    std::optional<float> roundTripMs;
+    std::optional<float> applyMs;
+    // As reported by the service
+    std::optional<float> serviceQueueMs;
+    std::optional<float> serviceInferenceMs;
+  };
+
+  struct Config {
+    std::filesystem::path directory;
+    std::string prefix;  // File names are <prefix>-<n>.wrj
+    uint64_t maxFileBytes{uint64_t{64} << 20};
+    int syncIntervalMs{1000};
+  };
+
+  explicit ResultJournal(const Config& config);
+  ~ResultJournal() override;
+  // From the environment (see above), or nullptr if it isn't configured
+  static std::unique_ptr<ResultJournal> fromEnvironment(
+      const std::string& prefix);
+
+  // One producer at a time. Every AnalysisRegions sharing a journal (each
+  // stream's, and a retired Buff's) has its own lock, so it's calling only
+  // from the message thread - their timers and the editor - that keeps it
+  // to one. Never blocks. False if the queue was full and it was dropped.
+  bool push(const Region& region);
+  uint64_t getNumWritten();
+  uint64_t getNumDropped();
+  // Written so far, oldest first
+  std::vector<std::filesystem::path> getFiles();
+
+  static Record toRecord(const Region& region, int64_t finishedUnixMs);
+  static void encode(const Record& record, uint8_t* out);
+  static Record decode(const uint8_t* in);
+  // Every whole record in a journal file. Empty if it isn't one.
+  static std::vector<Record> readFile(const std::filesystem::path& file);
+  static std::string toCsvHeader();
+  static std::string toCsv(const Record& record);
+  static std::string toJson(const Record& record);
+
+private:
+  void run() override;
+  // Writer thread only
+  bool openNextFile();
+  void writeQueued();
+  void sync();
+  void closeFile();
+
+  const Config config_;
+  // Single producer, single consumer ring. head_ is written by the writer,
+  // tail_ by the producer.
+  std::unique_ptr<std::array<uint8_t, recordSize>[]> queue_;
+  std::atomic<uint64_t> head_{0};
+  std::atomic<uint64_t> tail_{0};
+  std::atomic<uint64_t> written_{0};
+  std::atomic<uint64_t> dropped_{0};
+
+  std::FILE* file_{nullptr};
+  uint64_t fileBytes_{0};
+  uint32_t fileCount_{0};
+  std::vector<uint8_t> writeBuffer_;  // Avoid repeated alloc
+  std::mutex filesMtx_;
+  std::vector<std::filesystem::path> files_;  // Guarded by filesMtx_
+
+  SharedMetricsRegistry metrics_;
+  std::shared_ptr<Counter> recordsWritten_;
+  std::shared_ptr<Counter> recordsDropped_;
+};
+
+}  // namespace audio_plugin
@@ -0,0 +1,305 @@
+#include "SharedAudioRing.h"
+#include <algorithm>
+#include <cassert>
+#include <random>
+#include <sstream>
+
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+namespace audio_plugin {
+
+namespace {
+
+uint64_t readU64(const uint8_t* src) {
+  uint64_t value;
+  std::memcpy(&value, src, sizeof(value));
+  return value;
+}
+
+uint32_t readU32(const uint8_t* src) {
+  uint32_t value;
+  std::memcpy(&value, src, sizeof(value));
+  return value;
+}
+
+std::atomic_ref<uint64_t> generationOf(uint8_t* slot) {
+  return std::atomic_ref<uint64_t>(*reinterpret_cast<uint64_t*>(slot));
+}
+
+std::string makeRingName() {
+  // Short enough for macOS (31 characters with the leading slash)
+  std::random_device rd;
+  std::ostringstream oss;
+  oss << "wsa-" << std::hex << rd() << rd();
+  return oss.str();
+}
+
+}  // namespace
+
+void SharedAudioRing::Descriptor::writeTo(uint8_t* dest) const {
+  std::memcpy(dest, &generation, sizeof(generation));
+  std::memcpy(dest + 8, &slot, sizeof(slot));
+  std::memcpy(dest + 12, &samples, sizeof(samples));
+  std::memcpy(dest + fixedSize, name.data(), name.size());
+}
+
+std::optional<SharedAudioRing::Descriptor>
+SharedAudioRing::Descriptor::readFrom(const uint8_t* src, size_t size) {
+  if (size <= fixedSize) {
+    return {};
+  }
+  Descriptor descriptor;
+  descriptor.generation = readU64(src);
+  descriptor.slot = readU32(src + 8);
+  descriptor.samples = readU32(src + 12);
+  descriptor.name.assign(reinterpret_cast<const char*>(src + fixedSize),
+                         size - fixedSize);
+  return descriptor;
+}
+
+SharedAudioRing::SharedAudioRing(size_t slotCount, size_t slotSamples)
+    : name_(makeRingName()),
+      slotCount_(slotCount),
+      slotSamples_(slotSamples),
+      slotStride_(slotHeaderSize +
+                  ((slotSamples * sizeof(float) + slotHeaderSize - 1) /
+                   slotHeaderSize) *
+                      slotHeaderSize),
+      slots_(slotCount) {
+  assert(slotCount > 0 && slotSamples > 0);
+  const size_t bytes = headerSize + slotCount_ * slotStride_;
+
+#ifdef _WIN32
+  // Backed by the page file, and gone once the last handle is closed
+  HANDLE mapping = CreateFileMappingA(
+      INVALID_HANDLE_VALUE, nullptr, PAGE_READWRITE,
+      static_cast<DWORD>(static_cast<uint64_t>(bytes) >> 32),
+      static_cast<DWORD>(bytes), name_.c_str());
+  if (mapping == nullptr) {
+    return;
+  }
+  mappingHandle_ = mapping;
+  auto view = MapViewOfFile(mapping, FILE_MAP_ALL_ACCESS, 0, 0, bytes);
+  if (view == nullptr) {
+    return;
+  }
+  mapping_ = static_cast<uint8_t*>(view);
+#else
+  const auto path = "/" + name_;
+  int fd = shm_open(path.c_str(), O_RDWR | O_CREAT | O_EXCL, 0600);
+  if (fd < 0) {
+    return;
+  }
+  // Pages are only allocated as slots are written
+  if (ftruncate(fd, static_cast<off_t>(bytes)) != 0) {
+    close(fd);
+    shm_unlink(path.c_str());
+    return;
+  }
+  void* mapping =
+      mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if (mapping == MAP_FAILED) {
+    shm_unlink(path.c_str());
+    return;
+  }
+  mapping_ = static_cast<uint8_t*>(mapping);
+#endif
+  bytes_ = bytes;
+
+  std::memcpy(mapping_, magic, sizeof(magic));
+  const auto count = static_cast<uint32_t>(slotCount_);
+  const auto samples = static_cast<uint32_t>(slotSamples_);
+  const auto stride = static_cast<uint32_t>(slotStride_);
+  std::memcpy(mapping_ + 4, &count, sizeof(count));
+  std::memcpy(mapping_ + 8, &samples, sizeof(samples));
+  std::memcpy(mapping_ + 12, &stride, sizeof(stride));
+}
+
+SharedAudioRing::~SharedAudioRing() {
+#ifdef _WIN32
+  if (mapping_) {
+    UnmapViewOfFile(mapping_);
+  }
+  if (mappingHandle_) {
+    CloseHandle(mappingHandle_);
+  }
+#else
+  if (mapping_) {
+    munmap(mapping_, bytes_);
+    // Readers keep their own mappings until they let go
+    shm_unlink(("/" + name_).c_str());
+  }
+#endif
+}
+
+bool SharedAudioRing::isValid() const {
+  return mapping_ != nullptr;
+}
+
+const std::string& SharedAudioRing::getName() const {
+  return name_;
+}
+
+size_t SharedAudioRing::getSlotSamples() const {
+  return slotSamples_;
+}
+
+uint8_t* SharedAudioRing::slotAddress(size_t slot) const {
+  return mapping_ + headerSize + slot * slotStride_;
+}
+
+std::optional<SharedAudioRing::Descriptor> SharedAudioRing::write(
+    int64_t requestId,
+    size_t numSamples,
+    const std::function<void(std::span<float>)>& fill) {
+  if (!isValid() || numSamples > slotSamples_) {
+    return {};
+  }
+  std::lock_guard lock(mtx_);
+  // A free slot, or failing that the one waiting longest
+  auto slot = std::min_element(
+      slots_.begin(), slots_.end(), [](const auto& lhs, const auto& rhs) {
+        if (lhs.inUse != rhs.inUse) {
+          return !lhs.inUse;
+        }
+        return lhs.lastUsed < rhs.lastUsed;
+      });
+  *slot = SlotState{requestId, ++useCounter_, true};
+  const auto index = static_cast<size_t>(slot - slots_.begin());
+
+  auto address = slotAddress(index);
+  auto generation = generationOf(address);
+  const auto previous = generation.load(std::memory_order_relaxed);
+  generation.store(previous + 1, std::memory_order_relaxed);  // Odd: writing
+  std::atomic_thread_fence(std::memory_order_release);
+  const uint64_t samples{numSamples};
+  std::memcpy(address + 8, &samples, sizeof(samples));
+  fill(std::span<float>(reinterpret_cast<float*>(address + slotHeaderSize),
+                        numSamples));
+  generation.store(previous + 2, std::memory_order_release);
+
+  return Descriptor{previous + 2, static_cast<uint32_t>(index),
+                    static_cast<uint32_t>(numSamples), name_};
+}
+
+void SharedAudioRing::releaseAll() {
+  std::lock_guard lock(mtx_);
+  for (auto& slot : slots_) {
+    slot.inUse = false;
+  }
+}
+
+size_t SharedAudioRing::slotsInUse() {
+  std::lock_guard lock(mtx_);
+  return static_cast<size_t>(
+      std::count_if(slots_.begin(), slots_.end(),
+                    [](const auto& slot) { return slot.inUse; }));
+}
+
+void SharedAudioRing::release(int64_t requestId) {
+  std::lock_guard lock(mtx_);
+  for (auto& slot : slots_) {
+    if (slot.inUse && slot.requestId == requestId) {
+      slot.inUse = false;
+      return;
+    }
+  }
+}
+
+SharedAudioRing::Reader::Reader(const std::string& name) {
+#ifdef _WIN32
+  HANDLE mapping = OpenFileMappingA(FILE_MAP_READ, FALSE, name.c_str());
+  if (mapping == nullptr) {
+    return;
+  }
+  mappingHandle_ = mapping;
+  auto view = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+  if (view == nullptr) {
+    return;
+  }
+  mapping_ = static_cast<const uint8_t*>(view);
+  MEMORY_BASIC_INFORMATION info{};
+  VirtualQuery(view, &info, sizeof(info));
+  bytes_ = info.RegionSize;
+#else
+  int fd = shm_open(("/" + name).c_str(), O_RDONLY, 0);
+  if (fd < 0) {
+    return;
+  }
+  off_t size = lseek(fd, 0, SEEK_END);
+  if (size < static_cast<off_t>(headerSize)) {
+    close(fd);
+    return;
+  }
+  void* mapping = mmap(nullptr, static_cast<size_t>(size), PROT_READ,
+                       MAP_SHARED, fd, 0);
+  close(fd);
+  if (mapping == MAP_FAILED) {
+    return;
+  }
+  mapping_ = static_cast<const uint8_t*>(mapping);
+  bytes_ = static_cast<size_t>(size);
+#endif
+  if (std::memcmp(mapping_, magic, sizeof(magic)) != 0) {
+    return;
+  }
+  slotCount_ = readU32(mapping_ + 4);
+  slotSamples_ = readU32(mapping_ + 8);
+  slotStride_ = readU32(mapping_ + 12);
+}
+
+SharedAudioRing::Reader::~Reader() {
+#ifdef _WIN32
+  if (mapping_) {
+    UnmapViewOfFile(mapping_);
+  }
+  if (mappingHandle_) {
+    CloseHandle(mappingHandle_);
+  }
+#else
+  if (mapping_) {
+    munmap(const_cast<uint8_t*>(mapping_), bytes_);
+  }
+#endif
+}
+
+bool SharedAudioRing::Reader::isValid() const {
+  return slotCount_ > 0 &&
+         headerSize + static_cast<size_t>(slotCount_) * slotStride_ <= bytes_;
+}
+
+std::optional<std::span<const float>> SharedAudioRing::Reader::view(
+    const Descriptor& descriptor) {
+  if (!isValid() || descriptor.slot >= slotCount_ ||
+      descriptor.samples > slotSamples_ || !stillValid(descriptor)) {
+    return {};
+  }
+  auto address = mapping_ + headerSize +
+                 static_cast<size_t>(descriptor.slot) * slotStride_;
+  return std::span<const float>(
+      reinterpret_cast<const float*>(address + slotHeaderSize),
+      descriptor.samples);
+}
+
+bool SharedAudioRing::Reader::stillValid(const Descriptor& descriptor) const {
+  if (!isValid() || descriptor.slot >= slotCount_) {
+    return false;
+  }
+  auto address = const_cast<uint8_t*>(mapping_) + headerSize +
+                 static_cast<size_t>(descriptor.slot) * slotStride_;
+  std::atomic_thread_fence(std::memory_order_acquire);
+  return generationOf(address).load(std::memory_order_acquire) ==
+         descriptor.generation;
+}
+
+}  // namespace audio_plugin
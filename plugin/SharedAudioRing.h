@@ -0,0 +1,123 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <mutex>
+#include <optional>
+#include <span>
+#include <string>
+#include <vector>
+
+namespace audio_plugin {
+
+// Regions' audio in named shared memory, for a service on the same machine
+// to read in place. Requests then carry a small descriptor rather than the
+// audio itself.
+//
+// Fixed size slots, each headed by a seqlock style generation (odd while
+// being written). A slot is reused once its reply arrives, or if every slot
+// is waiting, the one sent longest ago is taken back. Readers check the
+// generation is still the one they were given once they have read, so a
+// slot reused underneath them fails the request rather than analysing the
+// wrong audio.
+//
+// Layout (little-endian): "WSA" + version, uint32 slot count, uint32 slot
+// samples, uint32 slot stride (bytes), padded to headerSize. Then each slot:
+// uint64 generation, uint64 sample count, padded to slotHeaderSize, then the
+// float32 samples.
+class SharedAudioRing {
+public:
+  static constexpr uint8_t magic[4]{'W', 'S', 'A', 1};
+  static constexpr size_t headerSize{64};
+  static constexpr size_t slotHeaderSize{64};
+  // Whisper's whole window, so any region fits. Senders that know their
+  // region length size slots to that instead.
+  static constexpr size_t defaultSlotSamples{16000 * 30};
+  static constexpr size_t defaultSlots{16};
+
+  // Follows the request ID in place of audio: uint64 generation, uint32
+  // slot, uint32 sample count, then the ring's name
+  struct Descriptor {
+    uint64_t generation{0};
+    uint32_t slot{0};
+    uint32_t samples{0};
+    std::string name;
+
+    static constexpr size_t fixedSize{16};
+    size_t size() const { return fixedSize + name.size(); }
+    void writeTo(uint8_t* dest) const;
+    static std::optional<Descriptor> readFrom(const uint8_t* src, size_t size);
+  };
+
+  SharedAudioRing(size_t slotCount = defaultSlots,
+                  size_t slotSamples = defaultSlotSamples);
+  ~SharedAudioRing();
+
+  // False if the shared memory couldn't be created (send audio inline)
+  bool isValid() const;
+  const std::string& getName() const;
+  size_t getSlotSamples() const;
+
+  // Fills a slot with numSamples via fill, on behalf of requestId. Empty if
+  // numSamples won't fit in a slot.
+  std::optional<Descriptor> write(
+      int64_t requestId,
+      size_t numSamples,
+      const std::function<void(std::span<float>)>& fill);
+  // The reply for requestId has arrived, so its slot can be reused
+  void release(int64_t requestId);
+  // Every reply outstanding has been written off
+  void releaseAll();
+  // Slots still waiting on a reply
+  size_t slotsInUse();
+
+  // For readers: maps an existing ring (read only) and reads a slot out,
+  // checking it wasn't reused. For tools and tests - the service has its own.
+  class Reader {
+  public:
+    explicit Reader(const std::string& name);
+    ~Reader();
+    bool isValid() const;
+    // The slot's samples while they are still the descriptor's
+    std::optional<std::span<const float>> view(const Descriptor& descriptor);
+    // After reading a view, whether it is still the descriptor's
+    bool stillValid(const Descriptor& descriptor) const;
+
+  private:
+    const uint8_t* mapping_{nullptr};
+    size_t bytes_{0};
+    uint32_t slotCount_{0};
+    uint32_t slotSamples_{0};
+    uint32_t slotStride_{0};
+#ifdef _WIN32
+    void* mappingHandle_{nullptr};
+#endif
+  };
+
+private:
+  struct SlotState {
+    int64_t requestId{0};
+    uint64_t lastUsed{0};
+    bool inUse{false};
+  };
+
+  uint8_t* slotAddress(size_t slot) const;
+
+  std::string name_;
+  size_t slotCount_;
+  size_t slotSamples_;
+  size_t slotStride_;
+  size_t bytes_{0};
+  uint8_t* mapping_{nullptr};
+#ifdef _WIN32
+  void* mappingHandle_{nullptr};
+#endif
+
+  std::mutex mtx_;
+  std::vector<SlotState> slots_;
+  uint64_t useCounter_{0};
+};
+
+}  // namespace audio_plugin
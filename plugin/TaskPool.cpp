@@ -0,0 +1,150 @@
+#include "TaskPool.h"
+
+namespace audio_plugin {
+
+class TaskPool::Worker : public juce::Thread {
+public:
+  Worker(TaskPool& pool, size_t index)
+      : juce::Thread("Task Pool " + juce::String(index)),
+        pool_(pool),
+        index_(index) {}
+
+  void run() override {
+    while (true) {
+      if (pool_.runNext(index_)) {
+        continue;
+      }
+      std::unique_lock lock(pool_.idleMtx_);
+      pool_.taskQueued_.wait(
+          lock, [this] { return pool_.stopping_ || pool_.queued_ > 0; });
+      if (pool_.stopping_) {
+        return;
+      }
+    }
+  }
+
+private:
+  TaskPool& pool_;
+  const size_t index_;
+};
+
+// The chunks of one parallelFor(), claimed in turn by whoever gets to them
+// first. Helpers hold it, so it outlives any that start after it's done.
+struct TaskPool::Job {
+  void* context;
+  void (*call)(void*, size_t);
+  size_t numChunks;
+  std::atomic<size_t> next{0};
+  std::atomic<size_t> done{0};
+
+  void run() {
+    for (auto chunk = next++; chunk < numChunks; chunk = next++) {
+      call(context, chunk);
+      if (++done == numChunks) {
+        done.notify_all();
+      }
+    }
+  }
+};
+
+TaskPool::TaskPool()
+    : TaskPool(std::clamp<size_t>(
+          static_cast<size_t>(juce::SystemStats::getNumCpus()) / 2,
+          1,
+          maxThreads)) {}
+
+TaskPool::TaskPool(size_t numThreads) {
+  numThreads = std::min(numThreads, maxThreads);
+  for (size_t i = 0; i < numThreads; i++) {
+    queues_.push_back(std::make_unique<Queues>());
+  }
+  for (size_t i = 0; i < numThreads; i++) {
+    workers_.push_back(std::make_unique<Worker>(*this, i));
+    // Below the host's audio and GUI threads. parallelFor() callers don't
+    // wait on them for long either way.
+    workers_.back()->startThread(juce::Thread::Priority::low);
+  }
+}
+
+TaskPool::~TaskPool() {
+  // Anything still queued is dropped
+  {
+    std::lock_guard lock(idleMtx_);
+    stopping_ = true;
+  }
+  taskQueued_.notify_all();
+  for (auto& worker : workers_) {
+    worker->stopThread(2000);
+  }
+}
+
+size_t TaskPool::getNumThreads() const {
+  return workers_.size();
+}
+
+void TaskPool::submit(Lane lane, std::function<void()> task) {
+  if (workers_.empty()) {
+    task();
+    return;
+  }
+  auto& queue = *queues_[nextQueue_++ % queues_.size()];
+  {
+    std::lock_guard lock(queue.mtx);
+    queue.lanes[lane].push_back(std::move(task));
+  }
+  queued_++;
+  {
+    // So a worker can't miss it between checking and waiting
+    std::lock_guard lock(idleMtx_);
+  }
+  taskQueued_.notify_one();
+}
+
+bool TaskPool::runNext(size_t worker) {
+  for (auto lane : {GUI, BACKGROUND}) {
+    for (size_t i = 0; i < queues_.size(); i++) {
+      auto& queue = *queues_[(worker + i) % queues_.size()];
+      std::function<void()> task;
+      {
+        std::lock_guard lock(queue.mtx);
+        auto& tasks = queue.lanes[lane];
+        if (tasks.empty()) {
+          continue;
+        }
+        if (i == 0) {
+          task = std::move(tasks.front());
+          tasks.pop_front();
+        } else {
+          task = std::move(tasks.back());
+          tasks.pop_back();
+        }
+      }
+      queued_--;
+      task();
+      return true;
+    }
+  }
+  return false;
+}
+
+void TaskPool::runChunks(Lane lane,
+                         size_t numChunks,
+                         void* context,
+                         void (*call)(void*, size_t)) {
+  auto job = std::make_shared<Job>();
+  job->context = context;
+  job->call = call;
+  job->numChunks = numChunks;
+  auto helpers = std::min(numChunks - 1, workers_.size());
+  for (size_t i = 0; i < helpers; i++) {
+    submit(lane, [job] { job->run(); });
+  }
+  job->run();
+  // Only chunks already started by helpers can be left
+  for (auto done = job->done.load(); done < numChunks;
+       done = job->done.load()) {
+    job->done.wait(done);
+  }
+}
+
+}  // namespace audio_plugin
@@ -0,0 +1,97 @@
+#pragma once
+
+#include <juce_core/juce_core.h>
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+namespace audio_plugin {
+
+// A small, persistent pool of worker threads for splitting up work that's
+// big enough to be worth it, instead of leaving it to the standard library's
+// parallel algorithms (which may start TBB or OpenMP threads of their own).
+//
+// Each worker has its own queue for each lane and takes from the front of
+// its own, then steals from the back of the others'. GUI work is always
+// taken before background work. parallelFor() runs chunks on the calling
+// thread too, so it never waits on a worker that's busy (or at low
+// priority) for longer than doing the work itself would take.
+class TaskPool {
+public:
+  enum Lane { GUI, BACKGROUND };
+  static constexpr size_t maxThreads{4};
+
+  // Half the cores, up to maxThreads
+  TaskPool();
+  // 0 runs everything on the calling thread
+  explicit TaskPool(size_t numThreads);
+  ~TaskPool();
+
+  size_t getNumThreads() const;
+  void submit(Lane lane, std::function<void()> task);
+
+  // Calls fn(begin, end) for chunks covering [0, count), of at least
+  // minChunk (except perhaps the last), and returns once they're all done.
+  // Only splits the work if there is more than one chunk's worth.
+  template <typename Fn>
+  void parallelFor(Lane lane, size_t count, size_t minChunk, Fn&& fn) {
+    minChunk = std::max<size_t>(minChunk, 1);
+    if (count <= minChunk || workers_.empty()) {
+      if (count > 0) {
+        fn(size_t{0}, count);
+      }
+      return;
+    }
+    // A few chunks per thread, to even out uneven ones
+    auto numChunks = std::min((count + minChunk - 1) / minChunk,
+                              (workers_.size() + 1) * 4);
+    auto chunkSize = (count + numChunks - 1) / numChunks;
+    numChunks = (count + chunkSize - 1) / chunkSize;
+    struct Context {
+      Fn& fn;
+      size_t count;
+      size_t chunkSize;
+    } context{fn, count, chunkSize};
+    runChunks(lane, numChunks, &context, [](void* data, size_t chunk) {
+      auto& context = *static_cast<Context*>(data);
+      auto begin = chunk * context.chunkSize;
+      context.fn(begin, std::min(begin + context.chunkSize, context.count));
+    });
+  }
+
+private:
+  class Worker;
+  struct Job;
+
+  void runChunks(Lane lane,
+                 size_t numChunks,
+                 void* context,
+                 void (*call)(void*, size_t));
+  // For workers. Their own queue first, then the others'.
+  bool runNext(size_t worker);
+
+  struct Queues {
+    std::mutex mtx;
+    std::deque<std::function<void()>> lanes[BACKGROUND + 1];
+  };
+  std::vector<std::unique_ptr<Queues>> queues_;  // One per worker
+  std::vector<std::unique_ptr<Worker>> workers_;
+  std::atomic<size_t> nextQueue_{0};  // Where submit() puts the next task
+  // Idle workers wait here for tasks
+  std::mutex idleMtx_;
+  std::condition_variable taskQueued_;
+  std::atomic<size_t> queued_{0};
+  bool stopping_{false};  // Guarded by idleMtx_
+};
+
+// Shared by everything in the process, so plugin instances don't each add
+// their own threads
+using SharedTaskPool = juce::SharedResourcePointer<TaskPool>;
+
+}  // namespace audio_plugin
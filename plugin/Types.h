@@ -2,12 +2,92 @@
 #include <cstdint>
 #include <optional>
 #include <cassert>
+#include <numeric>
 #include <type_traits>
 
 typedef uint32_t SampleRate;
 typedef int64_t SampleCounter;  // need to support neg for priming
 typedef int64_t PlayheadTime;  // same underlying type as juce uses for playhead
 
+// Rounds towards minus infinity, so positions before zero convert the same
+// way as those after it. Without branching. d must be positive.
+constexpr int64_t floorDiv(int64_t x, int64_t d) {
+  return x / d - static_cast<int64_t>((x % d != 0) & (x < 0));
+}
+
+// Converts sample positions from one rate to another exactly, as a multiply
+// and divide by the reduced ratio of the rates (rounding to nearest, halves
+// up), rather than through a double. Positions are split into whole periods
+// of the ratio and what's left, so nothing a SampleCounter can hold
+// overflows unless the result wouldn't fit either.
+//
+// Converting to a higher rate and back always gives the same position, and
+// to a lower rate and back, within half a period of the lower rate.
+class RateConversion {
+public:
+  constexpr RateConversion(SampleRate from, SampleRate to)
+      : RateConversion(between(from, to)) {}
+
+  constexpr SampleRate getFrom() const { return from_; }
+  constexpr SampleRate getTo() const { return to_; }
+  constexpr bool isIdentity() const { return num_ == den_; }
+
+  constexpr int64_t convert(int64_t position) const {
+    auto periods = floorDiv(position, den_);
+    auto remainder = position - periods * den_;
+    return periods * num_ + (2 * remainder * num_ + den_) / (2 * den_);
+  }
+
+  constexpr RateConversion inverse() const {
+    return RateConversion(to_, from_, den_, num_);
+  }
+
+private:
+  constexpr RateConversion(SampleRate from,
+                           SampleRate to,
+                           int64_t num,
+                           int64_t den)
+      : from_(from), to_(to), num_(num), den_(den) {}
+
+  static constexpr RateConversion between(SampleRate from, SampleRate to) {
+    // Host rates to the processing rate are already reduced
+    if (to == 16000) {
+      switch (from) {
+        case 16000:
+          return {from, to, 1, 1};
+        case 44100:
+          return {from, to, 160, 441};
+        case 48000:
+          return {from, to, 1, 3};
+        case 88200:
+          return {from, to, 80, 441};
+        case 96000:
+          return {from, to, 1, 6};
+        case 176400:
+          return {from, to, 40, 441};
+        case 192000:
+          return {from, to, 1, 12};
+      }
+    }
+    assert(from > 0 && to > 0);
+    auto divisor = std::gcd(from, to);
+    return {from, to, to / divisor, from / divisor};
+  }
+
+  SampleRate from_;
+  SampleRate to_;
+  int64_t num_;  // to_ / gcd
+  int64_t den_;  // from_ / gcd
+};
+
+static_assert(RateConversion(44100, 16000).convert(441) == 160);
+static_assert(RateConversion(44100, 16000).convert(-1) == 0);
+static_assert(RateConversion(44100, 16000).convert(-2) == -1);
+static_assert(RateConversion(16000, 44100).convert(160) == 441);
+static_assert(RateConversion(48000, 16000).inverse().convert(1) == 3);
+static_assert(RateConversion(48000, 16000).convert(INT64_MAX - 1) ==
+              (INT64_MAX - 1) / 3);
+
 // This struct describes a point in the audio in time
 //
 // sampleCounter is an ever-increasing count of the number
@@ -34,9 +114,7 @@ struct TimePoint {
   // Overload operators
 
   TimePoint& operator+=(const TimePoint& other) {
-    auto ratio = other.sampleRate / sampleRate;
-    auto otherConv = other / ratio;
-    assert(otherConv.sampleRate == sampleRate);
+    auto otherConv = other.asSampleRate(sampleRate);
     sampleCounter += otherConv.sampleCounter;
     if (playheadTime.has_value() && otherConv.playheadTime.has_value()) {
       *playheadTime += *otherConv.playheadTime;
@@ -71,9 +149,7 @@ struct TimePoint {
   }
 
   TimePoint& operator-=(const TimePoint& other) {
-    auto ratio = other.sampleRate / sampleRate;
-    auto otherConv = other / ratio;
-    assert(otherConv.sampleRate == sampleRate);
+    auto otherConv = other.asSampleRate(sampleRate);
     sampleCounter -= otherConv.sampleCounter;
     if (playheadTime.has_value() && otherConv.playheadTime.has_value()) {
       *playheadTime -= *otherConv.playheadTime;
@@ -107,36 +183,22 @@ struct TimePoint {
     return newTimePoint;
   }
 
-  TimePoint& operator/=(double downsampleRatio) {
-    if (downsampleRatio == 1.0)
-      return *this;
-    double sampleRateDownsampled =
-        static_cast<double>(sampleRate) / downsampleRatio;
-    this->sampleRate = static_cast<SampleRate>(sampleRateDownsampled);
-    double sampleCounterDownsampled =
-        static_cast<double>(sampleCounter) / downsampleRatio;
-    this->sampleCounter = static_cast<SampleCounter>(sampleCounterDownsampled);
-    if (playheadTime.has_value()) {
-      double playheadTimeDownsampled =
-          static_cast<double>(playheadTime.value()) / downsampleRatio;
-      playheadTime = static_cast<PlayheadTime>(playheadTimeDownsampled);
-    }
-    return *this;
-  }
-
-  TimePoint operator/(double downsampleRatio) const {
-    TimePoint newTimePoint = *this;
-    newTimePoint /= downsampleRatio;
-    return newTimePoint;
+  // For conversions done often, make the RateConversion once
+  TimePoint converted(const RateConversion& conversion) const {
+    assert(conversion.getFrom() == sampleRate);
+    // The playhead time is converted whether or not there is one, so
+    // there's nothing to branch on beyond what std::optional does itself
+    auto playhead = conversion.convert(playheadTime.value_or(0));
+    return TimePoint{conversion.getTo(), conversion.convert(sampleCounter),
+                     playheadTime ? std::optional<PlayheadTime>(playhead)
+                                  : std::nullopt};
   }
 
   TimePoint asSampleRate(const SampleRate newSampleRate) const {
     if (newSampleRate == sampleRate) {
       return *this;
     }
-    auto downsampleRatio =
-        static_cast<double>(sampleRate) / static_cast<double>(newSampleRate);
-    return *this / downsampleRatio;
+    return converted(RateConversion(sampleRate, newSampleRate));
   }
 
 };
@@ -150,19 +212,10 @@ struct PlaybackTimePoint {
     if (newSampleRate == sampleRate) {
       return *this;
     }
-    auto downsampleRatio =
-        static_cast<double>(sampleRate) / static_cast<double>(newSampleRate);
-    double sampleRateDownsampled =
-        static_cast<double>(sampleRate) / downsampleRatio;
-    double sampleCounterDownsampled =
-        static_cast<double>(sampleCounter) / downsampleRatio;
-    double playheadTimeDownsampled =
-        static_cast<double>(playheadTime) / downsampleRatio;
-
-    return PlaybackTimePoint{
-        static_cast<SampleRate>(sampleRateDownsampled),
-        static_cast<SampleCounter>(sampleCounterDownsampled),
-        static_cast<PlayheadTime>(playheadTimeDownsampled)};
+    RateConversion conversion(sampleRate, newSampleRate);
+    return PlaybackTimePoint{newSampleRate,
+                             conversion.convert(sampleCounter),
+                             conversion.convert(playheadTime)};
   }
 
 };
@@ -183,4 +236,4 @@ struct PlaybackRegion {
     return PlaybackRegion{newStart, newEnd};
   }
 
-};
\ No newline at end of file
+};
\ No newline at end of file
@@ -9,32 +9,6 @@
 #include <functional>
 #include "Types.h"
 
-// Detect if <execution> and its policies are available
-#if defined(__has_include)
-  #if __has_include(<execution>)
-    #include <execution>
-    #define HAS_EXECUTION_POLICY 1
-  #else
-    #define HAS_EXECUTION_POLICY 0
-  #endif
-#else
-  #define HAS_EXECUTION_POLICY 0
-#endif
-
-// Check if compiling with Apple Clang
-#if defined(__apple_build_version__)
-  #define USE_PARALLEL_POLICY 0
-#else
-  #define USE_PARALLEL_POLICY 1
-#endif
-
-// Define the PREFERRED_EXEC macro based on availability and compiler
-#if HAS_EXECUTION_POLICY && USE_PARALLEL_POLICY
-  #define PREFERRED_EXEC(policy, ...) policy, __VA_ARGS__
-#else
-  #define PREFERRED_EXEC(policy, ...) __VA_ARGS__
-#endif
-
 inline std::string formatTime(SampleCounter sampleCounter, SampleRate samplesPerSecond) {
   // Total time in seconds (floating point for fractional part)
   double totalSeconds = static_cast<double>(sampleCounter) / samplesPerSecond;
@@ -68,7 +42,8 @@ inline SampleCounter toSecBoundary(SampleCounter fromSampleCounter,
 }
 
 inline SampleCounter msToSamples(uint32_t ms, SampleRate refSampleRate) {
-  return (ms * refSampleRate) / 1000;
+  // Widen first - 20 mins at 16KHz overflows 32 bits before the divide
+  return (static_cast<SampleCounter>(ms) * refSampleRate) / 1000;
 }
 
 inline uint32_t samplesToMs(SampleCounter samples, SampleRate refSampleRate) {
@@ -0,0 +1,605 @@
+#include <PluginProcessor.h>
+#include <GuiComponents/Graph.h>
+#include <MockService.h>
+#include <benchmark/benchmark.h>
+#include <cmath>
+#include <cstdint>
+#include <fstream>
+#include <memory>
+#include <string>
+#include <vector>
+
+#if defined(_WIN32)
+#include <windows.h>
+#include <psapi.h>
+#elif defined(__APPLE__)
+#include <mach/mach.h>
+#else
+#include <unistd.h>
+#endif
+
+namespace audio_plugin_benchmark {
+namespace {
+
+// Resident set size of this process, in bytes
+size_t getResidentBytes() {
+#if defined(_WIN32)
+  PROCESS_MEMORY_COUNTERS counters{};
+  if (!GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters)))
+    return 0;
+  return counters.WorkingSetSize;
+#elif defined(__APPLE__)
+  mach_task_basic_info info{};
+  mach_msg_type_number_t count = MACH_TASK_BASIC_INFO_COUNT;
+  if (task_info(mach_task_self(), MACH_TASK_BASIC_INFO,
+                reinterpret_cast<task_info_t>(&info), &count) != KERN_SUCCESS)
+    return 0;
+  return info.resident_size;
+#else
+  std::ifstream statm("/proc/self/statm");
+  size_t totalPages{0}, residentPages{0};
+  statm >> totalPages >> residentPages;
+  return residentPages * static_cast<size_t>(sysconf(_SC_PAGESIZE));
+#endif
+}
+
+void ensureJuceInitialised() {
+  static juce::ScopedJuceInitialiser_GUI juceInit;
+}
+
+constexpr SampleRate processingRate{16000};
+
+// Something other than silence, so nothing gets to take a shortcut
+void fillWithSine(std::vector<float>& samples, SampleCounter from = 0) {
+  for (size_t i = 0; i < samples.size(); i++) {
+    samples[i] = 0.5f * std::sin(0.05f * static_cast<float>(from + i));
+  }
+}
+
+// Writes seconds of history at 16 kHz, returning where it got to. Much
+// faster than real time, so it waits for the encoder like an offline render.
+TimePoint writeHistory(audio_plugin::MonoCircularBuffer& history,
+                       uint32_t seconds) {
+  std::vector<float> block(processingRate);
+  TimePoint time{processingRate, 0, std::nullopt};
+  history.setBlockWhenFull(true);
+  for (uint32_t s = 0; s < seconds; s++) {
+    fillWithSine(block, time.sampleCounter);
+    history.updateFrom(block, time);
+    time += static_cast<SampleCounter>(block.size());
+  }
+  history.setBlockWhenFull(false);
+  return time;
+}
+
+// Block sizes hosts commonly use, from low latency monitoring to bouncing
+void blockSizes(benchmark::internal::Benchmark* b) {
+  for (auto blockSize : {32, 128, 512, 1024, 4096}) {
+    b->Arg(blockSize);
+  }
+}
+
+}  // namespace
+
+// What a host pays for each instance during a plugin scan or session load
+static void BM_InstantiateProcessor(benchmark::State& state) {
+  ensureJuceInitialised();
+  const auto numInstances = static_cast<size_t>(state.range(0));
+  std::vector<std::unique_ptr<audio_plugin::AudioPluginAudioProcessor>>
+      processors;
+  processors.reserve(numInstances);
+  int64_t residentDelta{0};
+
+  for (auto _ : state) {
+    const auto residentBefore = getResidentBytes();
+    for (size_t i = 0; i < numInstances; i++) {
+      processors.push_back(
+          std::make_unique<audio_plugin::AudioPluginAudioProcessor>());
+    }
+    residentDelta = static_cast<int64_t>(getResidentBytes()) -
+                    static_cast<int64_t>(residentBefore);
+
+    state.PauseTiming();
+    processors.clear();
+    state.ResumeTiming();
+  }
+
+  state.counters["rss_per_instance_bytes"] =
+      static_cast<double>(residentDelta) / static_cast<double>(numInstances);
+}
+BENCHMARK(BM_InstantiateProcessor)
+    ->Arg(1)
+    ->Arg(16)
+    ->Unit(benchmark::kMillisecond);
+
+// Host switching sample rate, which rebuilds the history
+static void BM_PrepareToPlay(benchmark::State& state) {
+  ensureJuceInitialised();
+  audio_plugin::AudioPluginAudioProcessor processor;
+  const double sampleRates[] = {44100.0, 48000.0};
+  size_t rateIndex{0};
+  int64_t residentDelta{0};
+
+  for (auto _ : state) {
+    const auto residentBefore = getResidentBytes();
+    processor.prepareToPlay(sampleRates[rateIndex], 512);
+    residentDelta = static_cast<int64_t>(getResidentBytes()) -
+                    static_cast<int64_t>(residentBefore);
+    rateIndex = (rateIndex + 1) % std::size(sampleRates);
+  }
+
+  state.counters["rss_delta_bytes"] = static_cast<double>(residentDelta);
+  state.counters["rss_total_bytes"] = static_cast<double>(getResidentBytes());
+}
+BENCHMARK(BM_PrepareToPlay)->Unit(benchmark::kMillisecond);
+
+// Regions per second ServiceCommunicator can push through a service that
+// takes no time at all, with state.range(0) requests kept in flight
+static void BM_ServiceRoundTrip(benchmark::State& state) {
+  audio_plugin::MockService::Config config;
+  config.bindAddress = "tcp://127.0.0.1:*";
+  config.latency = {audio_plugin::MockService::LatencyDistribution::FIXED, 0.0,
+                    0.0};
+  config.poolSize = 1024;
+  config.maxQueue = 1024;
+  audio_plugin::MockService service(config);
+  if (!service.start()) {
+    state.SkipWithError("Unable to start mock service");
+    return;
+  }
+
+  const SampleCounter regionSize{16000 * 5};
+  auto history = std::make_shared<audio_plugin::MonoCircularBuffer>(
+      audio_plugin::HistoryConfig{}, 16000);
+  std::vector<float> block(regionSize + 1, 0.1f);
+  history->updateFrom(block, TimePoint{16000, 0, std::nullopt});
+
+  audio_plugin::ServiceCommunicator comms;
+  comms.setServiceAddress("127.0.0.1:" + std::to_string(service.getPort()));
+  const auto maxInFlight = state.range(0);
+  int64_t inFlight{0};
+  int64_t completed{0};
+
+  for (auto _ : state) {
+    // One request in, one reply out
+    while (inFlight >= maxInFlight || !comms.readyToSend()) {
+      if (comms.getResponse()) {
+        inFlight--;
+        completed++;
+      }
+    }
+    comms.sendRequest(TimePoint{16000, 0, std::nullopt}, regionSize, history);
+    inFlight++;
+  }
+
+  state.SetItemsProcessed(completed);
+  state.SetBytesProcessed(completed * regionSize *
+                          static_cast<int64_t>(sizeof(float)));
+}
+BENCHMARK(BM_ServiceRoundTrip)->Arg(1)->Arg(8)->Arg(64)->UseRealTime();
+
+// As above, with state.range(0) regions per request and 4 requests in
+// flight. The mock takes no time per region either way, so this is the
+// client and transport's share - for the service's own (batched inference)
+// throughput see whisper/python-service/batch_benchmark.py
+static void BM_ServiceBatchRoundTrip(benchmark::State& state) {
+  audio_plugin::MockService::Config config;
+  config.bindAddress = "tcp://127.0.0.1:*";
+  config.latency = {audio_plugin::MockService::LatencyDistribution::FIXED, 0.0,
+                    0.0};
+  config.poolSize = 1024;
+  config.maxQueue = 1024;
+  audio_plugin::MockService service(config);
+  if (!service.start()) {
+    state.SkipWithError("Unable to start mock service");
+    return;
+  }
+
+  const SampleCounter regionSize{16000 * 5};
+  auto history = std::make_shared<audio_plugin::MonoCircularBuffer>(
+      audio_plugin::HistoryConfig{}, 16000);
+  std::vector<float> block(regionSize + 1, 0.1f);
+  history->updateFrom(block, TimePoint{16000, 0, std::nullopt});
+
+  audio_plugin::ServiceCommunicator comms;
+  comms.setServiceAddress("127.0.0.1:" + std::to_string(service.getPort()));
+  const auto batchSize = state.range(0);
+  std::vector<TimePoint> starts(static_cast<size_t>(batchSize),
+                                TimePoint{16000, 0, std::nullopt});
+  const int64_t maxInFlight{4 * batchSize};
+  int64_t inFlight{0};
+  int64_t completed{0};
+
+  for (auto _ : state) {
+    // One request of batchSize regions in, batchSize replies out
+    while (inFlight + batchSize > maxInFlight || !comms.readyToSend()) {
+      if (comms.getResponse()) {
+        inFlight--;
+        completed++;
+      }
+    }
+    comms.sendRequests(starts, regionSize, history);
+    inFlight += batchSize;
+  }
+
+  state.SetItemsProcessed(completed);
+  state.SetBytesProcessed(completed * regionSize *
+                          static_cast<int64_t>(sizeof(float)));
+}
+BENCHMARK(BM_ServiceBatchRoundTrip)
+    ->ArgName("batch")
+    ->Arg(1)
+    ->Arg(4)
+    ->Arg(8)
+    ->Arg(16)
+    ->UseRealTime();
+
+// Regions per second through TCP loopback (ipc 0) or ipc:// with the audio
+// in shared memory (ipc 1), with in_flight requests outstanding. With one in
+// flight the time per item is the round trip latency.
+static void BM_ServiceTransport(benchmark::State& state) {
+  const bool ipc = state.range(0) != 0;
+  audio_plugin::MockService::Config config;
+  config.bindAddress = ipc ? "ipc://*" : "tcp://127.0.0.1:*";
+  config.latency = {audio_plugin::MockService::LatencyDistribution::FIXED, 0.0,
+                    0.0};
+  config.poolSize = 1024;
+  config.maxQueue = 1024;
+  // Read every sample, so neither transport gets away without delivering
+  config.score = audio_plugin::MockService::Config::RMS;
+  audio_plugin::MockService service(config);
+  if (!service.start()) {
+    state.SkipWithError("Unable to start mock service");
+    return;
+  }
+
+  const SampleCounter regionSize{16000 * 5};
+  auto history = std::make_shared<audio_plugin::MonoCircularBuffer>(
+      audio_plugin::HistoryConfig{}, 16000);
+  std::vector<float> block(regionSize + 1024, 0.1f);
+  history->updateFrom(block, TimePoint{16000, 0, std::nullopt});
+
+  audio_plugin::ServiceCommunicator comms;
+  comms.setServiceAddress(service.getEndpoint());
+  const auto maxInFlight = state.range(1);
+  int64_t inFlight{0};
+  int64_t completed{0};
+  SampleCounter next{0};
+
+  for (auto _ : state) {
+    while (inFlight >= maxInFlight || !comms.readyToSend()) {
+      if (comms.getResponse()) {
+        inFlight--;
+        completed++;
+      }
+    }
+    // Distinct IDs, so each shared memory slot is released by its own reply
+    comms.sendRequest(TimePoint{16000, next++ % 1024, std::nullopt}, regionSize,
+                      history);
+    inFlight++;
+  }
+
+  state.SetItemsProcessed(completed);
+  state.SetBytesProcessed(completed * regionSize *
+                          static_cast<int64_t>(sizeof(float)));
+}
+#ifndef _WIN32
+BENCHMARK(BM_ServiceTransport)
+    ->ArgNames({"ipc", "in_flight"})
+    ->ArgsProduct({{0, 1}, {1, 8}})
+    ->UseRealTime();
+#endif
+
+// Audio thread writing (already resampled) blocks in to the history
+static void BM_CircularBufferUpdateFrom(benchmark::State& state) {
+  audio_plugin::MonoCircularBuffer history(audio_plugin::HistoryConfig{},
+                                           processingRate);
+  // With the whole hot tier committed, as after the first minute of audio
+  auto time = writeHistory(history, 60);
+  std::vector<float> block(static_cast<size_t>(state.range(0)));
+  fillWithSine(block);
+
+  for (auto _ : state) {
+    history.updateFrom(block, time);
+    time += static_cast<SampleCounter>(block.size());
+  }
+
+  state.SetItemsProcessed(state.iterations() * state.range(0));
+}
+BENCHMARK(BM_CircularBufferUpdateFrom)->Apply(blockSizes);
+
+// Reading a region for analysis. state.range(0) is 0 for a region still in
+// the hot tier, 1 for one only in the cold tier.
+static void BM_CircularBufferGetSamples(benchmark::State& state) {
+  audio_plugin::HistoryConfig config;
+  audio_plugin::MonoCircularBuffer history(config, processingRate);
+  // Twice the hot tier, so the oldest half is only in the cold tier
+  const auto end = writeHistory(history, 2 * config.hotLengthMs / 1000);
+  history.releaseUnusedMemory();
+
+  const SampleCounter regionSize{processingRate * 5};
+  const bool cold = state.range(0) == 1;
+  TimePoint start{processingRate,
+                  cold ? processingRate : end.sampleCounter - regionSize - 1,
+                  std::nullopt};
+  std::vector<float> region(static_cast<size_t>(regionSize));
+
+  for (auto _ : state) {
+    if (!history.getSamples(start, region)) {
+      state.SkipWithError("Region not available");
+      break;
+    }
+    benchmark::DoNotOptimize(region.data());
+  }
+
+  state.SetItemsProcessed(state.iterations() * regionSize);
+}
+BENCHMARK(BM_CircularBufferGetSamples)->ArgName("cold")->Arg(0)->Arg(1);
+
+// GUI fetching everything it's about to draw. state.range(0) samples, i.e.
+// width * samples per line.
+static void BM_CircularBufferGetLatestSamples(benchmark::State& state) {
+  audio_plugin::MonoCircularBuffer history(audio_plugin::HistoryConfig{},
+                                           processingRate);
+  writeHistory(history, 60);
+  std::vector<float> samples(static_cast<size_t>(state.range(0)));
+
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(history.getLatestSamples(samples));
+  }
+
+  state.SetItemsProcessed(state.iterations() * state.range(0));
+}
+BENCHMARK(BM_CircularBufferGetLatestSamples)
+    ->Arg(800 * 16)
+    ->Arg(800 * 256)
+    ->Arg(800 * 1024);
+
+// Everything processBlock() hands off: downmix, resample and write to history
+static void BM_BuffUpdateFrom(benchmark::State& state) {
+  ensureJuceInitialised();
+  const auto srcRate = static_cast<SampleRate>(state.range(0));
+  const auto blockSize = static_cast<int>(state.range(1));
+  const auto numChannels = static_cast<int>(state.range(2));
+  audio_plugin::Buff buff(srcRate, static_cast<uint16_t>(blockSize),
+                          processingRate,
+                          std::make_shared<audio_plugin::ServiceCommunicator>());
+  juce::AudioBuffer<float> block(numChannels, blockSize);
+  for (int ch = 0; ch < numChannels; ch++) {
+    for (int i = 0; i < blockSize; i++) {
+      block.setSample(ch, i, 0.5f * std::sin(0.01f * static_cast<float>(i)));
+    }
+  }
+  TimePoint time{srcRate, 0, std::nullopt};
+
+  for (auto _ : state) {
+    buff.updateFrom(block, time);
+    time += static_cast<SampleCounter>(blockSize);
+  }
+
+  state.SetItemsProcessed(state.iterations() * blockSize);
+}
+BENCHMARK(BM_BuffUpdateFrom)
+    ->ArgNames({"rate", "block", "channels"})
+    ->ArgsProduct({{44100, 48000, 96000, 192000},
+                   {32, 128, 512, 1024, 4096},
+                   {1, 2, 8}});
+
+// The conversions and arithmetic done for every block and region
+static void BM_TimePointArithmetic(benchmark::State& state) {
+  const auto srcRate = static_cast<SampleRate>(state.range(0));
+  TimePoint time{srcRate, 0, PlayheadTime{0}};
+  const TimePoint regionLength{processingRate, processingRate * 5,
+                               std::nullopt};
+
+  for (auto _ : state) {
+    time += 512;
+    auto converted = time.asSampleRate(processingRate);
+    auto regionStart = converted - regionLength;
+    benchmark::DoNotOptimize(regionStart);
+  }
+}
+BENCHMARK(BM_TimePointArithmetic)->Arg(44100)->Arg(48000)->Arg(192000);
+
+// As Buff converts each block's start time, with the conversion made once
+static void BM_TimePointConversion(benchmark::State& state) {
+  const auto srcRate = static_cast<SampleRate>(state.range(0));
+  const RateConversion toProcessing(srcRate, processingRate);
+  TimePoint time{srcRate, 0, PlayheadTime{0}};
+
+  for (auto _ : state) {
+    time += 512;
+    auto converted = time.converted(toProcessing);
+    benchmark::DoNotOptimize(converted);
+  }
+}
+BENCHMARK(BM_TimePointConversion)->Arg(44100)->Arg(48000)->Arg(192000);
+
+// Audio thread side of region generation, per block
+static void BM_AnalysisRegionsUpdateFrom(benchmark::State& state) {
+  ensureJuceInitialised();
+  auto history = std::make_shared<audio_plugin::MonoCircularBuffer>(
+      audio_plugin::HistoryConfig{}, processingRate);
+  auto comms = std::make_shared<audio_plugin::ServiceCommunicator>();
+  audio_plugin::AnalysisRegions regions(history, comms);
+  const auto blockSize = static_cast<SampleCounter>(state.range(0));
+  TimePoint time{processingRate, 0, std::nullopt};
+  const PlaybackRegion playback;
+
+  for (auto _ : state) {
+    auto blockStart = time;
+    time += blockSize;
+    regions.updateFrom(blockStart, time, playback);
+  }
+}
+BENCHMARK(BM_AnalysisRegionsUpdateFrom)->Apply(blockSizes);
+
+// Timer side of region management, with state.range(0) regions held and no
+// service to send them to
+static void BM_AnalysisRegionsUpdateRegions(benchmark::State& state) {
+  ensureJuceInitialised();
+  auto history = std::make_shared<audio_plugin::MonoCircularBuffer>(
+      audio_plugin::HistoryConfig{}, processingRate);
+  auto comms = std::make_shared<audio_plugin::ServiceCommunicator>();
+  audio_plugin::AnalysisRegions regions(history, comms);
+
+  // Keep enough history that none of the regions are aged out
+  const auto numRegions = static_cast<uint32_t>(state.range(0));
+  const auto seconds =
+      (numRegions * regions.getRegionFreqMs() + regions.getRegionSizeMs()) /
+      1000 + 1;
+  const auto end = writeHistory(*history, seconds);
+  const PlaybackRegion playback;
+  for (TimePoint time{processingRate, 0, std::nullopt};
+       time.sampleCounter < end.sampleCounter; time += 512) {
+    regions.updateFrom(time, time + 512, playback);
+  }
+
+  for (auto _ : state) {
+    regions.updateRegions();
+  }
+
+  state.counters["regions"] = static_cast<double>(
+      regions.getRegions(0, end.sampleCounter).size());
+}
+BENCHMARK(BM_AnalysisRegionsUpdateRegions)->Arg(16)->Arg(128)->Arg(448);
+
+// The stats panel's per-state region counts, with state.range(0) regions
+static void BM_AnalysisRegionsNumInState(benchmark::State& state) {
+  ensureJuceInitialised();
+  auto history = std::make_shared<audio_plugin::MonoCircularBuffer>(
+      audio_plugin::HistoryConfig{}, processingRate);
+  auto comms = std::make_shared<audio_plugin::ServiceCommunicator>();
+  audio_plugin::AnalysisRegions regions(history, comms);
+
+  const auto numRegions = static_cast<uint32_t>(state.range(0));
+  const auto seconds =
+      (numRegions * regions.getRegionFreqMs() + regions.getRegionSizeMs()) /
+      1000 + 1;
+  const auto end = writeHistory(*history, seconds);
+  const PlaybackRegion playback;
+  for (TimePoint time{processingRate, 0, std::nullopt};
+       time.sampleCounter < end.sampleCounter; time += 512) {
+    regions.updateFrom(time, time + 512, playback);
+  }
+
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(
+        regions.getNumRegionsInState(audio_plugin::Region::State::PENDING));
+  }
+}
+BENCHMARK(BM_AnalysisRegionsNumInState)->Arg(16)->Arg(128)->Arg(448);
+
+// Queueing state.range(1) regions with the scheduler and taking them all
+// back off, under policy state.range(0)
+static void BM_RegionSchedulerPushPop(benchmark::State& state) {
+  using Scheduler = audio_plugin::RegionScheduler;
+  const auto policy = static_cast<Scheduler::Policy>(state.range(0));
+  const auto numRegions = static_cast<SampleCounter>(state.range(1));
+  std::set<audio_plugin::Region> regions;
+  for (SampleCounter i = 0; i < numRegions; i++) {
+    regions
+        .emplace(TimePoint{16000, i * 40000, std::nullopt},
+                 TimePoint{16000, i * 40000 + 80000, std::nullopt},
+                 static_cast<uint16_t>(i), false)
+        .first->createdMs = static_cast<double>(i);
+  }
+  Scheduler scheduler;
+  scheduler.setPolicy(policy);
+
+  for (auto _ : state) {
+    for (auto const& region : regions) {
+      scheduler.push(region, 0.0);
+    }
+    while (auto region = scheduler.pop(0.0)) {
+      scheduler.setCovered(*region, true);
+    }
+    scheduler.clear();
+  }
+  state.SetItemsProcessed(state.iterations() * numRegions);
+}
+BENCHMARK(BM_RegionSchedulerPushPop)
+    ->ArgNames({"policy", "regions"})
+    ->ArgsProduct({{audio_plugin::RegionScheduler::LATEST_FIRST,
+                    audio_plugin::RegionScheduler::GAP_FILLING,
+                    audio_plugin::RegionScheduler::WEIGHTED_AGING},
+                   {16, 256, 4096}});
+
+// Decoding a reply from the service, as JSON or binary
+static void BM_ParseResponse(benchmark::State& state) {
+  using Comms = audio_plugin::ServiceCommunicator;
+  const bool binary = state.range(0) != 0;
+  const bool error = state.range(1) != 0;
+  std::string reply;
+  if (!binary) {
+    reply = error ? "{\"request_id\": 1234567, \"error\": \"overloaded\"}"
+                  : "{\"request_id\": 1234567, \"result\": [0.123456789], "
+                    "\"timing\": {\"queue_ms\": 12.5, \"inference_ms\": "
+                    "3000.0}}";
+  } else {
+    const uint8_t status = error ? Comms::REPLY_OVERLOADED : Comms::REPLY_OK;
+    const uint8_t flags = error ? 0 : Comms::binaryReplyHasTiming;
+    const uint16_t count = error ? 0 : 1;
+    const uint64_t reqId = 1234567;
+    const float fields[3]{0.123456789f, 12.5f, 3000.f};
+    reply.append(reinterpret_cast<const char*>(Comms::binaryReplyMagic), 4);
+    reply.append(reinterpret_cast<const char*>(&status), 1);
+    reply.append(reinterpret_cast<const char*>(&flags), 1);
+    reply.append(reinterpret_cast<const char*>(&count), 2);
+    reply.append(reinterpret_cast<const char*>(&reqId), 8);
+    if (!error) {
+      reply.append(reinterpret_cast<const char*>(fields), sizeof(fields));
+    }
+  }
+
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(Comms::parseResponse(reply.data(), reply.size()));
+  }
+}
+BENCHMARK(BM_ParseResponse)
+    ->ArgNames({"binary", "error"})
+    ->ArgsProduct({{0, 1}, {0, 1}});
+
+// Graph reducing the samples it draws to one peak per column, for an 800
+// column graph at state.range(0) samples per column, with state.range(1)
+// pool threads (0 for just the calling thread)
+static void BM_GraphColumnPeaks(benchmark::State& state) {
+  const size_t numColumns{800};
+  const auto samplesPerColumn = static_cast<size_t>(state.range(0));
+  audio_plugin::TaskPool pool(static_cast<size_t>(state.range(1)));
+  std::vector<float> samples(numColumns * samplesPerColumn);
+  fillWithSine(samples);
+  std::vector<float> columns(numColumns);
+
+  for (auto _ : state) {
+    audio_plugin::ui::calcColumnPeaks(samples, samplesPerColumn, columns,
+                                      pool);
+    benchmark::DoNotOptimize(columns.data());
+  }
+
+  state.SetItemsProcessed(state.iterations() *
+                          static_cast<int64_t>(samples.size()));
+}
+BENCHMARK(BM_GraphColumnPeaks)
+    ->ArgNames({"samples_per_column", "threads"})
+    ->ArgsProduct({{16, 256, 4096}, {0, 2, 4}})
+    ->UseRealTime();
+
+// Cost of handing work to the pool and waiting for it, per call
+static void BM_TaskPoolParallelFor(benchmark::State& state) {
+  audio_plugin::TaskPool pool(static_cast<size_t>(state.range(0)));
+  std::vector<uint64_t> counts(64);
+
+  for (auto _ : state) {
+    pool.parallelFor(audio_plugin::TaskPool::BACKGROUND, counts.size(), 1,
+                     [&counts](size_t begin, size_t end) {
+                       for (auto i = begin; i < end; i++) {
+                         counts[i]++;
+                       }
+                     });
+    benchmark::DoNotOptimize(counts.data());
+  }
+}
+BENCHMARK(BM_TaskPoolParallelFor)->Arg(0)->Arg(2)->Arg(4)->UseRealTime();
+
+}  // namespace audio_plugin_benchmark
@@ -1,10 +1,1327 @@
 #include <PluginProcessor.h>
+#include <MockService.h>
+#include <SharedAudioRing.h>
 #include <gtest/gtest.h>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstring>
+#include <mutex>
+#include <numeric>
+#include <random>
+#include <set>
+#include <thread>
 
 namespace audio_plugin_test {
 TEST(AudioProcessor, Test1) {
   audio_plugin::AudioPluginAudioProcessor processor{};
 }
+TEST(Buff, ReconfigureKeepsHistory) {
+  auto comms = std::make_shared<audio_plugin::ServiceCommunicator>();
+  audio_plugin::Buff buff{48000, 480, 16000, comms};
+  auto circBuff = buff.getCircularBuffer();
+
+  // 1s of 1.0 at 48Khz, then 1s of 0.5 at 44.1Khz
+  SampleCounter sampleCounter{0};
+  juce::AudioBuffer<float> block{1, 480};
+  for (int i = 0; i < 100; i++) {
+    juce::FloatVectorOperations::fill(block.getWritePointer(0), 1.f, 480);
+    buff.updateFrom(block, TimePoint{48000, sampleCounter, std::nullopt});
+    sampleCounter += 480;
+  }
+  buff.reconfigure(44100, 441);
+  sampleCounter = sampleCounter * 44100 / 48000;
+  block.setSize(1, 441);
+  for (int i = 0; i < 100; i++) {
+    juce::FloatVectorOperations::fill(block.getWritePointer(0), 0.5f, 441);
+    buff.updateFrom(block, TimePoint{44100, sampleCounter, std::nullopt});
+    sampleCounter += 441;
+  }
+
+  // The 16Khz history carries straight on from before the change
+  std::vector<float> samples(32000);
+  auto latest = circBuff->getLatestSamples(samples);
+  EXPECT_NEAR(static_cast<double>(latest.sampleCounter), 32000.0, 16.0);
+  EXPECT_NEAR(samples[8000], 1.f, 1e-3f);
+  EXPECT_NEAR(samples[24000], 0.5f, 1e-3f);
+}
+TEST(Buff, SplitsChannelGroupsIntoStreams) {
+  auto streams = audio_plugin::parseStreamConfigs("Left: 1; Right: 2");
+  ASSERT_EQ(streams.size(), 2u);
+  EXPECT_EQ(streams[1].name, "Right");
+  EXPECT_EQ(streams[1].channels, 2u);
+  EXPECT_EQ(audio_plugin::formatStreamConfigs(streams), "Left: 1; Right: 2");
+
+  auto comms = std::make_shared<audio_plugin::ServiceCommunicator>();
+  audio_plugin::Buff buff{48000, 480, 16000, comms, {}, {}, streams};
+  ASSERT_EQ(buff.getNumStreams(), 2u);
+  EXPECT_EQ(buff.getAnalysisRegions()->getNumStreams(), 2u);
+  EXPECT_EQ(buff.getAnalysisRegions()->getStreamName(1), "Right");
+
+  // 1s of 1.0 on the left and 0.5 on the right
+  juce::AudioBuffer<float> block{2, 480};
+  for (SampleCounter start = 0; start < 48000; start += 480) {
+    juce::FloatVectorOperations::fill(block.getWritePointer(0), 1.f, 480);
+    juce::FloatVectorOperations::fill(block.getWritePointer(1), 0.5f, 480);
+    buff.updateFrom(block, TimePoint{48000, start, std::nullopt});
+  }
+
+  // Each stream's history has only its own channel, at full level
+  std::vector<float> samples(8000);
+  buff.getCircularBuffer(0)->getLatestSamples(samples);
+  EXPECT_NEAR(samples[4000], 1.f, 1e-3f);
+  buff.getCircularBuffer(1)->getLatestSamples(samples);
+  EXPECT_NEAR(samples[4000], 0.5f, 1e-3f);
+}
+// A history whose encoder only runs when the test says so, so it can be put
+// behind the audio thread
+class ManualHistory : public audio_plugin::MonoCircularBuffer {
+public:
+  ManualHistory(const audio_plugin::HistoryConfig& config,
+                std::shared_ptr<audio_plugin::AudioThreadStats> stats = {})
+      : MonoCircularBuffer(config, 16000, stats) {
+    encoderThread_->removeTimeSliceClient(this);
+  }
+  void runEncoder() { useTimeSlice(); }
+};
+std::vector<float> sineBlock(SampleCounter from, size_t size) {
+  std::vector<float> block(size);
+  for (size_t i = 0; i < size; i++) {
+    block[i] = 0.5f * std::sin(0.001f * static_cast<float>(from + i));
+  }
+  return block;
+}
+constexpr size_t hotChunkBytes{16000 * sizeof(float)};
+TEST(MonoCircularBuffer, CommitsHotChunksAsAudioArrives) {
+  audio_plugin::HistoryConfig config;
+  config.hotLengthMs = 10000;
+  auto stats = std::make_shared<audio_plugin::AudioThreadStats>();
+  ManualHistory history{config, stats};
+
+  // Only the first couple of chunks and the reserve before any audio
+  auto idle = history.getMemoryUsageBytes();
+  EXPECT_LT(idle, 5 * hotChunkBytes);
+
+  for (SampleCounter start = 0; start < 128000; start += 16000) {
+    history.updateFrom(sineBlock(start, 16000), {16000, start, std::nullopt});
+    history.runEncoder();
+  }
+  EXPECT_GE(history.getMemoryUsageBytes(), idle + 5 * hotChunkBytes);
+  EXPECT_EQ(stats->getSnapshot().historyDrops, 0u);
+}
+TEST(MonoCircularBuffer, ReleasesHotChunksAlreadyInTheColdTier) {
+  audio_plugin::HistoryConfig config;
+  config.hotLengthMs = 10000;
+  auto stats = std::make_shared<audio_plugin::AudioThreadStats>();
+  ManualHistory history{config, stats};
+  for (SampleCounter start = 0; start < 128000; start += 16000) {
+    history.updateFrom(sineBlock(start, 16000), {16000, start, std::nullopt});
+    history.runEncoder();
+  }
+  auto before = history.getMemoryUsageBytes();
+  history.releaseUnusedMemory();
+  EXPECT_LE(history.getMemoryUsageBytes(), before - 6 * hotChunkBytes);
+
+  // What was released comes from the cold tier (as float16), right up to
+  // where the hot tier is still valid from (the start of the last chunk)
+  std::vector<float> samples(20000);
+  ASSERT_TRUE(history.getSamples({16000, 100000, std::nullopt}, samples));
+  auto expected = sineBlock(100000, samples.size());
+  for (size_t i = 0; i < samples.size(); i++) {
+    ASSERT_NEAR(samples[i], expected[i], 1e-3f) << "at " << i;
+  }
+
+  // The chunk the next write goes to is kept, and prepareToPlay's
+  // commitAhead() covers the rest, so nothing is dropped when audio resumes
+  history.updateFrom(sineBlock(128000, 16000), {16000, 128000, std::nullopt});
+  history.commitAhead();
+  history.updateFrom(sineBlock(144000, 16000), {16000, 144000, std::nullopt});
+  EXPECT_EQ(stats->getSnapshot().historyDrops, 0u);
+  samples.resize(40000);
+  ASSERT_TRUE(history.getSamples({16000, 100000, std::nullopt}, samples));
+  expected = sineBlock(100000, samples.size());
+  for (size_t i = 0; i < samples.size(); i++) {
+    ASSERT_NEAR(samples[i], expected[i], 1e-3f) << "at " << i;
+  }
+}
+TEST(MonoCircularBuffer, DropsAudioRatherThanAllocating) {
+  audio_plugin::HistoryConfig config;
+  config.hotLengthMs = 10000;
+  auto stats = std::make_shared<audio_plugin::AudioThreadStats>();
+  ManualHistory history{config, stats};
+  auto idle = history.getMemoryUsageBytes();
+
+  // With the encoder stuck, the first two chunks and the reserve fill up and
+  // the rest is dropped rather than committed on the audio thread
+  for (SampleCounter start = 0; start < 80000; start += 16000) {
+    history.updateFrom(sineBlock(start, 16000), {16000, start, std::nullopt});
+  }
+  EXPECT_EQ(stats->getSnapshot().historyDrops, 2u);
+  EXPECT_EQ(history.getMemoryUsageBytes(), idle);
+  std::vector<float> samples(16000);
+  EXPECT_FALSE(history.getSamples({16000, 48000, std::nullopt}, samples));
+
+  // Once it catches up, the history carries on after a gap
+  history.runEncoder();
+  history.updateFrom(sineBlock(80000, 16000), {16000, 80000, std::nullopt});
+  EXPECT_EQ(stats->getSnapshot().historyDrops, 2u);
+  EXPECT_EQ(history.getLatestSamples(samples).sampleCounter, 95999);
+  EXPECT_EQ(samples, sineBlock(80000, 16000));
+}
+TEST(MonoCircularBuffer, WaitsForChunksWhenFasterThanRealTime) {
+  audio_plugin::HistoryConfig config;
+  config.hotLengthMs = 10000;
+  auto stats = std::make_shared<audio_plugin::AudioThreadStats>();
+  audio_plugin::MonoCircularBuffer history{config, 16000, stats};
+  history.setBlockWhenFull(true);
+  for (SampleCounter start = 0; start < 400000; start += 16000) {
+    history.updateFrom(sineBlock(start, 16000), {16000, start, std::nullopt});
+  }
+  EXPECT_EQ(stats->getSnapshot().historyDrops, 0u);
+  std::vector<float> samples(16000);
+  ASSERT_TRUE(history.getSamples({16000, 0, std::nullopt}, samples));
+  EXPECT_NEAR(samples[8000], sineBlock(8000, 1)[0], 1e-3f);
+}
+TEST(HistoryStore, ConvertsToHalfPrecision) {
+  using audio_plugin::floatToHalf;
+  using audio_plugin::halfToFloat;
+  // Every half but NaN survives the trip through float
+  for (uint32_t h = 0; h < 0x10000; h++) {
+    auto half = static_cast<uint16_t>(h);
+    if (std::isnan(halfToFloat(half))) {
+      EXPECT_EQ(half & 0x7c00, 0x7c00);
+      continue;
+    }
+    ASSERT_EQ(floatToHalf(halfToFloat(half)), half) << "for " << h;
+  }
+
+  EXPECT_EQ(floatToHalf(1.f), 0x3c00);
+  EXPECT_EQ(floatToHalf(-0.f), 0x8000);
+  EXPECT_EQ(floatToHalf(65504.f), 0x7bff);  // Largest normal
+  EXPECT_EQ(floatToHalf(65520.f), 0x7c00);  // Rounds up to inf
+  EXPECT_EQ(floatToHalf(-INFINITY), 0xfc00);
+  EXPECT_TRUE(std::isnan(halfToFloat(floatToHalf(NAN))));
+
+  // Subnormals, down to the smallest, and half of that rounding to even
+  EXPECT_EQ(floatToHalf(std::ldexp(1.f, -24)), 0x0001);
+  EXPECT_EQ(halfToFloat(0x0001), std::ldexp(1.f, -24));
+  EXPECT_EQ(floatToHalf(std::ldexp(1023.f, -24)), 0x03ff);
+  EXPECT_EQ(floatToHalf(std::ldexp(1.f, -25)), 0x0000);
+  EXPECT_EQ(floatToHalf(std::ldexp(3.f, -25)), 0x0002);
+  EXPECT_EQ(floatToHalf(-std::ldexp(1.f, -26)), 0x8000);
+
+  // Round to nearest, ties to even
+  EXPECT_EQ(floatToHalf(1.f + std::ldexp(1.f, -11)), 0x3c00);
+  EXPECT_EQ(floatToHalf(1.f + std::ldexp(3.f, -11)), 0x3c02);
+  EXPECT_EQ(floatToHalf(1.f + std::ldexp(1.f, -11) + std::ldexp(1.f, -20)),
+            0x3c01);
+}
+TEST(CompressedHistoryStore, ZeroFillsGaps) {
+  audio_plugin::CompressedHistoryStore store{1000};
+  store.append(0, std::vector<float>(1000, 0.25f));
+  store.append(2000, std::vector<float>(1000, 0.5f));
+
+  std::vector<float> samples(2000);
+  EXPECT_FALSE(store.read(500, samples));
+  EXPECT_EQ(samples[499], 0.25f);
+  EXPECT_EQ(samples[500], 0.f);
+  EXPECT_EQ(samples[1499], 0.f);
+  EXPECT_EQ(samples[1500], 0.5f);
+
+  samples.resize(1000);
+  EXPECT_TRUE(store.read(2000, samples));
+  EXPECT_FALSE(store.read(2500, samples));
+  EXPECT_EQ(samples[499], 0.5f);
+  EXPECT_EQ(samples[500], 0.f);
+}
+TEST(CompressedHistoryStore, RecyclesTrimmedChunks) {
+  audio_plugin::CompressedHistoryStore store{1000};
+  const size_t chunkBytes{1000 * sizeof(uint16_t)};
+  for (SampleCounter start = 0; start < 5000; start += 1000) {
+    store.append(start, std::vector<float>(1000, 0.25f));
+  }
+  EXPECT_EQ(store.getMemoryUsageBytes(), 5 * chunkBytes);
+
+  // A couple of the trimmed chunks are kept spare...
+  store.trimBefore(4000);
+  EXPECT_EQ(store.getOldestSampleCounter(), SampleCounter{4000});
+  EXPECT_EQ(store.getMemoryUsageBytes(), 3 * chunkBytes);
+
+  // ...and used for the next ones
+  store.append(5000, std::vector<float>(1000, 0.25f));
+  store.append(6000, std::vector<float>(1000, 0.25f));
+  EXPECT_EQ(store.getMemoryUsageBytes(), 3 * chunkBytes);
+  std::vector<float> samples(3000);
+  EXPECT_TRUE(store.read(4000, samples));
+}
+// Each sample is its own sample counter, so it's clear where reads came from
+std::vector<float> rampBlock(SampleCounter from, size_t size) {
+  std::vector<float> block(size);
+  std::iota(block.begin(), block.end(), static_cast<float>(from));
+  return block;
+}
+TEST(MappedHistoryStore, WrapsAroundTheRing) {
+  audio_plugin::MappedHistoryStore store{1000, 4000, {}};
+  ASSERT_TRUE(store.isValid());
+  for (SampleCounter start = 0; start < 6000; start += 1000) {
+    store.append(start, rampBlock(start, 1000));
+  }
+  EXPECT_EQ(store.getOldestSampleCounter(), SampleCounter{2000});
+
+  // All that's held, then a read over the end of the ring
+  std::vector<float> samples(4000);
+  ASSERT_TRUE(store.read(2000, samples));
+  EXPECT_EQ(samples, rampBlock(2000, 4000));
+  samples.resize(1000);
+  ASSERT_TRUE(store.read(3500, samples));
+  EXPECT_EQ(samples, rampBlock(3500, 1000));
+
+  // Whatever of the mapping is resident counts, which is all of it here
+  EXPECT_GE(store.getMemoryUsageBytes(), 4000 * sizeof(float));
+}
+TEST(MappedHistoryStore, ZeroFillsWhatIsntHeld) {
+  audio_plugin::MappedHistoryStore store{1000, 4000, {}};
+  ASSERT_TRUE(store.isValid());
+  for (SampleCounter start = 0; start < 6000; start += 1000) {
+    store.append(start, rampBlock(start, 1000));
+  }
+
+  // Straddling where the held samples start and end
+  std::vector<float> samples(1000);
+  EXPECT_FALSE(store.read(1500, samples));
+  EXPECT_EQ(samples[499], 0.f);
+  EXPECT_EQ(samples[500], 2000.f);
+  EXPECT_FALSE(store.read(5500, samples));
+  EXPECT_EQ(samples[499], 5999.f);
+  EXPECT_EQ(samples[500], 0.f);
+
+  // Only contiguous history is held, so a gap starts it over
+  store.append(7000, rampBlock(7000, 1000));
+  EXPECT_EQ(store.getOldestSampleCounter(), SampleCounter{7000});
+  EXPECT_FALSE(store.read(5000, samples));
+  EXPECT_EQ(samples, std::vector<float>(1000, 0.f));
+  ASSERT_TRUE(store.read(7000, samples));
+  EXPECT_EQ(samples, rampBlock(7000, 1000));
+}
+TEST(MonoCircularBuffer, ReadsDiskHistoryBackExactly) {
+  audio_plugin::HistoryConfig config;
+  config.hotLengthMs = 2000;
+  config.storage = audio_plugin::HistoryConfig::DISK;
+  config.diskCapacityMs = 60000;
+  ManualHistory history{config};
+  ASSERT_EQ(history.getStorage(), audio_plugin::HistoryConfig::DISK);
+  for (SampleCounter start = 0; start < 96000; start += 16000) {
+    history.updateFrom(rampBlock(start, 16000), {16000, start, std::nullopt});
+    history.runEncoder();
+  }
+
+  // Kept as float32, so unlike the compressed tier nothing is lost once it's
+  // out of the hot tier
+  std::vector<float> samples(16000);
+  ASSERT_TRUE(history.getSamples({16000, 16000, std::nullopt}, samples));
+  EXPECT_EQ(samples, rampBlock(16000, 16000));
+  EXPECT_GE(history.getMemoryUsageBytes(), 16000 * sizeof(float));
+}
+TEST(MonoCircularBuffer, BlockingWhenFullWaitsForTheEncoder) {
+  audio_plugin::HistoryConfig config;
+  config.hotLengthMs = 2000;
+  ManualHistory history{config};
+  history.setBlockWhenFull(true);
+  history.updateFrom(rampBlock(0, 16000), {16000, 0, std::nullopt});
+  history.updateFrom(rampBlock(16000, 16000), {16000, 16000, std::nullopt});
+
+  // The hot tier is full of audio not yet encoded, so this has to wait
+  std::atomic<bool> written{false};
+  std::thread writer([&history, &written] {
+    history.updateFrom(rampBlock(32000, 16000), {16000, 32000, std::nullopt});
+    written = true;
+  });
+  std::this_thread::sleep_for(std::chrono::milliseconds(100));
+  EXPECT_FALSE(written.load());
+  history.runEncoder();
+  writer.join();
+
+  // Nothing was overwritten before it was encoded
+  std::vector<float> samples(48000);
+  EXPECT_EQ(history.getLatestSamples(samples).sampleCounter, 47999);
+  EXPECT_EQ(samples[8000], 8000.f);
+  EXPECT_EQ(samples[16000], 16000.f);
+  EXPECT_EQ(samples[47999], 47999.f);
+}
+TEST(MonoCircularBuffer, BlockingIsBoundedAndNeverRealtime) {
+  audio_plugin::HistoryConfig config;
+  config.hotLengthMs = 2000;
+  ManualHistory history{config};
+  history.setBlockWhenFull(true);
+  history.updateFrom(rampBlock(0, 16000), {16000, 0, std::nullopt});
+  history.updateFrom(rampBlock(16000, 16000), {16000, 16000, std::nullopt});
+  auto msTaken = [](auto write) {
+    auto started = std::chrono::steady_clock::now();
+    write();
+    return std::chrono::duration<double, std::milli>(
+               std::chrono::steady_clock::now() - started)
+        .count();
+  };
+
+  // With the encoder stuck, a 10 ms block waits 20 times its length
+  auto waited = msTaken([&history] {
+    history.updateFrom(rampBlock(32000, 160), {16000, 32000, std::nullopt});
+  });
+  EXPECT_GE(waited, 150.0);
+  EXPECT_LT(waited, 2000.0);
+
+  // and on a real-time audio thread it doesn't wait at all
+  history.setRealtime(true);
+  waited = msTaken([&history] {
+    history.updateFrom(rampBlock(32160, 160), {16000, 32160, std::nullopt});
+  });
+  EXPECT_LT(waited, 100.0);
+}
+TEST(RateConversion, ConvertsExactlyAndRoundTrips) {
+  const SampleRate rates[]{8000,  11025, 16000,  22050, 32000, 37800,
+                           44100, 48000, 88200, 96000, 176400, 192000};
+  std::mt19937_64 random(1);
+  std::uniform_int_distribution<int64_t> positions(-(int64_t{1} << 44),
+                                                   int64_t{1} << 44);
+  for (auto from : rates) {
+    for (auto to : rates) {
+      RateConversion conversion(from, to);
+      auto back = conversion.inverse();
+      for (int i = 0; i < 1000; i++) {
+        auto position = i < 3 ? int64_t{i} - 1 : positions(random);
+        auto converted = conversion.convert(position);
+        ASSERT_EQ(converted, floorDiv(2 * position * to + from, 2 * from));
+        ASSERT_LE(converted, conversion.convert(position + 1));
+        auto roundTripped = back.convert(converted);
+        if (to >= from) {
+          ASSERT_EQ(roundTripped, position) << from << " -> " << to;
+        } else {
+          // Within half a period of the lower rate
+          ASSERT_LE(2 * std::abs(position - roundTripped) * to,
+                    int64_t{from} + to);
+        }
+      }
+    }
+  }
+  // Far beyond what multiplying first could take
+  EXPECT_EQ(RateConversion(48000, 16000).convert(INT64_MIN + 2),
+            (INT64_MIN + 2) / 3);
+
+  // Times at different rates add and convert exactly
+  TimePoint time{16000, 100, PlayheadTime{0}};
+  time += TimePoint{44100, 441, PlayheadTime{441}};
+  EXPECT_EQ(time.sampleCounter, 260);
+  EXPECT_EQ(time.playheadTime, 160);
+  auto live = TimePoint{44100, 44098, std::nullopt}.asSampleRate(16000);
+  EXPECT_EQ(live.sampleRate, 16000u);
+  EXPECT_EQ(live.sampleCounter, 15999);
+  EXPECT_FALSE(live.playheadTime);
+}
+TEST(TaskPool, SplitsWorkAndRunsEveryChunkOnce) {
+  audio_plugin::TaskPool pool(3);
+  std::vector<std::atomic<int>> hits(10000);
+  std::atomic<size_t> chunks{0};
+  std::atomic<bool> undersized{false};
+  pool.parallelFor(audio_plugin::TaskPool::GUI, hits.size(), 100,
+                   [&](size_t begin, size_t end) {
+                     if (end - begin < 100 && end != hits.size()) {
+                       undersized = true;
+                     }
+                     chunks++;
+                     for (auto i = begin; i < end; i++) {
+                       hits[i]++;
+                     }
+                   });
+  EXPECT_TRUE(std::all_of(hits.begin(), hits.end(),
+                          [](const std::atomic<int>& hit) { return hit == 1; }));
+  EXPECT_GT(chunks.load(), 1u);
+  EXPECT_FALSE(undersized);
+
+  // Too little to split runs here
+  std::thread::id ranOn;
+  pool.parallelFor(audio_plugin::TaskPool::GUI, 100, 100,
+                   [&ranOn](size_t, size_t) {
+                     ranOn = std::this_thread::get_id();
+                   });
+  EXPECT_EQ(ranOn, std::this_thread::get_id());
+
+  std::atomic<int> done{0};
+  for (int i = 0; i < 100; i++) {
+    pool.submit(audio_plugin::TaskPool::BACKGROUND, [&done] { done++; });
+  }
+  for (int i = 0; i < 500 && done < 100; i++) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+  }
+  EXPECT_EQ(done.load(), 100);
+}
+TEST(AudioThreadStats, RecordsOverrunsAndLockWaits) {
+  audio_plugin::AudioThreadStats stats;
+  {
+    // 16 samples at 16Khz is a 1ms deadline
+    auto timer = stats.timeCallback(16, 16000.0);
+    std::this_thread::sleep_for(std::chrono::milliseconds(5));
+  }
+  {
+    auto timer = stats.timeCallback(16000, 16000.0);
+  }
+
+  // Hold the lock for a while on another thread, so we have to wait for it
+  std::mutex mtx;
+  std::atomic<bool> held{false};
+  std::thread holder([&mtx, &held] {
+    std::lock_guard lock{mtx};
+    held = true;
+    std::this_thread::sleep_for(std::chrono::milliseconds(5));
+  });
+  while (!held) {
+    std::this_thread::yield();
+  }
+  { auto lock = stats.lock(mtx, audio_plugin::AudioThreadStats::REGIONS); }
+  holder.join();
+  { auto lock = stats.lock(mtx, audio_plugin::AudioThreadStats::REGIONS); }
+
+  auto snapshot = stats.getSnapshot();
+  EXPECT_EQ(snapshot.callbacks, 2u);
+  EXPECT_EQ(snapshot.overruns, 1u);
+  EXPECT_EQ(snapshot.loadHistogram.back(), 1u);
+  EXPECT_EQ(snapshot.loadHistogram.front(), 1u);
+  const auto& waits = snapshot.locks[audio_plugin::AudioThreadStats::REGIONS];
+  EXPECT_EQ(waits.count, 2u);
+  EXPECT_EQ(waits.contended, 1u);
+  EXPECT_GE(waits.maxNs, 1000000u);
+
+  stats.reset();
+  EXPECT_EQ(stats.getSnapshot().callbacks, 0u);
+}
+TEST(ServiceCommunicator, ParsesServiceTiming) {
+  const std::string reply{
+      "{\"request_id\": 42, \"result\": [0.5], "
+      "\"timing\": {\"queue_ms\": 12.5, \"inference_ms\": 3000}}"};
+  auto response = audio_plugin::ServiceCommunicator::parseResponse(
+      reply.data(), reply.size());
+  ASSERT_TRUE(response.has_value());
+  EXPECT_TRUE(response->success);
+  EXPECT_EQ(response->reqId, 42);
+  EXPECT_NEAR(response->serviceQueueMs.value_or(0.0), 12.5, 1e-6);
+  EXPECT_NEAR(response->serviceInferenceMs.value_or(0.0), 3000.0, 1e-6);
+}
+TEST(ServiceCommunicator, ParsesBinaryReplies) {
+  using Comms = audio_plugin::ServiceCommunicator;
+  // Request ID still carries the flag asking for binary, as old services
+  // would echo it
+  const uint64_t reqId = 42 | Comms::binaryReplyFlag;
+  const uint16_t count = 1;
+  const float fields[3]{0.5f, 12.5f, 3000.f};
+  std::vector<uint8_t> reply(Comms::binaryReplyHeaderSize + sizeof(fields));
+  std::memcpy(reply.data(), Comms::binaryReplyMagic, 4);
+  reply[4] = Comms::REPLY_OK;
+  reply[5] = Comms::binaryReplyHasTiming;
+  std::memcpy(reply.data() + 6, &count, sizeof(count));
+  std::memcpy(reply.data() + 8, &reqId, sizeof(reqId));
+  std::memcpy(reply.data() + 16, fields, sizeof(fields));
+
+  auto response = Comms::parseResponse(reply.data(), reply.size());
+  ASSERT_TRUE(response.has_value());
+  EXPECT_TRUE(response->success);
+  EXPECT_EQ(response->reqId, 42);
+  EXPECT_FLOAT_EQ(response->result, 0.5f);
+  EXPECT_NEAR(response->serviceQueueMs.value_or(0.0), 12.5, 1e-6);
+  EXPECT_NEAR(response->serviceInferenceMs.value_or(0.0), 3000.0, 1e-6);
+
+  // Rejected, and truncated
+  reply[4] = Comms::REPLY_OVERLOADED;
+  response = Comms::parseResponse(reply.data(), reply.size());
+  ASSERT_TRUE(response.has_value());
+  EXPECT_FALSE(response->success);
+  EXPECT_FALSE(
+      Comms::parseResponse(reply.data(), reply.size() - 1).has_value());
+}
+TEST(ServiceCommunicator, ReadsFramesInPlace) {
+  using Comms = audio_plugin::ServiceCommunicator;
+  const uint64_t reqId = 42;
+  const uint16_t count = 1;
+  const uint32_t frameCount = 3;
+  const float result = 0.5f;
+  const float frames[6]{0.1f, 0.2f, 0.3f, 1.f, 0.5f, 0.25f};
+  std::vector<uint8_t> reply(Comms::binaryReplyHeaderSize + sizeof(result) +
+                             sizeof(frameCount) + sizeof(frames));
+  std::memcpy(reply.data(), Comms::binaryReplyMagic, 4);
+  reply[4] = Comms::REPLY_OK;
+  reply[5] = Comms::binaryReplyHasFrames | Comms::binaryReplyHasConfidence;
+  std::memcpy(reply.data() + 6, &count, sizeof(count));
+  std::memcpy(reply.data() + 8, &reqId, sizeof(reqId));
+  std::memcpy(reply.data() + 16, &result, sizeof(result));
+  std::memcpy(reply.data() + 20, &frameCount, sizeof(frameCount));
+  std::memcpy(reply.data() + 24, frames, sizeof(frames));
+
+  auto response = Comms::parseResponse(reply.data(), reply.size());
+  ASSERT_TRUE(response.has_value());
+  ASSERT_EQ(response->frames.size(), 3u);
+  ASSERT_EQ(response->confidence.size(), 3u);
+  // Not copied out of the reply
+  EXPECT_EQ(static_cast<const void*>(response->frames.data()),
+            reply.data() + 24);
+  EXPECT_EQ(response->frames[2], 0.3f);
+  EXPECT_EQ(response->confidence[1], 0.5f);
+
+  // JSON replies keep their own
+  const std::string json{
+      "{\"request_id\": 42, \"result\": [0.5], \"frames\": [0.1, 0.2], "
+      "\"confidence\": [1.0, 0.5]}"};
+  response = Comms::parseResponse(json.data(), json.size());
+  ASSERT_TRUE(response.has_value());
+  ASSERT_EQ(response->frames.size(), 2u);
+  ASSERT_EQ(response->confidence.size(), 2u);
+  EXPECT_FLOAT_EQ(response->frames[1], 0.2f);
+  EXPECT_FLOAT_EQ(response->confidence[1], 0.5f);
+}
+TEST(ResultArena, StoresFramesUntilOverwritten) {
+  audio_plugin::ResultArena arena{8};
+  const std::vector<float> first{0.1f, 0.2f, 0.3f};
+  const std::vector<float> firstConfidence{1.f, 0.5f, 0.25f};
+  const std::vector<float> second{0.4f, 0.5f, 0.6f, 0.7f};
+  auto firstHandle = arena.add(first, firstConfidence);
+  auto secondHandle = arena.add(second, {});
+
+  std::vector<float> values;
+  std::vector<float> confidence;
+  ASSERT_TRUE(arena.read(firstHandle, values, &confidence));
+  EXPECT_EQ(values, first);
+  EXPECT_EQ(confidence, firstConfidence);
+  ASSERT_TRUE(arena.read(secondHandle, values, &confidence));
+  EXPECT_EQ(values, second);
+  EXPECT_TRUE(confidence.empty());
+
+  // Wraps around, overwriting the first region's frames but not the second's
+  auto thirdHandle = arena.add(first, {});
+  EXPECT_FALSE(arena.read(firstHandle, values));
+  ASSERT_TRUE(arena.read(secondHandle, values));
+  EXPECT_EQ(values, second);
+  ASSERT_TRUE(arena.read(thirdHandle, values));
+  EXPECT_EQ(values, first);
+  EXPECT_FALSE(arena.read(audio_plugin::ResultArena::Handle{}, values));
+}
+TEST(ResultArena, GrowsAsFramesArrive) {
+  // Several growths, then a wrap and a clear
+  constexpr size_t capacity{3 * audio_plugin::ResultArena::growthChunk + 100};
+  audio_plugin::ResultArena arena{capacity};
+  std::vector<std::vector<float>> added;
+  std::vector<audio_plugin::ResultArena::Handle> handles;
+  for (size_t i = 0; i < 10; i++) {
+    added.emplace_back(audio_plugin::ResultArena::growthChunk / 2 + i);
+    std::iota(added.back().begin(), added.back().end(),
+              static_cast<float>(i * 10000));
+    handles.push_back(arena.add(added.back(), added.back()));
+  }
+  // Only what the ring still holds reads back
+  std::vector<float> values;
+  std::vector<float> confidence;
+  size_t held{0};
+  for (size_t i = handles.size(); i-- > 0;) {
+    held += added[i].size();
+    if (held > capacity) {
+      EXPECT_FALSE(arena.read(handles[i], values)) << i;
+      continue;
+    }
+    ASSERT_TRUE(arena.read(handles[i], values, &confidence)) << i;
+    EXPECT_EQ(values, added[i]);
+    EXPECT_EQ(confidence, added[i]);
+  }
+  arena.clear();
+  EXPECT_FALSE(arena.read(handles.back(), values));
+  auto handle = arena.add(added[0], {});
+  ASSERT_TRUE(arena.read(handle, values));
+  EXPECT_EQ(values, added[0]);
+}
+TEST(RegionTracer, RecordsStagesAndExportsTrace) {
+  audio_plugin::RegionTracer tracer;
+  audio_plugin::Region region{TimePoint{16000, 0, std::nullopt},
+                              TimePoint{16000, 80000, std::nullopt}, 7, false};
+  region.analysisState = audio_plugin::Region::State::COMPLETE;
+  region.createdMs = 1000.0;
+  region.sendAttemptedMs = 1050.0;
+  region.sentMs = 1100.0;
+  region.serviceQueueMs = 200.0;
+  region.serviceInferenceMs = 3000.0;
+  region.receivedMs = 4400.0;
+  region.appliedMs = 4401.0;
+  tracer.record(region);
+
+  using Tracer = audio_plugin::RegionTracer;
+  auto snapshot = tracer.getSnapshot();
+  EXPECT_EQ(snapshot.regions, 1u);
+  EXPECT_NEAR(snapshot.stages[Tracer::TIMER_WAIT].totalMs, 50.0, 1e-6);
+  EXPECT_NEAR(snapshot.stages[Tracer::NETWORK].totalMs, 100.0, 1e-6);
+  EXPECT_NEAR(snapshot.stages[Tracer::TOTAL].maxMs, 3401.0, 1e-6);
+  // 3000ms is in the <4096ms bucket
+  EXPECT_EQ(snapshot.stages[Tracer::SERVICE_INFERENCE].histogram[12], 1u);
+
+  auto file = juce::File::createTempFile(".json");
+  ASSERT_TRUE(tracer.exportChromeTrace(file));
+  auto trace = juce::JSON::parse(file);
+  file.deleteFile();
+  ASSERT_TRUE(trace["traceEvents"].isArray());
+  // 2 process names, then begin/end pairs for 5 plugin and 3 service spans
+  EXPECT_EQ(trace["traceEvents"].getArray()->size(), 2 + 2 * (5 + 3));
+}
+TEST(RegionScheduler, OrdersByPolicyAndCountsDeferrals) {
+  using Scheduler = audio_plugin::RegionScheduler;
+  // 5s regions every 2.5s, the third heard during playback
+  std::set<audio_plugin::Region> regions;
+  for (uint16_t i = 0; i < 6; i++) {
+    TimePoint start{16000, i * 40000, std::nullopt};
+    TimePoint end{16000, i * 40000 + 80000, std::nullopt};
+    if (i == 2) {
+      start.playheadTime = 0;
+      end.playheadTime = 80000;
+    }
+    regions.emplace(start, end, i, false).first->createdMs = i * 2500.0;
+  }
+  auto order = [&regions](Scheduler::Policy policy) {
+    Scheduler scheduler;
+    scheduler.setPolicy(policy);
+    for (auto const& region : regions) {
+      scheduler.push(region, 0.0);
+    }
+    std::vector<uint16_t> counts;
+    while (auto region = scheduler.pop(0.0)) {
+      scheduler.setCovered(*region, true);
+      counts.push_back(region->count);
+    }
+    return counts;
+  };
+  using Counts = std::vector<uint16_t>;
+  EXPECT_EQ(order(Scheduler::LATEST_FIRST), (Counts{5, 4, 3, 2, 1, 0}));
+  EXPECT_EQ(order(Scheduler::PLAYHEAD_ALIGNED_FIRST),
+            (Counts{2, 5, 4, 3, 1, 0}));
+  // Every other region first, then those with the fewest neighbours done
+  EXPECT_EQ(order(Scheduler::GAP_FILLING), (Counts{5, 3, 1, 0, 4, 2}));
+  EXPECT_EQ(order(Scheduler::WEIGHTED_AGING), (Counts{2, 0, 1, 3, 4, 5}));
+  EXPECT_EQ(order(Scheduler::PROGRAMME_ORDER), (Counts{0, 1, 2, 3, 4, 5}));
+
+  // Regions left for a later tick are deferred, not dropped
+  Scheduler scheduler;
+  scheduler.beginTick();
+  for (auto const& region : regions) {
+    scheduler.push(region, 0.0);
+  }
+  EXPECT_EQ(scheduler.pop(10.0)->count, 5);
+  scheduler.beginTick();
+  EXPECT_EQ(scheduler.pop(20.0)->count, 4);
+  EXPECT_TRUE(scheduler.expire(*regions.begin()));
+  EXPECT_FALSE(scheduler.expire(*regions.begin()));
+  auto snapshot = scheduler.getSnapshot();
+  EXPECT_EQ(snapshot.queued, 3u);
+  EXPECT_EQ(snapshot.scheduled, 2u);
+  EXPECT_EQ(snapshot.deferred, 1u);
+  EXPECT_EQ(snapshot.expired, 1u);
+  ASSERT_EQ(snapshot.recent.size(), 2u);
+  EXPECT_NEAR(snapshot.recent.front().waitedMs, 20.0, 1e-9);
+}
+TEST(AnalysisRegions, AutoFrequencyMovesInStepsOfTheMinimum) {
+  juce::ScopedJuceInitialiser_GUI juce;
+  auto history = std::make_shared<audio_plugin::MonoCircularBuffer>(
+      audio_plugin::HistoryConfig{}, 16000);
+  auto comms = std::make_shared<audio_plugin::ServiceCommunicator>();
+  audio_plugin::AnalysisRegions regions(history, comms);
+  regions.setRegionFreqMs(2500);
+
+  // 5.5s isn't a whole number of 1s steps, and 2.5s rounds up to the next
+  regions.setAutoFrequency(true, 1000, 5500);
+  auto status = regions.getFrequencyStatus();
+  EXPECT_TRUE(status.automatic);
+  EXPECT_EQ(status.minMs, 1000u);
+  EXPECT_EQ(status.maxMs, 5000u);
+  EXPECT_EQ(status.frequencyMs, 3000u);
+
+  // Narrowing the range pulls it in
+  regions.setAutoFrequency(true, 1000, 2000);
+  EXPECT_EQ(regions.getRegionFreqMs(), 2000u);
+
+  // Off, it stays where it got to
+  regions.setAutoFrequency(false, 1000, 2000);
+  EXPECT_FALSE(regions.isAutoFrequency());
+  EXPECT_EQ(regions.getRegionFreqMs(), 2000u);
+}
+TEST(AnalysisRegions, AddsRegionsWhereResultsChange) {
+  juce::ScopedJuceInitialiser_GUI juce;
+  audio_plugin::MockService::Config config;
+  config.bindAddress = "tcp://127.0.0.1:*";
+  config.latency = {audio_plugin::MockService::LatencyDistribution::FIXED, 0.0,
+                    0.0};
+  config.score = audio_plugin::MockService::Config::RMS;
+  audio_plugin::MockService service(config);
+  ASSERT_TRUE(service.start());
+
+  auto history = std::make_shared<audio_plugin::MonoCircularBuffer>(
+      audio_plugin::HistoryConfig{}, 16000);
+  history->setBlockWhenFull(true);  // Written much faster than real time
+  auto comms = std::make_shared<audio_plugin::ServiceCommunicator>();
+  ASSERT_TRUE(comms->setServiceAddress("127.0.0.1:" +
+                                       std::to_string(service.getPort())));
+  audio_plugin::AnalysisRegions regions(history, comms);
+  regions.setRegionFreqMs(4000);
+  audio_plugin::AnalysisRegions::DensityConfig density;
+  density.adaptive = true;
+  regions.setDensityConfig(density);
+
+  // 10s at 0.1 then 10s at 0.9, giving 5s regions from 1s every 4s
+  std::vector<float> block(16000);
+  for (SampleCounter start = 0; start < 320000; start += 16000) {
+    std::fill(block.begin(), block.end(), start < 160000 ? 0.1f : 0.9f);
+    TimePoint blockStart{16000, start, std::nullopt};
+    history->updateFrom(block, blockStart);
+    regions.updateFrom(blockStart, blockStart + 15999, {}, {&block, 1});
+  }
+
+  // Only the 5s and 9s regions differ enough, filled in down to 1s apart
+  using State = audio_plugin::Region::State;
+  auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(10);
+  do {
+    regions.updateRegions();
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+  } while ((regions.getNumRegionsInState(State::PENDING) > 0 ||
+            regions.getNumRegionsInState(State::IN_PROGRESS) > 0) &&
+           std::chrono::steady_clock::now() < deadline);
+  std::vector<SampleCounter> infill;
+  for (auto const& region : regions.getRegions(0, 320000)) {
+    EXPECT_EQ(region.analysisState, State::COMPLETE);
+    if (region.infill) {
+      infill.push_back(region.start.sampleCounter);
+    }
+  }
+  EXPECT_EQ(infill, (std::vector<SampleCounter>{95998, 111998, 127998}));
+  EXPECT_EQ(regions.getNumInfillRegions(), 3u);
+}
+// Feeds seconds of a constant level to an offline render, much faster than
+// real time, then works through what's outstanding
+void renderOffline(audio_plugin::AnalysisRegions& regions,
+                   audio_plugin::MonoCircularBuffer& history,
+                   SampleCounter seconds) {
+  std::vector<float> block(16000, 0.5f);
+  for (SampleCounter start = 0; start < seconds * 16000; start += 16000) {
+    TimePoint blockStart{16000, start, std::nullopt};
+    history.updateFrom(block, blockStart);
+    regions.updateFrom(blockStart, blockStart + 15999, {}, {&block, 1});
+    regions.updateRegions();
+  }
+}
+void finishOffline(audio_plugin::AnalysisRegions& regions) {
+  using State = audio_plugin::Region::State;
+  auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(10);
+  do {
+    regions.updateRegions();
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+  } while ((regions.getNumRegionsInState(State::PENDING) > 0 ||
+            regions.getNumRegionsInState(State::IN_PROGRESS) > 0) &&
+           std::chrono::steady_clock::now() < deadline);
+}
+TEST(AnalysisRegions, OfflineRegionsPinHistoryUntilDone) {
+  juce::ScopedJuceInitialiser_GUI juce;
+  audio_plugin::MockService::Config config;
+  config.bindAddress = "tcp://127.0.0.1:*";
+  config.latency = {audio_plugin::MockService::LatencyDistribution::FIXED,
+                    2000.0, 0.0};
+  config.poolSize = 64;
+  config.maxQueue = 64;
+  config.score = audio_plugin::MockService::Config::RMS;
+  audio_plugin::MockService service(config);
+  ASSERT_TRUE(service.start());
+
+  audio_plugin::HistoryConfig historyConfig;
+  historyConfig.hotLengthMs = 10000;
+  historyConfig.retentionMs = 10000;
+  auto history = std::make_shared<audio_plugin::MonoCircularBuffer>(
+      historyConfig, 16000);
+  auto comms = std::make_shared<audio_plugin::ServiceCommunicator>();
+  ASSERT_TRUE(comms->setServiceAddress(service.getEndpoint()));
+  audio_plugin::AnalysisRegions regions(history, comms);
+  regions.setRegionFreqMs(1000);
+  regions.setOfflineMode(true);
+
+  // Three times the retention, all sent before the first reply is back
+  renderOffline(regions, *history, 30);
+  auto first = regions.getRegions(0, 480000).begin()->start;
+  std::vector<float> samples(regions.getRegionSizeSamples());
+  EXPECT_TRUE(history->getSamples(first, samples));
+  EXPECT_NEAR(samples.front(), 0.5f, 1e-3f);
+
+  // None are dropped as they age out, and once they're all done the history
+  // is let go
+  finishOffline(regions);
+  auto progress = regions.getOfflineProgress();
+  EXPECT_GE(progress.regionsTotal, 20u);
+  EXPECT_EQ(progress.regionsComplete, progress.regionsTotal);
+  EXPECT_EQ(progress.regionsFailed, 0u);
+  EXPECT_FALSE(history->getSamples(first, samples));
+}
+TEST(AnalysisRegions, OfflineRegionsAreRetriedUpToTheLimit) {
+  juce::ScopedJuceInitialiser_GUI juce;
+  audio_plugin::MockService::Config config;
+  config.bindAddress = "tcp://127.0.0.1:*";
+  config.latency = {audio_plugin::MockService::LatencyDistribution::FIXED, 0.0,
+                    0.0};
+  config.rejectRate = 1.0;
+  audio_plugin::MockService service(config);
+  ASSERT_TRUE(service.start());
+
+  auto history = std::make_shared<audio_plugin::MonoCircularBuffer>(
+      audio_plugin::HistoryConfig{}, 16000);
+  auto comms = std::make_shared<audio_plugin::ServiceCommunicator>();
+  ASSERT_TRUE(comms->setServiceAddress(service.getEndpoint()));
+  audio_plugin::AnalysisRegions regions(history, comms);
+  regions.setRegionFreqMs(1000);
+  regions.setOfflineMode(true);
+
+  // Every one is rejected, so each is sent five times before it fails
+  renderOffline(regions, *history, 10);
+  finishOffline(regions);
+  auto progress = regions.getOfflineProgress();
+  EXPECT_GE(progress.regionsTotal, 3u);
+  EXPECT_EQ(progress.regionsFailed, progress.regionsTotal);
+  EXPECT_EQ(regions.getNumRegionsInState(audio_plugin::Region::State::FAILURE),
+            progress.regionsTotal);
+  EXPECT_EQ(service.getStats().received, 5 * progress.regionsTotal);
+}
+TEST(PlaybackResults, RestoresResultsUntilTheAudioChanges) {
+  // The same audio a fraction of a sample later matches, louder doesn't
+  std::vector<float> audio(80000), shifted(80000), louder(80000);
+  for (size_t i = 0; i < audio.size(); i++) {
+    audio[i] = 0.3f * std::sin(static_cast<float>(i) * 0.05f);
+    shifted[i] = 0.3f * std::sin(static_cast<float>(i) * 0.05f + 0.01f);
+    louder[i] = 0.45f * std::sin(static_cast<float>(i) * 0.05f);
+  }
+  auto original = audio_plugin::AudioFingerprint::of(audio);
+  EXPECT_TRUE(original.matches(audio_plugin::AudioFingerprint::of(shifted)));
+  EXPECT_FALSE(original.matches(audio_plugin::AudioFingerprint::of(louder)));
+
+  auto result = [](SampleCounter offset, PlayheadTime playhead, float value,
+                   const audio_plugin::AudioFingerprint& fingerprint) {
+    audio_plugin::Region region(
+        TimePoint{16000, offset + playhead, playhead},
+        TimePoint{16000, offset + playhead + 80000, playhead + 80000}, 0,
+        true);
+    region.analysisState = audio_plugin::Region::State::COMPLETE;
+    region.analysisResult = value;
+    region.fingerprint = fingerprint;
+    return region;
+  };
+  audio_plugin::PlaybackResults saved;
+  saved.setConfig(0, 80000, 16000);
+  saved.addResult(result(1000, 0, 0.5f, original));
+  saved.addResult(result(1000, 16000, 0.6f, original));
+  juce::MemoryOutputStream out;
+  saved.writeTo(out);
+  // Little-endian whatever the platform, e.g. the region size of 0x13880
+  auto bytes = static_cast<const uint8_t*>(out.getData());
+  EXPECT_EQ(bytes[12], 0x80);
+  EXPECT_EQ(bytes[13], 0x38);
+  EXPECT_EQ(bytes[14], 0x01);
+
+  audio_plugin::PlaybackResults restored;
+  ASSERT_EQ(restored.readFrom(out.getData(), out.getDataSize()),
+            out.getDataSize());
+  EXPECT_EQ(restored.readFrom(out.getData(), out.getDataSize() - 1), 0u);
+  auto results = restored.getResults();
+  ASSERT_EQ(results.regions.size(), 1u);
+  EXPECT_FLOAT_EQ(results.regions.begin()->second.at(16000).analysisResult,
+                  0.6f);
+  // Sample counters are rebased along with their playthrough
+  const auto& [offset, playthrough] = *results.regions.begin();
+  EXPECT_EQ(playthrough.at(16000).start.sampleCounter, offset + 16000);
+  EXPECT_EQ(playthrough.at(16000).end.sampleCounter, offset + 96000);
+
+  // Played again: unchanged at 0, louder at 1s, which drops the old result
+  restored.addResult(result(9000, 0, 0.55f, original));
+  restored.addResult(result(9000, 16000, 0.7f,
+                            audio_plugin::AudioFingerprint::of(louder)));
+  results = restored.getResults();
+  ASSERT_EQ(results.regions.size(), 2u);
+  EXPECT_EQ(results.regions.begin()->second.size(), 1u);
+  EXPECT_EQ(restored.getNumInvalidated(), 1u);
+}
+TEST(ResultJournal, WritesRotatesAndReadsBack) {
+  auto directory = juce::File::getSpecialLocation(juce::File::tempDirectory)
+                       .getNonexistentChildFile("journal", "", false);
+  audio_plugin::ResultJournal::Config config;
+  config.directory = directory.getFullPathName().toStdString();
+  config.prefix = "test";
+  // Three records to a file
+  config.maxFileBytes = audio_plugin::ResultJournal::fileHeaderSize +
+                        3 * audio_plugin::ResultJournal::recordSize;
+  {
+    audio_plugin::ResultJournal journal(config);
+    for (int i = 0; i < 7; i++) {
+      audio_plugin::Region region(TimePoint{16000, i * 40000, std::nullopt},
+                                  TimePoint{16000, i * 40000 + 80000,
+                                            std::nullopt},
+                                  0, false, false, static_cast<uint8_t>(i % 2));
+      if (i == 3) {
+        region.start.playheadTime = 0;
+        region.end.playheadTime = 80000;
+      }
+      region.createdMs = 1000.0;
+      region.sentMs = 1010.0;
+      if (i == 6) {
+        region.analysisState = audio_plugin::Region::State::TIMEOUT;
+      } else {
+        region.analysisState = audio_plugin::Region::State::COMPLETE;
+        region.analysisResult = 0.1f * static_cast<float>(i);
+        region.receivedMs = 1110.0;
+        region.appliedMs = 1111.0;
+        region.serviceInferenceMs = 40.0;
+      }
+      EXPECT_TRUE(journal.push(region));
+    }
+  }  // Drained when destroyed
+
+  auto files = directory.findChildFiles(juce::File::findFiles, false, "*.wrj");
+  files.sort();
+  ASSERT_EQ(files.size(), 3);
+  std::vector<audio_plugin::ResultJournal::Record> records;
+  for (auto const& file : files) {
+    auto read = audio_plugin::ResultJournal::readFile(
+        file.getFullPathName().toStdString());
+    records.insert(records.end(), read.begin(), read.end());
+  }
+  // A torn record at the end is ignored
+  files.getLast().appendData("torn", 4);
+  EXPECT_EQ(audio_plugin::ResultJournal::readFile(
+                files.getLast().getFullPathName().toStdString())
+                .size(),
+            1u);
+  directory.deleteRecursively();
+
+  ASSERT_EQ(records.size(), 7u);
+  EXPECT_EQ(records[3].startSampleCounter, 120000);
+  EXPECT_EQ(records[3].stream, 1);
+  EXPECT_EQ(records[3].playheadEnd, 80000);
+  EXPECT_FALSE(records[2].playheadStart);
+  EXPECT_FLOAT_EQ(records[5].result, 0.5f);
+  EXPECT_FLOAT_EQ(*records[5].roundTripMs, 100.f);
+  EXPECT_FLOAT_EQ(*records[5].serviceInferenceMs, 40.f);
+  EXPECT_FALSE(records[5].serviceQueueMs);
+  EXPECT_EQ(records[6].state, audio_plugin::Region::State::TIMEOUT);
+  EXPECT_FLOAT_EQ(*records[6].sendWaitMs, 10.f);
+  EXPECT_FALSE(records[6].roundTripMs);
+}
+TEST(MetricsRegistry, RendersPrometheusText) {
+  audio_plugin::MetricsRegistry registry;
+  auto sent = registry.counter("test_sent_total", "Sent", "client=\"a\"");
+  auto latency = registry.histogram("test_latency_ms", "Latency", {10, 100});
+  sent->inc(3);
+  latency->observe(5);
+  latency->observe(50);
+  latency->observe(500);
+  {
+    auto dropped = registry.gauge("test_dropped", "Gone when released");
+  }
+
+  auto text = registry.toPrometheusText();
+  EXPECT_NE(text.find("# TYPE test_sent_total counter\n"
+                      "test_sent_total{client=\"a\"} 3\n"),
+            std::string::npos);
+  EXPECT_NE(text.find("test_latency_ms_bucket{le=\"10\"} 1\n"
+                      "test_latency_ms_bucket{le=\"100\"} 2\n"
+                      "test_latency_ms_bucket{le=\"+Inf\"} 3\n"
+                      "test_latency_ms_sum 555\n"
+                      "test_latency_ms_count 3\n"),
+            std::string::npos);
+  EXPECT_EQ(text.find("test_dropped"), std::string::npos);
+}
+TEST(ServiceCommunicator, RoundTripsThroughMockService) {
+  audio_plugin::MockService::Config config;
+  config.bindAddress = "tcp://127.0.0.1:*";
+  config.seed = 1;
+  config.latency = {audio_plugin::MockService::LatencyDistribution::FIXED, 0.0,
+                    0.0};
+  config.poolSize = 64;
+  config.maxQueue = 4096;
+  config.score = audio_plugin::MockService::Config::RMS;
+  audio_plugin::MockService service(config);
+  ASSERT_TRUE(service.start());
+
+  // 10s of a constant 0.5 at 16Khz
+  auto history = std::make_shared<audio_plugin::MonoCircularBuffer>(
+      audio_plugin::HistoryConfig{}, 16000);
+  history->setBlockWhenFull(true);  // Written much faster than real time
+  std::vector<float> block(16000, 0.5f);
+  for (SampleCounter start = 0; start < 160000; start += 16000) {
+    history->updateFrom(block, TimePoint{16000, start, std::nullopt});
+  }
+
+  audio_plugin::ServiceCommunicator comms;
+  ASSERT_TRUE(comms.setServiceAddress("127.0.0.1:" +
+                                      std::to_string(service.getPort())));
+
+  const int numRequests{2000};
+  int sent{0};
+  int received{0};
+  std::set<int64_t> outstanding;
+  auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(30);
+  while (received < numRequests && std::chrono::steady_clock::now() < deadline) {
+    while (sent < numRequests && comms.readyToSend()) {
+      TimePoint start{16000, sent * 64, std::nullopt};
+      if (!comms.sendRequest(start, 16000, history)) {
+        break;
+      }
+      outstanding.insert(start.sampleCounter);
+      sent++;
+    }
+    while (auto resp = comms.getResponse()) {
+      EXPECT_TRUE(resp->success);
+      EXPECT_NEAR(resp->result, 0.5f, 1e-4f);
+      EXPECT_EQ(outstanding.erase(resp->reqId), 1u);
+      received++;
+    }
+    std::this_thread::yield();
+  }
+  EXPECT_EQ(received, numRequests);
+  EXPECT_EQ(service.getStats().completed, static_cast<uint64_t>(numRequests));
+}
+TEST(ServiceCommunicator, SkipsRepliesItCantRead) {
+  audio_plugin::MockService::Config config;
+  config.bindAddress = "tcp://127.0.0.1:*";
+  config.seed = 1;
+  config.latency = {audio_plugin::MockService::LatencyDistribution::FIXED, 0.0,
+                    0.0};
+  config.poolSize = 64;
+  config.maxQueue = 64;
+  config.garbleRate = 0.5;
+  audio_plugin::MockService service(config);
+  ASSERT_TRUE(service.start());
+
+  auto history = std::make_shared<audio_plugin::MonoCircularBuffer>(
+      audio_plugin::HistoryConfig{}, 16000);
+  std::vector<float> block(16000, 0.5f);
+  history->updateFrom(block, TimePoint{16000, 0, std::nullopt});
+
+  audio_plugin::ServiceCommunicator comms;
+  ASSERT_TRUE(comms.setServiceAddress(service.getEndpoint()));
+  const uint64_t numRequests{20};
+  uint64_t sent{0};
+  auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(10);
+  while (sent < numRequests && std::chrono::steady_clock::now() < deadline) {
+    TimePoint start{16000, static_cast<SampleCounter>(sent) * 64, std::nullopt};
+    if (comms.readyToSend() && comms.sendRequest(start, 8000, history)) {
+      sent++;
+    } else {
+      std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+  }
+  ASSERT_EQ(sent, numRequests);
+  auto stats = service.getStats();
+  while (stats.completed + stats.garbled < numRequests &&
+         std::chrono::steady_clock::now() < deadline) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    stats = service.getStats();
+  }
+  std::this_thread::sleep_for(std::chrono::milliseconds(100));
+
+  // One drain gets every reply that can be read, however many can't
+  uint64_t received{0};
+  while (auto resp = comms.getResponse()) {
+    EXPECT_TRUE(resp->success);
+    received++;
+  }
+  EXPECT_GT(stats.garbled, 0u);
+  EXPECT_EQ(received, stats.completed);
+}
+TEST(ServiceCommunicator, BatchesRegionsInOneRequest) {
+  audio_plugin::MockService::Config config;
+  config.bindAddress = "tcp://127.0.0.1:*";
+  config.latency = {audio_plugin::MockService::LatencyDistribution::FIXED, 0.0,
+                    0.0};
+  config.poolSize = 16;
+  config.score = audio_plugin::MockService::Config::RMS;
+  audio_plugin::MockService service(config);
+  ASSERT_TRUE(service.start());
+
+  auto history = std::make_shared<audio_plugin::MonoCircularBuffer>(
+      audio_plugin::HistoryConfig{}, 16000);
+  std::vector<float> block(16000, 0.25f);
+  history->updateFrom(block, TimePoint{16000, 0, std::nullopt});
+
+  audio_plugin::ServiceCommunicator comms;
+  ASSERT_TRUE(comms.setServiceAddress("127.0.0.1:" +
+                                      std::to_string(service.getPort())));
+  std::vector<TimePoint> starts;
+  for (SampleCounter start = 0; start < 8 * 1000; start += 1000) {
+    starts.push_back(TimePoint{16000, start, std::nullopt});
+  }
+  auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(10);
+  while (!comms.readyToSend() && std::chrono::steady_clock::now() < deadline) {
+    std::this_thread::yield();
+  }
+  ASSERT_TRUE(comms.sendRequests(starts, 8000, history));
+
+  // One reply per region
+  std::set<int64_t> outstanding;
+  for (auto const& start : starts) {
+    outstanding.insert(start.sampleCounter);
+  }
+  while (!outstanding.empty() && std::chrono::steady_clock::now() < deadline) {
+    while (auto resp = comms.getResponse()) {
+      EXPECT_TRUE(resp->success);
+      EXPECT_NEAR(resp->result, 0.25f, 1e-4f);
+      EXPECT_EQ(outstanding.erase(resp->reqId), 1u);
+    }
+    std::this_thread::yield();
+  }
+  EXPECT_TRUE(outstanding.empty());
+  EXPECT_EQ(service.getStats().received, starts.size());
+}
+TEST(ServiceCommunicator, SharesAudioWithLocalServices) {
+#ifdef _WIN32
+  GTEST_SKIP() << "No ipc:// transport";
+#endif
+  audio_plugin::MockService::Config config;
+  config.bindAddress = "ipc://*";
+  config.latency = {audio_plugin::MockService::LatencyDistribution::FIXED, 0.0,
+                    0.0};
+  config.score = audio_plugin::MockService::Config::RMS;
+  audio_plugin::MockService service(config);
+  ASSERT_TRUE(service.start());
+
+  auto history = std::make_shared<audio_plugin::MonoCircularBuffer>(
+      audio_plugin::HistoryConfig{}, 16000);
+  std::vector<float> block(16000, 0.75f);
+  history->updateFrom(block, TimePoint{16000, 0, std::nullopt});
+
+  audio_plugin::ServiceCommunicator comms;
+  ASSERT_TRUE(comms.setServiceAddress(service.getEndpoint()));
+  auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(10);
+  while (!comms.readyToSend() && std::chrono::steady_clock::now() < deadline) {
+    std::this_thread::yield();
+  }
+  ASSERT_TRUE(comms.sendRequest(TimePoint{16000, 0, std::nullopt}, 16000,
+                                history));
+
+  std::optional<audio_plugin::ServiceCommunicator::Response> resp;
+  while (!resp && std::chrono::steady_clock::now() < deadline) {
+    resp = comms.getResponse();
+    std::this_thread::yield();
+  }
+  ASSERT_TRUE(resp.has_value());
+  EXPECT_TRUE(resp->success);
+  EXPECT_EQ(resp->reqId, 0);
+  // Read from shared memory by the mock
+  EXPECT_NEAR(resp->result, 0.75f, 1e-4f);
+  EXPECT_EQ(comms.getSharedSlotsInUse(), 0u);
+}
+TEST(ServiceCommunicator, ReleasesSharedAudioWhenSendingFails) {
+#ifdef _WIN32
+  GTEST_SKIP() << "No ipc:// transport";
+#endif
+  auto history = std::make_shared<audio_plugin::MonoCircularBuffer>(
+      audio_plugin::HistoryConfig{}, 16000);
+  std::vector<float> block(16000, 0.75f);
+  history->updateFrom(block, TimePoint{16000, 0, std::nullopt});
+
+  // Nothing listening, so there's no peer to queue the request for
+  auto path = juce::File::getSpecialLocation(juce::File::tempDirectory)
+                  .getNonexistentChildFile("whisper-test", ".ipc", false);
+  audio_plugin::ServiceCommunicator comms;
+  ASSERT_TRUE(comms.setServiceAddress(
+      "ipc://" + path.getFullPathName().toStdString()));
+  for (size_t i = 0; i <= audio_plugin::SharedAudioRing::defaultSlots; i++) {
+    EXPECT_FALSE(comms.sendRequest(TimePoint{16000, 0, std::nullopt}, 16000,
+                                   history));
+    EXPECT_EQ(comms.getSharedSlotsInUse(), 0u);
+  }
+}
+TEST(ServiceCommunicator, ReleasesSharedAudioOfRepliesWrittenOff) {
+#ifdef _WIN32
+  GTEST_SKIP() << "No ipc:// transport";
+#endif
+  audio_plugin::MockService::Config config;
+  config.bindAddress = "ipc://*";
+  // Still outstanding when the address changes
+  config.latency = {audio_plugin::MockService::LatencyDistribution::FIXED,
+                    10000.0, 0.0};
+  audio_plugin::MockService service(config);
+  ASSERT_TRUE(service.start());
+
+  auto history = std::make_shared<audio_plugin::MonoCircularBuffer>(
+      audio_plugin::HistoryConfig{}, 16000);
+  std::vector<float> block(16000, 0.75f);
+  history->updateFrom(block, TimePoint{16000, 0, std::nullopt});
+
+  audio_plugin::ServiceCommunicator comms;
+  ASSERT_TRUE(comms.setServiceAddress(service.getEndpoint()));
+  auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(10);
+  while (!comms.readyToSend() && std::chrono::steady_clock::now() < deadline) {
+    std::this_thread::yield();
+  }
+  ASSERT_TRUE(comms.sendRequest(TimePoint{16000, 0, std::nullopt}, 16000,
+                                history));
+  EXPECT_EQ(comms.getSharedSlotsInUse(), 1u);
+
+  ASSERT_TRUE(comms.setServiceAddress(service.getEndpoint()));
+  EXPECT_EQ(comms.getSharedSlotsInUse(), 0u);
+}
+TEST(ServiceCommunicator, TracksConnectionState) {
+  using Comms = audio_plugin::ServiceCommunicator;
+  audio_plugin::MockService::Config config;
+  config.bindAddress = "tcp://127.0.0.1:*";
+  auto service = std::make_unique<audio_plugin::MockService>(config);
+  ASSERT_TRUE(service->start());
+
+  Comms comms;
+  EXPECT_EQ(comms.getConnectionState(), Comms::DOWN);  // No address yet
+  ASSERT_TRUE(comms.setServiceAddress("127.0.0.1:" +
+                                      std::to_string(service->getPort())));
+  auto waitFor = [&comms](Comms::ConnectionState state) {
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(10);
+    while (comms.getConnectionState() != state &&
+           std::chrono::steady_clock::now() < deadline) {
+      std::this_thread::sleep_for(std::chrono::milliseconds(5));
+    }
+    return comms.getConnectionState() == state;
+  };
+  EXPECT_TRUE(waitFor(Comms::LIVE));
+  EXPECT_TRUE(comms.readyToSend());
+
+  // Stops sending as soon as the service goes...
+  config.bindAddress = service->getEndpoint();
+  service.reset();
+  EXPECT_TRUE(waitFor(Comms::DOWN));
+  EXPECT_FALSE(comms.readyToSend());
+
+  // ...and picks up again when it's back
+  service = std::make_unique<audio_plugin::MockService>(config);
+  ASSERT_TRUE(service->start());
+  EXPECT_TRUE(waitFor(Comms::LIVE));
+  EXPECT_TRUE(comms.readyToSend());
+}
+
+// The service checks a slot wasn't reused while it was reading
+TEST(SharedAudioRing, DetectsReusedSlots) {
+  audio_plugin::SharedAudioRing ring(2, 100);
+  ASSERT_TRUE(ring.isValid());
+  auto fill = [](float value) {
+    return [value](std::span<float> samples) {
+      std::fill(samples.begin(), samples.end(), value);
+    };
+  };
+  auto first = ring.write(1, 50, fill(1.f));
+  ASSERT_TRUE(first.has_value());
+  EXPECT_FALSE(ring.write(2, 101, fill(2.f)).has_value());
+
+  audio_plugin::SharedAudioRing::Reader reader(ring.getName());
+  auto view = reader.view(*first);
+  ASSERT_TRUE(view.has_value());
+  EXPECT_EQ(view->size(), 50u);
+  EXPECT_EQ((*view)[49], 1.f);
+
+  // Released slots are reused first, then the oldest outstanding
+  auto second = ring.write(2, 10, fill(2.f));
+  ring.release(2);
+  EXPECT_EQ(ring.write(3, 10, fill(3.f))->slot, second->slot);
+  EXPECT_EQ(ring.write(4, 10, fill(4.f))->slot, first->slot);
+  EXPECT_FALSE(reader.stillValid(*first));
+  EXPECT_FALSE(reader.view(*first).has_value());
+}
 //TEST(AudioProcessor, Test2) {
 //  audio_plugin::AudioPluginAudioProcessor processor{};
 //  throw std::exception();
@@ -0,0 +1,369 @@
+// Headless batch analysis of audio files.
+//
+// Each file is decoded, downmixed and resampled on a worker thread through
+// the same Buff/AnalysisRegions/ServiceCommunicator chain as the plugin, with
+// the regions in offline mode so none are dropped. Region sending and reply
+// handling run from the AnalysisRegions timers on the main (message) thread.
+//
+// Usage:
+//   whisper-batch [--service=host:port] [--jobs=N] [--in-flight=N]
+//                 [--batch=N] [--timeout=secs] [--csv=out.csv] [--json=out.json]
+//                 <file or directory>...
+
+#include <juce_audio_formats/juce_audio_formats.h>
+#include <juce_events/juce_events.h>
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include "AnalysisRegions.h"
+#include "CircularBuffer.h"
+#include "Comms.h"
+
+namespace audio_plugin {
+namespace {
+
+constexpr SampleRate processingSampleRate{16000};
+constexpr int readBlockSize{4096};
+
+struct Options {
+  std::string serviceAddress{"127.0.0.1:12345"};
+  size_t jobs{0};
+  size_t inFlight{6};  // Default service pool_size + max_queue
+  size_t batchSize{1};  // Regions per request
+  int timeoutSecs{120};
+  juce::File csvFile;
+  juce::File jsonFile;
+  juce::Array<juce::File> inputs;
+};
+
+struct RegionResult {
+  juce::String file;
+  double startSecs;
+  double endSecs;
+  Region::State state;
+  float result;
+  double latencyMs;
+  std::vector<float> frames;  // Per-frame scores, if the service sent them
+};
+
+const char* toString(Region::State state) {
+  switch (state) {
+    case Region::State::PENDING:
+      return "pending";
+    case Region::State::IN_PROGRESS:
+      return "in_progress";
+    case Region::State::COMPLETE:
+      return "complete";
+    case Region::State::TIMEOUT:
+      return "timeout";
+    case Region::State::FAILURE:
+      return "failure";
+  }
+  return "unknown";
+}
+
+class BatchAnalyser {
+public:
+  explicit BatchAnalyser(const Options& options) : options_(options) {
+    formatManager_.registerBasicFormats();
+  }
+
+  juce::Array<juce::File> findFiles() {
+    juce::Array<juce::File> files;
+    auto wildcard = formatManager_.getWildcardForAllFormats();
+    for (auto const& input : options_.inputs) {
+      if (input.isDirectory()) {
+        files.addArray(
+            input.findChildFiles(juce::File::findFiles, true, wildcard));
+      } else if (input.existsAsFile()) {
+        files.add(input);
+      } else {
+        std::cerr << "Skipping " << input.getFullPathName() << " (not found)"
+                  << std::endl;
+      }
+    }
+    return files;
+  }
+
+  // Runs the workers, pumping the message loop on this thread until done
+  void run(const juce::Array<juce::File>& files) {
+    files_ = files;
+    auto jobs = options_.jobs != 0
+                    ? options_.jobs
+                    : std::max<size_t>(1, std::thread::hardware_concurrency());
+    jobs = std::min<size_t>(jobs, std::max(1, files_.size()));
+    // Share the service's capacity between the workers
+    perFileInFlight_ = std::max<size_t>(1, options_.inFlight / jobs);
+
+    startMs_ = juce::Time::getMillisecondCounterHiRes();
+    std::vector<std::thread> workers;
+    for (size_t j = 0; j < jobs; j++) {
+      workers.emplace_back([this] { workerLoop(); });
+    }
+    std::thread coordinator([&workers] {
+      for (auto& worker : workers) {
+        worker.join();
+      }
+      // Queued behind any buffers still to be released
+      juce::MessageManager::callAsync(
+          [] { juce::MessageManager::getInstance()->stopDispatchLoop(); });
+    });
+    juce::MessageManager::getInstance()->runDispatchLoop();
+    coordinator.join();
+    endMs_ = juce::Time::getMillisecondCounterHiRes();
+  }
+
+  void writeCsv(const juce::File& file) {
+    juce::String csv{"file,start_s,end_s,state,result,latency_ms\n"};
+    for (auto const& r : results_) {
+      csv << r.file.quoted() << "," << juce::String(r.startSecs, 3) << ","
+          << juce::String(r.endSecs, 3) << "," << toString(r.state) << ","
+          << juce::String(r.result, 6) << "," << juce::String(r.latencyMs, 1)
+          << "\n";
+    }
+    if (!file.replaceWithText(csv)) {
+      std::cerr << "Unable to write " << file.getFullPathName() << std::endl;
+    }
+  }
+
+  void writeJson(const juce::File& file) {
+    juce::Array<juce::var> regions;
+    for (auto const& r : results_) {
+      auto obj = std::make_unique<juce::DynamicObject>();
+      obj->setProperty("file", r.file);
+      obj->setProperty("start_s", r.startSecs);
+      obj->setProperty("end_s", r.endSecs);
+      obj->setProperty("state", juce::String(toString(r.state)));
+      obj->setProperty("result", r.result);
+      obj->setProperty("latency_ms", r.latencyMs);
+      if (!r.frames.empty()) {
+        juce::Array<juce::var> frames;
+        for (auto frame : r.frames) {
+          frames.add(frame);
+        }
+        obj->setProperty("frames", frames);
+      }
+      regions.add(juce::var(obj.release()));
+    }
+    auto root = std::make_unique<juce::DynamicObject>();
+    root->setProperty("regions", regions);
+    root->setProperty("summary", getSummary());
+    if (!file.replaceWithText(juce::JSON::toString(juce::var(root.release())))) {
+      std::cerr << "Unable to write " << file.getFullPathName() << std::endl;
+    }
+  }
+
+  juce::var getSummary() {
+    std::vector<double> latencies;
+    size_t completed{0};
+    for (auto const& r : results_) {
+      if (r.state == Region::State::COMPLETE) {
+        completed++;
+        latencies.push_back(r.latencyMs);
+      }
+    }
+    std::sort(latencies.begin(), latencies.end());
+    auto percentile = [&latencies](double p) {
+      if (latencies.empty()) {
+        return 0.0;
+      }
+      // Nearest rank
+      auto rank = static_cast<size_t>(
+          std::ceil(p / 100.0 * static_cast<double>(latencies.size())));
+      return latencies[std::clamp<size_t>(rank, 1, latencies.size()) - 1];
+    };
+    auto wallSecs = (endMs_ - startMs_) / 1000.0;
+
+    auto summary = std::make_unique<juce::DynamicObject>();
+    summary->setProperty("files", files_.size());
+    summary->setProperty("regions", static_cast<int>(results_.size()));
+    summary->setProperty("completed", static_cast<int>(completed));
+    summary->setProperty("failed",
+                         static_cast<int>(results_.size() - completed));
+    summary->setProperty("incomplete", static_cast<int>(incomplete_.load()));
+    summary->setProperty("wall_s", wallSecs);
+    summary->setProperty(
+        "regions_per_s",
+        wallSecs > 0.0 ? static_cast<double>(completed) / wallSecs : 0.0);
+    summary->setProperty("latency_p50_ms", percentile(50.0));
+    summary->setProperty("latency_p95_ms", percentile(95.0));
+    summary->setProperty("latency_p99_ms", percentile(99.0));
+    return juce::var(summary.release());
+  }
+
+private:
+  void workerLoop() {
+    while (true) {
+      auto index = nextFile_++;
+      if (index >= static_cast<size_t>(files_.size())) {
+        return;
+      }
+      analyseFile(files_[static_cast<int>(index)]);
+    }
+  }
+
+  void analyseFile(const juce::File& file) {
+    std::unique_ptr<juce::AudioFormatReader> reader(
+        formatManager_.createReaderFor(file));
+    if (!reader) {
+      std::cerr << "Unable to read " << file.getFullPathName() << std::endl;
+      return;
+    }
+    auto fileName = file.getFileName();
+    auto comms = std::make_shared<ServiceCommunicator>();
+    comms->setMaxBatchSize(options_.batchSize);
+    if (!comms->setServiceAddress(options_.serviceAddress)) {
+      std::cerr << "Unable to connect to " << options_.serviceAddress
+                << std::endl;
+      return;
+    }
+    auto srcSampleRate = static_cast<SampleRate>(reader->sampleRate);
+    auto buff = std::make_shared<Buff>(srcSampleRate,
+                                       static_cast<uint16_t>(readBlockSize),
+                                       processingSampleRate, comms);
+    auto regions = buff->getAnalysisRegions();
+    regions->setMaxInFlight(perFileInFlight_);
+    regions->setOfflineMode(true);
+    auto& resultArena = regions->getResultArena();
+    regions->setRegionFinishedCallback([this, fileName, &resultArena](
+                                           const Region& region) {
+      RegionResult result{
+          fileName,
+          static_cast<double>(region.start.sampleCounter) /
+              processingSampleRate,
+          static_cast<double>(region.end.sampleCounter) / processingSampleRate,
+          region.analysisState,
+          region.analysisResult,
+          region.receivedMs - region.sentMs};
+      resultArena.read(region.frames, result.frames);
+      std::lock_guard<std::mutex> lock(resultsMtx_);
+      results_.push_back(std::move(result));
+    });
+
+    // Decode, downmix and resample as fast as the history will take it
+    juce::AudioBuffer<float> block(
+        static_cast<int>(std::max(1u, reader->numChannels)), readBlockSize);
+    for (juce::int64 pos = 0; pos < reader->lengthInSamples;
+         pos += readBlockSize) {
+      auto numSamples = static_cast<int>(
+          std::min<juce::int64>(readBlockSize, reader->lengthInSamples - pos));
+      block.setSize(block.getNumChannels(), numSamples, false, false, true);
+      reader->read(&block, 0, numSamples, pos, true, true);
+      buff->updateFrom(block, TimePoint{srcSampleRate, pos, std::nullopt});
+    }
+
+    // Wait for the service to work through the regions, giving up if nothing
+    // comes back for a while
+    size_t lastFinished{0};
+    auto lastProgressMs = juce::Time::getMillisecondCounterHiRes();
+    while (true) {
+      auto progress = regions->getOfflineProgress();
+      auto finished = progress.regionsComplete + progress.regionsFailed;
+      if (finished >= progress.regionsTotal) {
+        break;
+      }
+      auto nowMs = juce::Time::getMillisecondCounterHiRes();
+      if (finished != lastFinished) {
+        lastFinished = finished;
+        lastProgressMs = nowMs;
+      } else if (nowMs - lastProgressMs > options_.timeoutSecs * 1000.0) {
+        std::cerr << fileName << ": no replies for " << options_.timeoutSecs
+                  << "s, giving up on " << progress.regionsTotal - finished
+                  << " regions" << std::endl;
+        incomplete_ += progress.regionsTotal - finished;
+        regions->abortInProgress();
+        break;
+      }
+      juce::Thread::sleep(10);
+    }
+
+    regions->setRegionFinishedCallback(nullptr);
+    std::cout << fileName << ": done" << std::endl;
+    // Timers must be torn down on the message thread
+    juce::MessageManager::callAsync(
+        [buff = std::move(buff)]() mutable { buff.reset(); });
+  }
+
+  const Options options_;
+  juce::AudioFormatManager formatManager_;
+  juce::Array<juce::File> files_;
+  std::atomic<size_t> nextFile_{0};
+  size_t perFileInFlight_{1};
+  std::atomic<size_t> incomplete_{0};
+  double startMs_{0.0};
+  double endMs_{0.0};
+
+  std::mutex resultsMtx_;
+  std::vector<RegionResult> results_;
+};
+
+}  // namespace
+}  // namespace audio_plugin
+
+int main(int argc, char* argv[]) {
+  juce::ScopedJuceInitialiser_GUI juceInit;
+  juce::ArgumentList args(argc, argv);
+
+  audio_plugin::Options options;
+  if (args.containsOption("--service")) {
+    options.serviceAddress =
+        args.removeValueForOption("--service").toStdString();
+  }
+  if (args.containsOption("--jobs")) {
+    options.jobs = static_cast<size_t>(
+        std::max(1, args.removeValueForOption("--jobs").getIntValue()));
+  }
+  if (args.containsOption("--in-flight")) {
+    options.inFlight = static_cast<size_t>(
+        std::max(1, args.removeValueForOption("--in-flight").getIntValue()));
+  }
+  if (args.containsOption("--batch")) {
+    options.batchSize = static_cast<size_t>(
+        std::max(1, args.removeValueForOption("--batch").getIntValue()));
+  }
+  if (args.containsOption("--timeout")) {
+    options.timeoutSecs =
+        std::max(1, args.removeValueForOption("--timeout").getIntValue());
+  }
+  if (args.containsOption("--csv")) {
+    options.csvFile = args.getFileForOption("--csv");
+    args.removeValueForOption("--csv");
+  }
+  if (args.containsOption("--json")) {
+    options.jsonFile = args.getFileForOption("--json");
+    args.removeValueForOption("--json");
+  }
+  for (auto const& arg : args.arguments) {
+    options.inputs.add(arg.resolveAsFile());
+  }
+  if (options.inputs.isEmpty()) {
+    std::cerr << "Usage: " << args.executableName
+              << " [--service=host:port] [--jobs=N] [--in-flight=N]"
+                 " [--batch=N] [--timeout=secs] [--csv=out.csv] [--json=out.json]"
+                 " <file or directory>..."
+              << std::endl;
+    return 1;
+  }
+
+  audio_plugin::BatchAnalyser analyser(options);
+  auto files = analyser.findFiles();
+  if (files.isEmpty()) {
+    std::cerr << "No audio files found" << std::endl;
+    return 1;
+  }
+  analyser.run(files);
+
+  if (options.csvFile != juce::File()) {
+    analyser.writeCsv(options.csvFile);
+  }
+  if (options.jsonFile != juce::File()) {
+    analyser.writeJson(options.jsonFile);
+  }
+  std::cout << juce::JSON::toString(analyser.getSummary()) << std::endl;
+  return 0;
+}
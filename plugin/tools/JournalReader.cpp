@@ -0,0 +1,119 @@
+// Converts result journals (see ResultJournal.h) to CSV or JSON.
+//
+// Directories are searched for journal files. Files are read in name order,
+// so each instance's files come out oldest first.
+//
+// Usage:
+//   whisper-journal [--csv=out.csv] [--json=out.json] <file or directory>...
+//
+// With neither option, CSV is written to stdout.
+
+#include <juce_core/juce_core.h>
+#include <algorithm>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <vector>
+#include "ResultJournal.h"
+
+namespace audio_plugin {
+namespace {
+
+std::vector<std::filesystem::path> findJournals(
+    const std::vector<std::filesystem::path>& inputs) {
+  std::vector<std::filesystem::path> files;
+  for (auto const& input : inputs) {
+    if (!std::filesystem::is_directory(input)) {
+      files.push_back(input);
+      continue;
+    }
+    for (auto const& entry : std::filesystem::directory_iterator(input)) {
+      if (entry.is_regular_file() &&
+          entry.path().extension() == ResultJournal::fileExtension) {
+        files.push_back(entry.path());
+      }
+    }
+  }
+  std::sort(files.begin(), files.end());
+  return files;
+}
+
+void writeCsv(std::ostream& out,
+              const std::vector<ResultJournal::Record>& records) {
+  out << ResultJournal::toCsvHeader() << "\n";
+  for (auto const& record : records) {
+    out << ResultJournal::toCsv(record) << "\n";
+  }
+}
+
+void writeJson(std::ostream& out,
+               const std::vector<ResultJournal::Record>& records) {
+  out << "[";
+  for (size_t i = 0; i < records.size(); i++) {
+    out << (i == 0 ? "\n  " : ",\n  ") << ResultJournal::toJson(records[i]);
+  }
+  out << "\n]\n";
+}
+
+template <typename Writer>
+bool writeFile(const juce::File& file,
+               const std::vector<ResultJournal::Record>& records,
+               Writer writer) {
+  std::ofstream out(file.getFullPathName().toStdString());
+  writer(out, records);
+  if (!out) {
+    std::cerr << "Unable to write " << file.getFullPathName() << std::endl;
+    return false;
+  }
+  return true;
+}
+
+}  // namespace
+}  // namespace audio_plugin
+
+int main(int argc, char* argv[]) {
+  using namespace audio_plugin;
+  juce::ArgumentList args(argc, argv);
+
+  juce::File csvFile;
+  juce::File jsonFile;
+  if (args.containsOption("--csv")) {
+    csvFile = args.getFileForOption("--csv");
+    args.removeValueForOption("--csv");
+  }
+  if (args.containsOption("--json")) {
+    jsonFile = args.getFileForOption("--json");
+    args.removeValueForOption("--json");
+  }
+  std::vector<std::filesystem::path> inputs;
+  for (auto const& arg : args.arguments) {
+    inputs.emplace_back(arg.resolveAsFile().getFullPathName().toStdString());
+  }
+  if (inputs.empty()) {
+    std::cerr << "Usage: " << args.executableName
+              << " [--csv=out.csv] [--json=out.json] <file or directory>..."
+              << std::endl;
+    return 1;
+  }
+
+  std::vector<ResultJournal::Record> records;
+  for (auto const& file : findJournals(inputs)) {
+    auto fileRecords = ResultJournal::readFile(file);
+    if (fileRecords.empty()) {
+      std::cerr << "No records in " << file.string() << std::endl;
+    }
+    records.insert(records.end(), fileRecords.begin(), fileRecords.end());
+  }
+
+  bool ok{true};
+  if (csvFile != juce::File()) {
+    ok &= writeFile(csvFile, records, writeCsv);
+  }
+  if (jsonFile != juce::File()) {
+    ok &= writeFile(jsonFile, records, writeJson);
+  }
+  if (csvFile == juce::File() && jsonFile == juce::File()) {
+    writeCsv(std::cout, records);
+  }
+  return ok ? 0 : 1;
+}
@@ -0,0 +1,387 @@
+#include "MockService.h"
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstring>
+#include <deque>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <optional>
+#include <span>
+#include <sstream>
+#include <vector>
+#include "SharedAudioRing.h"
+
+namespace audio_plugin {
+namespace {
+
+using Clock = std::chrono::steady_clock;
+
+// Asks for a binary reply (see ServiceCommunicator::parseBinaryResponse)
+constexpr uint64_t binaryReplyFlag{uint64_t{1} << 62};
+// Asks for per-frame scores as well
+constexpr uint64_t framesRequestFlag{uint64_t{1} << 61};
+// The request carries a SharedAudioRing descriptor rather than audio
+constexpr uint64_t sharedAudioFlag{uint64_t{1} << 60};
+constexpr uint8_t replyOk{0};
+constexpr uint8_t replyOverloaded{1};
+
+struct Job {
+  Clock::time_point due;
+  Clock::time_point received;
+  Clock::time_point started;
+  zmq::message_t identity;
+  uint64_t requestId;
+  bool binary;
+  float score;
+  std::vector<float> frames;
+};
+
+// Earliest due at the front of the heap
+bool dueLater(const Job& lhs, const Job& rhs) {
+  return lhs.due > rhs.due;
+}
+
+double sampleLatencyMs(const MockService::LatencyDistribution& latency,
+                       std::mt19937_64& rng) {
+  using Latency = MockService::LatencyDistribution;
+  double ms{0.0};
+  switch (latency.kind) {
+    case Latency::FIXED:
+      ms = latency.a;
+      break;
+    case Latency::UNIFORM:
+      ms = std::uniform_real_distribution<double>(
+          latency.a, std::max(latency.a, latency.b))(rng);
+      break;
+    case Latency::NORMAL:
+      ms = std::normal_distribution<double>(latency.a, latency.b)(rng);
+      break;
+    case Latency::LOG_NORMAL:
+      ms = std::lognormal_distribution<double>(
+          std::log(std::max(latency.a, 1e-3)), latency.b)(rng);
+      break;
+    case Latency::EXPONENTIAL:
+      ms = std::exponential_distribution<double>(
+          1.0 / std::max(latency.a, 1e-3))(rng);
+      break;
+  }
+  return std::max(ms, 0.0);
+}
+
+float calcRms(std::span<const uint8_t> audioBytes) {
+  const auto numSamples = audioBytes.size() / sizeof(float);
+  if (numSamples == 0) {
+    return 0.f;
+  }
+  double sumSquares{0.0};
+  for (size_t i = 0; i < numSamples; ++i) {
+    float sample;
+    std::memcpy(&sample, audioBytes.data() + i * sizeof(float), sizeof(float));
+    sumSquares += static_cast<double>(sample) * sample;
+  }
+  return static_cast<float>(std::sqrt(sumSquares / numSamples));
+}
+
+void sendReply(zmq::socket_t& router,
+               zmq::message_t& identity,
+               const std::string& json) {
+  try {
+    router.send(identity, zmq::send_flags::sndmore);
+    router.send(zmq::buffer(json), zmq::send_flags::none);
+  } catch (const zmq::error_t& e) {
+    std::cerr << "Mock service send error: " << e.what() << std::endl;
+  }
+}
+
+double msBetween(Clock::time_point from, Clock::time_point to) {
+  return std::chrono::duration<double, std::milli>(to - from).count();
+}
+
+template <typename T>
+void append(std::string& out, T value) {
+  out.append(reinterpret_cast<const char*>(&value), sizeof(value));
+}
+
+std::string binaryReply(uint64_t requestId,
+                        uint8_t status,
+                        std::optional<float> score,
+                        std::optional<std::pair<float, float>> timingMs,
+                        std::span<const float> frames = {}) {
+  std::string out{"WSR\x01", 4};
+  append<uint8_t>(out, status);
+  append<uint8_t>(out, (timingMs ? 1 : 0) | (frames.empty() ? 0 : 2));
+  append<uint16_t>(out, score ? 1 : 0);
+  append<uint64_t>(out, requestId);
+  if (score) {
+    append<float>(out, *score);
+  }
+  if (timingMs) {
+    append<float>(out, timingMs->first);
+    append<float>(out, timingMs->second);
+  }
+  if (!frames.empty()) {
+    append<uint32_t>(out, static_cast<uint32_t>(frames.size()));
+    for (auto frame : frames) {
+      append<float>(out, frame);
+    }
+  }
+  return out;
+}
+
+std::string resultReply(const Job& job, Clock::time_point replied) {
+  if (job.binary) {
+    return binaryReply(
+        job.requestId, replyOk, job.score,
+        std::pair<float, float>(
+            static_cast<float>(msBetween(job.received, job.started)),
+            static_cast<float>(msBetween(job.started, replied))),
+        job.frames);
+  }
+  // Always with a decimal point, so it parses as a double
+  std::ostringstream oss;
+  oss << "{\"request_id\": " << job.requestId << ", \"result\": ["
+      << std::fixed << std::setprecision(9) << job.score << "]"
+      << std::setprecision(3) << ", \"timing\": {\"queue_ms\": "
+      << msBetween(job.received, job.started)
+      << ", \"inference_ms\": " << msBetween(job.started, replied) << "}";
+  if (!job.frames.empty()) {
+    oss << std::setprecision(6) << ", \"frames\": [";
+    for (size_t i = 0; i < job.frames.size(); ++i) {
+      oss << (i > 0 ? ", " : "") << job.frames[i];
+    }
+    oss << "]";
+  }
+  oss << "}";
+  return oss.str();
+}
+
+std::string rejectionReply(uint64_t requestId, bool binary) {
+  if (binary) {
+    return binaryReply(requestId, replyOverloaded, std::nullopt, std::nullopt);
+  }
+  return "{\"request_id\": " + std::to_string(requestId) +
+         ", \"error\": \"overloaded\"}";
+}
+
+}  // namespace
+
+MockService::MockService(const Config& config)
+    : config_(config), context_{1}, router_{context_, ZMQ_ROUTER} {
+  router_.set(zmq::sockopt::linger, 0);
+}
+
+MockService::~MockService() {
+  stop();
+}
+
+bool MockService::start() {
+  if (running_) {
+    return true;
+  }
+  try {
+    router_.bind(config_.bindAddress);
+  } catch (const zmq::error_t& e) {
+    std::cerr << "Mock service unable to bind " << config_.bindAddress << ": "
+              << e.what() << std::endl;
+    return false;
+  }
+  endpoint_ = router_.get(zmq::sockopt::last_endpoint);
+  if (endpoint_.starts_with("tcp://")) {
+    port_ = std::stoi(endpoint_.substr(endpoint_.find_last_of(':') + 1));
+  }
+  running_ = true;
+  thread_ = std::thread([this] { run(); });
+  return true;
+}
+
+void MockService::stop() {
+  running_ = false;
+  if (thread_.joinable()) {
+    thread_.join();
+  }
+  if (!endpoint_.empty()) {
+    // Drops clients' connections too, as a service going away would
+    try {
+      router_.unbind(endpoint_);
+    } catch (const zmq::error_t&) {
+    }
+    endpoint_.clear();
+  }
+}
+
+int MockService::getPort() const {
+  return port_;
+}
+
+std::string MockService::getEndpoint() const {
+  return endpoint_;
+}
+
+MockService::Stats MockService::getStats() const {
+  return Stats{received_, completed_, rejected_, dropped_, garbled_};
+}
+
+void MockService::run() {
+  std::mt19937_64 rng(config_.seed);
+  std::uniform_real_distribution<double> chance(0.0, 1.0);
+  std::vector<Job> analysing;  // Heap by due time, at most poolSize
+  std::deque<Job> queued;
+  std::vector<zmq::message_t> payloads;  // Of the latest request
+  // Clients' shared audio, by name
+  std::map<std::string, std::unique_ptr<SharedAudioRing::Reader>> readers;
+
+  auto startJob = [&](Job job) {
+    job.started = Clock::now();
+    job.due = job.started + std::chrono::microseconds(static_cast<int64_t>(
+                                sampleLatencyMs(config_.latency, rng) * 1000));
+    analysing.push_back(std::move(job));
+    std::push_heap(analysing.begin(), analysing.end(), dueLater);
+  };
+
+  while (running_) {
+    // Sleep until the next job is due, new requests arrive, or we're stopped
+    auto timeout = std::chrono::milliseconds(50);
+    if (!analysing.empty()) {
+      auto untilDue = std::chrono::ceil<std::chrono::milliseconds>(
+          analysing.front().due - Clock::now());
+      timeout = std::clamp(untilDue, std::chrono::milliseconds(0), timeout);
+    }
+    zmq::pollitem_t items[] = {{router_.handle(), 0, ZMQ_POLLIN, 0}};
+    zmq::poll(items, 1, timeout);
+
+    // Take everything that has arrived
+    while (true) {
+      zmq::message_t identity;
+      if (!router_.recv(identity, zmq::recv_flags::dontwait)) {
+        break;
+      }
+      // Batched requests carry one region per part. Each is handled (and
+      // replied to) as a request of its own.
+      if (!identity.more()) {
+        continue;
+      }
+      payloads.clear();
+      do {
+        zmq::message_t payload;
+        if (!router_.recv(payload, zmq::recv_flags::none)) {
+          break;
+        }
+        payloads.push_back(std::move(payload));
+      } while (payloads.back().more());
+      for (auto& payload : payloads) {
+        received_++;
+        if (payload.size() < sizeof(uint64_t)) {
+          continue;
+        }
+        uint64_t requestId;
+        std::memcpy(&requestId, payload.data(), sizeof(requestId));
+        const bool binary = requestId & binaryReplyFlag;
+        const bool wantsFrames = requestId & framesRequestFlag;
+        const bool sharedAudio = requestId & sharedAudioFlag;
+        requestId &= ~(binaryReplyFlag | framesRequestFlag | sharedAudioFlag);
+
+        if (chance(rng) < config_.dropRate) {
+          dropped_++;
+          continue;
+        }
+        // Only drawn for when asked for, so seeded runs are as they were
+        if (config_.garbleRate > 0.0 && chance(rng) < config_.garbleRate) {
+          garbled_++;
+          zmq::message_t replyTo(identity.data(), identity.size());
+          sendReply(router_, replyTo, "{\"request_id\": ");
+          continue;
+        }
+        if (chance(rng) < config_.rejectRate ||
+            (analysing.size() >= config_.poolSize &&
+             queued.size() >= config_.maxQueue)) {
+          rejected_++;
+          zmq::message_t replyTo(identity.data(), identity.size());
+          sendReply(router_, replyTo, rejectionReply(requestId, binary));
+          continue;
+        }
+
+        Job job{Clock::time_point{}, Clock::now(), Clock::time_point{},
+                zmq::message_t(identity.data(), identity.size()), requestId,
+                binary, 0.f, {}};
+        std::span<const uint8_t> audioBytes(
+            static_cast<const uint8_t*>(payload.data()) + sizeof(uint64_t),
+            payload.size() - sizeof(uint64_t));
+        std::optional<SharedAudioRing::Descriptor> shared;
+        SharedAudioRing::Reader* reader{nullptr};
+        if (sharedAudio) {
+          // Read in place from the client's ring
+          shared = SharedAudioRing::Descriptor::readFrom(audioBytes.data(),
+                                                         audioBytes.size());
+          std::optional<std::span<const float>> view;
+          if (shared) {
+            auto& mapped = readers[shared->name];
+            if (!mapped) {
+              mapped = std::make_unique<SharedAudioRing::Reader>(shared->name);
+            }
+            reader = mapped.get();
+            view = reader->view(*shared);
+          }
+          if (!view) {
+            rejected_++;
+            sendReply(router_, job.identity, rejectionReply(requestId, binary));
+            continue;
+          }
+          audioBytes = {reinterpret_cast<const uint8_t*>(view->data()),
+                        view->size_bytes()};
+        }
+        if (config_.score == Config::RMS) {
+          job.score = calcRms(audioBytes);
+        } else {
+          job.score = static_cast<float>(chance(rng));
+        }
+        if (wantsFrames && config_.framesPerRequest > 0) {
+          // Split in to whole samples, the last frame taking any remainder
+          const auto numSamples = audioBytes.size() / sizeof(float);
+          const auto frameSamples =
+              std::max<size_t>(1, numSamples / config_.framesPerRequest);
+          for (size_t f = 0; f < config_.framesPerRequest; ++f) {
+            const auto from = std::min(f * frameSamples, numSamples);
+            const auto to = f + 1 == config_.framesPerRequest
+                                ? numSamples
+                                : std::min(from + frameSamples, numSamples);
+            job.frames.push_back(
+                config_.score == Config::RMS
+                    ? calcRms(audioBytes.subspan(from * sizeof(float),
+                                                 (to - from) * sizeof(float)))
+                    : static_cast<float>(chance(rng)));
+          }
+        }
+        if (reader && !reader->stillValid(*shared)) {
+          // Reused while we were reading it
+          rejected_++;
+          sendReply(router_, job.identity, rejectionReply(requestId, binary));
+          continue;
+        }
+        if (analysing.size() < config_.poolSize) {
+          startJob(std::move(job));
+        } else {
+          queued.push_back(std::move(job));
+        }
+      }
+    }
+
+    // Reply to anything finished, freeing the pool for whatever's queued
+    auto now = Clock::now();
+    while (!analysing.empty() && analysing.front().due <= now) {
+      std::pop_heap(analysing.begin(), analysing.end(), dueLater);
+      auto job = std::move(analysing.back());
+      analysing.pop_back();
+      sendReply(router_, job.identity, resultReply(job, Clock::now()));
+      completed_++;
+      if (!queued.empty()) {
+        startJob(std::move(queued.front()));
+        queued.pop_front();
+      }
+    }
+  }
+}
+
+}  // namespace audio_plugin
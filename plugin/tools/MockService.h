@@ -0,0 +1,85 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <random>
+#include <string>
+#include <thread>
+#include <zmq.hpp>
+
+namespace audio_plugin {
+
+// In-process stand-in for the Python inference service.
+//
+// Speaks the same ROUTER protocol (8 byte request ID + float32 samples in,
+// a part per region when batched, or shared memory descriptors in place of
+// samples, JSON or binary out) from a single event loop thread, so it can be driven
+// much harder than the simulator and, given the same seed, behaves the same
+// every run.
+class MockService {
+public:
+  struct LatencyDistribution {
+    // FIXED: a | UNIFORM: [a, b) | NORMAL: mean a, stddev b
+    // LOG_NORMAL: median a, sigma b | EXPONENTIAL: mean a
+    // All in ms, clamped at 0
+    enum Kind { FIXED, UNIFORM, NORMAL, LOG_NORMAL, EXPONENTIAL };
+    Kind kind{UNIFORM};
+    double a{3000.0};
+    double b{8000.0};
+  };
+
+  struct Config {
+    // Use port * for any free port, or ipc://* for any free path
+    std::string bindAddress{"tcp://*:12345"};
+    uint64_t seed{0};
+    LatencyDistribution latency;
+    size_t poolSize{3};  // Requests analysed at once
+    size_t maxQueue{3};  // Requests waiting for the pool before rejecting
+    double rejectRate{0.0};  // Chance of an "overloaded" reply regardless
+    double dropRate{0.0};    // Chance of never replying at all
+    double garbleRate{0.0};  // Chance of a reply that can't be parsed
+    enum Score { RANDOM, RMS } score{RANDOM};
+    // Per-frame scores to send to clients that ask for them (0 for none).
+    // RMS scores each frame's own samples.
+    size_t framesPerRequest{0};
+  };
+
+  struct Stats {
+    uint64_t received{0};
+    uint64_t completed{0};
+    uint64_t rejected{0};
+    uint64_t dropped{0};
+    uint64_t garbled{0};
+  };
+
+  explicit MockService(const Config& config);
+  ~MockService();
+
+  // Binds and starts serving on a background thread. False if unable to bind.
+  bool start();
+  void stop();
+  // Port actually bound (useful with port *), or 0 if not TCP
+  int getPort() const;
+  // Endpoint actually bound (useful with ipc://*)
+  std::string getEndpoint() const;
+  Stats getStats() const;
+
+private:
+  void run();
+
+  const Config config_;
+  zmq::context_t context_;
+  zmq::socket_t router_;
+  int port_{0};
+  std::string endpoint_;
+  std::thread thread_;
+  std::atomic<bool> running_{false};
+
+  std::atomic<uint64_t> received_{0};
+  std::atomic<uint64_t> completed_{0};
+  std::atomic<uint64_t> rejected_{0};
+  std::atomic<uint64_t> dropped_{0};
+  std::atomic<uint64_t> garbled_{0};
+};
+
+}  // namespace audio_plugin
@@ -0,0 +1,116 @@
+// Native mock of the inference service, for load testing the plugin and
+// whisper-batch without a Python environment.
+//
+// Usage:
+//   whisper-mock-service [--port=12345 | --ipc=path] [--seed=0] [--pool=3]
+//                        [--queue=3]
+//                        [--latency=<kind>:<a>[,<b>]] [--reject=0.0]
+//                        [--drop=0.0] [--garble=0.0] [--score=random|rms]
+//                        [--frames=0]
+//
+// Latency kinds (ms): fixed:a, uniform:a,b, normal:mean,stddev,
+// lognormal:median,sigma, exponential:mean. Defaults to uniform:3000,8000 to
+// match the Python simulator.
+
+#include <atomic>
+#include <chrono>
+#include <csignal>
+#include <cstdlib>
+#include <iostream>
+#include <map>
+#include <string>
+#include <thread>
+#include "MockService.h"
+
+namespace {
+
+std::atomic<bool> quit{false};
+
+bool parseLatency(const std::string& value,
+                  audio_plugin::MockService::LatencyDistribution& latency) {
+  using Latency = audio_plugin::MockService::LatencyDistribution;
+  const std::map<std::string, Latency::Kind> kinds{
+      {"fixed", Latency::FIXED},
+      {"uniform", Latency::UNIFORM},
+      {"normal", Latency::NORMAL},
+      {"lognormal", Latency::LOG_NORMAL},
+      {"exponential", Latency::EXPONENTIAL}};
+  auto colon = value.find(':');
+  auto kind = kinds.find(value.substr(0, colon));
+  if (kind == kinds.end() || colon == std::string::npos) {
+    return false;
+  }
+  latency.kind = kind->second;
+  auto params = value.substr(colon + 1);
+  auto comma = params.find(',');
+  latency.a = std::atof(params.substr(0, comma).c_str());
+  latency.b = comma == std::string::npos
+                  ? 0.0
+                  : std::atof(params.substr(comma + 1).c_str());
+  return true;
+}
+
+}  // namespace
+
+int main(int argc, char* argv[]) {
+  audio_plugin::MockService::Config config;
+  std::string port{"12345"};
+  std::string ipcPath;
+  for (int i = 1; i < argc; ++i) {
+    std::string arg{argv[i]};
+    auto equals = arg.find('=');
+    auto key = arg.substr(0, equals);
+    auto value = equals == std::string::npos ? "" : arg.substr(equals + 1);
+    if (key == "--port") {
+      port = value;
+    } else if (key == "--ipc") {
+      ipcPath = value;
+    } else if (key == "--seed") {
+      config.seed = std::strtoull(value.c_str(), nullptr, 10);
+    } else if (key == "--pool") {
+      config.poolSize = std::strtoul(value.c_str(), nullptr, 10);
+    } else if (key == "--queue") {
+      config.maxQueue = std::strtoul(value.c_str(), nullptr, 10);
+    } else if (key == "--reject") {
+      config.rejectRate = std::atof(value.c_str());
+    } else if (key == "--drop") {
+      config.dropRate = std::atof(value.c_str());
+    } else if (key == "--garble") {
+      config.garbleRate = std::atof(value.c_str());
+    } else if (key == "--score") {
+      config.score = value == "rms" ? audio_plugin::MockService::Config::RMS
+                                    : audio_plugin::MockService::Config::RANDOM;
+    } else if (key == "--frames") {
+      config.framesPerRequest = std::strtoul(value.c_str(), nullptr, 10);
+    } else if (key == "--latency") {
+      if (!parseLatency(value, config.latency)) {
+        std::cerr << "Unrecognised latency: " << value << std::endl;
+        return 1;
+      }
+    } else {
+      std::cerr << "Unrecognised option: " << arg << std::endl;
+      return 1;
+    }
+  }
+  config.bindAddress = ipcPath.empty() ? "tcp://*:" + port : "ipc://" + ipcPath;
+
+  audio_plugin::MockService service(config);
+  if (!service.start()) {
+    return 1;
+  }
+  std::cout << "Mock service listening on " << service.getEndpoint()
+            << std::endl;
+
+  std::signal(SIGINT, [](int) { quit = true; });
+  while (!quit) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+  }
+  service.stop();
+
+  auto stats = service.getStats();
+  std::cout << "Received " << stats.received << ", completed "
+            << stats.completed << ", rejected " << stats.rejected
+            << ", dropped " << stats.dropped << ", garbled " << stats.garbled
+            << std::endl;
+  return 0;
+}
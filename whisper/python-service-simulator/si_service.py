@@ -9,6 +9,8 @@ import zmq.asyncio
 from inference import model_init, si_inference
 from omegaconf import OmegaConf
 import platform
+import struct
+import time
 
 class SI_Pool:
     def __init__(self, cfg):
@@ -21,16 +23,60 @@ class SI_Pool:
         pass
 
     async def get_inference(self, audio_list):
+        started = time.monotonic()
         # TODO: Currently temp random delay to simulate work
         await asyncio.sleep(np.random.uniform(3, 8))
         # Use asyncio.to_thread to offload the blocking call
         results = await asyncio.to_thread(self.process_pool.map, si_inference, audio_list)
-        return {"result": list(results)}
+        return {"result": list(results), "started": started, "finished": time.monotonic()}
+
+
+# Set in a request ID by clients that accept a binary reply
+BINARY_REPLY_FLAG = 1 << 62
+# ...and by those that would like per-frame scores
+FRAMES_REQUEST_FLAG = 1 << 61
+# ...and by those on this machine that put the audio in shared memory, sending
+# a descriptor (uint64 generation, uint32 slot, uint32 samples, name) instead
+SHARED_AUDIO_FLAG = 1 << 60
+REPLY_STATUS = {"queue full": 1, "overloaded": 1, "analysis failed": 3}
+
+
+def encode_reply(result, binary):
+    if not binary or "request_id" not in result:
+        return json.dumps(result).encode('utf-8')
+    # "WSR" + version, status, flags, result count, request ID, float32
+    # results, then float32 queue_ms and inference_ms if flags & 1, then
+    # uint32 frame count and float32 frames if flags & 2, and float32
+    # confidence if flags & 4
+    status = REPLY_STATUS.get(result.get("error"), 2) if "error" in result else 0
+    results = result.get("result", [])
+    timing = result.get("timing")
+    frames = result.get("frames")
+    confidence = result.get("confidence")
+    flags = (1 if timing else 0) | (2 if frames else 0) | (4 if frames and confidence else 0)
+    reply = struct.pack("<4sBBHQ", b"WSR\x01", status, flags, len(results), result["request_id"])
+    reply += np.asarray(results, dtype="<f4").tobytes()
+    if timing:
+        reply += struct.pack("<ff", timing["queue_ms"], timing["inference_ms"])
+    if frames:
+        reply += struct.pack("<I", len(frames)) + np.asarray(frames, dtype="<f4").tobytes()
+        if confidence:
+            reply += np.asarray(confidence, dtype="<f4").tobytes()
+    return reply
+
+
+def simulate_frames(score, num_frames):
+    # A random walk that averages out to the score, with random confidence
+    walk = np.cumsum(np.random.normal(0, 0.05, num_frames))
+    frames = np.clip(score + walk - walk.mean(), 0, 1)
+    confidence = np.random.uniform(0.2, 1, num_frames)
+    return frames.tolist(), confidence.tolist()
 
 
 def parse_args(defaults):
     parser = argparse.ArgumentParser(description="Whisper Service Simulator")
     parser.add_argument("-p", "--port", help="port", required=False)
+    parser.add_argument("--ipc_path", help="Also listen on ipc://<ipc_path>", required=False)
     args = parser.parse_args()
     for a, v in vars(args).items():
         if not v == None:
@@ -39,7 +85,12 @@ def parse_args(defaults):
 
 
 async def handle_message(envelope, message):
+    received = time.monotonic()
     request_id = int.from_bytes(message[:8], byteorder="little", signed=False)
+    binary = bool(request_id & BINARY_REPLY_FLAG)
+    wants_frames = bool(request_id & FRAMES_REQUEST_FLAG)
+    shared = bool(request_id & SHARED_AUDIO_FLAG)
+    request_id = request_id & ~(BINARY_REPLY_FLAG | FRAMES_REQUEST_FLAG | SHARED_AUDIO_FLAG)
     
     # Simulate req rejection (e.g, job queue too long)
     if np.random.random() < 0.2:
@@ -47,26 +98,41 @@ async def handle_message(envelope, message):
             "request_id": request_id,
             "error": "overloaded",
             }
-        result_json = json.dumps(result)
         print(f"Sending rejection to {envelope} for ID {request_id}")
-        await socket.send_multipart([envelope, result_json.encode('utf-8')])
+        await socket.send_multipart([envelope, encode_reply(result, binary)])
     
     else:
         audio_data = message[8:]
-        audio = np.frombuffer(audio_data, dtype=np.float32) # Create a NumPy array of floats
+        if shared:
+            # Scores are random anyway, so only the length matters
+            audio = np.zeros(struct.unpack_from("<QII", audio_data)[2], dtype=np.float32)
+        else:
+            audio = np.frombuffer(audio_data, dtype=np.float32) # Create a NumPy array of floats
         print(f"Received {len(audio)} samples from {envelope} with ID {request_id}")
-        result = await si_pool.get_inference([audio])
-        result["request_id"] = request_id
-        result_json = json.dumps(result)
+        si_result = await si_pool.get_inference([audio])
+        result = {
+            "request_id": request_id,
+            "result": si_result["result"],
+            "timing": {
+                "queue_ms": (si_result["started"] - received) * 1000,
+                "inference_ms": (si_result["finished"] - si_result["started"]) * 1000,
+            },
+        }
+        frame_rate = cfg.get("frame_rate", 0)
+        if wants_frames and frame_rate:
+            num_frames = max(1, len(audio) * frame_rate // 16000)
+            result["frames"], result["confidence"] = simulate_frames(si_result["result"][0], num_frames)
         print(f"Sending result to {envelope} for ID {request_id}")
-        await socket.send_multipart([envelope, result_json.encode('utf-8')])
+        await socket.send_multipart([envelope, encode_reply(result, binary)])
 
 
 # Main async loop to receive and handle multiple messages concurrently
 async def main():
     while True:
-        envelope, data = await socket.recv_multipart()  # Non-blocking receive
-        asyncio.create_task(handle_message(envelope, data))  # Process each message concurrently
+        envelope, *parts = await socket.recv_multipart()  # Non-blocking receive
+        # Batched requests carry one region per part, each replied to alone
+        for data in parts:
+            asyncio.create_task(handle_message(envelope, data))  # Process each message concurrently
 
 # Entry point to run the server
 if __name__ == "__main__":
@@ -88,6 +154,8 @@ if __name__ == "__main__":
     socket = context.socket(zmq.ROUTER)
     socket.setsockopt_string(zmq.IDENTITY, server_identity)
     socket.bind(f"tcp://*:{cfg.port}")
+    if cfg.get("ipc_path"):
+        socket.bind(f"ipc://{cfg.ipc_path}")
     
     print(f"{server_identity}: connected!")
     
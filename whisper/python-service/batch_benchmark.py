@@ -0,0 +1,77 @@
+import argparse
+import time
+
+import numpy as np
+import zmq
+from omegaconf import OmegaConf
+from scipy.io import wavfile
+from scipy.signal import resample_poly
+
+# Compares the service's throughput at different batch sizes: sends the same
+# regions as multipart requests of each size, keeping the pool busy but never
+# over the service's queue limit, and reports regions analysed per second.
+
+
+def load_regions(path, num_regions, region_secs):
+    fs, audio = wavfile.read(path)
+    if audio.ndim > 1:
+        audio = audio[:, 0]
+    audio = np.array(audio / (0.5 * 2**16), dtype="float32")
+    audio = resample_poly(audio, 16000, fs).astype("float32")
+    length = int(region_secs * 16000)
+    hop = max(1, (len(audio) - length) // max(1, num_regions - 1))
+    return [audio[i * hop : i * hop + length] for i in range(num_regions)]
+
+
+def run(socket, regions, batch_size, in_flight):
+    next_region = 0
+    batches_out = 0
+    replies = 0
+    errors = 0
+    pending = {}  # Request ID -> batch
+    start = time.monotonic()
+    while replies < len(regions):
+        while next_region < len(regions) and batches_out < in_flight:
+            batch = range(next_region, min(next_region + batch_size, len(regions)))
+            parts = []
+            for i in batch:
+                request_id = i + 1
+                pending[request_id] = batch.start
+                parts.append(request_id.to_bytes(8, "little") + regions[i].tobytes())
+            socket.send_multipart(parts)
+            next_region = batch.stop
+            batches_out += 1
+        result = socket.recv_json()
+        replies += 1
+        if "error" in result:
+            errors += 1
+        batch_start = pending.pop(result["request_id"])
+        if batch_start not in pending.values():
+            batches_out -= 1
+    return time.monotonic() - start, errors
+
+
+if __name__ == "__main__":
+    cfg = OmegaConf.load("defaults.yaml")
+    if not "ip_address" in cfg:
+        cfg.ip_address = "localhost"
+    parser = argparse.ArgumentParser(description="Service batch throughput comparison")
+    parser.add_argument("--wav", default="JugWine-0-100.wav", help="Audio to cut regions from")
+    parser.add_argument("--regions", type=int, default=48, help="Regions per batch size")
+    parser.add_argument("--region_secs", type=float, default=5.0)
+    parser.add_argument("--batch_sizes", default="1,4,8,16")
+    parser.add_argument(
+        "--in_flight", type=int, default=cfg.get("max_queue", 3),
+        help="Batches outstanding at once (keep within the service's max_queue)",
+    )
+    args = parser.parse_args()
+
+    context = zmq.Context()
+    socket = context.socket(zmq.DEALER)
+    socket.connect(f"tcp://{cfg.ip_address}:{cfg.port}")
+    regions = load_regions(args.wav, args.regions, args.region_secs)
+
+    print("batch  regions/s  seconds  errors")
+    for batch_size in [int(b) for b in args.batch_sizes.split(",")]:
+        seconds, errors = run(socket, regions, batch_size, args.in_flight)
+        print(f"{batch_size:5}  {len(regions) / seconds:9.2f}  {seconds:7.1f}  {errors:6}")
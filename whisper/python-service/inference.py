@@ -1,4 +1,5 @@
 import os
+import time
 
 import numpy as np
 import speechbrain as sb
@@ -10,6 +11,7 @@ from transformers import WhisperFeatureExtractor
 
 from models.ni_feat_extractors import WhisperFull_feats
 from models.ni_predictor_models import MetricPredictorLSTM_layers
+import shared_audio
 
 # globals
 cfg = None
@@ -22,33 +24,152 @@ model = None
 fs = 16000
 
 
-def si_inference(x):
-    """_summary_
-
-    Args:
-        x (arraylike): 5 second window of audio to be evaluated
+def fit(x):
+    """Resamples and pads/truncates to the model's input - or when
+    truncating, only truncates
 
     Returns:
-        float: SI estimate
+        tuple: (audio, seconds of real audio in it)
     """
     if fs > 16000:
         x = rs(x, 16000, fs)
     if fs < 16000:
         x = rs(x, fs, 16000)
-    if len(x) < cfg.inference_length:
+    real_secs = min(len(x), cfg.inference_length) / 16000
+    if len(x) < cfg.inference_length and not fe.feat_extract.truncate:
         zeros = np.zeros(cfg.inference_length - len(x))
         x = np.concatenate([x, zeros])
     if len(x) > cfg.inference_length:
         x = x[: cfg.inference_length]
-    
-    x = fe(torch.tensor(x, dtype=torch.float32).unsqueeze(0))
+    return x, real_secs
+
+
+def prepare(xs, token_times=False):
+    """Extracts features for a batch of windows in one pass
+
+    Returns:
+        tuple: (packed features, seconds of real audio in each, and when
+            token_times, the time in seconds of each window's feature steps)
+    """
+    fitted, real_secs = zip(*[fit(x) for x in xs])
+    # Truncated windows may differ in length - pad to the batch's longest
+    longest = max(len(x) for x in fitted)
+    fitted = [np.pad(x, (0, longest - len(x))) for x in fitted]
+    x, lengths, times = fe.forward_batch(
+        torch.tensor(np.stack(fitted), dtype=torch.float32), token_times
+    )
     a = torch.nn.utils.rnn.pack_padded_sequence(
         torch.Tensor(x),
-        lengths=[len(x) * x.shape[1]],
+        lengths=lengths,
         batch_first=True,
         enforce_sorted=False,
     )
-    return float(model(a, True)[0].detach().numpy()[0][0])
+    return a, real_secs, times
+
+
+def frame_curve(times, steps, att, real_secs, frame_rate):
+    """Samples per-step scores and attention at frame_rate
+
+    The attention pooling already scores every step of the features (one
+    per decoded token) on the way to the overall estimate, so this costs no
+    more inference. Each step is placed in time by the decoder's cross
+    attention.
+
+    Returns:
+        tuple: (per-frame estimates, per-frame confidence) - confidence being
+            the nearby steps' share of the attention, scaled so the most
+            attended is 1. Both empty if nothing was decoded.
+    """
+    num_steps = min(len(times), len(steps))
+    if num_steps == 0:
+        return [], []
+    order = np.argsort(times[:num_steps], kind="stable")
+    times = np.asarray(times)[order]
+    steps = steps[order]
+    att = att[order] / max(att[order].max(), 1e-12)
+    num_frames = max(1, int(round(real_secs * frame_rate)))
+    centres = (np.arange(num_frames) + 0.5) / frame_rate
+    frames = np.interp(centres, times, steps)
+    confidence = np.interp(centres, times, att)
+    return frames.tolist(), confidence.tolist()
+
+
+def si_inference_batch(xs, frame_rate=0):
+    """Estimates SI for a batch of windows with a single feature extraction
+    and model forward pass
+
+    Padding in the batch is left out of the pooling. Without truncate_input
+    every clip is padded to 30s, so each estimate is the same as it would be
+    alone. With it, the batch is cut to its longest clip (see huBERT_wrapper
+    fit_positions), so shorter clips are encoded with more padding than they
+    would be alone and their estimates can differ slightly - within the 0.02
+    that truncation_check.py allows truncated scores by default.
+
+    Args:
+        xs (list of arraylike or SharedAudio): 5 second windows of audio to
+            be evaluated
+        frame_rate (int): Frames per second of curve to return (0 for none)
+
+    Returns:
+        list: (SI estimate, per-frame estimates, per-frame confidence) per
+            window - the last two None without a frame_rate
+    """
+    shared = [x for x in xs if isinstance(x, shared_audio.SharedAudio)]
+    xs = [shared_audio.read(x) if isinstance(x, shared_audio.SharedAudio) else x for x in xs]
+    a, real_secs, times = prepare(xs, frame_rate > 0)
+    # prepare copied the audio, so shared audio is done with - provided it
+    # wasn't reused meanwhile
+    for x in shared:
+        shared_audio.check(x)
+    with torch.no_grad():
+        pooled, steps, att = model.forward_frames(a)
+    pooled = pooled.numpy()
+    steps = steps.numpy()
+    att = att.numpy()
+    results = []
+    for i in range(len(xs)):
+        result = float(pooled[i][0])
+        if frame_rate:
+            frames, confidence = frame_curve(
+                times[i], steps[i], att[i], real_secs[i], frame_rate
+            )
+            results.append((result, frames, confidence))
+        else:
+            results.append((result, None, None))
+    return results
+
+
+def si_inference(x):
+    """_summary_
+
+    Args:
+        x (arraylike): 5 second window of audio to be evaluated
+
+    Returns:
+        float: SI estimate
+    """
+    return si_inference_batch([x])[0][0]
+
+
+def si_inference_frames(x, frame_rate):
+    """si_inference, along with a curve of estimates across the audio
+
+    Returns:
+        tuple: (SI estimate, per-frame estimates, per-frame confidence)
+    """
+    return si_inference_batch([x], frame_rate)[0]
+
+
+def timed_si_inference_batch(xs, frame_rate=0):
+    """si_inference_batch, along with when it started and finished
+
+    Returns:
+        tuple: (list of (SI estimate, frames, confidence), start, finish) -
+            times from time.monotonic(), which is shared between processes
+    """
+    start = time.monotonic()
+    results = si_inference_batch(xs, frame_rate)
+    return results, start, time.monotonic()
 
 
 def model_init(model_path=None, sample_rate=16000):
@@ -62,6 +183,7 @@ def model_init(model_path=None, sample_rate=16000):
     fs = sample_rate
     global cfg
     cfg = OmegaConf.load("defaults.yaml")
+    fe.feat_extract.truncate = cfg.get("truncate_input", False)
     current_directory = os.getcwd()
     
     if model_path == None:
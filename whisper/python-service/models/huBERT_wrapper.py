@@ -73,14 +73,19 @@ class WhisperWrapper_encoder(nn.Module):
     
     
 class WhisperWrapper_full(nn.Module):
-    def __init__(self, layer = None, use_feat_extractor = False, pretrained_model = None, num_layers = 12, *args, **kwargs):
+    def __init__(self, layer = None, use_feat_extractor = False, pretrained_model = None, num_layers = 12, truncate = False, *args, **kwargs):
         super().__init__(*args, **kwargs)
 
         # using layer = -1 returns all layers in form (1, time, feat_dim, layers)
         # otherwise single layer in form (1, time, feat_dim)
 
+        # truncate: extract features for only as much audio as there is
+        # (the longest clip, in a batch) rather than padding it to 30s
+
         self.num_layers = num_layers
         self.use_feat_extractor = use_feat_extractor
+        self.truncate = truncate
+        self.all_positions = None
         if layer is None:
             self.layer = 12
         else:
@@ -96,31 +101,90 @@ class WhisperWrapper_full(nn.Module):
         self.device = 'cuda' if torch.cuda.is_available() else 'cpu'
 
         
-    def forward(self, data):
+    def forward(self, data, return_token_times = False):
+
+        decoder_hidden, _, times = self.forward_batch(data[:1], return_token_times)
+        if return_token_times:
+            return decoder_hidden, times[0]
+        return decoder_hidden
+
+    def forward_batch(self, data, return_token_times = False):
+        # As forward for a whole batch of clips, generated together. Returns
+        # the hidden states padded to the longest clip's token count, each
+        # clip's own token count and (if asked for) each clip's token times.
 
         if self.use_feat_extractor:
-            data = self.feature_extractor(data[0].to('cpu'), sampling_rate = 16000, return_tensors = 'pt')
+            if self.truncate:
+                # An even number of mel frames, for the encoder's stride 2
+                data = self.feature_extractor(list(data.to('cpu').numpy()), sampling_rate = 16000, return_tensors = 'pt', padding = 'longest', pad_to_multiple_of = 320)
+            else:
+                data = self.feature_extractor(list(data.to('cpu').numpy()), sampling_rate = 16000, return_tensors = 'pt')
             data = data.input_features.to(self.device)
+        self.fit_positions(data.shape[-1])
 
         outputs = self.model.generate(
             input_features = data,
             output_hidden_states = True,
+            output_attentions = return_token_times,
             return_dict_in_generate = True
         )
 
+        steps = len(outputs.decoder_hidden_states)
         if self.layer == -1:
             decoder_hidden = []
             for layer in range(self.num_layers):
-                hidden = torch.stack([outputs.decoder_hidden_states[word][layer][0][0] for word in range(len(outputs.decoder_hidden_states))])
-                decoder_hidden.append(hidden.unsqueeze(0))
+                decoder_hidden.append(torch.stack([outputs.decoder_hidden_states[word][layer][:, 0] for word in range(steps)], dim = 1))
             decoder_hidden = torch.stack(decoder_hidden, dim = -1)
         else:
-            decoder_hidden = torch.stack([outputs.decoder_hidden_states[word][self.layer][0][0] for word in range(len(outputs.decoder_hidden_states))])
-            decoder_hidden = decoder_hidden.unsqueeze(0)
+            decoder_hidden = torch.stack([outputs.decoder_hidden_states[word][self.layer][:, 0] for word in range(steps)], dim = 1)
         # print(f"decoder_hidden size: {decoder_hidden.size()}")
 
-        # print(decoder_hidden.size())
-        return decoder_hidden
+        lengths = self.token_counts(outputs, steps)
+        times = None
+        if return_token_times:
+            times = [self.token_times(outputs, item)[:length] for item, length in enumerate(lengths)]
+        return decoder_hidden, lengths, times
+
+    def fit_positions(self, mel_frames):
+        # The encoder adds a learned embedding for each of its positions (one
+        # per 2 mel frames) and insists on exactly 30s worth. For shorter
+        # input keep just the leading positions, which are the ones that
+        # audio would have had at the start of a padded input.
+        encoder = self.model.get_encoder()
+        positions = mel_frames // 2
+        if encoder.embed_positions.num_embeddings == positions:
+            return
+        if self.all_positions is None:
+            self.all_positions = encoder.embed_positions.weight.detach().clone()
+        embed_positions = nn.Embedding(positions, self.all_positions.shape[1])
+        embed_positions.weight.data.copy_(self.all_positions[:positions])
+        embed_positions.requires_grad_(False)
+        encoder.embed_positions = embed_positions.to(self.all_positions.device)
+        # Checked against the input's length
+        encoder.config.max_source_positions = positions
+        encoder.max_source_positions = positions
+
+    def token_counts(self, outputs, steps):
+        # Clips that finish early keep generating padding until the longest
+        # is done, so each clip's count runs up to its own end of text token.
+        generated = outputs.sequences[:, -steps:]
+        eos = self.model.generation_config.eos_token_id
+        eos = set(eos if isinstance(eos, list) else [eos])
+        lengths = []
+        for tokens in generated.tolist():
+            ends = [i for i, token in enumerate(tokens) if token in eos]
+            lengths.append(ends[0] + 1 if ends else steps)
+        return lengths
+
+    def token_times(self, outputs, item = 0):
+        # Each token is a decoder step, not a slice of time. Place it (in
+        # seconds) where its cross attention over the encoder's 50 frames/s
+        # peaks, averaged over layers and heads.
+        times = []
+        for word in range(len(outputs.cross_attentions)):
+            att = torch.stack([layer_att[item, :, 0, :] for layer_att in outputs.cross_attentions[word]])
+            times.append(att.mean(dim = (0, 1)).argmax().item() / 50)
+        return times
 
 
 
@@ -150,7 +214,7 @@ class WhisperWrapperBase(nn.Module):
         self.device = 'cuda' if torch.cuda.is_available() else 'cpu'
 
         
-    def forward(self, data):
+    def forward(self, data, return_token_times = False):
 
         if self.use_feat_extractor:
             data = self.feature_extractor(data[0].to('cpu'), sampling_rate = 16000, return_tensors = 'pt')
@@ -159,6 +223,7 @@ class WhisperWrapperBase(nn.Module):
         outputs = self.model.generate(
             input_features = data,
             output_hidden_states = True,
+            output_attentions = return_token_times,
             return_dict_in_generate = True
         )
 
@@ -111,21 +111,26 @@ class WhisperEncoder_feats(nn.Module):
     
 class WhisperFull_feats(nn.Module):
 
-    def __init__(self, layer = None, use_feat_extractor = False, pretrained_model = None):
+    def __init__(self, layer = None, use_feat_extractor = False, pretrained_model = None, truncate = False):
         super().__init__()
         
         self.feat_extract = WhisperWrapper_full(
             layer = layer,
             pretrained_model = pretrained_model,
-            use_feat_extractor = use_feat_extractor
+            use_feat_extractor = use_feat_extractor,
+            truncate = truncate
         )
 
-    def forward(self, x):
+    def forward(self, x, return_token_times = False):
 
-        x = self.feat_extract(x)#.permute(0,2,1)
+        x = self.feat_extract(x, return_token_times)#.permute(0,2,1)
         # print(f"whisperencoder_feats: {x.size()}")
 
         return x
+
+    def forward_batch(self, x, return_token_times = False):
+
+        return self.feat_extract.forward_batch(x, return_token_times)
     
 
 class WhisperBase_feats(nn.Module):
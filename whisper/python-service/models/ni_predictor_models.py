@@ -342,6 +342,20 @@ class MetricPredictorLSTM_layers(nn.Module):
 
         return X, None
 
+    def forward_frames(self, X):
+        """As forward (with a packed sequence), also returning per-frame
+        scores and attention weights, each with dim (batch size, time).
+        Padding is left out of the pooling, so batching doesn't change an
+        item's estimate."""
+        X, X_len = nn.utils.rnn.pad_packed_sequence(X, batch_first = True)
+        X = X @ self.sm(self.layer_weights)
+        X = nn.utils.rnn.pack_padded_sequence(X, lengths = X_len, batch_first = True, enforce_sorted = False)
+        X, _ = self.blstm(X)
+        X, _ = nn.utils.rnn.pad_packed_sequence(X, batch_first = True)
+
+        pooled, frames, att = self.attenPool.forward_frames(X, X_len)
+        return self.sigmoid(pooled), self.sigmoid(frames).squeeze(-1), att
+
 
 class ExLSTM_layers(nn.Module):
     """Metric estimator for enhancement training.
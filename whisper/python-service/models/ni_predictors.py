@@ -46,6 +46,24 @@ class PoolAttFF(torch.nn.Module):
         
         return x  
 
+    def forward_frames(self, x: Tensor, lengths: Tensor = None):
+        # As forward, along with each frame's own output and attention weight.
+        # linear3 is linear, so the pooled output is exactly the attention
+        # weighted sum of the per-frame outputs - the curve comes for free.
+        # Given lengths (of a padded batch), padding gets no attention, so
+        # each item pools as it would alone.
+        att = self.linear2(self.dropout(self.activation(self.linear1(x))))
+        # att has dim (*, time)
+        att = att.squeeze(-1)
+        if lengths is not None:
+            padding = torch.arange(att.shape[-1]).unsqueeze(0) >= lengths.unsqueeze(-1)
+            att = att.masked_fill(padding, float('-inf'))
+        att = F.softmax(att, dim = -1)
+        # frames has dim (*, time, dim_out)
+        frames = self.linear3(x)
+        pooled = torch.sum(att.unsqueeze(-1) * frames, dim = -2)
+        return pooled, frames, att
+
 
     
 
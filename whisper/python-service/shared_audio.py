@@ -0,0 +1,99 @@
+import os
+import struct
+from collections import OrderedDict
+from multiprocessing import shared_memory
+
+import numpy as np
+
+# Clients on the same machine (connected over ipc://) can put a request's
+# audio in a shared memory ring and send where it is in place of the audio -
+# see SharedAudioRing in the plugin for the layout. The ring is mapped
+# straight in to NumPy, so the audio is only copied when the model's input is
+# built.
+
+# Set in a request ID by clients sending a descriptor rather than audio
+SHARED_AUDIO_FLAG = 1 << 60
+MAGIC = b"WSA\x01"
+HEADER_SIZE = 64
+SLOT_HEADER_SIZE = 64
+MAX_RINGS = 8  # Mapped at once, per process
+
+rings = OrderedDict()  # By name, most recently used last
+
+
+class StaleAudio(Exception):
+    """The client reused the slot before we were done with it"""
+
+
+class SharedAudio:
+    """Where a request's audio is: uint64 generation, uint32 slot, uint32
+    sample count, then the ring's name"""
+
+    def __init__(self, descriptor):
+        self.generation, self.slot, self.samples = struct.unpack_from("<QII", descriptor)
+        self.name = bytes(descriptor[16:]).decode("utf-8")
+
+    def __len__(self):
+        return self.samples
+
+
+class Ring:
+    def __init__(self, name):
+        self.shm = shared_memory.SharedMemory(name=name)
+        if os.name == "posix":
+            # The client owns it - don't let the resource tracker unlink it
+            # when we exit
+            from multiprocessing import resource_tracker
+            try:
+                resource_tracker.unregister(self.shm._name, "shared_memory")
+            except Exception:
+                pass
+        magic, self.slot_count, self.slot_samples, self.slot_stride = struct.unpack_from("<4sIII", self.shm.buf)
+        if magic != MAGIC:
+            self.close()
+            raise ValueError(f"{name} is not a shared audio ring")
+
+    def slot_offset(self, slot):
+        return HEADER_SIZE + slot * self.slot_stride
+
+    def generation(self, slot):
+        return struct.unpack_from("<Q", self.shm.buf, self.slot_offset(slot))[0]
+
+    def view(self, audio):
+        if audio.slot >= self.slot_count or audio.samples > self.slot_samples:
+            raise ValueError("descriptor out of range")
+        check(audio, self)
+        return np.frombuffer(
+            self.shm.buf, dtype="<f4", count=audio.samples,
+            offset=self.slot_offset(audio.slot) + SLOT_HEADER_SIZE,
+        )
+
+    def close(self):
+        try:
+            self.shm.close()
+        except BufferError:
+            pass  # A view is still about - it goes when they do
+
+
+def ring(name):
+    if name in rings:
+        rings.move_to_end(name)
+    else:
+        rings[name] = Ring(name)
+        if len(rings) > MAX_RINGS:
+            _, oldest = rings.popitem(last=False)
+            oldest.close()
+    return rings[name]
+
+
+def read(audio):
+    """The audio in place. Copy it (or whatever's made from it) and then
+    check() before relying on it."""
+    return ring(audio.name).view(audio)
+
+
+def check(audio, mapped=None):
+    """Raises StaleAudio if the slot has been reused since audio was sent"""
+    mapped = mapped or ring(audio.name)
+    if mapped.generation(audio.slot) != audio.generation:
+        raise StaleAudio(f"slot {audio.slot} of {audio.name} was reused")
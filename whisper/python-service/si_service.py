@@ -2,34 +2,128 @@ import argparse
 import asyncio
 import json
 import multiprocessing as mp
+import os
 from os.path import join
 import uuid
 import numpy as np
 import zmq
 import zmq.asyncio
-from inference import model_init, si_inference
+from inference import model_init, timed_si_inference_batch
+from shared_audio import SHARED_AUDIO_FLAG, SharedAudio
 from omegaconf import OmegaConf
 import platform
+import struct
+import time
 
 # globals
 requests_outstanding = 0
+batches_outstanding = 0
 requests_queue_limit = 100
+requests_total = 0
+requests_rejected = 0
+requests_failed = 0
 
 class SI_Pool:
     def __init__(self, cfg):
         path = join(cfg.model_path, cfg.regressor)
-        if "pool_size" in cfg:
-            self.process_pool = mp.Pool(initializer=model_init, processes=cfg.pool_size, initargs=(path,))
-        else:
-            self.process_pool = mp.Pool(initializer=model_init, initargs=(path,))
+        self.size = cfg.pool_size if "pool_size" in cfg else os.cpu_count()
+        self.process_pool = mp.Pool(initializer=model_init, processes=self.size, initargs=(path,))
 
     def pool_init(self):
         pass
 
-    async def get_inference(self, audio_list):
-        # Use asyncio.to_thread to offload the blocking call
-        results = await asyncio.to_thread(self.process_pool.map, si_inference, audio_list)
-        return {"result": list(results)}
+    async def get_inference(self, audio_list, frame_rate=0):
+        # The whole list goes to one worker as a single batch, so the features
+        # and model run once for all of it. Use asyncio.to_thread to offload
+        # the blocking call
+        results, started, finished = await asyncio.to_thread(
+            self.process_pool.apply, timed_si_inference_batch, (audio_list, frame_rate)
+        )
+        return {
+            "result": [result for result, _, _ in results],
+            "frames": [frames for _, frames, _ in results],
+            "confidence": [confidence for _, _, confidence in results],
+            "started": started,
+            "finished": finished,
+        }
+
+
+# Set in a request ID by clients that accept a binary reply
+BINARY_REPLY_FLAG = 1 << 62
+# ...and by those that would like per-frame scores
+FRAMES_REQUEST_FLAG = 1 << 61
+REPLY_STATUS = {"queue full": 1, "overloaded": 1, "analysis failed": 3}
+
+
+def encode_reply(result, binary):
+    if not binary or "request_id" not in result:
+        return json.dumps(result).encode('utf-8')
+    # "WSR" + version, status, flags, result count, request ID, float32
+    # results, then float32 queue_ms and inference_ms if flags & 1, then
+    # uint32 frame count and float32 frames if flags & 2, and float32
+    # confidence if flags & 4
+    status = REPLY_STATUS.get(result.get("error"), 2) if "error" in result else 0
+    results = result.get("result", [])
+    timing = result.get("timing")
+    frames = result.get("frames")
+    confidence = result.get("confidence")
+    flags = (1 if timing else 0) | (2 if frames else 0) | (4 if frames and confidence else 0)
+    reply = struct.pack("<4sBBHQ", b"WSR\x01", status, flags, len(results), result["request_id"])
+    reply += np.asarray(results, dtype="<f4").tobytes()
+    if timing:
+        reply += struct.pack("<ff", timing["queue_ms"], timing["inference_ms"])
+    if frames:
+        reply += struct.pack("<I", len(frames)) + np.asarray(frames, dtype="<f4").tobytes()
+        if confidence:
+            reply += np.asarray(confidence, dtype="<f4").tobytes()
+    return reply
+
+
+def metrics_text():
+    # Prometheus text format, matching the plugin's exporter
+    busy = min(batches_outstanding, si_pool.size)
+    metrics = [
+        ("whisper_service_pool_size", "gauge", "Inference workers", si_pool.size),
+        ("whisper_service_pool_busy", "gauge", "Workers analysing a batch", busy),
+        ("whisper_service_pool_utilisation", "gauge", "Fraction of workers busy", busy / si_pool.size),
+        ("whisper_service_queue_length", "gauge", "Batches waiting for a worker", batches_outstanding - busy),
+        ("whisper_service_requests_outstanding", "gauge", "Requests accepted but not yet replied to", requests_outstanding),
+        ("whisper_service_queue_limit", "gauge", "Requests (or batches) held before rejecting", requests_queue_limit),
+        ("whisper_service_requests_total", "counter", "Requests received", requests_total),
+        ("whisper_service_requests_rejected_total", "counter", "Requests rejected as unreadable or over the queue limit", requests_rejected),
+        ("whisper_service_requests_failed_total", "counter", "Requests whose analysis failed", requests_failed),
+    ]
+    text = ""
+    for name, kind, help, value in metrics:
+        text += f"# HELP {name} {help}\n# TYPE {name} {kind}\n{name} {value}\n"
+    return text
+
+
+def write_metrics_file(path, text):
+    # Move in to place so scrapers never see half a file
+    with open(path + ".tmp", "w") as f:
+        f.write(text)
+    os.replace(path + ".tmp", path)
+
+
+async def export_metrics(path, pub_endpoint, interval_ms):
+    # Configured like the plugin, through WHISPER_METRICS_FILE,
+    # WHISPER_METRICS_PUB and WHISPER_METRICS_INTERVAL_MS
+    publisher = None
+    if pub_endpoint:
+        publisher = context.socket(zmq.PUB)
+        publisher.setsockopt(zmq.LINGER, 0)
+        publisher.bind(pub_endpoint)
+    while True:
+        text = metrics_text()
+        if path:
+            await asyncio.to_thread(write_metrics_file, path, text)
+        if publisher is not None:
+            try:
+                await publisher.send_multipart([b"metrics", text.encode("utf-8")], flags=zmq.NOBLOCK)
+            except zmq.Again:
+                pass
+        await asyncio.sleep(interval_ms / 1000)
 
 
 def parse_args(defaults):
@@ -38,6 +132,7 @@ def parse_args(defaults):
         "-m", "--model_path", type=str, help="Model file path", required=False
     )
     parser.add_argument("-p", "--port", help="port", required=False)
+    parser.add_argument("--ipc_path", help="Also listen on ipc://<ipc_path>", required=False)
     args = parser.parse_args()
     for a, v in vars(args).items():
         if not v == None:
@@ -45,66 +140,119 @@ def parse_args(defaults):
     return defaults
 
 
-async def handle_message(envelope, message):
-    # A request rejection (e.g, queue too big) should be handled as follows;
-    # The presence of a "error" key is enough for a client to assume failure of some sort.
-
-    # result = {
-        # "request_id": request_id,
-        # "error": "overloaded",
-        # }
-    # result_json = json.dumps(result)
-    # print(f"Sending rejection to {envelope} for ID {request_id}")
-    # await socket.send_multipart([envelope, result_json.encode('utf-8')])
-
+def parse_request(message):
     result = {}
     audio = None
-    
+    binary = False
+    wants_frames = False
+
     try:
         # Extract request id
-        result["request_id"] = int.from_bytes(message[:8], byteorder="little", signed=False)
+        request_id = int.from_bytes(message[:8], byteorder="little", signed=False)
+        binary = bool(request_id & BINARY_REPLY_FLAG)
+        wants_frames = bool(request_id & FRAMES_REQUEST_FLAG)
+        shared = bool(request_id & SHARED_AUDIO_FLAG)
+        result["request_id"] = request_id & ~(BINARY_REPLY_FLAG | FRAMES_REQUEST_FLAG | SHARED_AUDIO_FLAG)
     except:
         result["error"] = "unable to parse request - request ID"
-    
+
     if "error" not in result:
         try:
             # Extract audio data
             audio_data = message[8:]
-            audio = np.frombuffer(audio_data, dtype=np.float32) # Create a NumPy array of floats
+            if shared:
+                # Just where it is - the worker reads it in place
+                audio = SharedAudio(audio_data)
+            else:
+                audio = np.frombuffer(audio_data, dtype=np.float32) # Create a NumPy array of floats
         except:
             result["error"] = "unable to parse request - audio data"
-    
+    return result, audio, binary, wants_frames
+
+
+async def handle_message(envelope, parts):
+    # Each part is one region's request (request ID then audio). Clients may
+    # send several at once; they are analysed as one batch but each gets its
+    # own reply, rejections included.
+
+    # A request rejection (e.g, queue too big) should be handled as follows;
+    # The presence of a "error" key is enough for a client to assume failure of some sort.
+
+    # result = {
+        # "request_id": request_id,
+        # "error": "overloaded",
+        # }
+    # result_json = json.dumps(result)
+    # print(f"Sending rejection to {envelope} for ID {request_id}")
+    # await socket.send_multipart([envelope, result_json.encode('utf-8')])
+
+    received = time.monotonic()
     global requests_outstanding
+    global batches_outstanding
     global requests_queue_limit
-    
-    if "error" not in result:
-        print(f'Received {len(audio)} samples from {envelope} with ID {result["request_id"]}')
-        if requests_outstanding >= requests_queue_limit:
-            result["error"] = "queue full"
-            
-    if "error" not in result:
-        requests_outstanding = requests_outstanding + 1
+    global requests_total
+    global requests_rejected
+    global requests_failed
+
+    replies = []
+    batch = []
+    for message in parts:
+        result, audio, binary, wants_frames = parse_request(message)
+        requests_total = requests_total + 1
+        if "error" not in result:
+            print(f'Received {len(audio)} samples from {envelope} with ID {result["request_id"]}')
+            # A batch is one job for the pool, so counts once to the limit
+            if batches_outstanding >= requests_queue_limit:
+                result["error"] = "queue full"
+        if "error" in result:
+            requests_rejected = requests_rejected + 1
+        else:
+            batch.append((result, audio, wants_frames))
+        replies.append((result, binary))
+
+    if batch:
+        requests_outstanding = requests_outstanding + len(batch)
+        batches_outstanding = batches_outstanding + 1
         try:
             # Analyse
-            si_result = await si_pool.get_inference([audio])
-            result["result"] = si_result["result"]
+            wants_frames = any(wants for _, _, wants in batch)
+            frame_rate = cfg.get("frame_rate", 0) if wants_frames else 0
+            si_result = await si_pool.get_inference([audio for _, audio, _ in batch], frame_rate)
+            for i, (result, _, wants) in enumerate(batch):
+                result["result"] = [si_result["result"][i]]
+                if wants and si_result["frames"][i]:
+                    result["frames"] = si_result["frames"][i]
+                    result["confidence"] = si_result["confidence"][i]
+                # Lets the client tell our time apart from the network's
+                result["timing"] = {
+                    "queue_ms": (si_result["started"] - received) * 1000,
+                    "inference_ms": (si_result["finished"] - si_result["started"]) * 1000,
+                }
         except:
-            result["error"] = "analysis failed"
-        requests_outstanding = requests_outstanding - 1
-    
-    result_json = json.dumps(result)
-    if "error" in result:
-        print(f'Sending rejection to {envelope} for ID {result["request_id"]} - {result["error"]}')
-    else:
-        print(f'Sending result to {envelope} for ID {result["request_id"]}: {result["result"][0]}')
-    await socket.send_multipart([envelope, result_json.encode('utf-8')])
+            for result, _, _ in batch:
+                result["error"] = "analysis failed"
+            requests_failed = requests_failed + len(batch)
+        requests_outstanding = requests_outstanding - len(batch)
+        batches_outstanding = batches_outstanding - 1
+
+    for result, binary in replies:
+        if "error" in result:
+            print(f'Sending rejection to {envelope} for ID {result.get("request_id")} - {result["error"]}')
+        else:
+            print(f'Sending result to {envelope} for ID {result["request_id"]}: {result["result"][0]}')
+        await socket.send_multipart([envelope, encode_reply(result, binary)])
 
 
 # Main async loop to receive and handle multiple messages concurrently
 async def main():
+    metrics_file = os.environ.get("WHISPER_METRICS_FILE")
+    metrics_pub = os.environ.get("WHISPER_METRICS_PUB")
+    if metrics_file or metrics_pub:
+        interval_ms = int(os.environ.get("WHISPER_METRICS_INTERVAL_MS", "5000"))
+        asyncio.create_task(export_metrics(metrics_file, metrics_pub, interval_ms))
     while True:
-        envelope, data = await socket.recv_multipart()  # Non-blocking receive
-        asyncio.create_task(handle_message(envelope, data))  # Process each message concurrently
+        envelope, *parts = await socket.recv_multipart()  # Non-blocking receive
+        asyncio.create_task(handle_message(envelope, parts))  # Process each message concurrently
 
 # Entry point to run the server
 if __name__ == "__main__":
@@ -128,6 +276,9 @@ if __name__ == "__main__":
     socket = context.socket(zmq.ROUTER)
     socket.setsockopt_string(zmq.IDENTITY, server_identity)
     socket.bind(f"tcp://*:{cfg.port}")
+    if cfg.get("ipc_path"):
+        # For clients on this machine, which can also share audio in memory
+        socket.bind(f"ipc://{cfg.ipc_path}")
     
     print(f"{server_identity}: connected!")
     
@@ -0,0 +1,77 @@
+import argparse
+import sys
+import time
+from pathlib import Path
+
+import numpy as np
+from scipy.io import wavfile
+from scipy.signal import resample_poly
+
+import inference
+
+# Checks truncate_input against the padded model on a reference set: scores
+# every region both ways, reports how far apart they are and each way's
+# regions per second on this worker, and fails if they differ by more than
+# the tolerance.
+
+
+def load_regions(paths, region_secs, hop_secs):
+    regions = []
+    length = int(region_secs * 16000)
+    hop = int(hop_secs * 16000)
+    for path in paths:
+        fs, audio = wavfile.read(path)
+        if audio.ndim > 1:
+            audio = audio[:, 0]
+        if np.issubdtype(audio.dtype, np.integer):
+            audio = audio / float(np.iinfo(audio.dtype).max)
+        audio = resample_poly(audio, 16000, fs).astype("float32")
+        for start in range(0, max(1, len(audio) - length + 1), hop):
+            regions.append(audio[start : start + length])
+    return regions
+
+
+def score(regions, truncate, batch_size):
+    inference.fe.feat_extract.truncate = truncate
+    scores = []
+    start = time.monotonic()
+    for i in range(0, len(regions), batch_size):
+        results = inference.si_inference_batch(regions[i : i + batch_size])
+        scores += [result for result, _, _ in results]
+    return np.asarray(scores), time.monotonic() - start
+
+
+if __name__ == "__main__":
+    parser = argparse.ArgumentParser(description="Truncated input regression check")
+    parser.add_argument("reference", nargs="+", help="wav files, or directories of them")
+    parser.add_argument("-m", "--model_path", type=str, help="Model file path", required=False)
+    parser.add_argument("--region_secs", type=float, default=5.0)
+    parser.add_argument("--hop_secs", type=float, default=2.5)
+    parser.add_argument("--batch", type=int, default=1, help="Regions per inference")
+    parser.add_argument("--tolerance", type=float, default=0.02, help="Largest acceptable score difference")
+    args = parser.parse_args()
+
+    paths = []
+    for reference in args.reference:
+        reference = Path(reference)
+        paths += sorted(reference.glob("*.wav")) if reference.is_dir() else [reference]
+    regions = load_regions(paths, args.region_secs, args.hop_secs)
+    if not regions:
+        sys.exit("No reference audio found")
+
+    inference.model_init(args.model_path)
+    # Warm up before timing either way
+    inference.si_inference_batch(regions[:1])
+    padded, padded_secs = score(regions, False, args.batch)
+    truncated, truncated_secs = score(regions, True, args.batch)
+
+    diff = np.abs(truncated - padded)
+    corr = np.corrcoef(padded, truncated)[0, 1] if len(regions) > 1 else 1.0
+    print(f"{len(regions)} regions from {len(paths)} files")
+    print(f"padded:    {len(regions) / padded_secs:7.2f} regions/s")
+    print(f"truncated: {len(regions) / truncated_secs:7.2f} regions/s ({padded_secs / truncated_secs:.1f}x)")
+    print(f"score difference: mean {diff.mean():.4f}, max {diff.max():.4f}, correlation {corr:.4f}")
+    if diff.max() > args.tolerance:
+        print(f"FAIL: scores differ by more than {args.tolerance}")
+        sys.exit(1)
+    print("OK")